@@ -10,13 +10,51 @@
 #include "PortalRender.h"
 #include "c_portal_player.h"
 #include "model_types.h"
+#include "mathlib/ssemath.h"
+
+static ConVar cl_portal_ghost_bone_cache( "cl_portal_ghost_bone_cache", "1", FCVAR_CHEAT, "Reuse ghost renderable bones within a frame and only transform the bones the model actually has." );
+
+//-----------------------------------------------------------------------------
+// Purpose: pOut[i] = matTransform * pIn[i] for a run of bones. Same math as
+//			ConcatTransforms(), but the ghost transform stays in registers
+//			for the whole run. pIn and pOut may be the same array.
+//-----------------------------------------------------------------------------
+static void TransformGhostBones( const matrix3x4_t &matTransform, const matrix3x4_t *pIn, matrix3x4_t *pOut, int iBoneCount )
+{
+	fltx4 lastMask = LoadAlignedSIMD( g_SIMD_ComponentMask[3] );
+	fltx4 rowA0 = LoadUnalignedSIMD( matTransform.m_flMatVal[0] );
+	fltx4 rowA1 = LoadUnalignedSIMD( matTransform.m_flMatVal[1] );
+	fltx4 rowA2 = LoadUnalignedSIMD( matTransform.m_flMatVal[2] );
+
+	fltx4 A00 = SplatXSIMD( rowA0 ), A01 = SplatYSIMD( rowA0 ), A02 = SplatZSIMD( rowA0 ), A03 = AndSIMD( rowA0, lastMask );
+	fltx4 A10 = SplatXSIMD( rowA1 ), A11 = SplatYSIMD( rowA1 ), A12 = SplatZSIMD( rowA1 ), A13 = AndSIMD( rowA1, lastMask );
+	fltx4 A20 = SplatXSIMD( rowA2 ), A21 = SplatYSIMD( rowA2 ), A22 = SplatZSIMD( rowA2 ), A23 = AndSIMD( rowA2, lastMask );
+
+	for( int i = 0; i != iBoneCount; ++i )
+	{
+		fltx4 rowB0 = LoadUnalignedSIMD( pIn[i].m_flMatVal[0] );
+		fltx4 rowB1 = LoadUnalignedSIMD( pIn[i].m_flMatVal[1] );
+		fltx4 rowB2 = LoadUnalignedSIMD( pIn[i].m_flMatVal[2] );
+
+		fltx4 out0 = AddSIMD( AddSIMD( MulSIMD( A00, rowB0 ), MulSIMD( A01, rowB1 ) ), AddSIMD( MulSIMD( A02, rowB2 ), A03 ) );
+		fltx4 out1 = AddSIMD( AddSIMD( MulSIMD( A10, rowB0 ), MulSIMD( A11, rowB1 ) ), AddSIMD( MulSIMD( A12, rowB2 ), A13 ) );
+		fltx4 out2 = AddSIMD( AddSIMD( MulSIMD( A20, rowB0 ), MulSIMD( A21, rowB1 ) ), AddSIMD( MulSIMD( A22, rowB2 ), A23 ) );
+
+		StoreUnalignedSIMD( pOut[i].m_flMatVal[0], out0 );
+		StoreUnalignedSIMD( pOut[i].m_flMatVal[1], out1 );
+		StoreUnalignedSIMD( pOut[i].m_flMatVal[2], out2 );
+	}
+}
 
 C_PortalGhostRenderable::C_PortalGhostRenderable( C_Prop_Portal *pOwningPortal, C_BaseEntity *pGhostSource, RenderGroup_t sourceRenderGroup, const VMatrix &matGhostTransform, float *pSharedRenderClipPlane, bool bLocalPlayer )
 : m_pGhostedRenderable( pGhostSource ), 
 	m_matGhostTransform( matGhostTransform ), 
 	m_pSharedRenderClipPlane( pSharedRenderClipPlane ),
 	m_bLocalPlayer( bLocalPlayer ),
-	m_pOwningPortal( pOwningPortal )
+	m_pOwningPortal( pOwningPortal ),
+	m_iGhostBoneCacheFrame( -1 ),
+	m_iGhostBoneCacheMask( 0 ),
+	m_flGhostBoneCacheTime( 0.0f )
 {
 	m_bSourceIsBaseAnimating = (dynamic_cast<C_BaseAnimating *>(pGhostSource) != NULL);
 
@@ -105,6 +143,38 @@ QAngle const& C_PortalGhostRenderable::GetRenderAngles( void )
 	return m_ReferencedReturns.qRenderAngle;
 }
 
+int C_PortalGhostRenderable::GetGhostSourceBoneCount( int nMaxBones )
+{
+	//sources fill in bones for their model and nothing past it
+	const model_t *pModel = m_pGhostedRenderable->GetModel();
+	studiohdr_t *pStudioHdr = pModel ? modelinfo->GetStudiomodel( pModel ) : NULL;
+	if( pStudioHdr == NULL )
+		return nMaxBones;
+
+	return MIN( pStudioHdr->numbones, nMaxBones );
+}
+
+bool C_PortalGhostRenderable::IsGhostBoneCacheValid( int nBones, int boneMask, float currentTime ) const
+{
+	if( !cl_portal_ghost_bone_cache.GetBool() )
+		return false;
+
+	if( (m_iGhostBoneCacheFrame != gpGlobals->framecount) || (m_flGhostBoneCacheTime != currentTime) )
+		return false;
+
+	if( (m_GhostBoneCache.Count() != nBones) || ((m_iGhostBoneCacheMask & boneMask) != boneMask) )
+		return false;
+
+	if( m_matGhostBoneCacheTransform != m_matGhostTransform )
+		return false;
+
+	//the source dropped its bones since we copied them, they might come back different
+	if( m_bSourceIsBaseAnimating && !((C_BaseAnimating *)m_pGhostedRenderable)->IsBoneCacheValid() )
+		return false;
+
+	return true;
+}
+
 bool C_PortalGhostRenderable::SetupBones( matrix3x4_t *pBoneToWorldOut, int nMaxBones, int boneMask, float currentTime )
 {
 	if( m_pGhostedRenderable == NULL )
@@ -118,16 +188,31 @@ bool C_PortalGhostRenderable::SetupBones( matrix3x4_t *pBoneToWorldOut, int nMax
 		pParent->SetModelIndex( pParent->GetWorldModelIndex() );
 	}
 
-	if( m_pGhostedRenderable->SetupBones( pBoneToWorldOut, nMaxBones, boneMask, currentTime ) )
+	bool bSuccess;
+	int nBones = GetGhostSourceBoneCount( nMaxBones );
+	if( pBoneToWorldOut && IsGhostBoneCacheValid( nBones, boneMask, currentTime ) )
+	{
+		//another view already ghosted these bones this frame
+		memcpy( pBoneToWorldOut, m_GhostBoneCache.Base(), sizeof( matrix3x4_t ) * nBones );
+		bSuccess = true;
+	}
+	else
 	{
-		if( pBoneToWorldOut )
+		//an animating source hands back its own per-frame bone cache here if it's already been set up
+		bSuccess = m_pGhostedRenderable->SetupBones( pBoneToWorldOut, nMaxBones, boneMask, currentTime );
+		if( bSuccess && pBoneToWorldOut )
 		{
-			for( int i = 0; i != nMaxBones; ++i ) //FIXME: nMaxBones is most definitely greater than the actual number of bone transforms actually used, find the subset somehow
+			TransformGhostBones( m_matGhostTransform.As3x4(), pBoneToWorldOut, pBoneToWorldOut, nBones );
+
+			if( cl_portal_ghost_bone_cache.GetBool() )
 			{
-				pBoneToWorldOut[i] = (m_matGhostTransform * pBoneToWorldOut[i]).As3x4();
+				m_GhostBoneCache.CopyArray( pBoneToWorldOut, nBones );
+				m_iGhostBoneCacheFrame = gpGlobals->framecount;
+				m_iGhostBoneCacheMask = boneMask;
+				m_flGhostBoneCacheTime = currentTime;
+				m_matGhostBoneCacheTransform = m_matGhostTransform;
 			}
 		}
-		return true;
 	}
 	
 	if ( pParent )
@@ -135,7 +220,7 @@ bool C_PortalGhostRenderable::SetupBones( matrix3x4_t *pBoneToWorldOut, int nMax
 		pParent->SetModelIndex( nModelIndex );
 	}
 
-	return false;
+	return bSuccess;
 }
 
 void C_PortalGhostRenderable::GetRenderBounds( Vector& mins, Vector& maxs )
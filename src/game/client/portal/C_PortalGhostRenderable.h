@@ -136,6 +136,15 @@ public:
 	virtual IClientThinkable*		GetClientThinkable() { return NULL; };
 
 private:
+	int GetGhostSourceBoneCount( int nMaxBones );
+	bool IsGhostBoneCacheValid( int nBones, int boneMask, float currentTime ) const;
+
+	//ghosted bones from the last SetupBones() call, reused by the other views rendering this frame
+	CUtlVector<matrix3x4_t> m_GhostBoneCache;
+	int m_iGhostBoneCacheFrame;
+	int m_iGhostBoneCacheMask;
+	float m_flGhostBoneCacheTime;
+	VMatrix m_matGhostBoneCacheTransform;
 
 #ifdef GHOSTBASEFLEX
 	void SyncFlexValues( void );
@@ -19,6 +19,8 @@
 #include "view_scene.h"
 #include "viewrender.h"
 #include "vprof.h"
+#include "c_prop_portal.h"
+#include "portal_util_shared.h"
 
 CLIENTEFFECT_REGISTER_BEGIN( PrecachePortalDrawingMaterials )
 CLIENTEFFECT_MATERIAL( "shadertest/wireframe" )
@@ -33,6 +35,9 @@ static ConVar r_forcecheapwater( "r_forcecheapwater", "0", FCVAR_CLIENTDLL | FCV
 
 ConVar r_portal_use_stencils( "r_portal_use_stencils", "1", FCVAR_CLIENTDLL, "Render portal views using stencils (if available)" ); //draw portal views using stencil rendering
 ConVar r_portal_stencil_depth( "r_portal_stencil_depth", "3", FCVAR_CLIENTDLL | FCVAR_ARCHIVE, "When using stencil views, this changes how many views within views we see" );
+ConVar r_portal_view_budget_ms( "r_portal_view_budget_ms", "0", FCVAR_CLIENTDLL | FCVAR_ARCHIVE, "When using stencil views, milliseconds per frame we can spend on portal views before recursions start ending in depth doublers. 0 is no limit" );
+ConVar r_portal_view_budget_views( "r_portal_view_budget_views", "0", FCVAR_CLIENTDLL | FCVAR_ARCHIVE, "When using stencil views, how many portal views we render per frame before recursions start ending in depth doublers. 0 is no limit" );
+ConVar r_portal_view_min_coverage( "r_portal_view_min_coverage", "0", FCVAR_CLIENTDLL | FCVAR_ARCHIVE, "When using stencil views, recursions that would show up in less than this fraction of the screen end in depth doublers" );
 
 //-----------------------------------------------------------------------------
 //
@@ -213,6 +218,14 @@ CPortalRender::CPortalRender()
 	m_pRenderingViewExitPortal = NULL;
 
 	m_PortalViewIDNodeChain[0] = &m_HeadPortalViewIDNode;
+
+	m_fRecursiveViewScreenCoverage[0] = 1.0f;
+	m_fPortalViewBudgetStartTime = 0.0;
+	m_iPortalViewsRendered = 0;
+	m_iPortalViewRecursionsDropped = 0;
+	m_iLastFramePortalViewsRendered = 0;
+	m_iLastFramePortalViewRecursionsDropped = 0;
+	m_fLastFramePortalViewMilliseconds = 0.0f;
 }
 
 
@@ -448,6 +461,183 @@ void CPortalRender::EnteredPortal( CPortalRenderable *pEnteredPortal )
 
 
 
+//-----------------------------------------------------------------------------
+// Portal view budget
+//-----------------------------------------------------------------------------
+void CPortalRender::ResetPortalViewBudget( void )
+{
+	m_fPortalViewBudgetStartTime = Plat_FloatTime();
+	m_iPortalViewsRendered = 0;
+	m_iPortalViewRecursionsDropped = 0;
+	m_fRecursiveViewScreenCoverage[0] = 1.0f;
+}
+
+//-----------------------------------------------------------------------------
+// Should the views at the current recursion level get the "end of the line" treatment to stay within budget?
+// The primary view always gets to draw the portals it can see, only recursions are dropped
+//-----------------------------------------------------------------------------
+bool CPortalRender::ShouldDropPortalViewRecursion( void ) const
+{
+	if( m_iViewRecursionLevel == 0 )
+		return false;
+
+	if( m_fRecursiveViewScreenCoverage[m_iViewRecursionLevel] < r_portal_view_min_coverage.GetFloat() )
+		return true;
+
+	int iMaxViews = r_portal_view_budget_views.GetInt();
+	if( (iMaxViews > 0) && (m_iPortalViewsRendered >= iMaxViews) )
+		return true;
+
+	float fMaxMilliseconds = r_portal_view_budget_ms.GetFloat();
+	if( (fMaxMilliseconds > 0.0f) && ((Plat_FloatTime() - m_fPortalViewBudgetStartTime) * 1000.0 >= fMaxMilliseconds) )
+		return true;
+
+	return false;
+}
+
+struct PortalViewPriority_t
+{
+	CPortalRenderable *pPortal;
+	float fScreenCoverage; //< 0 is unknown
+};
+
+static int SortPortalViewsByPriority( const PortalViewPriority_t *pLeft, const PortalViewPriority_t *pRight )
+{
+	//unknown coverage sorts first, it's probably a portal that just came into view
+	float fLeft = (pLeft->fScreenCoverage < 0.0f) ? 2.0f : pLeft->fScreenCoverage;
+	float fRight = (pRight->fScreenCoverage < 0.0f) ? 2.0f : pRight->fScreenCoverage;
+
+	if( fLeft > fRight )
+		return -1;
+
+	return (fLeft < fRight) ? 1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+// Flags portals whose corners are all seen through another portal's quad from the camera. Everything behind a portal's
+// quad is covered by its view or the wall it's on, so those can't be seen at this level. Only prop portals are tested.
+//-----------------------------------------------------------------------------
+static void FindPortalsHiddenBehindPortals( const CUtlVector<CPortalRenderable *> &portals, const Vector &vCameraOrigin, bool *pHidden )
+{
+	int iPortalCount = portals.Count();
+	C_Prop_Portal **pPropPortals = (C_Prop_Portal **)stackalloc( sizeof( C_Prop_Portal * ) * iPortalCount );
+	int *pPropPortalIndices = (int *)stackalloc( sizeof( int ) * iPortalCount );
+	int iPropPortalCount = 0;
+	for( int i = 0; i != iPortalCount; ++i )
+	{
+		pHidden[i] = false;
+
+		C_Prop_Portal *pPortal = dynamic_cast<C_Prop_Portal *>( portals[i]->PortalRenderable_GetPairedEntity() );
+		if( pPortal == NULL )
+			continue;
+
+		pPropPortals[iPropPortalCount] = pPortal;
+		pPropPortalIndices[iPropPortalCount] = i;
+		++iPropPortalCount;
+	}
+
+	if( iPropPortalCount < 2 )
+		return;
+
+	//one ray from the camera to each corner of every portal, pushed out a unit so touching edges don't count as covered
+	CUtlVector< Ray_t, CUtlMemoryAligned< Ray_t, 16 > > cornerRays;
+	cornerRays.SetCount( iPropPortalCount * 4 );
+	for( int i = 0; i != iPropPortalCount; ++i )
+	{
+		const C_Prop_Portal *pPortal = pPropPortals[i];
+		Vector vRight = pPortal->m_vRight * (PORTAL_HALF_WIDTH + 1.0f);
+		Vector vUp = pPortal->m_vUp * (PORTAL_HALF_HEIGHT + 1.0f);
+		cornerRays[(i * 4) + 0].Init( vCameraOrigin, pPortal->m_ptOrigin - vRight - vUp );
+		cornerRays[(i * 4) + 1].Init( vCameraOrigin, pPortal->m_ptOrigin + vRight - vUp );
+		cornerRays[(i * 4) + 2].Init( vCameraOrigin, pPortal->m_ptOrigin + vRight + vUp );
+		cornerRays[(i * 4) + 3].Init( vCameraOrigin, pPortal->m_ptOrigin - vRight + vUp );
+	}
+
+	float *pFractions = (float *)stackalloc( sizeof( float ) * cornerRays.Count() * iPropPortalCount );
+	UTIL_IntersectRaysWithPortals( cornerRays.Base(), cornerRays.Count(), pPropPortals, iPropPortalCount, pFractions );
+
+	for( int i = 0; i != iPropPortalCount; ++i )
+	{
+		for( int iOccluder = 0; iOccluder != iPropPortalCount; ++iOccluder )
+		{
+			if( iOccluder == i )
+				continue;
+
+			//standing in the portal hole, its quad isn't in the way
+			if( (pPropPortals[iOccluder]->m_ptOrigin - vCameraOrigin).LengthSqr() < (PORTAL_HALF_HEIGHT * PORTAL_HALF_HEIGHT) )
+				continue;
+
+			bool bAllCornersCovered = true;
+			for( int iCorner = 0; bAllCornersCovered && (iCorner != 4); ++iCorner )
+			{
+				float fFraction = pFractions[(((i * 4) + iCorner) * iPropPortalCount) + iOccluder];
+				bAllCornersCovered = (fFraction >= 0.0f) && (fFraction < 1.0f);
+			}
+
+			if( bAllCornersCovered )
+			{
+				pHidden[pPropPortalIndices[i]] = true;
+				break;
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Orders portals at the current recursion level so the ones covering the most screen get their views (and the budget) first.
+// Coverage comes from last frame's pixel visibility when we have it, otherwise from the portal's own estimate. Portals
+// hidden behind another portal go last.
+//-----------------------------------------------------------------------------
+void CPortalRender::SortPortalsByViewPriority( CUtlVector<CPortalRenderable *> &portals, const CViewSetup &currentView, CUtlVector<float> &screenCoverages ) const
+{
+	int iPortalCount = portals.Count();
+	CUtlVector<PortalViewPriority_t> priorities( 0, iPortalCount );
+
+	bool *pHidden = (bool *)stackalloc( sizeof( bool ) * iPortalCount );
+	FindPortalsHiddenBehindPortals( portals, currentView.origin, pHidden );
+	for( int i = 0; i != iPortalCount; ++i )
+	{
+		PortalViewPriority_t &priority = priorities[priorities.AddToTail()];
+		priority.pPortal = portals[i];
+		priority.fScreenCoverage = -1.0f;
+
+		PortalViewIDNode_t *pNode = m_PortalViewIDNodeChain[m_iViewRecursionLevel]->ChildNodes[portals[i]->m_iPortalViewIDNodeIndex];
+		if( pNode )
+			priority.fScreenCoverage = pNode->fScreenFilledByPortalSurfaceLastFrame_Normalized;
+
+		if( pHidden[i] )
+			priority.fScreenCoverage = 0.0f;
+		else if( priority.fScreenCoverage < 0.0f )
+			priority.fScreenCoverage = portals[i]->EstimateScreenCoverage( currentView );
+	}
+
+	if( iPortalCount > 1 )
+		priorities.Sort( SortPortalViewsByPriority );
+
+	screenCoverages.SetCount( iPortalCount );
+	for( int i = 0; i != iPortalCount; ++i )
+	{
+		portals[i] = priorities[i].pPortal;
+		screenCoverages[i] = priorities[i].fScreenCoverage;
+	}
+}
+
+void CPortalRender::PrintPortalViewBudgetStats( void ) const
+{
+	Msg( "Portal views last frame: %d rendered, %d recursion levels dropped, %.3fms\n", m_iLastFramePortalViewsRendered, m_iLastFramePortalViewRecursionsDropped, m_fLastFramePortalViewMilliseconds );
+	Msg( "Budget: %s views, %s ms, min coverage %g\n", 
+		(r_portal_view_budget_views.GetInt() > 0) ? r_portal_view_budget_views.GetString() : "unlimited",
+		(r_portal_view_budget_ms.GetFloat() > 0.0f) ? r_portal_view_budget_ms.GetString() : "unlimited",
+		r_portal_view_min_coverage.GetFloat() );
+}
+
+CON_COMMAND( r_portal_view_budget_print, "Print how the portal view budget was spent last frame" )
+{
+	g_pPortalRender->PrintPortalViewBudgetStats();
+}
+
+
+
    
 bool CPortalRender::DrawPortalsUsingStencils( CViewRender *pViewRender )
 {	  
@@ -497,7 +687,14 @@ bool CPortalRender::DrawPortalsUsingStencils( CViewRender *pViewRender )
 
 	const int iMaxDepth = MIN( r_portal_stencil_depth.GetInt(), MIN( MAX_PORTAL_RECURSIVE_VIEWS, (1 << materials->StencilBufferBits()) ) - 1 );
 
-	if( m_iViewRecursionLevel >= iMaxDepth ) //can't support any more views	
+	if( m_iViewRecursionLevel == 0 )
+		ResetPortalViewBudget();
+
+	bool bOverBudget = (m_iViewRecursionLevel < iMaxDepth) && ShouldDropPortalViewRecursion();
+	if( bOverBudget )
+		++m_iPortalViewRecursionsDropped;
+
+	if( (m_iViewRecursionLevel >= iMaxDepth) || bOverBudget ) //can't support any more views	
 	{
 		m_iRemainingPortalViewDepth = 0; //special case handler for max depth 0 cases
 		for( int i = 0; i != iNumRenderablePortals; ++i )
@@ -559,6 +756,10 @@ bool CPortalRender::DrawPortalsUsingStencils( CViewRender *pViewRender )
 		m_RecursiveViewComplexFrustums[m_iViewRecursionLevel].AddMultipleToTail( FRUSTUM_NUMPLANES, pViewRender->GetFrustum() );
 	}
 
+	//biggest views first so they get the budget
+	CUtlVector<float> portalScreenCoverages;
+	SortPortalsByViewPriority( actualActivePortals, *pViewSetup, portalScreenCoverages );
+
 	for( int i = 0; i != iNumRenderablePortals; ++i )
 	{
 		CPortalRenderable *pCurrentPortal = actualActivePortals[i];
@@ -642,6 +843,11 @@ bool CPortalRender::DrawPortalsUsingStencils( CViewRender *pViewRender )
 				Assert( m_PortalViewIDNodeChain[m_iViewRecursionLevel]->ChildNodes.Count() > pCurrentPortal->m_iPortalViewIDNodeIndex );
 
 				m_PortalViewIDNodeChain[m_iViewRecursionLevel + 1] = m_PortalViewIDNodeChain[m_iViewRecursionLevel]->ChildNodes[pCurrentPortal->m_iPortalViewIDNodeIndex];
+
+				//unknown coverage doesn't shrink the view, we'd rather draw too much than drop a view we can't measure
+				float fPortalScreenCoverage = portalScreenCoverages[i];
+				m_fRecursiveViewScreenCoverage[m_iViewRecursionLevel + 1] = m_fRecursiveViewScreenCoverage[m_iViewRecursionLevel] * ((fPortalScreenCoverage < 0.0f) ? 1.0f : MIN( fPortalScreenCoverage, 1.0f ));
+				++m_iPortalViewsRendered;
 				
 				pCurrentPortal->RenderPortalViewToBackBuffer( pViewRender, *pViewSetup );
 				
@@ -704,6 +910,10 @@ bool CPortalRender::DrawPortalsUsingStencils( CViewRender *pViewRender )
 		pRenderContext->SetStencilReferenceValue( 0 );
 
 		m_RecursiveViewComplexFrustums[0].RemoveAll();
+
+		m_iLastFramePortalViewsRendered = m_iPortalViewsRendered;
+		m_iLastFramePortalViewRecursionsDropped = m_iPortalViewRecursionsDropped;
+		m_fLastFramePortalViewMilliseconds = (float)((Plat_FloatTime() - m_fPortalViewBudgetStartTime) * 1000.0);
 	}
 	else
 	{
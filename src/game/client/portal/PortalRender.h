@@ -63,6 +63,9 @@ public:
 	//Stencil mode only: You stated the portal was visible based on view, and this is how much of the screen your stencil mask took up last frame. Still want to draw this frame? Values less than zero indicate a lack of data from last frame
 	virtual bool	ShouldUpdatePortalView_BasedOnPixelVisibility( float fScreenFilledByStencilMaskLastFrame_Normalized ) { return (fScreenFilledByStencilMaskLastFrame_Normalized != 0.0f); }; // < 0 is unknown visibility, > 0 is known to be partially visible
 
+	//Rough guess at how much of the screen the portal surface covers from this view, normalized like the pixel visibility values. Used to prioritize views when there's no pixel visibility data. Less than zero means no idea
+	virtual float	EstimateScreenCoverage( const CViewSetup &currentView ) const { return -1.0f; };
+
 
 	//-----------------------------------------------------------------------------
 	// Misc
@@ -229,6 +232,8 @@ public:
 	
 	// tests if the parameter ID is being used by portal pixel vis queries
 	bool IsPortalViewID( view_id_t id );
+
+	void PrintPortalViewBudgetStats( void ) const;
 	
 private:
 	struct RecordedPortalInfo_t
@@ -243,6 +248,11 @@ private:
 	
 	void UpdatePortalPixelVisibility( void ); //updates pixel visibility for portal surfaces
 
+	//per frame budget for stencil views, once it's spent any deeper recursion gets the "end of the line" treatment
+	void ResetPortalViewBudget( void );
+	bool ShouldDropPortalViewRecursion( void ) const;
+	void SortPortalsByViewPriority( CUtlVector<CPortalRenderable *> &portals, const CViewSetup &currentView, CUtlVector<float> &screenCoverages ) const;
+
 	// Handles a portal update message
 	void HandlePortalUpdateMessage( KeyValues *pKeyValues );
 
@@ -256,6 +266,14 @@ private:
 	PortalRenderingMaterials_t	m_Materials;
 	int							m_iViewRecursionLevel;
 	int							m_iRemainingPortalViewDepth; //let's portals know that they should do "end of the line" kludges to cover up that portals don't go infinitely recursive
+
+	float						m_fRecursiveViewScreenCoverage[MAX_PORTAL_RECURSIVE_VIEWS]; //estimated fraction of the screen each recursion level's view shows up in, 0 is always the full screen
+	double						m_fPortalViewBudgetStartTime;
+	int							m_iPortalViewsRendered; //this frame
+	int							m_iPortalViewRecursionsDropped; //this frame, view levels that were cut short by the budget
+	int							m_iLastFramePortalViewsRendered;
+	int							m_iLastFramePortalViewRecursionsDropped;
+	float						m_fLastFramePortalViewMilliseconds;
 		
 	CPortalRenderable			*m_pRenderingViewForPortal; //the specific pointer for the portal that we're rending a view for
 	CPortalRenderable			*m_pRenderingViewExitPortal; //the specific pointer for the portal that our view exits from
@@ -132,52 +132,157 @@ void RenderPortalMeshConvexPolygon( PortalMeshPoint_t *pVerts, int iVertCount, c
 
 void Clip_And_Render_Convex_Polygon( PortalMeshPoint_t *pVerts, int iVertCount, const IMaterial *pMaterial, void *pBind )
 {
-	PortalMeshPoint_t *pInVerts = (PortalMeshPoint_t *)stackalloc( iVertCount * 4 * sizeof( PortalMeshPoint_t ) ); //really only should need 2x points, but I'm paranoid
-	PortalMeshPoint_t *pOutVerts = (PortalMeshPoint_t *)stackalloc( iVertCount * 4 * sizeof( PortalMeshPoint_t ) );
-	PortalMeshPoint_t *pTempVerts;
+	CPortalMeshPolygonBatch batch;
+	batch.AddClippedPolygon( pVerts, iVertCount, view->GetFrustum(), FRUSTUM_NUMPLANES );
+	batch.Draw( pMaterial, pBind );
+}
 
 
-	//clip by the viewing frustum
+int FindPlanesClippingConvexPolygon( const PortalMeshPoint_t *pVerts, int iVertCount, const VPlane *pPlanes, int iPlaneCount, VPlane *pOutPlanes )
+{
+	int iOutPlaneCount = 0;
+	for( int i = 0; i != iPlaneCount; ++i )
 	{
-		VPlane *pFrustum = view->GetFrustum();
-		
-		//clip by first plane and put output into pInVerts
-		iVertCount = ClipPolyToPlane_LerpTexCoords( pVerts, iVertCount, pInVerts, pFrustum[0].m_Normal, pFrustum[0].m_Dist, 0.01f );
-
-		//clip by other planes and flipflop in and out pointers
-		for( int i = 1; i != FRUSTUM_NUMPLANES; ++i )
+		int iInFront = 0;
+		for( int j = 0; j != iVertCount; ++j )
 		{
-			if( iVertCount < 3 )
-				return; //nothing to draw
-
-			iVertCount = ClipPolyToPlane_LerpTexCoords( pInVerts, iVertCount, pOutVerts, pFrustum[i].m_Normal, pFrustum[i].m_Dist, 0.01f );
-			pTempVerts = pInVerts; pInVerts = pOutVerts; pOutVerts = pTempVerts; //swap vertex pointers
+			if( pPlanes[i].DistTo( pVerts[j].vWorldSpacePosition ) > 0.01f ) //same epsilon the clipping uses
+				++iInFront;
 		}
 
-		if( iVertCount < 3 )
-			return; //nothing to draw
+		if( iInFront == 0 )
+			return -1; //nothing survives this plane
+
+		if( iInFront != iVertCount )
+			pOutPlanes[iOutPlaneCount++] = pPlanes[i];
 	}
 
-	CMatRenderContextPtr pRenderContext( materials );
-	
-	RenderPortalMeshConvexPolygon( pOutVerts, iVertCount, pMaterial, pBind );
-	if( mat_wireframe.GetBool() )
-		RenderPortalMeshConvexPolygon( pOutVerts, iVertCount, materials->FindMaterial( "shadertest/wireframe", TEXTURE_GROUP_CLIENT_EFFECTS, false ), pBind );
+	return iOutPlaneCount;
+}
 
-	stackfree( pOutVerts );
-	stackfree( pInVerts );
+
+
+CPortalMeshPolygonBatch::CPortalMeshPolygonBatch( void )
+: m_Vertices( 0, 64 ),
+  m_Polygons( 0, 16 )
+{
 }
 
+void CPortalMeshPolygonBatch::Reset( void )
+{
+	m_Vertices.RemoveAll();
+	m_Polygons.RemoveAll();
+}
 
+void CPortalMeshPolygonBatch::AddPolygon( const PortalMeshPoint_t *pVerts, int iVertCount )
+{
+	if( iVertCount < 3 )
+		return;
 
+	Polygon_t &polygon = m_Polygons[m_Polygons.AddToTail()];
+	polygon.iFirstVertex = m_Vertices.Count();
+	polygon.iVertexCount = iVertCount;
+	m_Vertices.AddMultipleToTail( iVertCount, pVerts );
+}
 
+void CPortalMeshPolygonBatch::AddClippedPolygon( const PortalMeshPoint_t *pVerts, int iVertCount, const VPlane *pPlanes, int iPlaneCount )
+{
+	if( iPlaneCount == 0 )
+	{
+		AddPolygon( pVerts, iVertCount );
+		return;
+	}
 
+	int iAllocSize = (iVertCount + iPlaneCount) * 2; //each plane can add at most one vertex, doubled because I'm paranoid
+	PortalMeshPoint_t *pInVerts = (PortalMeshPoint_t *)stackalloc( iAllocSize * 2 * sizeof( PortalMeshPoint_t ) );
+	PortalMeshPoint_t *pOutVerts = pInVerts + iAllocSize;
+	PortalMeshPoint_t *pTempVerts;
 
+	//clip by first plane and put output into pInVerts
+	iVertCount = ClipPolyToPlane_LerpTexCoords( (PortalMeshPoint_t *)pVerts, iVertCount, pInVerts, pPlanes[0].m_Normal, pPlanes[0].m_Dist, 0.01f );
 
+	//clip by other planes and flipflop in and out pointers
+	for( int i = 1; i != iPlaneCount; ++i )
+	{
+		if( iVertCount < 3 )
+			return; //nothing to draw
+
+		iVertCount = ClipPolyToPlane_LerpTexCoords( pInVerts, iVertCount, pOutVerts, pPlanes[i].m_Normal, pPlanes[i].m_Dist, 0.01f );
+		pTempVerts = pInVerts; pInVerts = pOutVerts; pOutVerts = pTempVerts; //swap vertex pointers
+	}
 
+	AddPolygon( pInVerts, iVertCount );
+}
 
+void CPortalMeshPolygonBatch::Draw( const IMaterial *pMaterial, void *pBind ) const
+{
+	if( m_Polygons.Count() == 0 )
+		return;
 
+	DrawMesh( pMaterial, pBind );
+	if( mat_wireframe.GetBool() )
+		DrawMesh( materials->FindMaterial( "shadertest/wireframe", TEXTURE_GROUP_CLIENT_EFFECTS, false ), pBind );
+}
 
+void CPortalMeshPolygonBatch::DrawMesh( const IMaterial *pMaterial, void *pBind ) const
+{
+	CMatRenderContextPtr pRenderContext( materials );
+	pRenderContext->Bind( (IMaterial *)pMaterial, pBind );
 
+	IMesh* pMesh = pRenderContext->GetDynamicMesh( true );
 
+	int iMaxVerts, iMaxIndices;
+	pRenderContext->GetMaxToRender( pMesh, false, &iMaxVerts, &iMaxIndices );
 
+	int iPolygon = 0;
+	int iPolygonCount = m_Polygons.Count();
+	while( iPolygon != iPolygonCount )
+	{
+		//gather as many polygons as fit in one dynamic mesh
+		int iBatchEnd = iPolygon;
+		int iBatchVerts = 0;
+		int iBatchIndices = 0;
+		while( iBatchEnd != iPolygonCount )
+		{
+			int iPolyVerts = m_Polygons[iBatchEnd].iVertexCount;
+			int iPolyIndices = (iPolyVerts - 2) * 3;
+			if( (iBatchEnd != iPolygon) && (((iBatchVerts + iPolyVerts) > iMaxVerts) || ((iBatchIndices + iPolyIndices) > iMaxIndices)) )
+				break;
+
+			iBatchVerts += iPolyVerts;
+			iBatchIndices += iPolyIndices;
+			++iBatchEnd;
+		}
+
+		CMeshBuilder meshBuilder;
+		meshBuilder.Begin( pMesh, MATERIAL_TRIANGLES, iBatchVerts, iBatchIndices );
+
+		int iBaseVertex = 0;
+		for( int i = iPolygon; i != iBatchEnd; ++i )
+		{
+			const Polygon_t &polygon = m_Polygons[i];
+			const PortalMeshPoint_t *pVerts = &m_Vertices[polygon.iFirstVertex];
+			for( int j = 0; j != polygon.iVertexCount; ++j )
+			{
+				meshBuilder.Position3fv( &pVerts[j].vWorldSpacePosition.x );
+				meshBuilder.TexCoord2fv( 0, &pVerts[j].texCoord.x );
+				meshBuilder.AdvanceVertex();
+			}
+
+			//convex, so a fan works. Wound the same way as the strips RenderPortalMeshConvexPolygon() makes
+			for( int j = 2; j != polygon.iVertexCount; ++j )
+			{
+				meshBuilder.FastIndex( iBaseVertex );
+				meshBuilder.FastIndex( iBaseVertex + j );
+				meshBuilder.FastIndex( iBaseVertex + j - 1 );
+			}
+
+			iBaseVertex += polygon.iVertexCount;
+		}
+
+		meshBuilder.End();
+		pMesh->Draw();
+
+		iPolygon = iBatchEnd;
+	}
+}
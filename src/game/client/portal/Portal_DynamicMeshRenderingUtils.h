@@ -27,6 +27,40 @@ void RenderPortalMeshConvexPolygon( PortalMeshPoint_t *pVerts, int iVertCount, c
 
 void Clip_And_Render_Convex_Polygon( PortalMeshPoint_t *pVerts, int iVertCount, const IMaterial *pMaterial, void *pBind );
 
+//Finds which of the planes actually cut into a convex polygon so a group of polygons inside it only has to be clipped by those.
+//Returns -1 if the polygon is entirely behind one of the planes, otherwise the number of planes written to pOutPlanes
+int FindPlanesClippingConvexPolygon( const PortalMeshPoint_t *pVerts, int iVertCount, const VPlane *pPlanes, int iPlaneCount, VPlane *pOutPlanes );
+
+//-----------------------------------------------------------------------------
+// Purpose: Collects convex polygons that share a material and draws them as
+//			one indexed dynamic mesh instead of a mesh per polygon.
+//-----------------------------------------------------------------------------
+class CPortalMeshPolygonBatch
+{
+public:
+	CPortalMeshPolygonBatch( void );
+
+	void Reset( void );
+
+	void AddPolygon( const PortalMeshPoint_t *pVerts, int iVertCount );
+	void AddClippedPolygon( const PortalMeshPoint_t *pVerts, int iVertCount, const VPlane *pPlanes, int iPlaneCount ); //only what's in front of all the planes gets added
+
+	void Draw( const IMaterial *pMaterial, void *pBind ) const; //also draws a wireframe pass when mat_wireframe is on
+	int GetPolygonCount( void ) const { return m_Polygons.Count(); }
+
+private:
+	void DrawMesh( const IMaterial *pMaterial, void *pBind ) const;
+
+	struct Polygon_t
+	{
+		int iFirstVertex;
+		int iVertexCount;
+	};
+
+	CUtlVector<PortalMeshPoint_t> m_Vertices;
+	CUtlVector<Polygon_t> m_Polygons;
+};
+
 
 #endif //#ifndef PORTAL_DYNAMICMESHRENDERINGUTILS_H
 
@@ -61,6 +61,7 @@ ConVar cl_reorient_in_air("cl_reorient_in_air", "1", FCVAR_ARCHIVE, "Allows the
 
 #if FIXANGLEMETHOD_CONVAR
 // I sincerely hate networking stuff with cvars, but it's the only way I know how to do it.
+static ConVar cl_portal_teleport_journal( "cl_portal_teleport_journal", "1", FCVAR_CLIENTDLL | FCVAR_CHEAT, "Re-predicted commands that repeat a predicted portal teleportation reuse it instead of unrolling and applying it again." );
 ConVar cl_got_portal_message("cl_got_portal_message", "0", FCVAR_HIDDEN | FCVAR_SERVER_CAN_EXECUTE | FCVAR_USERINFO, "Let's the server know if we teleported");
 #endif
 
@@ -1617,6 +1618,98 @@ void C_Portal_Player::UnrollPredictedTeleportations( int iCommandNumber )
 		//player->pl.v_angle = qVAngles;
 	}
 }
+
+void C_Portal_Player::BeginPredictedTeleportationReplay( int iCommandNumber )
+{
+	if( !cl_portal_teleport_journal.GetBool() )
+	{
+		UnrollPredictedTeleportations( iCommandNumber );
+		return;
+	}
+
+	//teleportations in later commands stay applied until those commands are predicted again
+	for( int i = m_PredictedPortalTeleportations.Count(); --i >= 0; )
+	{
+		PredictedPortalTeleportation_t &entry = m_PredictedPortalTeleportations[i];
+		if( entry.iCommandNumber < iCommandNumber )
+			break;
+
+		if( entry.iCommandNumber == iCommandNumber )
+			entry.bReplayPending = true;
+	}
+}
+
+int C_Portal_Player::FindReplayedTeleportation( int iCommandNumber, const C_Prop_Portal *pEnteredPortal, bool bDuckForced ) const
+{
+	const C_Prop_Portal *pExitPortal = pEnteredPortal->m_hLinkedPortal.Get();
+	if( pExitPortal == NULL )
+		return -1;
+
+	for( int i = 0; i != m_PredictedPortalTeleportations.Count(); ++i )
+	{
+		const PredictedPortalTeleportation_t &entry = m_PredictedPortalTeleportations[i];
+		if( !entry.bReplayPending || (entry.iCommandNumber != iCommandNumber) )
+			continue;
+
+		//the portals may have moved since, in which case this is a different teleportation
+		if( (entry.pEnteredPortal == pEnteredPortal) && (entry.pExitPortal == pExitPortal) && (entry.bDuckForced == bDuckForced) &&
+			(entry.flTime == gpGlobals->curtime) && (entry.matUnroll == pExitPortal->MatrixThisToLinked()) )
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: The parts of ApplyPredictedPortalTeleportation() that prediction
+//			restores on its own, the interpolators kept the first application.
+//-----------------------------------------------------------------------------
+void C_Portal_Player::ReplayPredictedPortalTeleportation( const C_Prop_Portal *pEnteredPortal, CMoveData *pMove )
+{
+	m_matLatestServerTeleportationInverseMatrix = pEnteredPortal->m_hLinkedPortal->MatrixThisToLinked();
+	m_fLatestServerTeleport = gpGlobals->curtime;
+
+	if ( pMove )
+		SetOldPlayerZ( pMove->GetAbsOrigin().z );
+}
+
+void C_Portal_Player::FinishPredictedTeleportationReplay( int iCommandNumber )
+{
+	for( int i = m_PredictedPortalTeleportations.Count(); --i >= 0; )
+	{
+		const PredictedPortalTeleportation_t &entry = m_PredictedPortalTeleportations[i];
+		if( entry.iCommandNumber < iCommandNumber )
+			break;
+
+		if( entry.bReplayPending )
+		{
+			//this command didn't teleport the same way again, so nothing predicted after it is valid either
+			UnrollPredictedTeleportations( iCommandNumber );
+			FixPortalEnvironmentOwnership();
+			return;
+		}
+	}
+}
+
+bool C_Portal_Player::IsPortalEnvironmentJournaled( const CPortalSimulator *pSimulator ) const
+{
+	if( !cl_portal_teleport_journal.GetBool() || !prediction->InPrediction() || prediction->IsFirstTimePredicted() || (m_pCurrentCommand == NULL) )
+		return false;
+
+	for( int i = m_PredictedPortalTeleportations.Count(); --i >= 0; )
+	{
+		const PredictedPortalTeleportation_t &entry = m_PredictedPortalTeleportations[i];
+		if( entry.iCommandNumber < m_pCurrentCommand->command_number )
+			break;
+
+		if( entry.pExitPortal && (&entry.pExitPortal->m_PortalSimulator == pSimulator) )
+			return true;
+	}
+
+	return false;
+}
 #endif // USEMOVEMENTFORPORTALLING
 void C_Portal_Player::ForceDropOfCarriedPhysObjects(CBaseEntity* pOnlyIfHoldingThis)
 {
@@ -2422,6 +2515,13 @@ void C_Portal_Player::FixPortalEnvironmentOwnership(void)
 	CPortalSimulator *pNewSimulator = pPortalEnvironment ? &pPortalEnvironment->m_PortalSimulator : NULL;
 	if (pExistingSimulator != pNewSimulator)
 	{
+#if USEMOVEMENTFORPORTALLING
+		//Re-predicting commands leading up to a teleportation we're going to repeat. Moving ownership back only to move it forward again
+		//a few commands later rebuilds the clones twice for nothing. FinishPredictedTeleportationReplay() fixes this up if we don't repeat it.
+		if (pExistingSimulator && IsPortalEnvironmentJournaled(pExistingSimulator))
+			return;
+#endif
+
 		if (pExistingSimulator)
 		{
 			pExistingSimulator->ReleaseOwnershipOfEntity(this);
@@ -164,6 +164,8 @@ public:
 		int iCommandNumber;
 		float fDeleteServerTimeStamp;
 		bool bDuckForced;
+		bool bReplayPending; //command is being predicted again, unrolled unless the same teleportation happens again
+		C_Prop_Portal *pExitPortal; //portal environment the teleportation put us in
 		VMatrix matUnroll; //sometimes the portals move/fizzle between an apply and an unroll. Store the undo matrix ahead of time
 	};
 	CUtlVector<PredictedPortalTeleportation_t> m_PredictedPortalTeleportations;
@@ -209,6 +211,13 @@ public:
 
 	void UnrollPredictedTeleportations( int iCommandNumber ); //unroll all predicted teleportations at or after the target tick
 
+	//Re-predicted commands that teleport exactly like they did the last time keep the journaled teleportation instead of unrolling and applying it again
+	void BeginPredictedTeleportationReplay( int iCommandNumber );
+	int FindReplayedTeleportation( int iCommandNumber, const C_Prop_Portal *pEnteredPortal, bool bDuckForced ) const;
+	void ReplayPredictedPortalTeleportation( const C_Prop_Portal *pEnteredPortal, CMoveData *pMove );
+	void FinishPredictedTeleportationReplay( int iCommandNumber );
+	bool IsPortalEnvironmentJournaled( const CPortalSimulator *pSimulator ) const; //a teleportation later in the current replay exits into pSimulator
+
 #endif
 
 	Activity TranslateActivity( Activity baseAct, bool *pRequired = NULL );
@@ -28,6 +28,7 @@
 #include "vcollide_parse.h"
 #include "collisionutils.h"
 #include "portal_placement.h"
+#include "portal_spatial_index.h"
 
 #include "c_portal_player.h"
 #include "prediction.h"
@@ -73,6 +74,10 @@ IMPLEMENT_CLIENTCLASS_DT( C_Prop_Portal, DT_Prop_Portal, CProp_Portal )
 	RecvPropVector( RECVINFO( m_ptOrigin ) ),
 	RecvPropVector( RECVINFO( m_qAbsAngle ) ),
 
+	RecvPropInt( RECVINFO( m_iPlacementAxis ) ),
+	RecvPropArray3( RECVINFO_ARRAY( m_iPlacementCoords ), RecvPropInt( RECVINFO( m_iPlacementCoords[0] ) ) ),
+	RecvPropInt( RECVINFO( m_iPlacementRoll ) ),
+
 	RecvPropEHandle( RECVINFO(m_hLinkedPortal) ),
 	RecvPropBool( RECVINFO(m_bActivated) ),
 	RecvPropBool( RECVINFO(m_bOldActivatedState) ),
@@ -371,7 +376,10 @@ CProp_Portal *CProp_Portal::FindPortal( unsigned char iLinkageGroupID, bool bPor
 C_Prop_Portal::C_Prop_Portal( void )
 {	
 	TransformedLighting.m_LightShadowHandle = CLIENTSHADOW_INVALID_HANDLE;
+	m_bHasHandledNetworkChanges = false;
+	m_iPlacementAxis = PORTAL_PLACEMENT_AXIS_NONE;
 	CProp_Portal_Shared::AllPortals.AddToTail( this );
+	g_PortalSpatialIndex.AddPortal( this );
 
 	SetPredictionEligible(true);
 }
@@ -381,6 +389,7 @@ C_Prop_Portal::~C_Prop_Portal( void )
 	DestroyAttachedParticles();
 
 	CProp_Portal_Shared::AllPortals.FindAndRemove( this );
+	g_PortalSpatialIndex.RemovePortal( this );
 	g_pPortalRender->RemovePortal( this );
 
 	for( int i = m_GhostRenderables.Count(); --i >= 0; )
@@ -1051,6 +1060,33 @@ void C_Prop_Portal::OnNewParticleEffect( const char *pszParticleName, CNewPartic
 	}
 }
 
+void C_Prop_Portal::PostDataUpdate( DataUpdateType_t updateType )
+{
+	//an axis aligned placement arrives as a few ints while the full precision vectors sit at zero, rebuild them before anything reads them
+	if( m_iPlacementAxis != PORTAL_PLACEMENT_AXIS_NONE )
+	{
+		PortalPlacementEncoding_t encoding;
+		encoding.iAxis = m_iPlacementAxis;
+		for( int i = 0; i != 3; ++i )
+			encoding.iCoords[i] = m_iPlacementCoords[i];
+		encoding.iRoll = m_iPlacementRoll;
+
+		Vector vOrigin;
+		QAngle qAngles;
+		CProp_Portal_Shared::DecodePlacement( encoding, vOrigin, qAngles );
+
+		SetNetworkOrigin( vOrigin );
+		SetNetworkAngles( qAngles );
+		m_ptOrigin = vOrigin;
+		m_qAbsAngle = qAngles;
+	}
+
+	BaseClass::PostDataUpdate( updateType );
+
+	//m_bActivated may have just been restored from the network or a prediction rollback without going through SetActive()
+	g_PortalSpatialIndex.UpdatePortal( this );
+}
+
 void C_Prop_Portal::OnPreDataChanged( DataUpdateType_t updateType )
 {
 	//PreDataChanged.m_matrixThisToLinked = m_matrixThisToLinked;
@@ -1086,6 +1122,7 @@ void C_Prop_Portal::HandleNetworkChanges( bool bForcedChanges )
 
 	GetVectors( &m_vForward, &m_vRight, &m_vUp );
 	m_ptOrigin = GetNetworkOrigin();
+	g_PortalSpatialIndex.UpdatePortal( this );
 	
 	bool bActivityChanged = PreDataChanged.m_bActivated != IsActive();
 
@@ -1232,6 +1269,29 @@ void C_Prop_Portal::HandleNetworkChanges( bool bForcedChanges )
 		if( pRemote )
 			pRemote->UpdateGhostRenderables();
 	}
+
+	m_LastHandledNetworkChanges.m_bActivated = IsActive();
+	m_LastHandledNetworkChanges.m_bOldActivatedState = m_bOldActivatedState;
+	m_LastHandledNetworkChanges.m_bIsPortal2 = m_bIsPortal2;
+	m_LastHandledNetworkChanges.m_vOrigin = m_ptOrigin;
+	m_LastHandledNetworkChanges.m_qAngles = m_qAbsAngle;
+	m_LastHandledNetworkChanges.m_hLinkedTo = m_hLinkedPortal.Get();
+	m_bHasHandledNetworkChanges = true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Replaying commands after a prediction error usually restores the
+//			exact placement we already handled. Moving the simulator and
+//			rebuilding the ghosts for it again is where replays got expensive.
+//-----------------------------------------------------------------------------
+bool C_Prop_Portal::NetworkChangesAlreadyHandled( void ) const
+{
+	return m_bHasHandledNetworkChanges &&
+		(m_LastHandledNetworkChanges.m_bActivated == IsActive()) &&
+		(m_LastHandledNetworkChanges.m_bIsPortal2 == m_bIsPortal2) &&
+		(m_LastHandledNetworkChanges.m_vOrigin == GetNetworkOrigin()) &&
+		(m_LastHandledNetworkChanges.m_qAngles == m_qAbsAngle) &&
+		(m_LastHandledNetworkChanges.m_hLinkedTo.Get() == m_hLinkedPortal.Get());
 }
 
 void C_Prop_Portal::OnDataChanged( DataUpdateType_t updateType )
@@ -1609,8 +1669,18 @@ bool C_Prop_Portal::ShouldCreateAttachedParticles(void)
 	return false;
 }
 
-void C_Prop_Portal::NewLocation( const Vector &vOrigin, const QAngle &qAngles )
+void C_Prop_Portal::NewLocation( const Vector &vNewOrigin, const QAngle &qNewAngles )
 {
+	//a predicted placement touches render registration, ghosts, orientation and the link matrix behind HandleNetworkChanges()' back.
+	//If it was mispredicted, the restored network state matches the last handled record and the correction would be skipped
+	m_bHasHandledNetworkChanges = false;
+
+	//predict the same snapped placement the server networks
+	Vector vOrigin = vNewOrigin;
+	QAngle qAngles = qNewAngles;
+	if( GetMoveParent() == NULL )
+		CProp_Portal_Shared::QuantizePlacement( vOrigin, qAngles );
+
 	// Don't fizzle me if I moved from a location another portalgun shot
 //	if (m_pPortalReplacingMe)
 //		m_pPortalReplacingMe->m_pHitPortal = NULL;
@@ -2230,13 +2300,21 @@ void C_Prop_Portal::DestroyAttachedParticles( void )
 
 void C_Prop_Portal::HandlePredictionError( bool bErrorInThisEntity )
 {		
-	if( bErrorInThisEntity )
+	//an error in fields that don't affect placement, linkage or activity leaves everything below as it was
+	bool bPlacementChanged = bErrorInThisEntity && !NetworkChangesAlreadyHandled();
+
+	if( bPlacementChanged )
 	{
 		HandleNetworkChanges();
 	}
 
 	BaseClass::HandlePredictionError( bErrorInThisEntity );
+
+	//restoring predicted fields can flip m_bActivated behind SetActive()'s back
 	if( bErrorInThisEntity )
+		g_PortalSpatialIndex.UpdatePortal( this );
+
+	if( bPlacementChanged )
 	{
 		if( IsActive() )
 		{
@@ -123,6 +123,10 @@ public:
 		CHandle<C_Prop_Portal> m_hLinkedTo;
 	} PreDataChanged;
 
+	Portal_PreDataChanged	m_LastHandledNetworkChanges; //what HandleNetworkChanges() last brought the simulator, render and ghosts up to date with
+	bool					m_bHasHandledNetworkChanges;
+	bool					NetworkChangesAlreadyHandled( void ) const;
+
 	struct TransformedLightingData_t
 	{
 		ClientShadowHandle_t	m_LightShadowHandle;
@@ -139,6 +143,7 @@ public:
 	int			m_iDelayedFailure;
 	EHANDLE		m_hPlacedBy;
 
+	virtual void			PostDataUpdate( DataUpdateType_t updateType );
 	virtual void			OnPreDataChanged( DataUpdateType_t updateType );
 	void					HandleNetworkChanges( bool bForceChanges = false );
 	virtual void			OnDataChanged( DataUpdateType_t updateType );
@@ -160,6 +165,11 @@ public:
 	virtual C_BaseEntity *	PortalRenderable_GetPairedEntity( void ) { return this; };
 	
 	int m_nPlacementAttemptParity;
+
+	//compact network placement, see CProp_Portal_Shared::EncodePlacement()
+	int m_iPlacementAxis;
+	int m_iPlacementCoords[3];
+	int m_iPlacementRoll;
 	
 	unsigned char			m_iLinkageGroupID; //a group ID specifying which portals this one can possibly link to
 	
@@ -99,6 +99,8 @@ CPortalRenderable_FlatBasic::CPortalRenderable_FlatBasic( void )
 	m_InternallyMaintainedData.m_VisData.m_fDistToAreaPortalTolerance = 64.0f;
 	m_InternallyMaintainedData.m_VisData.m_vecVisOrigin = Vector(0,0,0);
 	m_InternallyMaintainedData.m_iViewLeaf = -1;
+	for( int i = 0; i != 4; ++i )
+		m_InternallyMaintainedData.m_bCornerInWorld[i] = false;
 
 	m_InternallyMaintainedData.m_DepthDoublerTextureView.Identity();
 	m_InternallyMaintainedData.m_bUsableDepthDoublerConfiguration = false;
@@ -110,6 +112,11 @@ CPortalRenderable_FlatBasic::CPortalRenderable_FlatBasic( void )
 		m_InternallyMaintainedData.m_ptCorners[2] =
 		m_InternallyMaintainedData.m_ptCorners[3] =
 		Vector( 0.0f, 0.0f, 0.0f );
+
+	for( int i = 0; i != PORTALRENDERABLE_FLATBASIC_FRUSTUMCACHE_SIZE; ++i )
+		m_FrustumCache[i].m_bValid = false;
+	m_iNextFrustumCacheEntry = 0;
+	m_iMoveCount = 0;
 }
 
 void CPortalRenderable_FlatBasic::GetToolRecordingState( bool bActive, KeyValues *msg )
@@ -136,6 +143,8 @@ void CPortalRenderable_FlatBasic::GetToolRecordingState( bool bActive, KeyValues
 
 void CPortalRenderable_FlatBasic::PortalMoved( void )
 {
+	++m_iMoveCount;
+
 	m_InternallyMaintainedData.m_ptForwardOrigin = m_ptOrigin + m_vForward;
 	m_InternallyMaintainedData.m_fPlaneDist = m_vForward.Dot( m_ptOrigin );
 
@@ -153,6 +162,9 @@ void CPortalRenderable_FlatBasic::PortalMoved( void )
 		m_InternallyMaintainedData.m_VisData.m_vecVisOrigin = m_InternallyMaintainedData.m_ptForwardOrigin;
 		m_InternallyMaintainedData.m_VisData.m_fDistToAreaPortalTolerance = 64.0f;				
 		m_InternallyMaintainedData.m_iViewLeaf = enginetrace->GetLeafContainingPoint( m_InternallyMaintainedData.m_ptForwardOrigin );
+
+		for( int i = 0; i != 4; ++i )
+			m_InternallyMaintainedData.m_bCornerInWorld[i] = (enginetrace->GetLeafContainingPoint( m_InternallyMaintainedData.m_ptCorners[i] ) != -1);
 	}
 
 	m_InternallyMaintainedData.m_nSkyboxVisibleFromCorners = engine->IsSkyboxVisibleFromPoint( m_InternallyMaintainedData.m_ptForwardOrigin );
@@ -225,16 +237,14 @@ bool CPortalRenderable_FlatBasic::WillUseDepthDoublerThisDraw( void ) const
 
 
 ConVar r_portal_use_complex_frustums( "r_portal_use_complex_frustums", "1", FCVAR_CLIENTDLL, "View optimization, turn this off if you get odd visual bugs." );
+ConVar r_portal_frustum_cache( "r_portal_frustum_cache", "1", FCVAR_CLIENTDLL | FCVAR_CHEAT, "Reuse frustums calculated through a portal while neither the view nor the portals have changed." );
 
 bool CPortalRenderable_FlatBasic::CalcFrustumThroughPortal( const Vector &ptCurrentViewOrigin, Frustum OutputFrustum )
 {
 	if( r_portal_use_complex_frustums.GetBool() == false )
 		return false;
 
-	int i;
-
 	int iViewRecursionLevel = g_pPortalRender->GetViewRecursionLevel();
-	int iNextViewRecursionLevel = iViewRecursionLevel + 1;
 
 	if( (iViewRecursionLevel == 0) && 
 		( (ptCurrentViewOrigin - m_ptOrigin).LengthSqr() < (PORTAL_HALF_HEIGHT * PORTAL_HALF_HEIGHT) ) )//FIXME: Player closeness check might need reimplementation
@@ -249,6 +259,77 @@ bool CPortalRenderable_FlatBasic::CalcFrustumThroughPortal( const Vector &ptCurr
 	if( m_vForward.Dot( ptCurrentViewOrigin ) <= m_InternallyMaintainedData.m_fPlaneDist )
 		return false; //looking at portal backface
 
+	bool bWroteComplexFrustum;
+	if( r_portal_frustum_cache.GetBool() == false )
+		return CalcFrustumThroughPortal_Clipped( ptCurrentViewOrigin, OutputFrustum, bWroteComplexFrustum );
+
+	CUtlVector<VPlane> &inputFrustum = g_pPortalRender->m_RecursiveViewComplexFrustums[iViewRecursionLevel];
+	CRC32_t iInputFrustumCRC;
+	CRC32_Init( &iInputFrustumCRC );
+	CRC32_ProcessBuffer( &iInputFrustumCRC, inputFrustum.Base(), sizeof( VPlane ) * inputFrustum.Count() );
+	CRC32_Final( &iInputFrustumCRC );
+
+	for( int i = 0; i != PORTALRENDERABLE_FLATBASIC_FRUSTUMCACHE_SIZE; ++i )
+	{
+		FrustumCacheEntry_t &entry = m_FrustumCache[i];
+		if( entry.m_bValid &&
+			(entry.m_iInputFrustumCRC == iInputFrustumCRC) &&
+			(entry.m_iInputFrustumPlaneCount == inputFrustum.Count()) &&
+			(entry.m_iViewRecursionLevel == iViewRecursionLevel) &&
+			(entry.m_iMoveCount == m_iMoveCount) &&
+			(entry.m_pLinkedPortal == m_pLinkedPortal) &&
+			(entry.m_iLinkedMoveCount == m_pLinkedPortal->m_iMoveCount) &&
+			(entry.m_ptViewOrigin == ptCurrentViewOrigin) )
+		{
+			if( entry.m_bWroteComplexFrustum )
+				g_pPortalRender->m_RecursiveViewComplexFrustums[iViewRecursionLevel + 1].CopyArray( entry.m_ComplexFrustum.Base(), entry.m_ComplexFrustum.Count() );
+
+			if( entry.m_bResult )
+				memcpy( OutputFrustum, entry.m_OutputFrustum, sizeof( Frustum ) );
+
+			return entry.m_bResult;
+		}
+	}
+
+	bool bResult = CalcFrustumThroughPortal_Clipped( ptCurrentViewOrigin, OutputFrustum, bWroteComplexFrustum );
+
+	FrustumCacheEntry_t &entry = m_FrustumCache[m_iNextFrustumCacheEntry];
+	m_iNextFrustumCacheEntry = (m_iNextFrustumCacheEntry + 1) % PORTALRENDERABLE_FLATBASIC_FRUSTUMCACHE_SIZE;
+
+	entry.m_bValid = true;
+	entry.m_ptViewOrigin = ptCurrentViewOrigin;
+	entry.m_iInputFrustumCRC = iInputFrustumCRC;
+	entry.m_iInputFrustumPlaneCount = inputFrustum.Count();
+	entry.m_iViewRecursionLevel = iViewRecursionLevel;
+	entry.m_iMoveCount = m_iMoveCount;
+	entry.m_pLinkedPortal = m_pLinkedPortal;
+	entry.m_iLinkedMoveCount = m_pLinkedPortal->m_iMoveCount;
+	entry.m_bResult = bResult;
+	entry.m_bWroteComplexFrustum = bWroteComplexFrustum;
+	if( bWroteComplexFrustum )
+	{
+		CUtlVector<VPlane> &complexFrustum = g_pPortalRender->m_RecursiveViewComplexFrustums[iViewRecursionLevel + 1];
+		entry.m_ComplexFrustum.CopyArray( complexFrustum.Base(), complexFrustum.Count() );
+	}
+	if( bResult )
+		memcpy( entry.m_OutputFrustum, OutputFrustum, sizeof( Frustum ) );
+
+	return bResult;
+}
+
+//-----------------------------------------------------------------------------
+// The expensive part of CalcFrustumThroughPortal(), clips the portal to the current view's complex frustum and builds
+// the next recursion level's complex frustum and a standard frustum from what's left.
+//-----------------------------------------------------------------------------
+bool CPortalRenderable_FlatBasic::CalcFrustumThroughPortal_Clipped( const Vector &ptCurrentViewOrigin, Frustum OutputFrustum, bool &bWroteComplexFrustum )
+{
+	int i;
+
+	int iViewRecursionLevel = g_pPortalRender->GetViewRecursionLevel();
+	int iNextViewRecursionLevel = iViewRecursionLevel + 1;
+
+	bWroteComplexFrustum = false;
+
 	//VPlane *pInputFrustum = view->GetFrustum(); //g_pPortalRender->m_RecursiveViewComplexFrustums[iViewRecursionLevel].Base();
 	//int iInputFrustumPlaneCount = 6; //g_pPortalRender->m_RecursiveViewComplexFrustums[iViewRecursionLevel].Count();
 	VPlane *pInputFrustum = g_pPortalRender->m_RecursiveViewComplexFrustums[iViewRecursionLevel].Base();
@@ -279,6 +360,7 @@ bool CPortalRenderable_FlatBasic::CalcFrustumThroughPortal( const Vector &ptCurr
 		return false; //nothing left in the frustum
 
 	g_pPortalRender->m_RecursiveViewComplexFrustums[iNextViewRecursionLevel].SetCount( iVertCount + 2 ); //+2 for near and far z planes
+	bWroteComplexFrustum = true;
 
 	Vector ptTransformedCamera = m_matrixThisToLinked * ptCurrentViewOrigin;
 
@@ -662,7 +744,7 @@ void CPortalRenderable_FlatBasic::AddToVisAsExitPortal( ViewCustomVisibility_t *
 	// Add four corners of the portal to the renderer as visibility origins
 	for ( int i = 0; i < 4; ++i )
 	{
-		if( enginetrace->GetLeafContainingPoint( m_InternallyMaintainedData.m_ptCorners[i] ) != -1 )
+		if( m_InternallyMaintainedData.m_bCornerInWorld[i] )
 			pCustomVisibility->AddVisOrigin( m_InternallyMaintainedData.m_ptCorners[i] );
 	}
 
@@ -727,7 +809,7 @@ void CPortalRenderable_FlatBasic::HandlePortalPlaybackMessage( KeyValues *pKeyVa
 }
 
 extern ConVar mat_wireframe;
-static void DrawComplexPortalMesh_SubQuad( Vector &ptBottomLeft, Vector &vUp, Vector &vRight, float *fSubQuadRect, void *pBindEnt, const IMaterial *pMaterial, const VMatrix *pReplacementViewMatrixForTexCoords = NULL )
+static void DrawComplexPortalMesh_SubQuad( Vector &ptBottomLeft, Vector &vUp, Vector &vRight, float *fSubQuadRect, CPortalMeshPolygonBatch &batch, const VPlane *pClipPlanes, int iClipPlaneCount )
 {
 	PortalMeshPoint_t Vertices[4];
 
@@ -747,7 +829,7 @@ static void DrawComplexPortalMesh_SubQuad( Vector &ptBottomLeft, Vector &vUp, Ve
 	Vertices[3].texCoord.x = fSubQuadRect[0];
 	Vertices[3].texCoord.y = fSubQuadRect[3];	
 
-	Clip_And_Render_Convex_Polygon( Vertices, 4, pMaterial, pBindEnt );
+	batch.AddClippedPolygon( Vertices, 4, pClipPlanes, iClipPlaneCount );
 }
 
 #define PORTAL_PROJECTION_MESH_SUBDIVIDE_HEIGHTCHUNKS 8
@@ -776,6 +858,20 @@ void CPortalRenderable_FlatBasic::DrawComplexPortalMesh( const IMaterial *pMater
 	}
 
 
+	//only the frustum planes that cut into the whole portal can cut into a piece of it
+	BaseVertices[0].vWorldSpacePosition = ptBottomLeft;
+	BaseVertices[1].vWorldSpacePosition = ptBottomLeft + vScaledUp;
+	BaseVertices[2].vWorldSpacePosition = ptBottomLeft + vScaledUp + vScaledRight;
+	BaseVertices[3].vWorldSpacePosition = ptBottomLeft + vScaledRight;
+
+	VPlane ClipPlanes[FRUSTUM_NUMPLANES];
+	int iClipPlaneCount = FindPlanesClippingConvexPolygon( BaseVertices, 4, view->GetFrustum(), FRUSTUM_NUMPLANES, ClipPlanes );
+	if( iClipPlaneCount < 0 )
+		return; //entirely outside the view
+
+	static CPortalMeshPolygonBatch s_SubQuadBatch; //only ever drawn from the main thread, static to keep the allocations around
+	s_SubQuadBatch.Reset();
+
 	float fSubQuadRect[4] = { 0.0f, 0.0f, 1.0f, 1.0f };
 
 	float fHeightBegin = 0.0f;
@@ -794,13 +890,15 @@ void CPortalRenderable_FlatBasic::DrawComplexPortalMesh( const IMaterial *pMater
 			fSubQuadRect[0] = fWidthBegin;
 			fSubQuadRect[2] = fWidthEnd;
 
-			DrawComplexPortalMesh_SubQuad( ptBottomLeft, vScaledUp, vScaledRight, fSubQuadRect, GetClientRenderable(), pMaterial );	
+			DrawComplexPortalMesh_SubQuad( ptBottomLeft, vScaledUp, vScaledRight, fSubQuadRect, s_SubQuadBatch, ClipPlanes, iClipPlaneCount );	
 
 			fWidthBegin = fWidthEnd;
 		}
 		fHeightBegin = fHeightEnd; 
 	}
 
+	s_SubQuadBatch.Draw( pMaterial, GetClientRenderable() );
+
 	//pRenderContext->Flush( false );	
 }
 
@@ -1338,6 +1436,30 @@ bool CPortalRenderable_FlatBasic::ShouldUpdatePortalView_BasedOnPixelVisibility(
 			(fScreenFilledByStencilMaskLastFrame_Normalized > PORTALRENDERABLE_FLATBASIC_MINPIXELVIS );
 }
 
+//-----------------------------------------------------------------------------
+// Solid angle of the portal quad over the solid angle of the view frustum. Ignores clipping against the frustum, so it's only good for ranking
+//-----------------------------------------------------------------------------
+float CPortalRenderable_FlatBasic::EstimateScreenCoverage( const CViewSetup &currentView ) const
+{
+	Vector vPortalToCamera = currentView.origin - m_ptOrigin;
+	float fDistSqr = vPortalToCamera.LengthSqr();
+	if( fDistSqr < (PORTAL_HALF_HEIGHT * PORTAL_HALF_HEIGHT) )
+		return 1.0f; //close enough to fill the screen
+
+	float fFacing = m_vForward.Dot( vPortalToCamera ) / FastSqrt( fDistSqr );
+	if( fFacing <= 0.0f )
+		return 0.0f; //backface
+
+	float fAspectRatio = (currentView.m_flAspectRatio > 0.0f) ? currentView.m_flAspectRatio : ((float)currentView.width / (float)MAX( currentView.height, 1 ));
+	float fTanHalfFOVX = tanf( DEG2RAD( currentView.fov * 0.5f ) );
+	float fTanHalfFOVY = fTanHalfFOVX / MAX( fAspectRatio, 0.01f );
+
+	float fPortalSolidAngle = (4.0f * PORTAL_HALF_WIDTH * PORTAL_HALF_HEIGHT * fFacing) / fDistSqr;
+	float fViewSolidAngle = 4.0f * fTanHalfFOVX * fTanHalfFOVY;
+
+	return MIN( fPortalSolidAngle / fViewSolidAngle, 1.0f );
+}
+
 CPortalRenderable *CreatePortal_FlatBasic_Fn( void )
 {
 	return new CPortalRenderable_FlatBasic;
@@ -13,9 +13,11 @@
 #endif
 
 #include "PortalRender.h"
+#include "checksum_crc.h"
 
 struct PortalMeshPoint_t;
 #define PORTALRENDERFIXMESH_OUTERBOUNDPLANES 12
+#define PORTALRENDERABLE_FLATBASIC_FRUSTUMCACHE_SIZE 4 //a portal is usually seen from a couple views per frame at most
 
 
 struct FlatBasicPortalRenderingMaterials_t
@@ -66,6 +68,7 @@ public:
 
 	virtual bool	ShouldUpdatePortalView_BasedOnView( const CViewSetup &currentView, CUtlVector<VPlane> &currentComplexFrustum ); //portal is both visible, and will display at least some portion of a remote view
 	virtual bool	ShouldUpdatePortalView_BasedOnPixelVisibility( float fScreenFilledByStencilMaskLastFrame_Normalized );
+	virtual float	EstimateScreenCoverage( const CViewSetup &currentView ) const;
 	virtual bool	ShouldUpdateDepthDoublerTexture( const CViewSetup &viewSetup );
 
 	virtual void	GetToolRecordingState( bool bActive, KeyValues *msg );
@@ -81,6 +84,7 @@ public:
 	bool			CalcFrustumThroughPortal( const Vector &ptCurrentViewOrigin, Frustum OutputFrustum );
 	
 protected:
+	bool			CalcFrustumThroughPortal_Clipped( const Vector &ptCurrentViewOrigin, Frustum OutputFrustum, bool &bWroteComplexFrustum );
 	
 	void			ClipFixToBoundingAreaAndDraw( PortalMeshPoint_t *pVerts, const IMaterial *pMaterial );
 	void			Internal_DrawRenderFixMesh( const IMaterial *pMaterial );
@@ -98,6 +102,7 @@ protected:
 
 		VisOverrideData_t	m_VisData; // a data to use for visibility calculations (to override area portal culling)
 		int					m_iViewLeaf; // leaf to start in for area portal flowing through calculations
+		bool				m_bCornerInWorld[4]; // whether each of m_ptCorners is inside a leaf, only those get added as vis origins
 
 		VMatrix				m_DepthDoublerTextureView; //cached version of view matrix at depth 1 for use when drawing the depth doubler mesh
 		bool				m_bUsableDepthDoublerConfiguration; //every time a portal moves we re-evaluate whether the depth doubler will reasonably approximate more views
@@ -111,6 +116,28 @@ protected:
 
 	FlatBasicPortal_InternalData_t m_InternallyMaintainedData;
 
+	//CalcFrustumThroughPortal() results for recent views. The output only depends on the view origin, the frustum we're looking through it with and where both portals are
+	struct FrustumCacheEntry_t
+	{
+		Vector				m_ptViewOrigin;
+		CRC32_t				m_iInputFrustumCRC;
+		int					m_iInputFrustumPlaneCount;
+		int					m_iViewRecursionLevel;
+		int					m_iMoveCount;
+		int					m_iLinkedMoveCount;
+		const CPortalRenderable_FlatBasic *m_pLinkedPortal;
+
+		bool				m_bValid;
+		bool				m_bResult;
+		bool				m_bWroteComplexFrustum;
+		Frustum				m_OutputFrustum;
+		CUtlVector<VPlane>	m_ComplexFrustum; //what we left in the next recursion level's complex frustum
+	};
+
+	FrustumCacheEntry_t	m_FrustumCache[PORTALRENDERABLE_FLATBASIC_FRUSTUMCACHE_SIZE];
+	int					m_iNextFrustumCacheEntry;
+	int					m_iMoveCount; //bumped by every PortalMoved(), invalidates cached frustums for this portal and any portal linked to it
+
 public:
 
 	CPortalRenderable_FlatBasic	*m_pLinkedPortal;
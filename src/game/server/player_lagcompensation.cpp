@@ -10,10 +10,15 @@
 #include "igamesystem.h"
 #include "ilagcompensationmanager.h"
 #include "inetchannelinfo.h"
-#include "utllinkedlist.h"
+#include "utlvector.h"
 #include "BaseAnimatingOverlay.h"
 #include "tier0/vprof.h"
 
+#ifdef PORTAL
+#include "portal_player.h"
+#include "prop_portal.h"
+#endif
+
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
 
@@ -24,6 +29,9 @@
 #define LC_ANGLES_CHANGED	(1<<9)
 #define LC_SIZE_CHANGED		(1<<10)
 #define LC_ANIMATION_CHANGED (1<<11)
+#define LC_PORTAL_ENVIRONMENT_CHANGED (1<<12)
+
+#define LAG_RECORD_HISTORY_SECONDS 1.0f // upper bound of sv_maxunlag, the history never needs to cover more than this
 
 static ConVar sv_lagcompensation_teleport_dist( "sv_lagcompensation_teleport_dist", "64", FCVAR_DEVELOPMENTONLY | FCVAR_CHEAT, "How far a player got moved by game code before we can't lag compensate their position back" );
 #define LAG_COMPENSATION_EPS_SQR ( 0.1f * 0.1f )
@@ -79,6 +87,11 @@ public:
 		m_flSimulationTime = -1;
 		m_masterSequence = 0;
 		m_masterCycle = 0;
+#ifdef PORTAL
+		m_hPortalEnvironment = NULL;
+		m_bPortalTeleported = false;
+		m_matPortalTeleport.Identity();
+#endif
 	}
 
 	LagRecord( const LagRecord& src )
@@ -95,6 +108,11 @@ public:
 		}
 		m_masterSequence = src.m_masterSequence;
 		m_masterCycle = src.m_masterCycle;
+#ifdef PORTAL
+		m_hPortalEnvironment = src.m_hPortalEnvironment;
+		m_bPortalTeleported = src.m_bPortalTeleported;
+		m_matPortalTeleport = src.m_matPortalTeleport;
+#endif
 	}
 
 	// Did player die this frame
@@ -112,6 +130,76 @@ public:
 	LayerRecord				m_layerRecords[MAX_LAYER_RECORDS];
 	int						m_masterSequence;
 	float					m_masterCycle;
+
+#ifdef PORTAL
+	// Portal whose environment the player was in, traces against the player at this time should go through its simulator
+	CHandle<CProp_Portal>	m_hPortalEnvironment;
+
+	// Did the player go through a portal since the previous (older) record, and if so the transform it applied
+	bool					m_bPortalTeleported;
+	VMatrix					m_matPortalTeleport;
+#endif
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Fixed capacity history of lag records for one player, newest first.
+//			Adding to a full history overwrites the oldest record.
+//-----------------------------------------------------------------------------
+class CLagRecordHistory
+{
+public:
+	CLagRecordHistory() : m_iNewest( 0 ), m_iCount( 0 ) {}
+
+	void SetCapacity( int iCapacity )
+	{
+		if ( m_Records.Count() == iCapacity )
+			return;
+
+		m_Records.SetCount( iCapacity );
+		RemoveAll();
+	}
+
+	int Count() const { return m_iCount; }
+
+	// 0 is the newest record, Count() - 1 the oldest
+	LagRecord &Element( int i )
+	{
+		Assert( i >= 0 && i < m_iCount );
+		return m_Records[ (m_iNewest + i) % m_Records.Count() ];
+	}
+
+	LagRecord &AddToHead()
+	{
+		Assert( m_Records.Count() > 0 );
+		m_iNewest = ( m_iNewest + m_Records.Count() - 1 ) % m_Records.Count();
+		if ( m_iCount < m_Records.Count() )
+			++m_iCount;
+
+		return m_Records[ m_iNewest ];
+	}
+
+	void RemoveTail()
+	{
+		Assert( m_iCount > 0 );
+		--m_iCount;
+	}
+
+	void RemoveAll()
+	{
+		m_iNewest = 0;
+		m_iCount = 0;
+	}
+
+	void Purge()
+	{
+		m_Records.Purge();
+		RemoveAll();
+	}
+
+private:
+	CUtlVector< LagRecord >	m_Records;
+	int						m_iNewest;
+	int						m_iCount;
 };
 
 
@@ -200,14 +288,18 @@ public:
 private:
 	void			BacktrackPlayer( CBasePlayer *player, float flTargetTime );
 
+#ifdef PORTAL
+	void			RecordPortalState( CBasePlayer *pPlayer, CLagRecordHistory *track );
+#endif
+
 	void ClearHistory()
 	{
 		for ( int i=0; i<MAX_PLAYERS; i++ )
 			m_PlayerTrack[i].Purge();
 	}
 
-	// keep a list of lag records for each player
-	CUtlFixedLinkedList< LagRecord >	m_PlayerTrack[ MAX_PLAYERS ];
+	// keep a history of lag records for each player
+	CLagRecordHistory		m_PlayerTrack[ MAX_PLAYERS ];
 
 	// Scratchpad for determining what needs to be restored
 	CBitVec<MAX_PLAYERS>	m_RestorePlayer;
@@ -245,12 +337,15 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 	// remove all records before that time:
 	int flDeadtime = gpGlobals->curtime - sv_maxunlag.GetFloat();
 
+	// one record per tick at most, plus a spare for the record straddling the dead time
+	int iHistoryCapacity = TIME_TO_TICKS( LAG_RECORD_HISTORY_SECONDS ) + 2;
+
 	// Iterate all active players
 	for ( int i = 1; i <= gpGlobals->maxClients; i++ )
 	{
 		CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
 
-		CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[i-1];
+		CLagRecordHistory *track = &m_PlayerTrack[i-1];
 
 		if ( !pPlayer )
 		{
@@ -262,27 +357,25 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 			continue;
 		}
 
-		Assert( track->Count() < 1000 ); // insanity check
+		track->SetCapacity( iHistoryCapacity );
 
 		// remove tail records that are too old
-		int tailIndex = track->Tail();
-		while ( track->IsValidIndex( tailIndex ) )
+		while ( track->Count() > 0 )
 		{
-			LagRecord &tail = track->Element( tailIndex );
+			LagRecord &tail = track->Element( track->Count() - 1 );
 
 			// if tail is within limits, stop
 			if ( tail.m_flSimulationTime >= flDeadtime )
 				break;
 			
 			// remove tail, get new tail
-			track->Remove( tailIndex );
-			tailIndex = track->Tail();
+			track->RemoveTail();
 		}
 
 		// check if head has same simulation time
 		if ( track->Count() > 0 )
 		{
-			LagRecord &head = track->Element( track->Head() );
+			LagRecord &head = track->Element( 0 );
 
 			// check if player changed simulation time since last time updated
 			if ( head.m_flSimulationTime >= pPlayer->GetSimulationTime() )
@@ -290,7 +383,7 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 		}
 
 		// add new record to player track
-		LagRecord &record = track->Element( track->AddToHead() );
+		LagRecord &record = track->AddToHead();
 
 		record.m_fFlags = 0;
 		if ( pPlayer->IsAlive() )
@@ -318,12 +411,65 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 		}
 		record.m_masterSequence = pPlayer->GetSequence();
 		record.m_masterCycle = pPlayer->GetCycle();
+
+#ifdef PORTAL
+		RecordPortalState( pPlayer, track );
+#endif
 	}
 
 	//Clear the current player.
 	m_pCurrentPlayer = NULL;
 }
 
+#ifdef PORTAL
+//-----------------------------------------------------------------------------
+// Purpose: Fills in the portal part of the newest record. A jump bigger than the
+//			teleport distance that lines up with a portal the player was in is
+//			a trip through that portal, not a teleport we can't compensate.
+//-----------------------------------------------------------------------------
+void CLagCompensationManager::RecordPortalState( CBasePlayer *pPlayer, CLagRecordHistory *track )
+{
+	LagRecord &record = track->Element( 0 );
+	CPortal_Player *pPortalPlayer = ToPortalPlayer( pPlayer );
+
+	record.m_hPortalEnvironment = pPortalPlayer->m_hPortalEnvironment.Get();
+	record.m_bPortalTeleported = false;
+	record.m_matPortalTeleport.Identity();
+
+	if ( track->Count() < 2 )
+		return;
+
+	const LagRecord &prevRecord = track->Element( 1 );
+	if ( (record.m_vecOrigin - prevRecord.m_vecOrigin).Length2DSqr() <= m_flTeleportDistanceSqr )
+		return;
+
+	// either went in the portal the last record was near, or came out of the one this record is near
+	CProp_Portal *pEnteredPortal = prevRecord.m_hPortalEnvironment.Get();
+	if ( pEnteredPortal && pEnteredPortal->IsActivedAndLinked() )
+	{
+		Vector vTransformed = pEnteredPortal->MatrixThisToLinked() * prevRecord.m_vecOrigin;
+		if ( (vTransformed - record.m_vecOrigin).LengthSqr() <= m_flTeleportDistanceSqr )
+		{
+			record.m_bPortalTeleported = true;
+			record.m_matPortalTeleport = pEnteredPortal->MatrixThisToLinked();
+			return;
+		}
+	}
+
+	CProp_Portal *pExitPortal = record.m_hPortalEnvironment.Get();
+	if ( pExitPortal && pExitPortal->IsActivedAndLinked() )
+	{
+		const VMatrix &matTeleport = pExitPortal->m_hLinkedPortal->MatrixThisToLinked();
+		Vector vTransformed = matTeleport * prevRecord.m_vecOrigin;
+		if ( (vTransformed - record.m_vecOrigin).LengthSqr() <= m_flTeleportDistanceSqr )
+		{
+			record.m_bPortalTeleported = true;
+			record.m_matPortalTeleport = matTeleport;
+		}
+	}
+}
+#endif
+
 // Called during player movement to set up/restore after lag compensation
 void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCmd *cmd )
 {
@@ -431,21 +577,19 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	int pl_index = pPlayer->entindex() - 1;
 
 	// get track history of this player
-	CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[ pl_index ];
+	CLagRecordHistory *track = &m_PlayerTrack[ pl_index ];
 
 	// check if we have at leat one entry
 	if ( track->Count() <= 0 )
 		return;
 
-	int curr = track->Head();
-
 	LagRecord *prevRecord = NULL;
 	LagRecord *record = NULL;
 
 	Vector prevOrg = pPlayer->GetLocalOrigin();
 	
 	// Walk context looking for any invalidating event
-	while( track->IsValidIndex(curr) )
+	for ( int curr = 0; curr < track->Count(); ++curr )
 	{
 		// remember last record
 		prevRecord = record;
@@ -459,7 +603,16 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 			return;
 		}
 
-		Vector delta = record->m_vecOrigin - prevOrg;
+		Vector vecOrigin = record->m_vecOrigin;
+#ifdef PORTAL
+		// going through a portal isn't losing track, compare where this record ended up on the other side
+		if ( prevRecord && prevRecord->m_bPortalTeleported )
+		{
+			vecOrigin = prevRecord->m_matPortalTeleport * vecOrigin;
+		}
+#endif
+
+		Vector delta = vecOrigin - prevOrg;
 		if ( delta.Length2DSqr() > m_flTeleportDistanceSqr )
 		{
 			// lost track, too much difference
@@ -471,9 +624,6 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 			break; // hurra, stop
 
 		prevOrg = record->m_vecOrigin;
-
-		// go one step back
-		curr = track->Next( curr );
 	}
 
 	Assert( record );
@@ -491,7 +641,11 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	float frac = 0.0f;
 	if ( prevRecord && 
 		 (record->m_flSimulationTime < flTargetTime) &&
-		 (record->m_flSimulationTime < prevRecord->m_flSimulationTime) )
+		 (record->m_flSimulationTime < prevRecord->m_flSimulationTime)
+#ifdef PORTAL
+		 && !prevRecord->m_bPortalTeleported // the two records are on different sides of a portal, there's nothing in between
+#endif
+		 )
 	{
 		// we didn't find the exact time but have a valid previous record
 		// so interpolate between these two records;
@@ -612,6 +766,19 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 		change->m_vecMaxsPreScaled = maxsPreScaled;
 	}
 
+#ifdef PORTAL
+	// Put the player back in the portal environment they were in. Only the handle moves, simulator
+	// ownership stays put; UTIL_Portal_TraceEntity() reads the handle while we're compensating.
+	CPortal_Player *pPortalPlayer = ToPortalPlayer( pPlayer );
+	if ( pPortalPlayer->m_hPortalEnvironment.Get() != record->m_hPortalEnvironment.Get() )
+	{
+		flags |= LC_PORTAL_ENVIRONMENT_CHANGED;
+		restore->m_hPortalEnvironment = pPortalPlayer->m_hPortalEnvironment.Get();
+		pPortalPlayer->m_hPortalEnvironment = record->m_hPortalEnvironment.Get();
+		change->m_hPortalEnvironment = record->m_hPortalEnvironment;
+	}
+#endif
+
 	// Note, do origin at end since it causes a relink into the k/d tree
 	if ( orgdiff.LengthSqr() > LAG_COMPENSATION_EPS_SQR )
 	{
@@ -800,6 +967,18 @@ void CLagCompensationManager::FinishLagCompensation( CBasePlayer *player )
 			}
 		}
 
+#ifdef PORTAL
+		if ( restore->m_fFlags & LC_PORTAL_ENVIRONMENT_CHANGED )
+		{
+			// leave it alone if the command moved them into another environment for real
+			CPortal_Player *pPortalPlayer = ToPortalPlayer( pPlayer );
+			if ( pPortalPlayer->m_hPortalEnvironment.Get() == change->m_hPortalEnvironment.Get() )
+			{
+				pPortalPlayer->m_hPortalEnvironment = restore->m_hPortalEnvironment.Get();
+			}
+		}
+#endif
+
 		if ( restore->m_fFlags & LC_ORIGIN_CHANGED )
 		{
 			restoreSimulationTime = true;
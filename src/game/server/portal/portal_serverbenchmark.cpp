@@ -0,0 +1,425 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Portal hook for the server benchmark. With sv_benchmark_portal_pairs
+//			set it turns into a portal stress test: linked pairs keep moving to
+//			new walls while physics props and bots get thrown through them, and
+//			the results include per-tick portal simulator, shadow clone and
+//			portal trace costs.
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "serverbenchmark_base.h"
+#include "prop_portal.h"
+#include "portal_placement.h"
+#include "portal_shareddefs.h"
+#include "portal_simulator_profiling.h"
+#include "physicsshadowclone.h"
+#include "props.h"
+#include "movehelper_server.h"
+#include "filesystem.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+extern ConVar sv_portal_placement_cache_time;
+
+static ConVar sv_benchmark_portal_pairs( "sv_benchmark_portal_pairs", "0", 0, "If > 0, the server benchmark stress tests portals with this many linked portal pairs." );
+static ConVar sv_benchmark_portal_move_interval( "sv_benchmark_portal_move_interval", "66", 0, "Portal stress benchmark: move every portal pair to new walls every N ticks." );
+static ConVar sv_benchmark_portal_funnel_interval( "sv_benchmark_portal_funnel_interval", "11", 0, "Portal stress benchmark: throw a physics prop and a bot into a portal every N ticks." );
+
+#define PORTAL_BENCHMARK_LINKAGE_GROUP_BASE 128 //stay clear of the linkage groups maps and portal guns use
+#define PORTAL_BENCHMARK_MAX_PAIRS 64
+#define PORTAL_BENCHMARK_MAX_PROPS 32 //props are recycled round robin after this many
+#define PORTAL_BENCHMARK_PLACEMENT_ATTEMPTS 24
+#define PORTAL_BENCHMARK_PLACEMENT_RANGE 1024.0f
+#define PORTAL_BENCHMARK_FUNNEL_DISTANCE 96.0f
+#define PORTAL_BENCHMARK_FUNNEL_SPEED 400.0f
+#define PORTAL_BENCHMARK_PROP_MODEL "models/props/metal_box.mdl"
+
+static int s_nPortalBenchmarkBotNumber = 0;
+
+
+// ---------------------------------------------------------------------------------------------- //
+// CPortalServerBenchmarkHook
+// ---------------------------------------------------------------------------------------------- //
+class CPortalServerBenchmarkHook : public CServerBenchmarkHook
+{
+public:
+	CPortalServerBenchmarkHook( void );
+
+	virtual void StartBenchmark( void );
+	virtual void UpdateBenchmark( void );
+	virtual void EndBenchmark( void );
+
+	virtual void GetPhysicsModelNames( CUtlVector<char*> &modelNames );
+	virtual CBasePlayer* CreateBot( void );
+
+	virtual void OutputResults( int nTicksSimulated );
+	virtual void WriteResults( FileHandle_t fh, int nTicksSimulated );
+
+private:
+	void CreatePortalPairs( void );
+	void MovePortalPairs( void );
+	bool FindPortalSpot( const CProp_Portal *pIgnorePortal, Vector &vOrigin, QAngle &qAngles );
+	void FunnelIntoPortals( void );
+	void RunBotMoves( void );
+	CProp_Portal *GetRandomLinkedPortal( void );
+	void RemoveStressEntities( void );
+
+	bool m_bStressing;
+	bool m_bPortalsCreated;
+	bool m_bWasProfiling; //restored when the benchmark ends
+	float m_flOldPlacementCacheTime; //restored when the benchmark ends
+
+	CUtlVector<Vector> m_SpawnSpots; //portal spots are found by tracing out from these
+	CUtlVector< CHandle<CProp_Portal> > m_Portals; //each pair is stored side by side
+	CUtlVector<EHANDLE> m_Props;
+	int m_iNextProp;
+	int m_iNextBot;
+
+	int m_nTicksSampled;
+	int m_nShadowCloneTotal; //summed over sampled ticks
+	int m_nPortalMoves;
+	int m_nFailedPortalMoves;
+	int m_nFunnelledProps;
+	int m_nFunnelledBots;
+};
+
+static CPortalServerBenchmarkHook s_PortalServerBenchmarkHook;
+
+CPortalServerBenchmarkHook::CPortalServerBenchmarkHook( void )
+: m_bStressing( false ),
+  m_bPortalsCreated( false ),
+  m_bWasProfiling( false ),
+  m_flOldPlacementCacheTime( 0.0f )
+{
+}
+
+void CPortalServerBenchmarkHook::StartBenchmark( void )
+{
+	m_bStressing = (sv_benchmark_portal_pairs.GetInt() > 0);
+	m_bPortalsCreated = false;
+	m_iNextProp = 0;
+	m_iNextBot = 0;
+	m_nTicksSampled = 0;
+	m_nShadowCloneTotal = 0;
+	m_nPortalMoves = 0;
+	m_nFailedPortalMoves = 0;
+	m_nFunnelledProps = 0;
+	m_nFunnelledBots = 0;
+
+	if( !m_bStressing )
+		return;
+
+	m_bWasProfiling = PortalSimulatorProfile_IsEnabled();
+	PortalSimulatorProfile_SetEnabled( true );
+
+	//cached preview results would depend on timing rather than the benchmark's random stream
+	m_flOldPlacementCacheTime = sv_portal_placement_cache_time.GetFloat();
+	sv_portal_placement_cache_time.SetValue( 0.0f );
+
+	m_SpawnSpots.RemoveAll();
+	CBaseEntity *pSpawn = NULL;
+	while( (pSpawn = gEntList.FindEntityByClassname( pSpawn, "info_player_start" )) != NULL )
+		m_SpawnSpots.AddToTail( pSpawn->GetAbsOrigin() );
+
+	if( m_SpawnSpots.Count() == 0 )
+		Warning( "Portal stress benchmark: no info_player_start on this map, portals can't be placed.\n" );
+}
+
+void CPortalServerBenchmarkHook::UpdateBenchmark( void )
+{
+	if( !m_bStressing )
+		return;
+
+	RunBotMoves();
+
+	//wait for the measured part of the run so the random stream and the profile line up with it
+	if( !m_bPortalsCreated )
+	{
+		m_bPortalsCreated = true;
+		CreatePortalPairs();
+		PortalSimulatorProfile_Reset();
+	}
+
+	int nTick = g_pServerBenchmark->GetTickOffset();
+
+	int nMoveInterval = sv_benchmark_portal_move_interval.GetInt();
+	if( (nMoveInterval > 0) && (nTick != 0) && ((nTick % nMoveInterval) == 0) )
+		MovePortalPairs();
+
+	int nFunnelInterval = sv_benchmark_portal_funnel_interval.GetInt();
+	if( (nFunnelInterval > 0) && ((nTick % nFunnelInterval) == 0) )
+		FunnelIntoPortals();
+
+	++m_nTicksSampled;
+	m_nShadowCloneTotal += CPhysicsShadowClone::g_ShadowCloneList.Count();
+}
+
+void CPortalServerBenchmarkHook::EndBenchmark( void )
+{
+	if( !m_bStressing )
+		return;
+
+	RemoveStressEntities();
+	PortalSimulatorProfile_SetEnabled( m_bWasProfiling );
+	sv_portal_placement_cache_time.SetValue( m_flOldPlacementCacheTime );
+	m_bStressing = false;
+}
+
+void CPortalServerBenchmarkHook::GetPhysicsModelNames( CUtlVector<char*> &modelNames )
+{
+	modelNames.AddToTail( (char *)PORTAL_BENCHMARK_PROP_MODEL );
+}
+
+CBasePlayer* CPortalServerBenchmarkHook::CreateBot( void )
+{
+	char szBotName[64];
+	Q_snprintf( szBotName, sizeof( szBotName ), "PortalBot%02i", s_nPortalBenchmarkBotNumber );
+
+	edict_t *pEdict = engine->CreateFakeClient( szBotName );
+	if( !pEdict )
+	{
+		Msg( "Failed to create Bot.\n" );
+		return NULL;
+	}
+
+	CBasePlayer *pPlayer = (CBasePlayer *)CBaseEntity::Instance( pEdict );
+	pPlayer->ClearFlags();
+	pPlayer->AddFlag( FL_CLIENT | FL_FAKECLIENT );
+
+	++s_nPortalBenchmarkBotNumber;
+	return pPlayer;
+}
+
+void CPortalServerBenchmarkHook::OutputResults( int nTicksSimulated )
+{
+	if( !m_bStressing || (nTicksSimulated <= 0) )
+		return;
+
+	Warning( "Portal pairs        : %d\n", m_Portals.Count() / 2 );
+	Warning( "Portal moves        : %d (%d without a valid spot)\n", m_nPortalMoves, m_nFailedPortalMoves );
+	Warning( "Funnelled props     : %d\n", m_nFunnelledProps );
+	Warning( "Funnelled bots      : %d\n", m_nFunnelledBots );
+	Warning( "Avg shadow clones   : %.2f\n", (m_nTicksSampled != 0) ? ((float)m_nShadowCloneTotal / (float)m_nTicksSampled) : 0.0f );
+	for( int i = 0; i != PSPP_COUNT; ++i )
+	{
+		int iSamples;
+		double fTotalMilliseconds;
+		float fMaxMilliseconds;
+		PortalSimulatorProfile_GetTotals( (PortalSimulatorProfilePhase_t)i, iSamples, fTotalMilliseconds, fMaxMilliseconds );
+
+		Warning( "%-20s: %.4f ms/tick (%d samples, max %.3f ms)\n", PortalSimulatorProfile_GetPhaseName( (PortalSimulatorProfilePhase_t)i ),
+			(float)(fTotalMilliseconds / nTicksSimulated), iSamples, fMaxMilliseconds );
+	}
+}
+
+void CPortalServerBenchmarkHook::WriteResults( FileHandle_t fh, int nTicksSimulated )
+{
+	if( !m_bStressing || (nTicksSimulated <= 0) )
+		return;
+
+	filesystem->FPrintf( fh, "sv_benchmark_portal_shadow_clones := %.2f\n", (m_nTicksSampled != 0) ? ((float)m_nShadowCloneTotal / (float)m_nTicksSampled) : 0.0f );
+	for( int i = 0; i != PSPP_COUNT; ++i )
+	{
+		int iSamples;
+		double fTotalMilliseconds;
+		float fMaxMilliseconds;
+		PortalSimulatorProfile_GetTotals( (PortalSimulatorProfilePhase_t)i, iSamples, fTotalMilliseconds, fMaxMilliseconds );
+
+		filesystem->FPrintf( fh, "sv_benchmark_portal_%s := %.4f\n", PortalSimulatorProfile_GetPhaseName( (PortalSimulatorProfilePhase_t)i ), (float)(fTotalMilliseconds / nTicksSimulated) );
+	}
+}
+
+void CPortalServerBenchmarkHook::CreatePortalPairs( void )
+{
+	int nPairs = MIN( sv_benchmark_portal_pairs.GetInt(), PORTAL_BENCHMARK_MAX_PAIRS );
+	for( int i = 0; i != nPairs; ++i )
+	{
+		unsigned char iLinkageGroupID = (unsigned char)(PORTAL_BENCHMARK_LINKAGE_GROUP_BASE + i);
+		m_Portals.AddToTail( CProp_Portal::FindPortal( iLinkageGroupID, false, true ) );
+		m_Portals.AddToTail( CProp_Portal::FindPortal( iLinkageGroupID, true, true ) );
+	}
+
+	MovePortalPairs();
+}
+
+void CPortalServerBenchmarkHook::MovePortalPairs( void )
+{
+	for( int i = 0; i != m_Portals.Count(); ++i )
+	{
+		CProp_Portal *pPortal = m_Portals[i];
+		if( !pPortal )
+			continue;
+
+		Vector vOrigin;
+		QAngle qAngles;
+		if( FindPortalSpot( pPortal, vOrigin, qAngles ) )
+		{
+			pPortal->NewLocation( vOrigin, qAngles );
+			++m_nPortalMoves;
+		}
+		else
+		{
+			++m_nFailedPortalMoves;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Traces out from a random spawn spot in a random direction until
+//			it finds a wall a fixed portal would fit on. Only uses the
+//			benchmark's random stream so every run picks the same walls.
+//-----------------------------------------------------------------------------
+bool CPortalServerBenchmarkHook::FindPortalSpot( const CProp_Portal *pIgnorePortal, Vector &vOrigin, QAngle &qAngles )
+{
+	if( m_SpawnSpots.Count() == 0 )
+		return false;
+
+	for( int i = 0; i != PORTAL_BENCHMARK_PLACEMENT_ATTEMPTS; ++i )
+	{
+		Vector vStart = m_SpawnSpots[g_pServerBenchmark->RandomInt( 0, m_SpawnSpots.Count() - 1 )] + Vector( 0.0f, 0.0f, 64.0f );
+
+		Vector vDirection;
+		AngleVectors( QAngle( g_pServerBenchmark->RandomFloat( -15.0f, 15.0f ), g_pServerBenchmark->RandomFloat( 0.0f, 360.0f ), 0.0f ), &vDirection );
+
+		trace_t tr;
+		UTIL_TraceLine( vStart, vStart + vDirection * PORTAL_BENCHMARK_PLACEMENT_RANGE, MASK_SHOT_PORTAL, pIgnorePortal, COLLISION_GROUP_NONE, &tr );
+		if( (tr.fraction == 1.0f) || tr.allsolid || !tr.DidHitWorld() || (tr.surface.flags & SURF_NOPORTAL) )
+			continue;
+
+		if( fabs( tr.plane.normal.z ) > 0.3f ) //walls only, floor and ceiling portals mostly catch props that are already resting
+			continue;
+
+		vOrigin = tr.endpos;
+		VectorAngles( tr.plane.normal, Vector( 0.0f, 0.0f, 1.0f ), qAngles );
+
+		if( VerifyPortalPlacement( pIgnorePortal, vOrigin, qAngles, PORTAL_PLACED_BY_FIXED, true ) >= 0.5f )
+			return true;
+	}
+
+	return false;
+}
+
+CProp_Portal *CPortalServerBenchmarkHook::GetRandomLinkedPortal( void )
+{
+	if( m_Portals.Count() == 0 )
+		return NULL;
+
+	CProp_Portal *pPortal = m_Portals[g_pServerBenchmark->RandomInt( 0, m_Portals.Count() - 1 )];
+	if( !pPortal || !pPortal->IsActivedAndLinked() )
+		return NULL;
+
+	return pPortal;
+}
+
+void CPortalServerBenchmarkHook::FunnelIntoPortals( void )
+{
+	Vector vForward;
+
+	//props
+	CProp_Portal *pPortal = GetRandomLinkedPortal();
+	if( pPortal )
+	{
+		pPortal->GetVectors( &vForward, NULL, NULL );
+		Vector vLaunch = pPortal->GetAbsOrigin() + vForward * PORTAL_BENCHMARK_FUNNEL_DISTANCE;
+		Vector vVelocity = vForward * -PORTAL_BENCHMARK_FUNNEL_SPEED;
+
+		CBaseEntity *pProp = NULL;
+		if( m_Props.Count() < PORTAL_BENCHMARK_MAX_PROPS )
+		{
+			pProp = CreatePhysicsProp( PORTAL_BENCHMARK_PROP_MODEL, vLaunch, vLaunch, NULL, true, "prop_physics" );
+			if( pProp )
+				m_Props.AddToTail( pProp );
+		}
+		else
+		{
+			pProp = m_Props[m_iNextProp];
+			m_iNextProp = (m_iNextProp + 1) % m_Props.Count();
+		}
+
+		if( pProp )
+		{
+			pProp->Teleport( &vLaunch, NULL, &vVelocity );
+			++m_nFunnelledProps;
+		}
+	}
+
+	//bots
+	pPortal = GetRandomLinkedPortal();
+	if( pPortal )
+	{
+		CUtlVector<CBasePlayer *> bots;
+		for( int i = 1; i <= gpGlobals->maxClients; ++i )
+		{
+			CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
+			if( pPlayer && (pPlayer->GetFlags() & FL_FAKECLIENT) && pPlayer->IsAlive() )
+				bots.AddToTail( pPlayer );
+		}
+
+		if( bots.Count() != 0 )
+		{
+			CBasePlayer *pBot = bots[m_iNextBot % bots.Count()];
+			++m_iNextBot;
+
+			pPortal->GetVectors( &vForward, NULL, NULL );
+			Vector vLaunch = pPortal->GetAbsOrigin() + vForward * PORTAL_BENCHMARK_FUNNEL_DISTANCE - Vector( 0.0f, 0.0f, 36.0f ); //player origins are at their feet
+			Vector vVelocity = vForward * -PORTAL_BENCHMARK_FUNNEL_SPEED;
+			pBot->Teleport( &vLaunch, NULL, &vVelocity );
+			++m_nFunnelledBots;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Portal has no bot driver. Without a usercmd every tick the bots
+//			never run gamemovement, so they'd never go through a portal. The
+//			commands have no movement input, bots just carry whatever velocity
+//			FunnelIntoPortals() gave them.
+//-----------------------------------------------------------------------------
+void CPortalServerBenchmarkHook::RunBotMoves( void )
+{
+	// Store off the globals.. they're gonna get whacked
+	float flOldFrametime = gpGlobals->frametime;
+	float flOldCurtime = gpGlobals->curtime;
+
+	for( int i = 1; i <= gpGlobals->maxClients; ++i )
+	{
+		CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
+		if( !pPlayer || !(pPlayer->GetFlags() & FL_FAKECLIENT) || !pPlayer->IsAlive() )
+			continue;
+
+		pPlayer->SetTimeBase( gpGlobals->curtime );
+
+		CUserCmd cmd;
+		Q_memset( &cmd, 0, sizeof( cmd ) );
+		cmd.viewangles = pPlayer->GetLocalAngles();
+		cmd.random_seed = gpGlobals->tickcount; //not the benchmark's random stream, that has to stay in step with the portal moves
+
+		MoveHelperServer()->SetHost( pPlayer );
+		pPlayer->PlayerRunCommand( &cmd, MoveHelperServer() );
+		pPlayer->SetLastUserCommand( cmd );
+		pPlayer->pl.fixangle = FIXANGLE_NONE;
+
+		gpGlobals->frametime = flOldFrametime;
+		gpGlobals->curtime = flOldCurtime;
+	}
+}
+
+void CPortalServerBenchmarkHook::RemoveStressEntities( void )
+{
+	for( int i = 0; i != m_Portals.Count(); ++i )
+	{
+		if( m_Portals[i] )
+			UTIL_Remove( m_Portals[i] );
+	}
+	m_Portals.RemoveAll();
+
+	for( int i = 0; i != m_Props.Count(); ++i )
+	{
+		if( m_Props[i] )
+			UTIL_Remove( m_Props[i] );
+	}
+	m_Props.RemoveAll();
+}
@@ -32,6 +32,7 @@
 #include "env_debughistory.h"
 #include "tier1/callqueue.h"
 #include "filters.h"
+#include "portal_spatial_index.h"
 #include <string>
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -103,17 +104,62 @@ END_DATADESC()
 extern void SendProxy_Origin( const SendProp *pProp, const void *pStruct, const void *pData, DVariant *pOut, int iElement, int objectID );
 extern void SendProxy_Angles( const SendProp *pProp, const void *pStruct, const void *pData, DVariant *pOut, int iElement, int objectID );
 
+//while the compact placement describes the portal, the full precision vectors hold still at zero so they never make it into a delta
+static void SendProxy_PortalOrigin( const SendProp *pProp, const void *pStruct, const void *pData, DVariant *pOut, int iElement, int objectID )
+{
+	if( ((const CProp_Portal *)pStruct)->UsesCompactPlacement() )
+	{
+		pOut->m_Vector[0] = pOut->m_Vector[1] = pOut->m_Vector[2] = 0.0f;
+		return;
+	}
+
+	SendProxy_Origin( pProp, pStruct, pData, pOut, iElement, objectID );
+}
+
+static void SendProxy_PortalAngles( const SendProp *pProp, const void *pStruct, const void *pData, DVariant *pOut, int iElement, int objectID )
+{
+	if( ((const CProp_Portal *)pStruct)->UsesCompactPlacement() )
+	{
+		pOut->m_Vector[0] = pOut->m_Vector[1] = pOut->m_Vector[2] = 0.0f;
+		return;
+	}
+
+	SendProxy_Angles( pProp, pStruct, pData, pOut, iElement, objectID );
+}
+
+static void SendProxy_PortalFullPrecisionVector( const SendProp *pProp, const void *pStruct, const void *pData, DVariant *pOut, int iElement, int objectID )
+{
+	if( ((const CProp_Portal *)pStruct)->UsesCompactPlacement() )
+	{
+		pOut->m_Vector[0] = pOut->m_Vector[1] = pOut->m_Vector[2] = 0.0f;
+		return;
+	}
+
+	SendProxy_VectorToVector( pProp, pStruct, pData, pOut, iElement, objectID );
+}
+
+static void SendProxy_PortalPlacementAxis( const SendProp *pProp, const void *pStruct, const void *pData, DVariant *pOut, int iElement, int objectID )
+{
+	const CProp_Portal *pPortal = (const CProp_Portal *)pStruct;
+	pOut->m_Int = pPortal->UsesCompactPlacement() ? pPortal->m_iPlacementAxis.Get() : PORTAL_PLACEMENT_AXIS_NONE;
+}
+
 IMPLEMENT_SERVERCLASS_ST( CProp_Portal, DT_Prop_Portal )
 
 	SendPropExclude( "DT_BaseEntity", "m_vecOrigin" ),
 	SendPropExclude( "DT_BaseEntity", "m_angRotation" ),
-	SendPropVector( SENDINFO(m_vecOrigin), -1,  SPROP_NOSCALE, 0.0f, HIGH_DEFAULT, SendProxy_Origin ),
-	SendPropVector( SENDINFO(m_angRotation), -1, SPROP_NOSCALE, 0.0f, HIGH_DEFAULT, SendProxy_Angles ),
+	SendPropVector( SENDINFO(m_vecOrigin), -1,  SPROP_NOSCALE, 0.0f, HIGH_DEFAULT, SendProxy_PortalOrigin ),
+	SendPropVector( SENDINFO(m_angRotation), -1, SPROP_NOSCALE, 0.0f, HIGH_DEFAULT, SendProxy_PortalAngles ),
 	SendPropInt( SENDINFO(m_iLinkageGroupID)),
 	
 	//if we're resting on another entity, we still need ultra-precise absolute coords. We should probably downgrade local origin/angles in favor of these
-	SendPropVector( SENDINFO(m_ptOrigin), -1,  SPROP_NOSCALE, 0.0f, HIGH_DEFAULT ),
-	SendPropVector( SENDINFO(m_qAbsAngle), -1, SPROP_NOSCALE, 0.0f, HIGH_DEFAULT ),
+	SendPropVector( SENDINFO(m_ptOrigin), -1,  SPROP_NOSCALE, 0.0f, HIGH_DEFAULT, SendProxy_PortalFullPrecisionVector ),
+	SendPropVector( SENDINFO(m_qAbsAngle), -1, SPROP_NOSCALE, 0.0f, HIGH_DEFAULT, SendProxy_PortalFullPrecisionVector ),
+
+	//axis aligned placements replace all four vectors above with these
+	SendPropInt( SENDINFO( m_iPlacementAxis ), PORTAL_PLACEMENT_AXIS_BITS, SPROP_UNSIGNED, SendProxy_PortalPlacementAxis ),
+	SendPropArray3( SENDINFO_ARRAY3( m_iPlacementCoords ), SendPropInt( SENDINFO_ARRAY( m_iPlacementCoords ), PORTAL_PLACEMENT_COORD_BITS ) ),
+	SendPropInt( SENDINFO( m_iPlacementRoll ), PORTAL_PLACEMENT_ROLL_BITS, SPROP_UNSIGNED ),
 
 	SendPropEHandle( SENDINFO(m_hLinkedPortal) ),
 	SendPropBool( SENDINFO(m_bActivated) ),
@@ -139,6 +185,7 @@ CProp_Portal::CProp_Portal( void )
 {
 	m_vPrevForward = Vector( 0.0f, 0.0f, 0.0f );
 	m_vAudioOrigin = Vector( 0.0f, 0.0f, 0.0f );
+	m_iPlacementAxis = PORTAL_PLACEMENT_AXIS_NONE;
 	m_PortalSimulator.SetPortalSimulatorCallbacks( this );
 
 	// Init to something safe
@@ -187,11 +234,13 @@ CProp_Portal::CProp_Portal( void )
 	m_pCollisionShape = physcollision->ConvertConvexToCollide( &pConvex, 1 );
 
 	CProp_Portal_Shared::AllPortals.AddToTail( this );
+	g_PortalSpatialIndex.AddPortal( this );
 }
 
 CProp_Portal::~CProp_Portal( void )
 {
 	CProp_Portal_Shared::AllPortals.FindAndRemove( this );
+	g_PortalSpatialIndex.RemovePortal( this );
 	s_PortalLinkageGroups[m_iLinkageGroupID].FindAndRemove( this );
 }
 
@@ -400,7 +449,16 @@ void CProp_Portal::OnRestore()
 	m_ptOrigin = GetAbsOrigin();
 	m_qAbsAngle = GetAbsAngles();
 
+	//snap the same way NewLocation() does, saves from before placements were snapped would otherwise encode a placement that doesn't match where the portal sits
+	if( (GetMoveParent() == NULL) && CProp_Portal_Shared::QuantizePlacement( m_ptOrigin, m_qAbsAngle ) )
+	{
+		SetAbsOrigin( m_ptOrigin );
+		SetAbsAngles( m_qAbsAngle );
+	}
+	UpdatePlacementEncoding();
+
 	UpdateCorners();
+	g_PortalSpatialIndex.UpdatePortal( this );
 
 	Assert( m_pAttachedCloningArea == NULL );
 	m_pAttachedCloningArea = CPhysicsCloneArea::CreatePhysicsCloneArea( this );
@@ -1703,8 +1761,34 @@ void CProp_Portal::UpdatePortalLinkage( void )
 	}
 }
 
-void CProp_Portal::NewLocation( const Vector &vOrigin, const QAngle &qAngles )
+void CProp_Portal::UpdatePlacementEncoding( void )
 {
+	PortalPlacementEncoding_t encoding;
+	if( (GetMoveParent() != NULL) || !CProp_Portal_Shared::EncodePlacement( m_ptOrigin, m_qAbsAngle, encoding ) )
+	{
+		m_iPlacementAxis = PORTAL_PLACEMENT_AXIS_NONE;
+		return;
+	}
+
+	m_iPlacementAxis = encoding.iAxis;
+	for( int i = 0; i != 3; ++i )
+		m_iPlacementCoords.Set( i, encoding.iCoords[i] );
+	m_iPlacementRoll = encoding.iRoll;
+}
+
+bool CProp_Portal::UsesCompactPlacement( void ) const
+{
+	return (m_iPlacementAxis != PORTAL_PLACEMENT_AXIS_NONE) && (GetMoveParent() == NULL);
+}
+
+void CProp_Portal::NewLocation( const Vector &vNewOrigin, const QAngle &qNewAngles )
+{
+	//snap to what the compact network placement reproduces so clients build the exact same teleport matrix
+	Vector vOrigin = vNewOrigin;
+	QAngle qAngles = qNewAngles;
+	if( GetMoveParent() == NULL )
+		CProp_Portal_Shared::QuantizePlacement( vOrigin, qAngles );
+
 	// Tell our physics environment to stop simulating it's entities.
 	// Fast moving objects can pass through the hole this frame while it's in the old location.
 
@@ -1724,6 +1808,7 @@ void CProp_Portal::NewLocation( const Vector &vOrigin, const QAngle &qAngles )
 	
 	m_ptOrigin = vOrigin;
 	m_qAbsAngle = qAngles;
+	UpdatePlacementEncoding();
 
 #ifndef DONT_USE_MICROPHONESORSPEAKERS
 	if ( m_hMicrophone )
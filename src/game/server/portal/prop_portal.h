@@ -90,6 +90,13 @@ public:
 	Vector m_vForward, m_vUp, m_vRight;
 	CNetworkQAngle( m_qAbsAngle );
 
+	//compact network placement, see CProp_Portal_Shared::EncodePlacement()
+	CNetworkVar( int, m_iPlacementAxis );
+	CNetworkArray( int, m_iPlacementCoords, 3 );
+	CNetworkVar( int, m_iPlacementRoll );
+	void	UpdatePlacementEncoding( void ); //call whenever m_ptOrigin or m_qAbsAngle change
+	bool	UsesCompactPlacement( void ) const;
+
 	CPhysicsCloneArea		*m_pAttachedCloningArea;
 	
 	bool	IsPortal2() const;
@@ -177,6 +177,7 @@ public:
 			if ( fh )
 			{
 				filesystem->FPrintf( fh, "sv_benchmark := %.2f\n", flRunTime );
+				CServerBenchmarkHook::s_pBenchmarkHook->WriteResults( fh, sv_benchmark_numticks.GetInt() );
 			}
 			filesystem->Close( fh );
 
@@ -184,6 +185,9 @@ public:
 			engine->ServerCommand( "quit\n" );
 		}
 		
+		// Let the game-specific hook tear down whatever it set up.
+		CServerBenchmarkHook::s_pBenchmarkHook->EndBenchmark();
+
 		m_BenchmarkState = BENCHMARKSTATE_NOT_RUNNING;
 		engine->SetDedicatedServerBenchmarkMode( false );
 	}
@@ -335,6 +339,7 @@ public:
 		Warning( "Num ticks simulated : %d\n", sv_benchmark_numticks.GetInt() );
 		Warning( "Ticks per second    : %.2f\n", sv_benchmark_numticks.GetInt() / flRunTime );
 		Warning( "Benchmark CRC       : %d\n", CalculateBenchmarkCRC() );
+		CServerBenchmarkHook::s_pBenchmarkHook->OutputResults( sv_benchmark_numticks.GetInt() );
 		Warning( "--------------------------------------------------------------\n" );
 	}
 
@@ -56,6 +56,11 @@ public:
 	// If you want to manage the bots yourself, you can return NULL here.
 	virtual CBasePlayer* CreateBot() = 0;
 
+	// Called after the base results are printed and, when the results file is being written, with that file
+	// so game-specific counters end up next to the tick rate.
+	virtual void OutputResults( int nTicksSimulated ) {}
+	virtual void WriteResults( FileHandle_t fh, int nTicksSimulated ) {}
+
 private:
 	friend class CServerBenchmark;
 	static CServerBenchmarkHook *s_pBenchmarkHook; // There can be only one!!
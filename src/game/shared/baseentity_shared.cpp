@@ -1709,6 +1709,38 @@ void CBaseEntity::FireBullets( const FireBulletsInfo_t &info )
 	//-----------------------------------------------------
 	CShotManipulator Manipulator( info.m_vecDirShooting );
 
+#ifdef PORTAL
+	// Work out every pellet's direction first, in the same order and with the same seeds the
+	// loop below used to, so the portals along all of them can be found in one batch
+	Vector *pShotDirs = (Vector *)stackalloc( sizeof( Vector ) * info.m_iShots );
+	CProp_Portal **pShotPortals = (CProp_Portal **)stackalloc( sizeof( CProp_Portal * ) * info.m_iShots );
+	float *pShotPortalFractions = (float *)stackalloc( sizeof( float ) * info.m_iShots );
+	CUtlVector< Ray_t, CUtlMemoryAligned< Ray_t, 16 > > shotRays;
+	shotRays.SetCount( info.m_iShots );
+
+	for ( int iShot = 0; iShot < info.m_iShots; iShot++ )
+	{
+		if ( IsPlayer() )
+		{
+			RandomSeed( iSeed + iShot );
+		}
+
+		if ( iShot == 0 && info.m_iShots > 1 && (info.m_nFlags & FIRE_BULLETS_FIRST_SHOT_ACCURATE) )
+		{
+			pShotDirs[iShot] = Manipulator.GetShotDirection();
+		}
+		else
+		{
+			pShotDirs[iShot] = Manipulator.ApplySpread( info.m_vecSpread );
+		}
+
+		shotRays[iShot].Init( info.m_vecSrc, info.m_vecSrc + pShotDirs[iShot] * info.m_flDistance );
+		pShotPortalFractions[iShot] = 2.0f;
+	}
+
+	UTIL_Portal_FirstAlongRays( shotRays.Base(), info.m_iShots, pShotPortals, pShotPortalFractions );
+#endif
+
 	bool bDoImpacts = false;
 	bool bDoTracers = false;
 	
@@ -1725,6 +1757,9 @@ void CBaseEntity::FireBullets( const FireBulletsInfo_t &info )
 			RandomSeed( iSeed );	// init random system with this seed
 		}
 
+#ifdef PORTAL
+		vecDir = pShotDirs[iShot];
+#else
 		// If we're firing multiple shots, and the first shot has to be bang on target, ignore spread
 		if ( iShot == 0 && info.m_iShots > 1 && (info.m_nFlags & FIRE_BULLETS_FIRST_SHOT_ACCURATE) )
 		{
@@ -1736,6 +1771,7 @@ void CBaseEntity::FireBullets( const FireBulletsInfo_t &info )
 			// Don't run the biasing code for the player at the moment.
 			vecDir = Manipulator.ApplySpread( info.m_vecSpread );
 		}
+#endif
 
 		vecEnd = info.m_vecSrc + vecDir * info.m_flDistance;
 
@@ -1749,10 +1785,9 @@ void CBaseEntity::FireBullets( const FireBulletsInfo_t &info )
 		{
 			// Half of the shotgun pellets are hulls that make it easier to hit targets with the shotgun.
 #ifdef PORTAL
-			Ray_t rayBullet;
-			rayBullet.Init( info.m_vecSrc, vecEnd );
-			pShootThroughPortal = UTIL_Portal_FirstAlongRay( rayBullet, fPortalFraction );
-			if ( !UTIL_Portal_TraceRay_Bullets( pShootThroughPortal, rayBullet, MASK_SHOT, &traceFilter, &tr ) )
+			pShootThroughPortal = pShotPortals[iShot];
+			fPortalFraction = pShotPortalFractions[iShot];
+			if ( !UTIL_Portal_TraceRay_Bullets( pShootThroughPortal, shotRays[iShot], MASK_SHOT, &traceFilter, &tr ) )
 			{
 				pShootThroughPortal = NULL;
 			}
@@ -1763,10 +1798,9 @@ void CBaseEntity::FireBullets( const FireBulletsInfo_t &info )
 		else
 		{
 #ifdef PORTAL
-			Ray_t rayBullet;
-			rayBullet.Init( info.m_vecSrc, vecEnd );
-			pShootThroughPortal = UTIL_Portal_FirstAlongRay( rayBullet, fPortalFraction );
-			if ( !UTIL_Portal_TraceRay_Bullets( pShootThroughPortal, rayBullet, MASK_SHOT, &traceFilter, &tr ) )
+			pShootThroughPortal = pShotPortals[iShot];
+			fPortalFraction = pShotPortalFractions[iShot];
+			if ( !UTIL_Portal_TraceRay_Bullets( pShootThroughPortal, shotRays[iShot], MASK_SHOT, &traceFilter, &tr ) )
 			{
 				pShootThroughPortal = NULL;
 			}
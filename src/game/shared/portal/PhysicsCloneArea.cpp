@@ -38,6 +38,18 @@ const Vector CPhysicsCloneArea::vLocalMaxs( PORTAL_HALF_HEIGHT * PHYSICSCLONEARE
 
 extern ConVar sv_portal_debug_touch;
 
+ConVar portal_clonearea_incremental( "portal_clonearea_incremental", "1", FCVAR_REPLICATED | FCVAR_CHEAT, "Clone areas only start and stop cloning entities that cross their boundary instead of re-gathering everything when they move." );
+
+//-----------------------------------------------------------------------------
+// Purpose: OBB vs OBB test of an entity against the area placed at ptAreaOrigin/qAreaAngles
+//-----------------------------------------------------------------------------
+bool CPhysicsCloneArea::IsEntityInArea( CBaseEntity *pEntity, const Vector &ptAreaOrigin, const QAngle &qAreaAngles )
+{
+	CCollisionProperty *pEntCollision = pEntity->CollisionProp();
+	return IsOBBIntersectingOBB( ptAreaOrigin, qAreaAngles, vLocalMins, vLocalMaxs, 
+		pEntCollision->GetCollisionOrigin(), pEntCollision->GetCollisionAngles(), pEntCollision->OBBMins(), pEntCollision->OBBMaxs() );
+}
+
 #ifdef CLIENT_DLL
 CPhysicsCloneArea::CPhysicsCloneArea()
 {
@@ -58,6 +70,88 @@ void CPhysicsCloneArea::ClientThink( void )
 	HandleFakeTouch();
 }
 
+static int SortTouchHandles( const EHANDLE *pLeft, const EHANDLE *pRight )
+{
+	return pLeft->ToInt() - pRight->ToInt();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Same touches as CClientTouchable::HandleFakeTouch(), but members are
+//			kept sorted and merged against this frame's contents. Only entities
+//			crossing the boundary get a StartTouch()/EndTouch().
+//-----------------------------------------------------------------------------
+void CPhysicsCloneArea::HandleFakeTouch( void )
+{
+	if( !portal_clonearea_incremental.GetBool() )
+	{
+		CClientTouchable::HandleFakeTouch();
+		return;
+	}
+
+	Vector vMins, vMaxs;
+	CollisionProp()->WorldSpaceAABB( &vMins, &vMaxs );
+
+	C_BaseEntity *pEntsInBounds[1024];
+	int iCount = UTIL_EntitiesInBox( pEntsInBounds, ARRAYSIZE( pEntsInBounds ) - 1, vMins, vMaxs, 0, PARTITION_CLIENT_NON_STATIC_EDICTS );
+
+	//UTIL_EntitiesInBox() doesn't return the local player
+	C_BasePlayer *pLocalPlayer = C_BasePlayer::GetLocalPlayer();
+	if( pLocalPlayer )
+		pEntsInBounds[iCount++] = pLocalPlayer;
+
+	CUtlVector<EHANDLE> InArea;
+	InArea.EnsureCapacity( iCount );
+	for( int i = 0; i != iCount; ++i )
+	{
+		C_BaseEntity *pEntity = pEntsInBounds[i];
+		if( !pEntity || (pEntity == this) || !TouchCondition( pEntity ) || !EntityIsInBounds( pEntity ) )
+			continue;
+
+		InArea.AddToTail( pEntity );
+	}
+	InArea.Sort( SortTouchHandles );
+	for( int i = InArea.Count(); --i > 0; )
+	{
+		if( InArea[i] == InArea[i - 1] )
+			InArea.Remove( i );
+	}
+
+	//the base class doesn't keep these sorted, and may have run while incremental touches were off
+	m_TouchingEntities.Sort( SortTouchHandles );
+
+	int iOld = 0, iNew = 0;
+	while( (iOld != m_TouchingEntities.Count()) || (iNew != InArea.Count()) )
+	{
+		int iCompare;
+		if( iOld == m_TouchingEntities.Count() )
+			iCompare = 1;
+		else if( iNew == InArea.Count() )
+			iCompare = -1;
+		else
+			iCompare = SortTouchHandles( &m_TouchingEntities[iOld], &InArea[iNew] );
+
+		if( iCompare < 0 )
+		{
+			//left the area, or was deleted
+			C_BaseEntity *pEntity = m_TouchingEntities[iOld++].Get();
+			if( pEntity )
+				EndTouch( pEntity );
+		}
+		else
+		{
+			C_BaseEntity *pEntity = InArea[iNew++].Get();
+			if( iCompare > 0 )
+				StartTouch( pEntity );
+			else
+				++iOld;
+
+			Touch( pEntity );
+		}
+	}
+
+	m_TouchingEntities.Swap( InArea );
+}
+
 bool CPhysicsCloneArea::TouchCondition( C_BaseEntity *pOther )
 {
 	if ( !m_bActive )
@@ -162,14 +256,22 @@ void CPhysicsCloneArea::UpdatePosition( void )
 {
 	Assert( m_pAttachedPortal );
 
-	//untouch everything we're touching
+	//Entities that are still inside the area at its new placement keep touching it, and keep their clones.
+	//Everything else gets untouched. Either way this has to happen before m_bActive changes, EndTouch() is a no-op while inactive.
+	bool bKeepTouching = m_bActive && m_pAttachedPortal->IsActive() && portal_clonearea_incremental.GetBool();
+
 	touchlink_t *root = ( touchlink_t * )GetDataObject( TOUCHLINK );
 	if( root )
 	{
 		//don't want to risk list corruption while untouching
 		CUtlVector<CBaseEntity *> TouchingEnts;
 		for( touchlink_t *link = root->nextLink; link != root; link = link->nextLink )
+		{
+			if( bKeepTouching && IsEntityInArea( link->entityTouched, m_pAttachedPortal->m_ptOrigin, m_pAttachedPortal->m_qAbsAngle ) )
+				continue;
+
 			TouchingEnts.AddToTail( link->entityTouched );
+		}
 
 
 		for( int i = TouchingEnts.Count(); --i >= 0; )
@@ -254,14 +356,10 @@ void CPhysicsCloneArea::CloneNearbyEntities( void )
 
 			if( pPhysicsObject )
 			{
-				CCollisionProperty *pEntCollision = pEntity->CollisionProp();
-				Vector ptEntityCenter = pEntCollision->GetCollisionOrigin();
-
 				//double check intersection at the OBB vs OBB level, we don't want to affect large piles of physics objects if we don't have to, it gets slow
-				if( IsOBBIntersectingOBB( ptOrigin, qAngles, vLocalMins, vLocalMaxs, 
-					ptEntityCenter, pEntCollision->GetCollisionAngles(), pEntCollision->OBBMins(), pEntCollision->OBBMaxs() ) )
+				if( IsEntityInArea( pEntity, ptOrigin, qAngles ) )
 				{
-					tr.endpos = (ptOrigin + ptEntityCenter) * 0.5;
+					tr.endpos = (ptOrigin + pEntity->CollisionProp()->GetCollisionOrigin()) * 0.5;
 					PhysicsMarkEntitiesAsTouching( pEntity, tr );
 					//StartTouch( pEntity );
 					
@@ -42,6 +42,7 @@ public:
 
 	virtual void ClientThink( void );
 
+	virtual void HandleFakeTouch( void );
 	virtual bool TouchCondition( C_BaseEntity *pOther );
 
 #endif
@@ -61,6 +62,7 @@ public:
 
 	void					CloneTouchingEntities( void );
 	void					CloneNearbyEntities( void );
+	static bool				IsEntityInArea( CBaseEntity *pEntity, const Vector &ptAreaOrigin, const QAngle &qAreaAngles );
 #ifdef GAME_DLL
 	static CPhysicsCloneArea *CreatePhysicsCloneArea( CProp_Portal *pFollowPortal );	
 #else
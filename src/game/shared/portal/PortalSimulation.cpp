@@ -16,8 +16,10 @@
 #include "filesystem.h"
 #include "collisionutils.h"
 #include "tier1/callqueue.h"
+#include "vstdlib/jobthread.h"
 #include "portal/weapon_physcannon.h"
 #include "physicsshadowclone.h"
+#include "portal_simulator_profiling.h"
 
 #ifndef CLIENT_DLL
 
@@ -47,6 +49,7 @@ ConVar portal_clone_displacements ( "portal_clone_displacements", "0", FCVAR_REP
 static ConVar sv_portal_collision_sim_bounds_x( "sv_portal_collision_sim_bounds_x", "200", FCVAR_REPLICATED, "Size of box used to grab collision geometry around placed portals. These should be at the default size or larger only!" );
 static ConVar sv_portal_collision_sim_bounds_y( "sv_portal_collision_sim_bounds_y", "200", FCVAR_REPLICATED, "Size of box used to grab collision geometry around placed portals. These should be at the default size or larger only!" );
 static ConVar sv_portal_collision_sim_bounds_z( "sv_portal_collision_sim_bounds_z", "252", FCVAR_REPLICATED, "Size of box used to grab collision geometry around placed portals. These should be at the default size or larger only!" );
+static ConVar sv_portal_async_collision( "sv_portal_async_collision", "0", FCVAR_REPLICATED | FCVAR_CHEAT, "Carve collision for moved portals on a job thread. The previous collision stays in place until the new set is swapped in at the start of a physics frame." );
 
 //#define DEBUG_PORTAL_SIMULATION_CREATION_TIMES //define to output creation timings to developer 2
 //#define DEBUG_PORTAL_COLLISION_ENVIRONMENTS //define this to allow for glview collision dumps of portal simulators
@@ -105,6 +108,32 @@ static inline CPolyhedron *TransformAndClipSinglePolyhedron( CPolyhedron *pExist
 static int GetEntityPhysicsObjects( IPhysicsEnvironment *pEnvironment, CBaseEntity *pEntity, IPhysicsObject **pRetList, int iRetListArraySize );
 static CPhysCollide *ConvertPolyhedronsToCollideable( CPolyhedron **pPolyhedrons, int iPolyhedronCount );
 
+struct PS_CarveStaticProp_t
+{
+	int iFirstPolyhedron; //index into PS_PolyhedronCarve_t::StaticPropPolyhedrons
+	int iPolyhedronCount;
+	PS_SD_Static_World_StaticProps_ClippedProp_t Representation; //trace properties looked up on the main thread, the carve fills in the polyhedron group
+};
+
+struct PS_PolyhedronCarve_t //a snapshot of everything needed to carve the world around a placement, so the carve itself never has to touch the engine
+{
+	PS_PlacementData_t Placement;
+	Vector vWorldSimBounds;
+	bool bCarveWall; //the wall is only needed when simulating vphysics, otherwise it's just the tube
+
+	CUtlVector<int> WorldBrushes;
+	CUtlVector<int> WallBrushes;
+	CUtlVector<const CPolyhedron *> StaticPropPolyhedrons; //owned by g_StaticCollisionPolyhedronCache, which doesn't change until the level does
+	CUtlVector<PS_CarveStaticProp_t> StaticProps;
+
+	//async carves only
+	PS_SD_Static_t Result;
+	bool bRestoredFromCache; //Result came from g_PortalCarvedPolyhedronCache, nothing to clip
+	CJob *pJob; //NULL when restored from the cache
+
+	PS_PolyhedronCarve_t( void ) : bCarveWall( false ), bRestoredFromCache( false ), pJob( NULL ) { };
+};
+
 #if defined( CLIENT_DLL )
 //copy/paste from game/server/hierarchy.cpp
 static void GetAllChildren_r(CBaseEntity *pEntity, CUtlVector<CBaseEntity *> &list)
@@ -172,6 +201,8 @@ static CUtlVector<CPortalSimulator *> s_PortalSimulators;
 CUtlVector<CPortalSimulator *> const &g_PortalSimulators = s_PortalSimulators;
 
 static CPortalSimulator *s_OwnedEntityMap[MAX_EDICTS] = { NULL };
+static int s_OwnedEntityListIndex[MAX_EDICTS]; //where each owned entity sits in its owner's OwnedEntities, only valid while s_OwnedEntityMap is set
+CPortalSimulatorEntityFlagTable g_PortalSimulatorEntityFlags;
 static CPortalSimulatorEventCallbacks s_DummyPortalSimulatorCallback;
 
 const char *PS_SD_Static_World_StaticProps_ClippedProp_t::szTraceSurfaceName = "**studio**";
@@ -189,10 +220,12 @@ CPortalSimulator::CPortalSimulator( void )
 	m_bSharedCollisionConfiguration(false),
 	m_pLinkedPortal(NULL),
 	m_bInCrossLinkedFunction(false),
-	m_pCallbacks(&s_DummyPortalSimulatorCallback)
+	m_pCallbacks(&s_DummyPortalSimulatorCallback),
+	m_pPendingPolyhedronCarve(NULL)
 //	GetInternalData()(m_InternalData)
 {
 	s_PortalSimulators.AddToTail( this );
+	m_iEntityFlagSlot = g_PortalSimulatorEntityFlags.AllocSimulatorSlot();
 
 #ifdef CLIENT_DLL
 	m_bGenerateCollision = (GameRules()->IsMultiplayer());
@@ -222,7 +255,7 @@ CPortalSimulator::CPortalSimulator( void )
 	{
 		m_InternalData.Simulation.hCollisionEntity->m_pOwningSimulator = this;
 		MarkAsOwned( m_InternalData.Simulation.hCollisionEntity );
-		m_InternalData.Simulation.Dynamic.EntFlags[m_InternalData.Simulation.hCollisionEntity->entindex()] |= PSEF_OWNS_PHYSICS;
+		AddEntityFlags( m_InternalData.Simulation.hCollisionEntity, PSEF_OWNS_PHYSICS );
 #ifdef GAME_DLL
 		DispatchSpawn( m_InternalData.Simulation.hCollisionEntity );
 #else
@@ -259,7 +292,7 @@ CPortalSimulator::~CPortalSimulator( void )
 	if( m_InternalData.Simulation.hCollisionEntity )
 	{
 		m_InternalData.Simulation.hCollisionEntity->m_pOwningSimulator = NULL;
-		m_InternalData.Simulation.Dynamic.EntFlags[m_InternalData.Simulation.hCollisionEntity->entindex()] &= ~PSEF_OWNS_PHYSICS;
+		RemoveEntityFlags( m_InternalData.Simulation.hCollisionEntity, PSEF_OWNS_PHYSICS );
 		MarkAsReleased( m_InternalData.Simulation.hCollisionEntity );
 #ifndef CLIENT_DLL
 		UTIL_Remove( m_InternalData.Simulation.hCollisionEntity );
@@ -268,6 +301,8 @@ CPortalSimulator::~CPortalSimulator( void )
 #endif
 		m_InternalData.Simulation.hCollisionEntity = NULL;
 	}
+
+	g_PortalSimulatorEntityFlags.FreeSimulatorSlot( m_iEntityFlagSlot );
 }
 
 
@@ -276,6 +311,8 @@ void CPortalSimulator::MoveTo( const Vector &ptCenter, const QAngle &angles )
 {
 	if( (m_InternalData.Placement.ptCenter == ptCenter) && (m_InternalData.Placement.qAngles == angles) ) //not actually moving at all
 		return;
+
+	CancelAsyncPolyhedronCarve(); //superseded by this move
 #ifdef DEBUG
 #ifdef GAME_DLL
 	Msg("Server: CPortalSimulator::MoveTo:\nptCenter %f %f %f\nangles %f %f %f\n\n", ptCenter[0], ptCenter[1], ptCenter[2], angles[0], angles[1], angles[2]);
@@ -315,12 +352,18 @@ void CPortalSimulator::MoveTo( const Vector &ptCenter, const QAngle &angles )
 		m_InternalData.Placement.PortalPlane.Init( m_InternalData.Placement.vForward, m_InternalData.Placement.vForward.Dot( m_InternalData.Placement.ptCenter ) );
 	}
 
-	//Clear();
-	ClearLinkedPhysics();
-	ClearLocalPhysics();
-	ClearLinkedCollision();
-	ClearLocalCollision();
-	ClearPolyhedrons();
+	//when carving on a job thread, leave the existing collision in place until the new set is ready. A fresh portal has nothing to fall back on and carves right away
+	bool bCarveAsync = sv_portal_async_collision.GetBool() && IsCollisionGenerationEnabled() && m_CreationChecklist.bLocalCollisionGenerated;
+
+	if( !bCarveAsync )
+	{
+		//Clear();
+		ClearLinkedPhysics();
+		ClearLocalPhysics();
+		ClearLinkedCollision();
+		ClearLocalCollision();
+		ClearPolyhedrons();
+	}
 
 	m_bLocalDataIsReady = true;
 	UpdateLinkMatrix();
@@ -399,9 +442,16 @@ void CPortalSimulator::MoveTo( const Vector &ptCenter, const QAngle &angles )
 		}
 	}
 
-	CreatePolyhedrons();	
-	CreateAllCollision();
-	CreateAllPhysics();
+	if( bCarveAsync )
+	{
+		StartAsyncPolyhedronCarve(); //swapped in by PrePhysFrame(), or right away when the carve was cached
+	}
+	else
+	{
+		CreatePolyhedrons();	
+		CreateAllCollision();
+		CreateAllPhysics();
+	}
 
 #if defined( DEBUG_PORTAL_COLLISION_ENVIRONMENTS ) && !defined( CLIENT_DLL )
 	if(   sv_dump_portalsimulator_collision.GetBool() )
@@ -703,6 +753,7 @@ void CPortalSimulator::ClearEverything( void )
 	DEBUGTIMERONLY( DevMsg( 2, "[PSDT:%d] %sCPortalSimulator::Clear() START\n", GetPortalSimulatorGUID(), TABSPACING ); );
 	INCREMENTTABSPACING();	
 
+	CancelAsyncPolyhedronCarve();
 	ClearAllPhysics();
 	ClearAllCollision();
 	ClearPolyhedrons();
@@ -786,16 +837,18 @@ void CPortalSimulator::TakeOwnershipOfEntity( CBaseEntity *pEntity )
 	if( OwnsEntity( pEntity ) )
 		return;
 
+	PORTAL_SIMULATOR_PROFILE_SCOPE( PSPP_OWNERSHIP_CHANGE, "CPortalSimulator::TakeOwnershipOfEntity" );
+
 	Assert( GetSimulatorThatOwnsEntity( pEntity ) == NULL );
 	MarkAsOwned( pEntity );
 	Assert( GetSimulatorThatOwnsEntity( pEntity ) == this );
 
 	if( EntityIsInPortalHole( pEntity ) )
-		m_InternalData.Simulation.Dynamic.EntFlags[pEntity->entindex()] |= PSEF_IS_IN_PORTAL_HOLE;
+		AddEntityFlags( pEntity, PSEF_IS_IN_PORTAL_HOLE );
 	else
-		m_InternalData.Simulation.Dynamic.EntFlags[pEntity->entindex()] &= ~PSEF_IS_IN_PORTAL_HOLE;
+		RemoveEntityFlags( pEntity, PSEF_IS_IN_PORTAL_HOLE );
 
-	UpdateShadowClonesPortalSimulationFlags( pEntity, PSEF_IS_IN_PORTAL_HOLE, m_InternalData.Simulation.Dynamic.EntFlags[pEntity->entindex()] );
+	UpdateShadowClonesPortalSimulationFlags( pEntity, PSEF_IS_IN_PORTAL_HOLE, GetEntityFlags( pEntity ) );
 
 	m_pCallbacks->PortalSimulator_TookOwnershipOfEntity( pEntity );
 
@@ -836,11 +889,11 @@ void CPortalSimulator::MarkAsOwned( CBaseEntity *pEntity )
 	for( int i = m_InternalData.Simulation.Dynamic.OwnedEntities.Count(); --i >= 0; )
 		Assert( m_InternalData.Simulation.Dynamic.OwnedEntities[i] != pEntity );
 #endif
-	Assert( (m_InternalData.Simulation.Dynamic.EntFlags[iEntIndex] & PSEF_OWNS_ENTITY) == 0 );
+	Assert( !OwnsEntity( pEntity ) );
 
-	m_InternalData.Simulation.Dynamic.EntFlags[iEntIndex] |= PSEF_OWNS_ENTITY;
+	AddEntityFlags( pEntity, PSEF_OWNS_ENTITY );
 	s_OwnedEntityMap[iEntIndex] = this;
-	m_InternalData.Simulation.Dynamic.OwnedEntities.AddToTail( pEntity );
+	s_OwnedEntityListIndex[iEntIndex] = m_InternalData.Simulation.Dynamic.OwnedEntities.AddToTail( pEntity );
 }
 
 void CPortalSimulator::MarkAsReleased( CBaseEntity *pEntity )
@@ -848,20 +901,18 @@ void CPortalSimulator::MarkAsReleased( CBaseEntity *pEntity )
 	Assert( pEntity != NULL );
 	int iEntIndex = pEntity->entindex();
 	Assert( s_OwnedEntityMap[iEntIndex] == this );
-	Assert( ((m_InternalData.Simulation.Dynamic.EntFlags[iEntIndex] & PSEF_OWNS_ENTITY) != 0) || CPSCollisionEntity::IsPortalSimulatorCollisionEntity(pEntity) );
+	Assert( OwnsEntity( pEntity ) || CPSCollisionEntity::IsPortalSimulatorCollisionEntity(pEntity) );
 
 	s_OwnedEntityMap[iEntIndex] = NULL;
-	m_InternalData.Simulation.Dynamic.EntFlags[iEntIndex] &= ~PSEF_OWNS_ENTITY;
-	int i;
-	for( i = m_InternalData.Simulation.Dynamic.OwnedEntities.Count(); --i >= 0; )
-	{
-		if( m_InternalData.Simulation.Dynamic.OwnedEntities[i] == pEntity )
-		{
-			m_InternalData.Simulation.Dynamic.OwnedEntities.FastRemove(i);
-			break;
-		}
-	}
-	Assert( i >= 0 );
+	RemoveEntityFlags( pEntity, PSEF_OWNS_ENTITY );
+
+	//swap the tail into our spot, same as FastRemove() but without hunting for the entity first
+	CUtlVector<CBaseEntity *> &OwnedEntities = m_InternalData.Simulation.Dynamic.OwnedEntities;
+	int iListIndex = s_OwnedEntityListIndex[iEntIndex];
+	Assert( OwnedEntities.IsValidIndex( iListIndex ) && (OwnedEntities[iListIndex] == pEntity) );
+	OwnedEntities.FastRemove( iListIndex );
+	if( iListIndex != OwnedEntities.Count() )
+		s_OwnedEntityListIndex[OwnedEntities[iListIndex]->entindex()] = iListIndex;
 }
 
 
@@ -896,26 +947,19 @@ void CPortalSimulator::ReleaseOwnershipOfEntity( CBaseEntity *pEntity, bool bMov
 		return;
 
 
+	PORTAL_SIMULATOR_PROFILE_SCOPE( PSPP_OWNERSHIP_CHANGE, "CPortalSimulator::ReleaseOwnershipOfEntity" );
+
 	if( m_InternalData.Simulation.pPhysicsEnvironment )
 		ReleasePhysicsOwnership( pEntity, true, bMovingToLinkedSimulator );
 
-	m_InternalData.Simulation.Dynamic.EntFlags[pEntity->entindex()] &= ~PSEF_IS_IN_PORTAL_HOLE;
+	RemoveEntityFlags( pEntity, PSEF_IS_IN_PORTAL_HOLE );
 
-	UpdateShadowClonesPortalSimulationFlags( pEntity, PSEF_IS_IN_PORTAL_HOLE, m_InternalData.Simulation.Dynamic.EntFlags[pEntity->entindex()] );
+	UpdateShadowClonesPortalSimulationFlags( pEntity, PSEF_IS_IN_PORTAL_HOLE, GetEntityFlags( pEntity ) );
 
 	Assert( GetSimulatorThatOwnsEntity( pEntity ) == this );
-	MarkAsReleased( pEntity );
+	MarkAsReleased( pEntity ); //also pulls it out of OwnedEntities
 	Assert( GetSimulatorThatOwnsEntity( pEntity ) == NULL );
 
-	for( int i = m_InternalData.Simulation.Dynamic.OwnedEntities.Count(); --i >= 0; )
-	{
-		if( m_InternalData.Simulation.Dynamic.OwnedEntities[i] == pEntity )
-		{
-			m_InternalData.Simulation.Dynamic.OwnedEntities.FastRemove(i);
-			break;
-		}
-	}
-
 	if( bMovingToLinkedSimulator == false )
 	{
 		RecheckEntityCollision( pEntity );
@@ -968,8 +1012,9 @@ void CPortalSimulator::TakePhysicsOwnership( CBaseEntity *pEntity )
 	if( OwnsPhysicsForEntity( pEntity ) )
 		return;
 
-	int iEntIndex = pEntity->entindex();
-	m_InternalData.Simulation.Dynamic.EntFlags[iEntIndex] |= PSEF_OWNS_PHYSICS;
+	PORTAL_SIMULATOR_PROFILE_SCOPE( PSPP_OWNERSHIP_CHANGE, "CPortalSimulator::TakePhysicsOwnership" );
+
+	AddEntityFlags( pEntity, PSEF_OWNS_PHYSICS );
 
 
 	//physics cloning
@@ -1044,8 +1089,7 @@ void CPortalSimulator::TakePhysicsOwnership( CBaseEntity *pEntity )
 
 				m_pLinkedPortal->m_InternalData.Simulation.Dynamic.ShadowClones.FromLinkedPortal.AddToTail( pClone );
 				m_pLinkedPortal->MarkAsOwned( pClone );
-				m_pLinkedPortal->m_InternalData.Simulation.Dynamic.EntFlags[pClone->entindex()] |= PSEF_OWNS_PHYSICS;
-				m_pLinkedPortal->m_InternalData.Simulation.Dynamic.EntFlags[pClone->entindex()] |= m_InternalData.Simulation.Dynamic.EntFlags[pEntity->entindex()] & PSEF_IS_IN_PORTAL_HOLE;
+				m_pLinkedPortal->AddEntityFlags( pClone, PSEF_OWNS_PHYSICS | (GetEntityFlags( pEntity ) & PSEF_IS_IN_PORTAL_HOLE) );
 				pClone->CollisionRulesChanged(); //adding the clone to the portal simulator changes how it collides
 
 				if( pHeldEntity )
@@ -1082,11 +1126,12 @@ void CPortalSimulator::ReleasePhysicsOwnership( CBaseEntity *pEntity, bool bCont
 	if( !OwnsPhysicsForEntity( pEntity ) )
 		return;
 
+	PORTAL_SIMULATOR_PROFILE_SCOPE( PSPP_OWNERSHIP_CHANGE, "CPortalSimulator::ReleasePhysicsOwnership" );
+
 	if( IsSimulatingVPhysics() == false )
 		bContinuePhysicsCloning = false;
 
-	int iEntIndex = pEntity->entindex();
-	m_InternalData.Simulation.Dynamic.EntFlags[iEntIndex] &= ~PSEF_OWNS_PHYSICS;
+	RemoveEntityFlags( pEntity, PSEF_OWNS_PHYSICS );
 	
 	//physics cloning
 	{
@@ -1152,7 +1197,7 @@ void CPortalSimulator::ReleasePhysicsOwnership( CBaseEntity *pEntity, bool bCont
 							pHeldEntity = NULL;
 						}
 
-						m_pLinkedPortal->m_InternalData.Simulation.Dynamic.EntFlags[pClone->entindex()] &= ~PSEF_OWNS_PHYSICS;
+						m_pLinkedPortal->RemoveEntityFlags( pClone, PSEF_OWNS_PHYSICS );
 						m_pLinkedPortal->MarkAsReleased( pClone );
 						pClone->Free();
 						m_pLinkedPortal->m_InternalData.Simulation.Dynamic.ShadowClones.FromLinkedPortal.FastRemove(i);
@@ -1187,7 +1232,7 @@ void CPortalSimulator::StartCloningEntity( CBaseEntity *pEntity )
 	if( CPhysicsShadowClone::IsShadowClone( pEntity ) || CPSCollisionEntity::IsPortalSimulatorCollisionEntity( pEntity ) )
 		return;
 
-	if( (m_InternalData.Simulation.Dynamic.EntFlags[pEntity->entindex()] & PSEF_CLONES_ENTITY_FROM_MAIN) != 0 )
+	if( (GetEntityFlags( pEntity ) & PSEF_CLONES_ENTITY_FROM_MAIN) != 0 )
 		return; //already cloned, no work to do
 
 #ifdef _DEBUG
@@ -1198,12 +1243,12 @@ void CPortalSimulator::StartCloningEntity( CBaseEntity *pEntity )
 	//NDebugOverlay::EntityBounds( pEntity, 0, 255, 0, 50, 5.0f );
 
 	m_InternalData.Simulation.Dynamic.ShadowClones.ShouldCloneFromMain.AddToTail( pEntity );
-	m_InternalData.Simulation.Dynamic.EntFlags[pEntity->entindex()] |= PSEF_CLONES_ENTITY_FROM_MAIN;
+	AddEntityFlags( pEntity, PSEF_CLONES_ENTITY_FROM_MAIN );
 }
 
 void CPortalSimulator::StopCloningEntity( CBaseEntity *pEntity )
 {
-	if( (m_InternalData.Simulation.Dynamic.EntFlags[pEntity->entindex()] & PSEF_CLONES_ENTITY_FROM_MAIN) == 0 )
+	if( (GetEntityFlags( pEntity ) & PSEF_CLONES_ENTITY_FROM_MAIN) == 0 )
 	{
 		Assert( m_InternalData.Simulation.Dynamic.ShadowClones.ShouldCloneFromMain.Find( pEntity ) == -1 );
 		return; //not cloned, no work to do
@@ -1212,7 +1257,7 @@ void CPortalSimulator::StopCloningEntity( CBaseEntity *pEntity )
 	//NDebugOverlay::EntityBounds( pEntity, 255, 0, 0, 50, 5.0f );
 
 	m_InternalData.Simulation.Dynamic.ShadowClones.ShouldCloneFromMain.FastRemove(m_InternalData.Simulation.Dynamic.ShadowClones.ShouldCloneFromMain.Find( pEntity ));
-	m_InternalData.Simulation.Dynamic.EntFlags[pEntity->entindex()] &= ~PSEF_CLONES_ENTITY_FROM_MAIN;
+	RemoveEntityFlags( pEntity, PSEF_CLONES_ENTITY_FROM_MAIN );
 }
 
 
@@ -1228,6 +1273,8 @@ void CPortalSimulator::CreateAllPhysics( void )
 	if( IsSimulatingVPhysics() == false )
 		return;
 
+	PORTAL_SIMULATOR_PROFILE_SCOPE( PSPP_PHYSICS_CREATION, "CPortalSimulator::CreateAllPhysics" );
+
 	CREATEDEBUGTIMER( functionTimer );
 
 	STARTDEBUGTIMER( functionTimer );
@@ -1278,6 +1325,8 @@ void CPortalSimulator::CreateLocalPhysics( void )
 	if( m_CreationChecklist.bLocalPhysicsGenerated )
 		return;
 
+	PORTAL_SIMULATOR_PROFILE_SCOPE( PSPP_PHYSICS_CREATION, "CPortalSimulator::CreateLocalPhysics" );
+
 	CREATEDEBUGTIMER( functionTimer );
 
 	STARTDEBUGTIMER( functionTimer );
@@ -1404,6 +1453,8 @@ void CPortalSimulator::CreateLinkedPhysics( void )
 	if( m_CreationChecklist.bLinkedPhysicsGenerated )
 		return;
 
+	PORTAL_SIMULATOR_PROFILE_SCOPE( PSPP_PHYSICS_CREATION, "CPortalSimulator::CreateLinkedPhysics" );
+
 	CREATEDEBUGTIMER( functionTimer );
 	STARTDEBUGTIMER( functionTimer );
 	DEBUGTIMERONLY( DevMsg( 2, "[PSDT:%d] %sCPortalSimulator::CreateLinkedPhysics() START\n", GetPortalSimulatorGUID(), TABSPACING ); );
@@ -1475,7 +1526,7 @@ void CPortalSimulator::CreateLinkedPhysics( void )
 		if( pClone )
 		{
 			MarkAsOwned( pClone );
-			m_InternalData.Simulation.Dynamic.EntFlags[pClone->entindex()] |= PSEF_OWNS_PHYSICS;
+			AddEntityFlags( pClone, PSEF_OWNS_PHYSICS );
 			m_InternalData.Simulation.Dynamic.ShadowClones.FromLinkedPortal.AddToTail( pClone );
 			pClone->CollisionRulesChanged(); //adding the clone to the portal simulator changes how it collides
 		}
@@ -1602,7 +1653,7 @@ void CPortalSimulator::ClearLocalPhysics( void )
 		{
 			CPhysicsShadowClone *pClone = m_InternalData.Simulation.Dynamic.ShadowClones.FromLinkedPortal[i];
 			Assert( GetSimulatorThatOwnsEntity( pClone ) == this );
-			m_InternalData.Simulation.Dynamic.EntFlags[pClone->entindex()] &= ~PSEF_OWNS_PHYSICS;
+			RemoveEntityFlags( pClone, PSEF_OWNS_PHYSICS );
 			MarkAsReleased( pClone );
 			Assert( GetSimulatorThatOwnsEntity( pClone ) == NULL );
 			pClone->Free();
@@ -1673,7 +1724,7 @@ void CPortalSimulator::ClearLinkedPhysics( void )
 		for( int i = m_InternalData.Simulation.Dynamic.ShadowClones.FromLinkedPortal.Count(); --i >= 0; )
 		{
 			CPhysicsShadowClone *pClone = m_InternalData.Simulation.Dynamic.ShadowClones.FromLinkedPortal[i];
-			m_InternalData.Simulation.Dynamic.EntFlags[pClone->entindex()] &= ~PSEF_OWNS_PHYSICS;
+			RemoveEntityFlags( pClone, PSEF_OWNS_PHYSICS );
 			MarkAsReleased( pClone );
 			pClone->Free();
 		}
@@ -1714,7 +1765,7 @@ void CPortalSimulator::ClearLinkedEntities( void )
 		for( int i = m_InternalData.Simulation.Dynamic.ShadowClones.FromLinkedPortal.Count(); --i >= 0; )
 		{
 			CPhysicsShadowClone *pClone = m_InternalData.Simulation.Dynamic.ShadowClones.FromLinkedPortal[i];
-			m_InternalData.Simulation.Dynamic.EntFlags[pClone->entindex()] &= ~PSEF_OWNS_PHYSICS;
+			RemoveEntityFlags( pClone, PSEF_OWNS_PHYSICS );
 			MarkAsReleased( pClone );
 			pClone->Free();
 		}
@@ -1725,6 +1776,8 @@ void CPortalSimulator::ClearLinkedEntities( void )
 
 void CPortalSimulator::CreateAllCollision( void )
 {
+	PORTAL_SIMULATOR_PROFILE_SCOPE( PSPP_COLLISION_CREATION, "CPortalSimulator::CreateAllCollision" );
+
 	CREATEDEBUGTIMER( functionTimer );
 
 	STARTDEBUGTIMER( functionTimer );
@@ -1753,6 +1806,8 @@ void CPortalSimulator::CreateLocalCollision( void )
 
 	DEBUGTIMERONLY( s_iPortalSimulatorGUID = GetPortalSimulatorGUID() );
 
+	PORTAL_SIMULATOR_PROFILE_SCOPE( PSPP_COLLISION_CREATION, "CPortalSimulator::CreateLocalCollision" );
+
 	CREATEDEBUGTIMER( functionTimer );
 
 	STARTDEBUGTIMER( functionTimer );
@@ -2038,12 +2093,6 @@ void CPortalSimulator::CreateLocalCollision( void )
 
 	CREATEDEBUGTIMER( worldPropTimer );
 	STARTDEBUGTIMER( worldPropTimer );
-#ifdef _DEBUG
-	for( int i = m_InternalData.Simulation.Static.World.StaticProps.ClippedRepresentations.Count(); --i >= 0; )
-	{
-		Assert( m_InternalData.Simulation.Static.World.StaticProps.ClippedRepresentations[i].pCollide == NULL );
-	}
-#endif
 	Assert( m_InternalData.Simulation.Static.World.StaticProps.bCollisionExists == false ); //Be sure to find graceful fixes for asserts, performance is a big concern with portal simulation
 	if( m_InternalData.Simulation.Static.World.StaticProps.ClippedRepresentations.Count() != 0 )
 	{
@@ -2113,6 +2162,40 @@ void CPortalSimulator::CreateLocalCollision( void )
 			m_InternalData.Simulation.Static.SurfaceProperties.pEntity = m_InternalData.Simulation.hCollisionEntity;
 	}
 
+	//tree over everything we just built collideables from, so traces can skip collideables they can't possibly hit
+	{
+		CREATEDEBUGTIMER( collisionTreeTimer );
+		STARTDEBUGTIMER( collisionTreeTimer );
+		CPortalCollisionTree &CollisionTree = m_InternalData.Simulation.Static.CollisionTree;
+		CollisionTree.Clear();
+
+		if( m_InternalData.Simulation.Static.World.Brushes.pCollideable )
+			CollisionTree.AddPolyhedrons( m_InternalData.Simulation.Static.World.Brushes.Polyhedrons.Base(), m_InternalData.Simulation.Static.World.Brushes.Polyhedrons.Count(), PCTG_WORLD_BRUSHES );
+		else
+			CollisionTree.AddPolyhedrons( NULL, 0, PCTG_WORLD_BRUSHES );
+
+		if( m_InternalData.Simulation.Static.Wall.Local.Brushes.pCollideable )
+			CollisionTree.AddPolyhedrons( m_InternalData.Simulation.Static.Wall.Local.Brushes.Polyhedrons.Base(), m_InternalData.Simulation.Static.Wall.Local.Brushes.Polyhedrons.Count(), PCTG_WALL_BRUSHES );
+		else
+			CollisionTree.AddPolyhedrons( NULL, 0, PCTG_WALL_BRUSHES );
+
+		if( m_InternalData.Simulation.Static.Wall.Local.Tube.pCollideable )
+			CollisionTree.AddPolyhedrons( m_InternalData.Simulation.Static.Wall.Local.Tube.Polyhedrons.Base(), m_InternalData.Simulation.Static.Wall.Local.Tube.Polyhedrons.Count(), PCTG_WALL_TUBE );
+		else
+			CollisionTree.AddPolyhedrons( NULL, 0, PCTG_WALL_TUBE );
+
+		CPolyhedron **pPropPolyhedronsBase = m_InternalData.Simulation.Static.World.StaticProps.Polyhedrons.Base();
+		for( int i = 0; i != m_InternalData.Simulation.Static.World.StaticProps.ClippedRepresentations.Count(); ++i )
+		{
+			const PS_SD_Static_World_StaticProps_ClippedProp_t &Representation = m_InternalData.Simulation.Static.World.StaticProps.ClippedRepresentations[i];
+			CollisionTree.AddPolyhedrons( &pPropPolyhedronsBase[Representation.PolyhedronGroup.iStartIndex], Representation.PolyhedronGroup.iNumPolyhedrons, PCTG_STATIC_PROPS + i );
+		}
+
+		CollisionTree.Build();
+		STOPDEBUGTIMER( collisionTreeTimer );
+		DEBUGTIMERONLY( DevMsg( 2, "[PSDT:%d] %sCollision Tree=%fms\n", GetPortalSimulatorGUID(), TABSPACING, collisionTreeTimer.GetDuration().GetMillisecondsF() ); );
+	}
+
 	STOPDEBUGTIMER( functionTimer );
 	DECREMENTTABSPACING();
 	DEBUGTIMERONLY( DevMsg( 2, "[PSDT:%d] %sCPortalSimulator::CreateLocalCollision() FINISH: %fms\n", GetPortalSimulatorGUID(), TABSPACING, functionTimer.GetDuration().GetMillisecondsF() ); );
@@ -2217,6 +2300,8 @@ void CPortalSimulator::ClearLocalCollision( void )
 	}
 	m_InternalData.Simulation.Static.World.StaticProps.bCollisionExists = false;
 
+	m_InternalData.Simulation.Static.CollisionTree.Clear();
+
 	STOPDEBUGTIMER( functionTimer );
 	DECREMENTTABSPACING();
 	DEBUGTIMERONLY( DevMsg( 2, "[PSDT:%d] %sCPortalSimulator::ClearLocalCollision() FINISH: %fms\n", GetPortalSimulatorGUID(), TABSPACING, functionTimer.GetDuration().GetMillisecondsF() ); );
@@ -2226,68 +2311,37 @@ void CPortalSimulator::ClearLocalCollision( void )
 
 
 
-void CPortalSimulator::CreatePolyhedrons( void )
+static void GetPortalCollisionSimBounds( Vector &vWorldSimBoundsOut )
 {
-	if( m_CreationChecklist.bPolyhedronsGenerated )
-		return;
-
-	if( IsCollisionGenerationEnabled() == false )
-		return;
-
-	CREATEDEBUGTIMER( functionTimer );
-
-	STARTDEBUGTIMER( functionTimer );
-	DEBUGTIMERONLY( DevMsg( 2, "[PSDT:%d] %sCPortalSimulator::CreatePolyhedrons() START\n", GetPortalSimulatorGUID(), TABSPACING ); );
-	INCREMENTTABSPACING();
-
-	//forward reverse conventions signify whether the normal is the same direction as m_InternalData.Placement.PortalPlane.m_Normal
-	//World and wall conventions signify whether it's been shifted in front of the portal plane or behind it
-
-	float fWorldClipPlane_Forward[4] = {	m_InternalData.Placement.PortalPlane.m_Normal.x,
-											m_InternalData.Placement.PortalPlane.m_Normal.y,
-											m_InternalData.Placement.PortalPlane.m_Normal.z,
-											m_InternalData.Placement.PortalPlane.m_Dist + PORTAL_WORLD_WALL_HALF_SEPARATION_AMOUNT };
-
-	float fWorldClipPlane_Reverse[4] = {	-fWorldClipPlane_Forward[0],
-											-fWorldClipPlane_Forward[1],
-											-fWorldClipPlane_Forward[2],
-											-fWorldClipPlane_Forward[3] };
-
-	float fWallClipPlane_Forward[4] = {		m_InternalData.Placement.PortalPlane.m_Normal.x,
-											m_InternalData.Placement.PortalPlane.m_Normal.y,
-											m_InternalData.Placement.PortalPlane.m_Normal.z,
-											m_InternalData.Placement.PortalPlane.m_Dist }; // - PORTAL_WORLD_WALL_HALF_SEPARATION_AMOUNT
-
-	//float fWallClipPlane_Reverse[4] = {		-fWallClipPlane_Forward[0],
-	//										-fWallClipPlane_Forward[1],
-	//										-fWallClipPlane_Forward[2],
-	//										-fWallClipPlane_Forward[3] };
-
+	//scale the extents to usable sizes
+	float flScaleX = sv_portal_collision_sim_bounds_x.GetFloat();
+	if ( flScaleX < 200.0f )
+		flScaleX = 200.0f;
+	float flScaleY = sv_portal_collision_sim_bounds_y.GetFloat();
+	if ( flScaleY < 200.0f )
+		flScaleY = 200.0f;
+	float flScaleZ = sv_portal_collision_sim_bounds_z.GetFloat();
+	if ( flScaleZ < 252.0f )
+		flScaleZ = 252.0f;
+
+	vWorldSimBoundsOut.Init( flScaleX, flScaleY, flScaleZ );
+}
 
+void CPortalSimulator::GatherPolyhedronSources( PS_PolyhedronCarve_t &Carve )
+{
 	//World
 	{
-		Vector vOBBForward = m_InternalData.Placement.vForward;
-		Vector vOBBRight = m_InternalData.Placement.vRight;
-		Vector vOBBUp = m_InternalData.Placement.vUp;
+		Vector vOBBForward = Carve.Placement.vForward;
+		Vector vOBBRight = Carve.Placement.vRight;
+		Vector vOBBUp = Carve.Placement.vUp;
 
 
-		//scale the extents to usable sizes
-		float flScaleX = sv_portal_collision_sim_bounds_x.GetFloat();
-		if ( flScaleX < 200.0f )
-			flScaleX = 200.0f;
-		float flScaleY = sv_portal_collision_sim_bounds_y.GetFloat();
-		if ( flScaleY < 200.0f )
-			flScaleY = 200.0f;
-		float flScaleZ = sv_portal_collision_sim_bounds_z.GetFloat();
-		if ( flScaleZ < 252.0f )
-			flScaleZ = 252.0f;
+		vOBBForward *= Carve.vWorldSimBounds.x;
+		vOBBRight	*= Carve.vWorldSimBounds.y;
+		vOBBUp		*= Carve.vWorldSimBounds.z;	// default size for scale z (252) is player (height + portal half height) * 2. Any smaller than this will allow for players to 
+													// reach unsimulated geometry before an end touch with teh portal.
 
-		vOBBForward *= flScaleX;
-		vOBBRight	*= flScaleY;
-		vOBBUp		*= flScaleZ;	// default size for scale z (252) is player (height + portal half height) * 2. Any smaller than this will allow for players to 
-									// reach unsimulated geometry before an end touch with teh portal.
-
-		Vector ptOBBOrigin = m_InternalData.Placement.ptCenter;
+		Vector ptOBBOrigin = Carve.Placement.ptCenter;
 		ptOBBOrigin -= vOBBRight / 2.0f;
 		ptOBBOrigin -= vOBBUp / 2.0f;
 
@@ -2310,24 +2364,10 @@ void CPortalSimulator::CreatePolyhedrons( void )
 		}
 
 		//Brushes
-		{
-			Assert( m_InternalData.Simulation.Static.World.Brushes.Polyhedrons.Count() == 0 );
-
-			CUtlVector<int> WorldBrushes;
-			enginetrace->GetBrushesInAABB( vAABBMins, vAABBMaxs, &WorldBrushes, MASK_SOLID_BRUSHONLY|CONTENTS_PLAYERCLIP|CONTENTS_MONSTERCLIP );
-
-			//create locally clipped polyhedrons for the world
-			{
-				int *pBrushList = WorldBrushes.Base();
-				int iBrushCount = WorldBrushes.Count();
-				ConvertBrushListToClippedPolyhedronList( pBrushList, iBrushCount, fWorldClipPlane_Reverse, 1, PORTAL_POLYHEDRON_CUT_EPSILON, &m_InternalData.Simulation.Static.World.Brushes.Polyhedrons );
-			}
-		}
+		enginetrace->GetBrushesInAABB( vAABBMins, vAABBMaxs, &Carve.WorldBrushes, MASK_SOLID_BRUSHONLY|CONTENTS_PLAYERCLIP|CONTENTS_MONSTERCLIP );
 
 		//static props
 		{
-			Assert( m_InternalData.Simulation.Static.World.StaticProps.Polyhedrons.Count() == 0 );
-
 			CUtlVector<ICollideable *> StaticProps;
 			staticpropmgr->GetAllStaticPropsInAABB( vAABBMins, vAABBMaxs, &StaticProps );
 
@@ -2341,73 +2381,55 @@ void CPortalSimulator::CreatePolyhedrons( void )
 
 				CPolyhedron *PolyhedronArray[1024];
 				int iPolyhedronCount = g_StaticCollisionPolyhedronCache.GetStaticPropPolyhedrons( pProp, PolyhedronArray, 1024 );
+				if( iPolyhedronCount == 0 )
+					continue;
 
-				StaticPropPolyhedronGroups_t indices;
-				indices.iStartIndex = m_InternalData.Simulation.Static.World.StaticProps.Polyhedrons.Count();
-
+				int index = Carve.StaticProps.AddToTail();
+				PS_CarveStaticProp_t &NewProp = Carve.StaticProps[index];
+				NewProp.iFirstPolyhedron = Carve.StaticPropPolyhedrons.Count();
+				NewProp.iPolyhedronCount = iPolyhedronCount;
 				for( int j = 0; j != iPolyhedronCount; ++j )
+					Carve.StaticPropPolyhedrons.AddToTail( PolyhedronArray[j] );
+
+				PS_SD_Static_World_StaticProps_ClippedProp_t &NewEntry = NewProp.Representation;
+				NewEntry.PolyhedronGroup.iStartIndex = 0;
+				NewEntry.PolyhedronGroup.iNumPolyhedrons = 0;
+				NewEntry.pCollide = NULL;
+				NewEntry.pPhysicsObject = NULL;
+				NewEntry.pSourceProp = pProp->GetEntityHandle();
+
+				const model_t *pModel = pProp->GetCollisionModel();
+				bool bIsStudioModel = pModel && (modelinfo->GetModelType( pModel ) == mod_studio);
+				AssertOnce( bIsStudioModel );
+				if( bIsStudioModel )
 				{
-					CPolyhedron *pPropPolyhedronPiece = PolyhedronArray[j];
-					if( pPropPolyhedronPiece )
-					{
-						CPolyhedron *pClippedPropPolyhedron = ClipPolyhedron( pPropPolyhedronPiece, fWorldClipPlane_Reverse, 1, 0.01f, false );
-						if( pClippedPropPolyhedron )
-							m_InternalData.Simulation.Static.World.StaticProps.Polyhedrons.AddToTail( pClippedPropPolyhedron );
-					}
+					studiohdr_t *pStudioHdr = modelinfo->GetStudiomodel( pModel );
+					Assert( pStudioHdr != NULL );
+					NewEntry.iTraceContents = pStudioHdr->contents;						
+					NewEntry.iTraceSurfaceProps = physprops->GetSurfaceIndex( pStudioHdr->pszSurfaceProp() );
 				}
-
-				indices.iNumPolyhedrons = m_InternalData.Simulation.Static.World.StaticProps.Polyhedrons.Count() - indices.iStartIndex;
-				if( indices.iNumPolyhedrons != 0 )
+				else
 				{
-					int index = m_InternalData.Simulation.Static.World.StaticProps.ClippedRepresentations.AddToTail();
-					PS_SD_Static_World_StaticProps_ClippedProp_t &NewEntry = m_InternalData.Simulation.Static.World.StaticProps.ClippedRepresentations[index];
-
-					NewEntry.PolyhedronGroup = indices;
-					NewEntry.pCollide = NULL;
-					NewEntry.pPhysicsObject = NULL;
-					NewEntry.pSourceProp = pProp->GetEntityHandle();
-
-					const model_t *pModel = pProp->GetCollisionModel();
-					bool bIsStudioModel = pModel && (modelinfo->GetModelType( pModel ) == mod_studio);
-					AssertOnce( bIsStudioModel );
-					if( bIsStudioModel )
-					{
-						studiohdr_t *pStudioHdr = modelinfo->GetStudiomodel( pModel );
-						Assert( pStudioHdr != NULL );
-						NewEntry.iTraceContents = pStudioHdr->contents;						
-						NewEntry.iTraceSurfaceProps = physprops->GetSurfaceIndex( pStudioHdr->pszSurfaceProp() );
-					}
-					else
-					{
-						NewEntry.iTraceContents = m_InternalData.Simulation.Static.SurfaceProperties.contents;
-						NewEntry.iTraceSurfaceProps = m_InternalData.Simulation.Static.SurfaceProperties.surface.surfaceProps;
-					}
+					NewEntry.iTraceContents = m_InternalData.Simulation.Static.SurfaceProperties.contents;
+					NewEntry.iTraceSurfaceProps = m_InternalData.Simulation.Static.SurfaceProperties.surface.surfaceProps;
 				}
 			}
 		}
 	}
 
-
-
 	//(Holy) Wall
+	if( Carve.bCarveWall ) //the tube alone doesn't need any brushes
 	{
-		Assert( m_InternalData.Simulation.Static.Wall.Local.Tube.Polyhedrons.Count() == 0 );
-		Assert( m_InternalData.Simulation.Static.Wall.Local.Brushes.Polyhedrons.Count() == 0 );
-
-		Vector vBackward = -m_InternalData.Placement.vForward;
-		Vector vLeft = -m_InternalData.Placement.vRight;
-		Vector vDown = -m_InternalData.Placement.vUp;
-
-		Vector vOBBForward = -m_InternalData.Placement.vForward;
-		Vector vOBBRight = -m_InternalData.Placement.vRight;
-		Vector vOBBUp = m_InternalData.Placement.vUp;
+		Vector vOBBForward = -Carve.Placement.vForward;
+		Vector vOBBRight = -Carve.Placement.vRight;
+		Vector vOBBUp = Carve.Placement.vUp;
 
 		//scale the extents to usable sizes
 		vOBBForward *= PORTAL_WALL_FARDIST / 2.0f;
 		vOBBRight *= PORTAL_WALL_FARDIST * 2.0f;
 		vOBBUp *= PORTAL_WALL_FARDIST * 2.0f;
 
-		Vector ptOBBOrigin = m_InternalData.Placement.ptCenter;
+		Vector ptOBBOrigin = Carve.Placement.ptCenter;
 		ptOBBOrigin -= vOBBRight / 2.0f;
 		ptOBBOrigin -= vOBBUp / 2.0f;
 
@@ -2429,6 +2451,89 @@ void CPortalSimulator::CreatePolyhedrons( void )
 			if( ptTest.z > vAABBMaxs.z ) vAABBMaxs.z = ptTest.z;
 		}
 
+		enginetrace->GetBrushesInAABB( vAABBMins, vAABBMaxs, &Carve.WallBrushes, MASK_SOLID_BRUSHONLY );
+	}
+}
+
+//doesn't touch the engine or the simulator, safe to run on a job thread as long as bUseTemporaryMemory is false
+static void CarvePortalPolyhedrons( const PS_PolyhedronCarve_t &Carve, PS_SD_Static_t &Static, bool bUseTemporaryMemory )
+{
+	//forward reverse conventions signify whether the normal is the same direction as Carve.Placement.PortalPlane.m_Normal
+	//World and wall conventions signify whether it's been shifted in front of the portal plane or behind it
+
+	float fWorldClipPlane_Forward[4] = {	Carve.Placement.PortalPlane.m_Normal.x,
+											Carve.Placement.PortalPlane.m_Normal.y,
+											Carve.Placement.PortalPlane.m_Normal.z,
+											Carve.Placement.PortalPlane.m_Dist + PORTAL_WORLD_WALL_HALF_SEPARATION_AMOUNT };
+
+	float fWorldClipPlane_Reverse[4] = {	-fWorldClipPlane_Forward[0],
+											-fWorldClipPlane_Forward[1],
+											-fWorldClipPlane_Forward[2],
+											-fWorldClipPlane_Forward[3] };
+
+	float fWallClipPlane_Forward[4] = {		Carve.Placement.PortalPlane.m_Normal.x,
+											Carve.Placement.PortalPlane.m_Normal.y,
+											Carve.Placement.PortalPlane.m_Normal.z,
+											Carve.Placement.PortalPlane.m_Dist }; // - PORTAL_WORLD_WALL_HALF_SEPARATION_AMOUNT
+
+	//float fWallClipPlane_Reverse[4] = {		-fWallClipPlane_Forward[0],
+	//										-fWallClipPlane_Forward[1],
+	//										-fWallClipPlane_Forward[2],
+	//										-fWallClipPlane_Forward[3] };
+
+
+	//World
+	{
+		//Brushes
+		{
+			Assert( Static.World.Brushes.Polyhedrons.Count() == 0 );
+
+			//create locally clipped polyhedrons for the world
+			ConvertBrushListToClippedPolyhedronList( Carve.WorldBrushes.Base(), Carve.WorldBrushes.Count(), fWorldClipPlane_Reverse, 1, PORTAL_POLYHEDRON_CUT_EPSILON, &Static.World.Brushes.Polyhedrons );
+		}
+
+		//static props
+		{
+			Assert( Static.World.StaticProps.Polyhedrons.Count() == 0 );
+
+			for( int i = 0; i != Carve.StaticProps.Count(); ++i )
+			{
+				const PS_CarveStaticProp_t &Prop = Carve.StaticProps[i];
+
+				StaticPropPolyhedronGroups_t indices;
+				indices.iStartIndex = Static.World.StaticProps.Polyhedrons.Count();
+
+				for( int j = 0; j != Prop.iPolyhedronCount; ++j )
+				{
+					const CPolyhedron *pPropPolyhedronPiece = Carve.StaticPropPolyhedrons[Prop.iFirstPolyhedron + j];
+					if( pPropPolyhedronPiece )
+					{
+						CPolyhedron *pClippedPropPolyhedron = ClipPolyhedron( pPropPolyhedronPiece, fWorldClipPlane_Reverse, 1, 0.01f, false );
+						if( pClippedPropPolyhedron )
+							Static.World.StaticProps.Polyhedrons.AddToTail( pClippedPropPolyhedron );
+					}
+				}
+
+				indices.iNumPolyhedrons = Static.World.StaticProps.Polyhedrons.Count() - indices.iStartIndex;
+				if( indices.iNumPolyhedrons != 0 )
+				{
+					int index = Static.World.StaticProps.ClippedRepresentations.AddToTail( Prop.Representation );
+					Static.World.StaticProps.ClippedRepresentations[index].PolyhedronGroup = indices;
+				}
+			}
+		}
+	}
+
+
+
+	//(Holy) Wall
+	{
+		Assert( Static.Wall.Local.Tube.Polyhedrons.Count() == 0 );
+		Assert( Static.Wall.Local.Brushes.Polyhedrons.Count() == 0 );
+
+		Vector vBackward = -Carve.Placement.vForward;
+		Vector vLeft = -Carve.Placement.vRight;
+		Vector vDown = -Carve.Placement.vUp;
 
 		float fPlanes[6 * 4];
 
@@ -2441,56 +2546,53 @@ void CPortalSimulator::CreatePolyhedrons( void )
 		fPlanes[(1*4) + 0] = vBackward.x;
 		fPlanes[(1*4) + 1] = vBackward.y;
 		fPlanes[(1*4) + 2] = vBackward.z;
-		float fTubeDepthDist = vBackward.Dot( m_InternalData.Placement.ptCenter + (vBackward * (PORTAL_WALL_TUBE_DEPTH + PORTAL_WALL_TUBE_OFFSET)) );
+		float fTubeDepthDist = vBackward.Dot( Carve.Placement.ptCenter + (vBackward * (PORTAL_WALL_TUBE_DEPTH + PORTAL_WALL_TUBE_OFFSET)) );
 		fPlanes[(1*4) + 3] = fTubeDepthDist;
 
 
 		//the remaining planes will always have the same ordering of normals, with different distances plugged in for each convex we're creating
 		//normal order is up, down, left, right
 
-		fPlanes[(2*4) + 0] = m_InternalData.Placement.vUp.x;
-		fPlanes[(2*4) + 1] = m_InternalData.Placement.vUp.y;
-		fPlanes[(2*4) + 2] = m_InternalData.Placement.vUp.z;
-		fPlanes[(2*4) + 3] = m_InternalData.Placement.vUp.Dot( m_InternalData.Placement.ptCenter + (m_InternalData.Placement.vUp * PORTAL_HOLE_HALF_HEIGHT) );
+		fPlanes[(2*4) + 0] = Carve.Placement.vUp.x;
+		fPlanes[(2*4) + 1] = Carve.Placement.vUp.y;
+		fPlanes[(2*4) + 2] = Carve.Placement.vUp.z;
+		fPlanes[(2*4) + 3] = Carve.Placement.vUp.Dot( Carve.Placement.ptCenter + (Carve.Placement.vUp * PORTAL_HOLE_HALF_HEIGHT) );
 
 		fPlanes[(3*4) + 0] = vDown.x;
 		fPlanes[(3*4) + 1] = vDown.y;
 		fPlanes[(3*4) + 2] = vDown.z;
-		fPlanes[(3*4) + 3] = vDown.Dot( m_InternalData.Placement.ptCenter + (vDown * PORTAL_HOLE_HALF_HEIGHT) );
+		fPlanes[(3*4) + 3] = vDown.Dot( Carve.Placement.ptCenter + (vDown * PORTAL_HOLE_HALF_HEIGHT) );
 
 		fPlanes[(4*4) + 0] = vLeft.x;
 		fPlanes[(4*4) + 1] = vLeft.y;
 		fPlanes[(4*4) + 2] = vLeft.z;
-		fPlanes[(4*4) + 3] = vLeft.Dot( m_InternalData.Placement.ptCenter + (vLeft * PORTAL_HOLE_HALF_WIDTH) );
+		fPlanes[(4*4) + 3] = vLeft.Dot( Carve.Placement.ptCenter + (vLeft * PORTAL_HOLE_HALF_WIDTH) );
 
-		fPlanes[(5*4) + 0] = m_InternalData.Placement.vRight.x;
-		fPlanes[(5*4) + 1] = m_InternalData.Placement.vRight.y;
-		fPlanes[(5*4) + 2] = m_InternalData.Placement.vRight.z;
-		fPlanes[(5*4) + 3] = m_InternalData.Placement.vRight.Dot( m_InternalData.Placement.ptCenter + (m_InternalData.Placement.vRight * PORTAL_HOLE_HALF_WIDTH) );
+		fPlanes[(5*4) + 0] = Carve.Placement.vRight.x;
+		fPlanes[(5*4) + 1] = Carve.Placement.vRight.y;
+		fPlanes[(5*4) + 2] = Carve.Placement.vRight.z;
+		fPlanes[(5*4) + 3] = Carve.Placement.vRight.Dot( Carve.Placement.ptCenter + (Carve.Placement.vRight * PORTAL_HOLE_HALF_WIDTH) );
 
 		float *fSidePlanesOnly = &fPlanes[(2*4)];
 
 		//these 2 get re-used a bit
-		float fFarRightPlaneDistance = m_InternalData.Placement.vRight.Dot( m_InternalData.Placement.ptCenter + m_InternalData.Placement.vRight * (PORTAL_WALL_FARDIST * 10.0f) );
-		float fFarLeftPlaneDistance = vLeft.Dot( m_InternalData.Placement.ptCenter + vLeft * (PORTAL_WALL_FARDIST * 10.0f) );
+		float fFarRightPlaneDistance = Carve.Placement.vRight.Dot( Carve.Placement.ptCenter + Carve.Placement.vRight * (PORTAL_WALL_FARDIST * 10.0f) );
+		float fFarLeftPlaneDistance = vLeft.Dot( Carve.Placement.ptCenter + vLeft * (PORTAL_WALL_FARDIST * 10.0f) );
 
 
-		CUtlVector<int> WallBrushes;
 		CUtlVector<CPolyhedron *> WallBrushPolyhedrons_ClippedToWall;
 		CPolyhedron **pWallClippedPolyhedrons = NULL;
 		int iWallClippedPolyhedronCount = 0;
-		if( IsSimulatingVPhysics() ) //if not simulating vphysics, we skip making the entire wall, and just create the minimal tube instead
+		if( Carve.bCarveWall ) //if not simulating vphysics, we skip making the entire wall, and just create the minimal tube instead
 		{
-			enginetrace->GetBrushesInAABB( vAABBMins, vAABBMaxs, &WallBrushes, MASK_SOLID_BRUSHONLY );
-
-			if( WallBrushes.Count() != 0 )
-				ConvertBrushListToClippedPolyhedronList( WallBrushes.Base(), WallBrushes.Count(), fPlanes, 1, PORTAL_POLYHEDRON_CUT_EPSILON, &WallBrushPolyhedrons_ClippedToWall );
+			if( Carve.WallBrushes.Count() != 0 )
+				ConvertBrushListToClippedPolyhedronList( Carve.WallBrushes.Base(), Carve.WallBrushes.Count(), fPlanes, 1, PORTAL_POLYHEDRON_CUT_EPSILON, &WallBrushPolyhedrons_ClippedToWall );
 			
 			if( WallBrushPolyhedrons_ClippedToWall.Count() != 0 )
 			{
 				for( int i = WallBrushPolyhedrons_ClippedToWall.Count(); --i >= 0; )
 				{
-					CPolyhedron *pPolyhedron = ClipPolyhedron( WallBrushPolyhedrons_ClippedToWall[i], fSidePlanesOnly, 4, PORTAL_POLYHEDRON_CUT_EPSILON, true );
+					CPolyhedron *pPolyhedron = ClipPolyhedron( WallBrushPolyhedrons_ClippedToWall[i], fSidePlanesOnly, 4, PORTAL_POLYHEDRON_CUT_EPSILON, bUseTemporaryMemory );
 					if( pPolyhedron )
 					{
 						//a chunk of this brush passes through the hole, not eligible to be removed from cutting
@@ -2499,7 +2601,7 @@ void CPortalSimulator::CreatePolyhedrons( void )
 					else
 					{
 						//no part of this brush interacts with the hole, no point in cutting the brush any later
-						m_InternalData.Simulation.Static.Wall.Local.Brushes.Polyhedrons.AddToTail( WallBrushPolyhedrons_ClippedToWall[i] );
+						Static.Wall.Local.Brushes.Polyhedrons.AddToTail( WallBrushPolyhedrons_ClippedToWall[i] );
 						WallBrushPolyhedrons_ClippedToWall.FastRemove( i );
 					}
 				}
@@ -2517,94 +2619,94 @@ void CPortalSimulator::CreatePolyhedrons( void )
 		{
 			//minimal portion that extends into the hole space
 			//fPlanes[(1*4) + 3] = fTubeDepthDist;
-			fPlanes[(2*4) + 3] = m_InternalData.Placement.vUp.Dot( m_InternalData.Placement.ptCenter + m_InternalData.Placement.vUp * (PORTAL_HOLE_HALF_HEIGHT + PORTAL_WALL_MIN_THICKNESS) );
-			fPlanes[(3*4) + 3] = vDown.Dot( m_InternalData.Placement.ptCenter + m_InternalData.Placement.vUp * PORTAL_HOLE_HALF_HEIGHT );
-			fPlanes[(4*4) + 3] = vLeft.Dot( m_InternalData.Placement.ptCenter + vLeft * (PORTAL_HOLE_HALF_WIDTH + PORTAL_WALL_MIN_THICKNESS) );
-			fPlanes[(5*4) + 3] = m_InternalData.Placement.vRight.Dot( m_InternalData.Placement.ptCenter + m_InternalData.Placement.vRight * (PORTAL_HOLE_HALF_WIDTH + PORTAL_WALL_MIN_THICKNESS) );
+			fPlanes[(2*4) + 3] = Carve.Placement.vUp.Dot( Carve.Placement.ptCenter + Carve.Placement.vUp * (PORTAL_HOLE_HALF_HEIGHT + PORTAL_WALL_MIN_THICKNESS) );
+			fPlanes[(3*4) + 3] = vDown.Dot( Carve.Placement.ptCenter + Carve.Placement.vUp * PORTAL_HOLE_HALF_HEIGHT );
+			fPlanes[(4*4) + 3] = vLeft.Dot( Carve.Placement.ptCenter + vLeft * (PORTAL_HOLE_HALF_WIDTH + PORTAL_WALL_MIN_THICKNESS) );
+			fPlanes[(5*4) + 3] = Carve.Placement.vRight.Dot( Carve.Placement.ptCenter + Carve.Placement.vRight * (PORTAL_HOLE_HALF_WIDTH + PORTAL_WALL_MIN_THICKNESS) );
 
 			CPolyhedron *pTubePolyhedron = GeneratePolyhedronFromPlanes( fPlanes, 6, PORTAL_POLYHEDRON_CUT_EPSILON );
 			if( pTubePolyhedron )
-				m_InternalData.Simulation.Static.Wall.Local.Tube.Polyhedrons.AddToTail( pTubePolyhedron );
+				Static.Wall.Local.Tube.Polyhedrons.AddToTail( pTubePolyhedron );
 
 			//general hole cut
 			//fPlanes[(1*4) + 3] += 2000.0f;
-			fPlanes[(2*4) + 3] = m_InternalData.Placement.vUp.Dot( m_InternalData.Placement.ptCenter + m_InternalData.Placement.vUp * (PORTAL_WALL_FARDIST * 10.0f) );
-			fPlanes[(3*4) + 3] = vDown.Dot( m_InternalData.Placement.ptCenter + m_InternalData.Placement.vUp * (PORTAL_HOLE_HALF_HEIGHT + PORTAL_WALL_MIN_THICKNESS) );
+			fPlanes[(2*4) + 3] = Carve.Placement.vUp.Dot( Carve.Placement.ptCenter + Carve.Placement.vUp * (PORTAL_WALL_FARDIST * 10.0f) );
+			fPlanes[(3*4) + 3] = vDown.Dot( Carve.Placement.ptCenter + Carve.Placement.vUp * (PORTAL_HOLE_HALF_HEIGHT + PORTAL_WALL_MIN_THICKNESS) );
 			fPlanes[(4*4) + 3] = fFarLeftPlaneDistance;
 			fPlanes[(5*4) + 3] = fFarRightPlaneDistance;
 
 			
 
-			ClipPolyhedrons( pWallClippedPolyhedrons, iWallClippedPolyhedronCount, fSidePlanesOnly, 4, PORTAL_POLYHEDRON_CUT_EPSILON, &m_InternalData.Simulation.Static.Wall.Local.Brushes.Polyhedrons );
+			ClipPolyhedrons( pWallClippedPolyhedrons, iWallClippedPolyhedronCount, fSidePlanesOnly, 4, PORTAL_POLYHEDRON_CUT_EPSILON, &Static.Wall.Local.Brushes.Polyhedrons );
 		}
 
 		//lower wall
 		{
 			//minimal portion that extends into the hole space
 			//fPlanes[(1*4) + 3] = fTubeDepthDist;
-			fPlanes[(2*4) + 3] = m_InternalData.Placement.vUp.Dot( m_InternalData.Placement.ptCenter + (vDown * PORTAL_HOLE_HALF_HEIGHT) );
-			fPlanes[(3*4) + 3] = vDown.Dot( m_InternalData.Placement.ptCenter + vDown * (PORTAL_HOLE_HALF_HEIGHT + PORTAL_WALL_MIN_THICKNESS) );
-			fPlanes[(4*4) + 3] = vLeft.Dot( m_InternalData.Placement.ptCenter + vLeft * (PORTAL_HOLE_HALF_WIDTH + PORTAL_WALL_MIN_THICKNESS) );
-			fPlanes[(5*4) + 3] = m_InternalData.Placement.vRight.Dot( m_InternalData.Placement.ptCenter + m_InternalData.Placement.vRight * (PORTAL_HOLE_HALF_WIDTH + PORTAL_WALL_MIN_THICKNESS) );
+			fPlanes[(2*4) + 3] = Carve.Placement.vUp.Dot( Carve.Placement.ptCenter + (vDown * PORTAL_HOLE_HALF_HEIGHT) );
+			fPlanes[(3*4) + 3] = vDown.Dot( Carve.Placement.ptCenter + vDown * (PORTAL_HOLE_HALF_HEIGHT + PORTAL_WALL_MIN_THICKNESS) );
+			fPlanes[(4*4) + 3] = vLeft.Dot( Carve.Placement.ptCenter + vLeft * (PORTAL_HOLE_HALF_WIDTH + PORTAL_WALL_MIN_THICKNESS) );
+			fPlanes[(5*4) + 3] = Carve.Placement.vRight.Dot( Carve.Placement.ptCenter + Carve.Placement.vRight * (PORTAL_HOLE_HALF_WIDTH + PORTAL_WALL_MIN_THICKNESS) );
 
 			CPolyhedron *pTubePolyhedron = GeneratePolyhedronFromPlanes( fPlanes, 6, PORTAL_POLYHEDRON_CUT_EPSILON );
 			if( pTubePolyhedron )
-				m_InternalData.Simulation.Static.Wall.Local.Tube.Polyhedrons.AddToTail( pTubePolyhedron );
+				Static.Wall.Local.Tube.Polyhedrons.AddToTail( pTubePolyhedron );
 
 			//general hole cut
 			//fPlanes[(1*4) + 3] += 2000.0f;
-			fPlanes[(2*4) + 3] = m_InternalData.Placement.vUp.Dot( m_InternalData.Placement.ptCenter + (vDown * (PORTAL_HOLE_HALF_HEIGHT + PORTAL_WALL_MIN_THICKNESS)) );
-			fPlanes[(3*4) + 3] = vDown.Dot( m_InternalData.Placement.ptCenter + (vDown * (PORTAL_WALL_FARDIST * 10.0f)) );
+			fPlanes[(2*4) + 3] = Carve.Placement.vUp.Dot( Carve.Placement.ptCenter + (vDown * (PORTAL_HOLE_HALF_HEIGHT + PORTAL_WALL_MIN_THICKNESS)) );
+			fPlanes[(3*4) + 3] = vDown.Dot( Carve.Placement.ptCenter + (vDown * (PORTAL_WALL_FARDIST * 10.0f)) );
 			fPlanes[(4*4) + 3] = fFarLeftPlaneDistance;
 			fPlanes[(5*4) + 3] = fFarRightPlaneDistance;
 
-			ClipPolyhedrons( pWallClippedPolyhedrons, iWallClippedPolyhedronCount, fSidePlanesOnly, 4, PORTAL_POLYHEDRON_CUT_EPSILON, &m_InternalData.Simulation.Static.Wall.Local.Brushes.Polyhedrons );
+			ClipPolyhedrons( pWallClippedPolyhedrons, iWallClippedPolyhedronCount, fSidePlanesOnly, 4, PORTAL_POLYHEDRON_CUT_EPSILON, &Static.Wall.Local.Brushes.Polyhedrons );
 		}
 
 		//left wall
 		{
 			//minimal portion that extends into the hole space
 			//fPlanes[(1*4) + 3] = fTubeDepthDist;
-			fPlanes[(2*4) + 3] = m_InternalData.Placement.vUp.Dot( m_InternalData.Placement.ptCenter + (m_InternalData.Placement.vUp * PORTAL_HOLE_HALF_HEIGHT) );
-			fPlanes[(3*4) + 3] = vDown.Dot( m_InternalData.Placement.ptCenter + (vDown * PORTAL_HOLE_HALF_HEIGHT) );
-			fPlanes[(4*4) + 3] = vLeft.Dot( m_InternalData.Placement.ptCenter + (vLeft * (PORTAL_HOLE_HALF_WIDTH + PORTAL_WALL_MIN_THICKNESS)) );
-			fPlanes[(5*4) + 3] = m_InternalData.Placement.vRight.Dot( m_InternalData.Placement.ptCenter + (vLeft * PORTAL_HOLE_HALF_WIDTH) );
+			fPlanes[(2*4) + 3] = Carve.Placement.vUp.Dot( Carve.Placement.ptCenter + (Carve.Placement.vUp * PORTAL_HOLE_HALF_HEIGHT) );
+			fPlanes[(3*4) + 3] = vDown.Dot( Carve.Placement.ptCenter + (vDown * PORTAL_HOLE_HALF_HEIGHT) );
+			fPlanes[(4*4) + 3] = vLeft.Dot( Carve.Placement.ptCenter + (vLeft * (PORTAL_HOLE_HALF_WIDTH + PORTAL_WALL_MIN_THICKNESS)) );
+			fPlanes[(5*4) + 3] = Carve.Placement.vRight.Dot( Carve.Placement.ptCenter + (vLeft * PORTAL_HOLE_HALF_WIDTH) );
 
 			CPolyhedron *pTubePolyhedron = GeneratePolyhedronFromPlanes( fPlanes, 6, PORTAL_POLYHEDRON_CUT_EPSILON );
 			if( pTubePolyhedron )
-				m_InternalData.Simulation.Static.Wall.Local.Tube.Polyhedrons.AddToTail( pTubePolyhedron );
+				Static.Wall.Local.Tube.Polyhedrons.AddToTail( pTubePolyhedron );
 
 			//general hole cut
 			//fPlanes[(1*4) + 3] += 2000.0f;
-			fPlanes[(2*4) + 3] = m_InternalData.Placement.vUp.Dot( m_InternalData.Placement.ptCenter + (m_InternalData.Placement.vUp * (PORTAL_HOLE_HALF_HEIGHT + PORTAL_WALL_MIN_THICKNESS)) );
-			fPlanes[(3*4) + 3] = vDown.Dot( m_InternalData.Placement.ptCenter - (m_InternalData.Placement.vUp * (PORTAL_HOLE_HALF_HEIGHT + PORTAL_WALL_MIN_THICKNESS)) );
+			fPlanes[(2*4) + 3] = Carve.Placement.vUp.Dot( Carve.Placement.ptCenter + (Carve.Placement.vUp * (PORTAL_HOLE_HALF_HEIGHT + PORTAL_WALL_MIN_THICKNESS)) );
+			fPlanes[(3*4) + 3] = vDown.Dot( Carve.Placement.ptCenter - (Carve.Placement.vUp * (PORTAL_HOLE_HALF_HEIGHT + PORTAL_WALL_MIN_THICKNESS)) );
 			fPlanes[(4*4) + 3] = fFarLeftPlaneDistance;
-			fPlanes[(5*4) + 3] = m_InternalData.Placement.vRight.Dot( m_InternalData.Placement.ptCenter + (vLeft * (PORTAL_HOLE_HALF_WIDTH + PORTAL_WALL_MIN_THICKNESS)) );
+			fPlanes[(5*4) + 3] = Carve.Placement.vRight.Dot( Carve.Placement.ptCenter + (vLeft * (PORTAL_HOLE_HALF_WIDTH + PORTAL_WALL_MIN_THICKNESS)) );
 
-			ClipPolyhedrons( pWallClippedPolyhedrons, iWallClippedPolyhedronCount, fSidePlanesOnly, 4, PORTAL_POLYHEDRON_CUT_EPSILON, &m_InternalData.Simulation.Static.Wall.Local.Brushes.Polyhedrons );
+			ClipPolyhedrons( pWallClippedPolyhedrons, iWallClippedPolyhedronCount, fSidePlanesOnly, 4, PORTAL_POLYHEDRON_CUT_EPSILON, &Static.Wall.Local.Brushes.Polyhedrons );
 		}
 
 		//right wall
 		{
 			//minimal portion that extends into the hole space
 			//fPlanes[(1*4) + 3] = fTubeDepthDist;
-			fPlanes[(2*4) + 3] = m_InternalData.Placement.vUp.Dot( m_InternalData.Placement.ptCenter + (m_InternalData.Placement.vUp * (PORTAL_HOLE_HALF_HEIGHT)) );
-			fPlanes[(3*4) + 3] = vDown.Dot( m_InternalData.Placement.ptCenter + (vDown * (PORTAL_HOLE_HALF_HEIGHT)) );
-			fPlanes[(4*4) + 3] = vLeft.Dot( m_InternalData.Placement.ptCenter + m_InternalData.Placement.vRight * PORTAL_HOLE_HALF_WIDTH );
-			fPlanes[(5*4) + 3] = m_InternalData.Placement.vRight.Dot( m_InternalData.Placement.ptCenter + m_InternalData.Placement.vRight * (PORTAL_HOLE_HALF_WIDTH + PORTAL_WALL_MIN_THICKNESS) );
+			fPlanes[(2*4) + 3] = Carve.Placement.vUp.Dot( Carve.Placement.ptCenter + (Carve.Placement.vUp * (PORTAL_HOLE_HALF_HEIGHT)) );
+			fPlanes[(3*4) + 3] = vDown.Dot( Carve.Placement.ptCenter + (vDown * (PORTAL_HOLE_HALF_HEIGHT)) );
+			fPlanes[(4*4) + 3] = vLeft.Dot( Carve.Placement.ptCenter + Carve.Placement.vRight * PORTAL_HOLE_HALF_WIDTH );
+			fPlanes[(5*4) + 3] = Carve.Placement.vRight.Dot( Carve.Placement.ptCenter + Carve.Placement.vRight * (PORTAL_HOLE_HALF_WIDTH + PORTAL_WALL_MIN_THICKNESS) );
 
 			CPolyhedron *pTubePolyhedron = GeneratePolyhedronFromPlanes( fPlanes, 6, PORTAL_POLYHEDRON_CUT_EPSILON );
 			if( pTubePolyhedron )
-				m_InternalData.Simulation.Static.Wall.Local.Tube.Polyhedrons.AddToTail( pTubePolyhedron );
+				Static.Wall.Local.Tube.Polyhedrons.AddToTail( pTubePolyhedron );
 
 			//general hole cut
 			//fPlanes[(1*4) + 3] += 2000.0f;
-			fPlanes[(2*4) + 3] = m_InternalData.Placement.vUp.Dot( m_InternalData.Placement.ptCenter + (m_InternalData.Placement.vUp * (PORTAL_HOLE_HALF_HEIGHT + PORTAL_WALL_MIN_THICKNESS)) );
-			fPlanes[(3*4) + 3] = vDown.Dot( m_InternalData.Placement.ptCenter + (vDown * (PORTAL_HOLE_HALF_HEIGHT + PORTAL_WALL_MIN_THICKNESS)) );
-			fPlanes[(4*4) + 3] = vLeft.Dot( m_InternalData.Placement.ptCenter + m_InternalData.Placement.vRight * (PORTAL_HOLE_HALF_WIDTH + PORTAL_WALL_MIN_THICKNESS) );
+			fPlanes[(2*4) + 3] = Carve.Placement.vUp.Dot( Carve.Placement.ptCenter + (Carve.Placement.vUp * (PORTAL_HOLE_HALF_HEIGHT + PORTAL_WALL_MIN_THICKNESS)) );
+			fPlanes[(3*4) + 3] = vDown.Dot( Carve.Placement.ptCenter + (vDown * (PORTAL_HOLE_HALF_HEIGHT + PORTAL_WALL_MIN_THICKNESS)) );
+			fPlanes[(4*4) + 3] = vLeft.Dot( Carve.Placement.ptCenter + Carve.Placement.vRight * (PORTAL_HOLE_HALF_WIDTH + PORTAL_WALL_MIN_THICKNESS) );
 			fPlanes[(5*4) + 3] = fFarRightPlaneDistance;
 
-			ClipPolyhedrons( pWallClippedPolyhedrons, iWallClippedPolyhedronCount, fSidePlanesOnly, 4, PORTAL_POLYHEDRON_CUT_EPSILON, &m_InternalData.Simulation.Static.Wall.Local.Brushes.Polyhedrons );
+			ClipPolyhedrons( pWallClippedPolyhedrons, iWallClippedPolyhedronCount, fSidePlanesOnly, 4, PORTAL_POLYHEDRON_CUT_EPSILON, &Static.Wall.Local.Brushes.Polyhedrons );
 		}
 
 		for( int i = WallBrushPolyhedrons_ClippedToWall.Count(); --i >= 0; )
@@ -2612,6 +2714,76 @@ void CPortalSimulator::CreatePolyhedrons( void )
 
 		WallBrushPolyhedrons_ClippedToWall.RemoveAll();
 	}
+}
+
+//throws away a carve that never got swapped into a simulator
+static void ReleaseCarvedPolyhedrons( PS_SD_Static_t &Static )
+{
+	Static.World.StaticProps.ClippedRepresentations.RemoveAll();
+
+	for( int i = Static.World.Brushes.Polyhedrons.Count(); --i >= 0; )
+		Static.World.Brushes.Polyhedrons[i]->Release();
+	Static.World.Brushes.Polyhedrons.RemoveAll();
+
+	for( int i = Static.World.StaticProps.Polyhedrons.Count(); --i >= 0; )
+		Static.World.StaticProps.Polyhedrons[i]->Release();
+	Static.World.StaticProps.Polyhedrons.RemoveAll();
+
+	for( int i = Static.Wall.Local.Brushes.Polyhedrons.Count(); --i >= 0; )
+		Static.Wall.Local.Brushes.Polyhedrons[i]->Release();
+	Static.Wall.Local.Brushes.Polyhedrons.RemoveAll();
+
+	for( int i = Static.Wall.Local.Tube.Polyhedrons.Count(); --i >= 0; )
+		Static.Wall.Local.Tube.Polyhedrons[i]->Release();
+	Static.Wall.Local.Tube.Polyhedrons.RemoveAll();
+}
+
+//only the clipping happens here, the collideables are built on the main thread once the carve is swapped in
+static void ExecutePolyhedronCarveJob( PS_PolyhedronCarve_t *pCarve )
+{
+	//temporary polyhedron memory is a single global buffer, it's off limits away from the main thread
+	CPortalSimulatorProfileScope carveProfileScope( PSPP_POLYHEDRON_CARVE );
+	CarvePortalPolyhedrons( *pCarve, pCarve->Result, false );
+}
+
+
+
+void CPortalSimulator::CreatePolyhedrons( void )
+{
+	if( m_CreationChecklist.bPolyhedronsGenerated )
+		return;
+
+	if( IsCollisionGenerationEnabled() == false )
+		return;
+
+	PORTAL_SIMULATOR_PROFILE_SCOPE( PSPP_POLYHEDRON_CARVE, "CPortalSimulator::CreatePolyhedrons" );
+
+	CREATEDEBUGTIMER( functionTimer );
+
+	STARTDEBUGTIMER( functionTimer );
+	DEBUGTIMERONLY( DevMsg( 2, "[PSDT:%d] %sCPortalSimulator::CreatePolyhedrons() START\n", GetPortalSimulatorGUID(), TABSPACING ); );
+	INCREMENTTABSPACING();
+
+	PS_PolyhedronCarve_t Carve;
+	Carve.Placement = m_InternalData.Placement;
+	GetPortalCollisionSimBounds( Carve.vWorldSimBounds );
+	Carve.bCarveWall = IsSimulatingVPhysics();
+
+	//repeat placements can reuse a previous carve
+	if( g_PortalCarvedPolyhedronCache.RestoreCarvedPolyhedrons( Carve.Placement.ptCenter, Carve.Placement.qAngles, Carve.vWorldSimBounds, Carve.bCarveWall, m_InternalData.Simulation.Static ) )
+	{
+		STOPDEBUGTIMER( functionTimer );
+		DECREMENTTABSPACING();
+		DEBUGTIMERONLY( DevMsg( 2, "[PSDT:%d] %sCPortalSimulator::CreatePolyhedrons() FINISH (cached): %fms\n", GetPortalSimulatorGUID(), TABSPACING, functionTimer.GetDuration().GetMillisecondsF() ); );
+
+		m_CreationChecklist.bPolyhedronsGenerated = true;
+		return;
+	}
+
+	GatherPolyhedronSources( Carve );
+	CarvePortalPolyhedrons( Carve, m_InternalData.Simulation.Static, true );
+
+	g_PortalCarvedPolyhedronCache.StoreCarvedPolyhedrons( Carve.Placement.ptCenter, Carve.Placement.qAngles, Carve.vWorldSimBounds, Carve.bCarveWall, m_InternalData.Simulation.Static );
 
 	STOPDEBUGTIMER( functionTimer );
 	DECREMENTTABSPACING();
@@ -2622,6 +2794,101 @@ void CPortalSimulator::CreatePolyhedrons( void )
 
 
 
+void CPortalSimulator::StartAsyncPolyhedronCarve( void )
+{
+	Assert( m_pPendingPolyhedronCarve == NULL );
+
+	PS_PolyhedronCarve_t *pCarve = new PS_PolyhedronCarve_t;
+	pCarve->Placement = m_InternalData.Placement;
+	GetPortalCollisionSimBounds( pCarve->vWorldSimBounds );
+	pCarve->bCarveWall = IsSimulatingVPhysics();
+
+	m_pPendingPolyhedronCarve = pCarve;
+
+	//a cached carve has nothing left to clip, swap it in right away
+	pCarve->bRestoredFromCache = g_PortalCarvedPolyhedronCache.RestoreCarvedPolyhedrons( pCarve->Placement.ptCenter, pCarve->Placement.qAngles, pCarve->vWorldSimBounds, pCarve->bCarveWall, pCarve->Result );
+	if( pCarve->bRestoredFromCache )
+	{
+		FinishAsyncPolyhedronCarve();
+		return;
+	}
+
+	GatherPolyhedronSources( *pCarve );
+	pCarve->pJob = ThreadExecute( &ExecutePolyhedronCarveJob, pCarve );
+}
+
+
+
+void CPortalSimulator::FinishAsyncPolyhedronCarve( void )
+{
+	PS_PolyhedronCarve_t *pCarve = m_pPendingPolyhedronCarve;
+	if( pCarve == NULL )
+		return;
+
+	CREATEDEBUGTIMER( functionTimer );
+
+	STARTDEBUGTIMER( functionTimer );
+	DEBUGTIMERONLY( DevMsg( 2, "[PSDT:%d] %sCPortalSimulator::FinishAsyncPolyhedronCarve() START\n", GetPortalSimulatorGUID(), TABSPACING ); );
+	INCREMENTTABSPACING();
+
+	if( pCarve->pJob )
+		pCarve->pJob->WaitForFinishAndRelease();
+	m_pPendingPolyhedronCarve = NULL;
+
+	//IMPORTANT: Physics objects must be destroyed before their associated collision data or a fairly cryptic crash will ensue
+	ClearLinkedPhysics();
+	ClearLocalPhysics();
+	ClearLinkedCollision();
+	ClearLocalCollision();
+	ClearPolyhedrons();
+
+	PS_SD_Static_t &Static = m_InternalData.Simulation.Static;
+	PS_SD_Static_t &Result = pCarve->Result;
+
+	Static.World.Brushes.Polyhedrons.Swap( Result.World.Brushes.Polyhedrons );
+	Static.World.StaticProps.Polyhedrons.Swap( Result.World.StaticProps.Polyhedrons );
+	Static.World.StaticProps.ClippedRepresentations.Swap( Result.World.StaticProps.ClippedRepresentations );
+	Static.Wall.Local.Brushes.Polyhedrons.Swap( Result.Wall.Local.Brushes.Polyhedrons );
+	Static.Wall.Local.Tube.Polyhedrons.Swap( Result.Wall.Local.Tube.Polyhedrons );
+
+	m_CreationChecklist.bPolyhedronsGenerated = true;
+
+	if( !pCarve->bRestoredFromCache )
+		g_PortalCarvedPolyhedronCache.StoreCarvedPolyhedrons( pCarve->Placement.ptCenter, pCarve->Placement.qAngles, pCarve->vWorldSimBounds, pCarve->bCarveWall, Static );
+
+	delete pCarve;
+
+	//collideables are built here rather than on the job, the physics collision interface is main thread only
+	CreateAllCollision();
+	CreateAllPhysics();
+
+	STOPDEBUGTIMER( functionTimer );
+	DECREMENTTABSPACING();
+	DEBUGTIMERONLY( DevMsg( 2, "[PSDT:%d] %sCPortalSimulator::FinishAsyncPolyhedronCarve() FINISH: %fms\n", GetPortalSimulatorGUID(), TABSPACING, functionTimer.GetDuration().GetMillisecondsF() ); );
+}
+
+
+
+void CPortalSimulator::CancelAsyncPolyhedronCarve( void )
+{
+	PS_PolyhedronCarve_t *pCarve = m_pPendingPolyhedronCarve;
+	if( pCarve == NULL )
+		return;
+
+	m_pPendingPolyhedronCarve = NULL;
+
+	if( pCarve->pJob )
+	{
+		pCarve->pJob->Abort(); //does nothing if a thread already picked it up
+		pCarve->pJob->WaitForFinishAndRelease();
+	}
+
+	ReleaseCarvedPolyhedrons( pCarve->Result );
+	delete pCarve;
+}
+
+
+
 void CPortalSimulator::ClearPolyhedrons( void )
 {
 	if( m_CreationChecklist.bPolyhedronsGenerated == false )
@@ -2739,6 +3006,8 @@ void CPortalSimulator::SetVPhysicsSimulationEnabled( bool bEnabled )
 	DEBUGTIMERONLY( DevMsg( 2, "[PSDT:%d] %sCPortalSimulator::SetVPhysicsSimulationEnabled() START\n", GetPortalSimulatorGUID(), TABSPACING ); );
 	INCREMENTTABSPACING();
 	
+	FinishAsyncPolyhedronCarve(); //the carve in flight was made for the old setting, but at least it's the right placement
+
 	m_bSimulateVPhysics = bEnabled;
 	if( bEnabled )
 	{
@@ -2768,6 +3037,80 @@ void CPortalSimulator::SetVPhysicsSimulationEnabled( bool bEnabled )
 }
 
 
+CPortalSimulatorEntityFlagTable::CPortalSimulatorEntityFlagTable( void )
+{
+}
+
+CPortalSimulatorEntityFlagTable::~CPortalSimulatorEntityFlagTable( void )
+{
+	m_Slots.PurgeAndDeleteElements();
+}
+
+int CPortalSimulatorEntityFlagTable::AllocSimulatorSlot( void )
+{
+	for( int i = 0; i != m_Slots.Count(); ++i )
+	{
+		if( !m_Slots[i]->bInUse )
+		{
+			m_Slots[i]->bInUse = true;
+			return i;
+		}
+	}
+
+	SlotFlags_t *pSlot = new SlotFlags_t; //bit vectors start out clear
+	pSlot->bInUse = true;
+	return m_Slots.AddToTail( pSlot );
+}
+
+void CPortalSimulatorEntityFlagTable::FreeSimulatorSlot( int iSlot )
+{
+	SlotFlags_t *pSlot = m_Slots[iSlot];
+	Assert( pSlot->bInUse );
+
+	//the simulator should have let go of everything by now, but the next one to get this slot has to start out clean
+	for( int i = 0; i != PSEF_FLAG_COUNT; ++i )
+		pSlot->Planes[i].ClearAll();
+
+	pSlot->bInUse = false;
+}
+
+unsigned int CPortalSimulatorEntityFlagTable::GetFlags( int iSlot, int iEntIndex ) const
+{
+	const SlotFlags_t *pSlot = m_Slots[iSlot];
+	unsigned int iFlags = 0;
+	for( int i = 0; i != PSEF_FLAG_COUNT; ++i )
+	{
+		if( pSlot->Planes[i].IsBitSet( iEntIndex ) )
+			iFlags |= (1 << i);
+	}
+
+	return iFlags;
+}
+
+void CPortalSimulatorEntityFlagTable::SetFlags( int iSlot, int iEntIndex, unsigned int iFlags, unsigned int iMask )
+{
+	Assert( (iMask & ~PSEF_ALL_FLAGS) == 0 );
+	SlotFlags_t *pSlot = m_Slots[iSlot];
+	for( int i = 0; i != PSEF_FLAG_COUNT; ++i )
+	{
+		if( (iMask & (1 << i)) == 0 )
+			continue;
+
+		pSlot->Planes[i].Set( iEntIndex, (iFlags & (1 << i)) != 0 );
+	}
+}
+
+void CPortalSimulatorEntityFlagTable::ClearEntity( int iEntIndex )
+{
+	for( int i = m_Slots.Count(); --i >= 0; )
+	{
+		SlotFlags_t *pSlot = m_Slots[i];
+		for( int j = 0; j != PSEF_FLAG_COUNT; ++j )
+			pSlot->Planes[j].Clear( iEntIndex );
+	}
+}
+
+
 CPortalSimulator *CPortalSimulator::GetSimulatorThatOwnsEntity( const CBaseEntity *pEntity )
 {
 	if (!pEntity)
@@ -2782,7 +3125,7 @@ CPortalSimulator *CPortalSimulator::GetSimulatorThatOwnsEntity( const CBaseEntit
 
 	for( int i = s_PortalSimulators.Count(); --i >= 0; )
 	{
-		if( s_PortalSimulators[i]->m_InternalData.Simulation.Dynamic.EntFlags[iEntIndex] & PSEF_OWNS_ENTITY )
+		if( s_PortalSimulators[i]->OwnsEntity( pEntity ) )
 		{
 			AssertMsg( pOwningSimulatorCheck == NULL, "More than one portal simulator found owning the same entity." );
 			pOwningSimulatorCheck = s_PortalSimulators[i];
@@ -2806,6 +3149,9 @@ void CPortalSimulator::PrePhysFrame( void )
 		for( int i = 0; i != iPortalSimulators; ++i )
 		{
 			CPortalSimulator *pSimulator = pAllSimulators[i];
+			if( pSimulator->m_pPendingPolyhedronCarve && pSimulator->m_pPendingPolyhedronCarve->pJob->IsFinished() )
+				pSimulator->FinishAsyncPolyhedronCarve();
+
 			if( !pSimulator->IsReadyToSimulate() )
 				continue;
 
@@ -2825,16 +3171,16 @@ void CPortalSimulator::PrePhysFrame( void )
 					if( (pPhysObject == NULL) || pPhysObject->IsAsleep() )
 						continue;
 
-					int iEntIndex = pEntity->entindex();
-					int iExistingFlags = pSimulator->m_InternalData.Simulation.Dynamic.EntFlags[iEntIndex];
+					unsigned int iExistingFlags = pSimulator->GetEntityFlags( pEntity );
 					if( pSimulator->EntityIsInPortalHole( pEntity ) )
-						pSimulator->m_InternalData.Simulation.Dynamic.EntFlags[iEntIndex] |= PSEF_IS_IN_PORTAL_HOLE;
+						pSimulator->AddEntityFlags( pEntity, PSEF_IS_IN_PORTAL_HOLE );
 					else
-						pSimulator->m_InternalData.Simulation.Dynamic.EntFlags[iEntIndex] &= ~PSEF_IS_IN_PORTAL_HOLE;
+						pSimulator->RemoveEntityFlags( pEntity, PSEF_IS_IN_PORTAL_HOLE );
 
-					UpdateShadowClonesPortalSimulationFlags( pEntity, PSEF_IS_IN_PORTAL_HOLE, pSimulator->m_InternalData.Simulation.Dynamic.EntFlags[iEntIndex] );
+					unsigned int iNewFlags = pSimulator->GetEntityFlags( pEntity );
+					UpdateShadowClonesPortalSimulationFlags( pEntity, PSEF_IS_IN_PORTAL_HOLE, iNewFlags );
 
-					if( ((iExistingFlags ^ pSimulator->m_InternalData.Simulation.Dynamic.EntFlags[iEntIndex]) & PSEF_IS_IN_PORTAL_HOLE) != 0 ) //value changed
+					if( ((iExistingFlags ^ iNewFlags) & PSEF_IS_IN_PORTAL_HOLE) != 0 ) //value changed
 					{
 						pEntity->CollisionRulesChanged(); //entity moved into or out of the portal hole, need to either add or remove collision with transformed geometry
 
@@ -3151,10 +3497,7 @@ void CPortalSimulator::Pre_UTIL_Remove( CBaseEntity *pEntity )
 			s_PortalSimulators[i]->StopCloningEntity( pEntity );
 	}
 
-	for( int i = s_PortalSimulators.Count(); --i >= 0; )
-	{
-		s_PortalSimulators[i]->m_InternalData.Simulation.Dynamic.EntFlags[iEntIndex] = 0;
-	}
+	g_PortalSimulatorEntityFlags.ClearEntity( iEntIndex );
 
 
 	physenv = physenv_main;
@@ -3195,12 +3538,9 @@ void UpdateShadowClonesPortalSimulationFlags( const CBaseEntity *pSourceEntity,
 		CPhysicsShadowClone *pClone = pClones->pClone;
 		CPortalSimulator *pCloneSimulator = CPortalSimulator::GetSimulatorThatOwnsEntity( pClone );
 
-		unsigned int *pFlags = (unsigned int *)&pCloneSimulator->GetInternalData().Simulation.Dynamic.EntFlags[pClone->entindex()];
-				
-		*pFlags &= ~iFlags;
-		*pFlags |= iOrFlags;
+		g_PortalSimulatorEntityFlags.SetFlags( pCloneSimulator->GetEntityFlagSlot(), pClone->entindex(), iOrFlags, iFlags );
 		
-		Assert( ((iSourceFlags ^ *pFlags) & iFlags) == 0 );
+		Assert( ((iSourceFlags ^ pCloneSimulator->GetEntityFlags( pClone )) & iFlags) == 0 );
 
 		pClones = pClones->pNext;
 	}
@@ -3224,6 +3564,8 @@ public:
 	{
 		for( int i = s_PortalSimulators.Count(); --i >= 0; )
 			s_PortalSimulators[i]->ClearEverything();
+
+		CPhysicsShadowClone::ReleaseIdleClones();
 	}
 
 	virtual bool Init( void )
@@ -3287,7 +3629,7 @@ CPSCollisionEntity::~CPSCollisionEntity( void )
 {
 	if( m_pOwningSimulator )
 	{
-		m_pOwningSimulator->m_InternalData.Simulation.Dynamic.EntFlags[entindex()] &= ~PSEF_OWNS_PHYSICS;
+		m_pOwningSimulator->RemoveEntityFlags( this, PSEF_OWNS_PHYSICS );
 		m_pOwningSimulator->MarkAsReleased( this );
 		m_pOwningSimulator->m_InternalData.Simulation.hCollisionEntity = NULL;
 		m_pOwningSimulator = NULL;
@@ -3301,7 +3643,7 @@ void CPSCollisionEntity::UpdateOnRemove( void )
 	VPhysicsSetObject( NULL );
 	if( m_pOwningSimulator )
 	{
-		m_pOwningSimulator->m_InternalData.Simulation.Dynamic.EntFlags[entindex()] &= ~PSEF_OWNS_PHYSICS;
+		m_pOwningSimulator->RemoveEntityFlags( this, PSEF_OWNS_PHYSICS );
 		m_pOwningSimulator->MarkAsReleased( this );
 		m_pOwningSimulator->m_InternalData.Simulation.hCollisionEntity = NULL;
 		m_pOwningSimulator = NULL;
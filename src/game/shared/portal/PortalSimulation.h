@@ -16,7 +16,9 @@
 #include "const.h"
 #include "tier1/utlmap.h"
 #include "tier1/utlvector.h"
+#include "bitvec.h"
 #include "physicsshadowclone.h"
+#include "portal_collision_tree.h"
 
 #define PORTAL_SIMULATORS_EMBED_GUID //define this to embed a unique integer with each portal simulator for debugging purposes
 
@@ -35,6 +37,9 @@ enum PortalSimulationEntityFlags_t
 	//PSEF_HAS_LINKED_CLONE = (1 << 1), //this environment has a clone of the entity which is transformed from its linked portal
 };
 
+#define PSEF_FLAG_COUNT 4
+#define PSEF_ALL_FLAGS ((1 << PSEF_FLAG_COUNT) - 1)
+
 enum PS_PhysicsObjectSourceType_t
 {
 	PSPOST_LOCAL_BRUSHES,
@@ -234,6 +239,7 @@ struct PS_SD_Static_t //stuff that doesn't move around
 	PS_SD_Static_World_t World;
 	PS_SD_Static_Wall_t Wall;
 	PS_SD_Static_SurfaceProperties_t SurfaceProperties;
+	CPortalCollisionTree CollisionTree; //bounds of every polyhedron behind the local collideables, built along with them
 };
 #ifdef GAME_DLL
 class CPhysicsShadowClone;
@@ -252,19 +258,64 @@ struct PS_SD_Dynamic_PhysicsShadowClones_t
 
 struct PS_SD_Dynamic_t //stuff that moves around
 {
-	unsigned int EntFlags[MAX_EDICTS]; //flags maintained for every entity in the world based on its index
-
 	PS_SD_Dynamic_PhysicsShadowClones_t ShadowClones;
 
 	CUtlVector<CBaseEntity *> OwnedEntities;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: PortalSimulationEntityFlags_t for every simulator, stored as one
+//			entity indexed bitset per flag per simulator slot. Replaces a full
+//			MAX_EDICTS array of flag words in every simulator.
+//-----------------------------------------------------------------------------
+class CPortalSimulatorEntityFlagTable
+{
+public:
+	CPortalSimulatorEntityFlagTable( void );
+	~CPortalSimulatorEntityFlagTable( void );
+
+	int					AllocSimulatorSlot( void );
+	void				FreeSimulatorSlot( int iSlot );
+
+	unsigned int		GetFlags( int iSlot, int iEntIndex ) const;
+	inline bool			HasFlag( int iSlot, int iEntIndex, PortalSimulationEntityFlags_t flag ) const;
+	void				SetFlags( int iSlot, int iEntIndex, unsigned int iFlags, unsigned int iMask = PSEF_ALL_FLAGS ); //replaces the flags in iMask with the ones in iFlags
+	inline void			AddFlags( int iSlot, int iEntIndex, unsigned int iFlags ) { SetFlags( iSlot, iEntIndex, iFlags, iFlags ); }
+	inline void			RemoveFlags( int iSlot, int iEntIndex, unsigned int iFlags ) { SetFlags( iSlot, iEntIndex, 0, iFlags ); }
 
-	PS_SD_Dynamic_t()
+	void				ClearEntity( int iEntIndex ); //wipes the flags every simulator has for an entity index
+
+private:
+	static inline int	FlagToPlane( PortalSimulationEntityFlags_t flag );
+
+	struct SlotFlags_t
 	{
-		memset( EntFlags, 0, sizeof( EntFlags ) );
-	}
+		CBitVec<MAX_EDICTS> Planes[PSEF_FLAG_COUNT];
+		bool bInUse;
+	};
+
+	CUtlVector<SlotFlags_t *> m_Slots;
 };
 
+inline int CPortalSimulatorEntityFlagTable::FlagToPlane( PortalSimulationEntityFlags_t flag )
+{
+	Assert( (flag != 0) && ((flag & (flag - 1)) == 0) && ((flag & PSEF_ALL_FLAGS) == flag) ); //one flag at a time
+	int iPlane = 0;
+	while( (1 << iPlane) != flag )
+		++iPlane;
+
+	return iPlane;
+}
+
+inline bool CPortalSimulatorEntityFlagTable::HasFlag( int iSlot, int iEntIndex, PortalSimulationEntityFlags_t flag ) const
+{
+	return m_Slots[iSlot]->Planes[FlagToPlane( flag )].IsBitSet( iEntIndex );
+}
+
+extern CPortalSimulatorEntityFlagTable g_PortalSimulatorEntityFlags;
+
 class CPortalSimulator;
+struct PS_PolyhedronCarve_t;
 
 
 class CPSCollisionEntity : public CBaseEntity
@@ -378,7 +429,7 @@ public:
 
 	void				SetPortalSimulatorCallbacks( CPortalSimulatorEventCallbacks *pCallbacks );
 	
-	bool				IsReadyToSimulate( void ) const; //is active and linked to another portal
+	bool				IsReadyToSimulate( void ) const; //is active, linked to another portal, and neither side is waiting on a collision carve
 	
 	void				SetCollisionGenerationEnabled( bool bEnabled ); //enable/disable collision generation for the hole in the wall, needed for proper vphysics simulation
 	bool				IsCollisionGenerationEnabled( void ) const;
@@ -404,6 +455,8 @@ public:
 	void				ReleaseAllEntityOwnership( void ); //go back to not owning any entities
 
 	bool				OwnsEntity( const CBaseEntity *pEntity ) const;
+	unsigned int		GetEntityFlags( const CBaseEntity *pEntity ) const; //PortalSimulationEntityFlags_t this simulator has for the entity
+	int					GetEntityFlagSlot( void ) const { return m_iEntityFlagSlot; } //for walking g_PortalSimulatorEntityFlags directly
 	
 	//--------------------------------------------------
 	//--------------------------------------------------
@@ -443,6 +496,8 @@ protected:
 	CPortalSimulator	*m_pLinkedPortal;
 	bool				m_bInCrossLinkedFunction; //A flag to mark that we're already in a linked function and that the linked portal shouldn't call our side
 	CPortalSimulatorEventCallbacks *m_pCallbacks; 
+	int					m_iEntityFlagSlot; //slot in g_PortalSimulatorEntityFlags
+	PS_PolyhedronCarve_t *m_pPendingPolyhedronCarve; //carve running on a job thread, NULL when there isn't one
 #ifdef PORTAL_SIMULATORS_EMBED_GUID
 	int					m_iPortalSimulatorGUID;
 #endif
@@ -487,11 +542,19 @@ protected:
 	void				CreatePolyhedrons( void ); //carves up the world around the portal's position into sets of polyhedrons
 	void				ClearPolyhedrons( void );
 
+	void				GatherPolyhedronSources( PS_PolyhedronCarve_t &Carve ); //finds the brushes and static props a carve will cut up, main thread only
+	void				StartAsyncPolyhedronCarve( void ); //carves and builds local collideables on a job thread
+	void				FinishAsyncPolyhedronCarve( void ); //waits on the pending carve if needed and swaps it in for the current collision
+	void				CancelAsyncPolyhedronCarve( void ); //throws away the pending carve
+
 	void				UpdateLinkMatrix( void );
 
 	void				MarkAsOwned( CBaseEntity *pEntity );
 	void				MarkAsReleased( CBaseEntity *pEntity );
 
+	inline void			AddEntityFlags( const CBaseEntity *pEntity, unsigned int iFlags );
+	inline void			RemoveEntityFlags( const CBaseEntity *pEntity, unsigned int iFlags );
+
 	//PS_InternalData_t m_InternalData;
 
 #ifdef GAME_DLL
@@ -519,17 +582,34 @@ extern CUtlVector<CPortalSimulator *> const &g_PortalSimulators;
 
 inline bool CPortalSimulator::OwnsEntity( const CBaseEntity *pEntity ) const
 {
-	return ((m_InternalData.Simulation.Dynamic.EntFlags[pEntity->entindex()] & PSEF_OWNS_ENTITY) != 0);
+	return g_PortalSimulatorEntityFlags.HasFlag( m_iEntityFlagSlot, pEntity->entindex(), PSEF_OWNS_ENTITY );
 }
 
 inline bool CPortalSimulator::OwnsPhysicsForEntity( const CBaseEntity *pEntity ) const
 {
-	return ((m_InternalData.Simulation.Dynamic.EntFlags[pEntity->entindex()] & PSEF_OWNS_PHYSICS) != 0);
+	return g_PortalSimulatorEntityFlags.HasFlag( m_iEntityFlagSlot, pEntity->entindex(), PSEF_OWNS_PHYSICS );
+}
+
+inline unsigned int CPortalSimulator::GetEntityFlags( const CBaseEntity *pEntity ) const
+{
+	return g_PortalSimulatorEntityFlags.GetFlags( m_iEntityFlagSlot, pEntity->entindex() );
+}
+
+inline void CPortalSimulator::AddEntityFlags( const CBaseEntity *pEntity, unsigned int iFlags )
+{
+	g_PortalSimulatorEntityFlags.AddFlags( m_iEntityFlagSlot, pEntity->entindex(), iFlags );
+}
+
+inline void CPortalSimulator::RemoveEntityFlags( const CBaseEntity *pEntity, unsigned int iFlags )
+{
+	g_PortalSimulatorEntityFlags.RemoveFlags( m_iEntityFlagSlot, pEntity->entindex(), iFlags );
 }
 
 inline bool CPortalSimulator::IsReadyToSimulate( void ) const
 {
-	return m_bLocalDataIsReady && m_pLinkedPortal && m_pLinkedPortal->m_bLocalDataIsReady;
+	//while a carve is in flight the collision still describes the old placement on that side, simulating against it lets things fall through walls
+	return m_bLocalDataIsReady && (m_pPendingPolyhedronCarve == NULL) &&
+		m_pLinkedPortal && m_pLinkedPortal->m_bLocalDataIsReady && (m_pLinkedPortal->m_pPendingPolyhedronCarve == NULL);
 }
 
 inline bool CPortalSimulator::IsSimulatingVPhysics( void ) const
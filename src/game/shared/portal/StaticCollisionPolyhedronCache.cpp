@@ -9,6 +9,7 @@
 #include "StaticCollisionPolyhedronCache.h"
 #include "engine/IEngineTrace.h"
 #include "edict.h"
+#include "PortalSimulation.h"
 
 #include "tier0/memdbgon.h"
 
@@ -481,5 +482,212 @@ int CStaticCollisionPolyhedronCache::GetStaticPropPolyhedrons( ICollideable *pSt
 
 
 
+ConVar sv_portal_carved_polyhedron_cache( "sv_portal_carved_polyhedron_cache", "1", FCVAR_REPLICATED | FCVAR_CHEAT, "Reuse carved portal collision polyhedrons when a portal is placed somewhere it has been placed before." );
+ConVar sv_portal_carved_polyhedron_cache_size( "sv_portal_carved_polyhedron_cache_size", "64", FCVAR_REPLICATED | FCVAR_CHEAT, "Maximum number of portal placements to keep carved polyhedrons for." );
 
+#define PORTAL_CARVE_CACHE_ORIGIN_QUANTIZE 16.0f //1/16th unit
+#define PORTAL_CARVE_CACHE_ANGLE_QUANTIZE 64.0f //1/64th degree
 
+CPortalCarvedPolyhedronCache g_PortalCarvedPolyhedronCache;
+
+static CPolyhedron *CopyPolyhedron( const CPolyhedron *pSource )
+{
+	CPolyhedron *pCopy = CPolyhedron_AllocByNew::Allocate( pSource->iVertexCount, pSource->iLineCount, pSource->iIndexCount, pSource->iPolygonCount );
+
+	memcpy( pCopy->pVertices, pSource->pVertices, sizeof( Vector ) * pSource->iVertexCount );
+	memcpy( pCopy->pLines, pSource->pLines, sizeof( Polyhedron_IndexedLine_t ) * pSource->iLineCount );
+	memcpy( pCopy->pIndices, pSource->pIndices, sizeof( Polyhedron_IndexedLineReference_t ) * pSource->iIndexCount );
+	memcpy( pCopy->pPolygons, pSource->pPolygons, sizeof( Polyhedron_IndexedPolygon_t ) * pSource->iPolygonCount );
+
+	return pCopy;
+}
+
+static void CopyPolyhedronList( const CUtlVector<CPolyhedron *> &Source, CUtlVector<CPolyhedron *> &Dest )
+{
+	Dest.EnsureCapacity( Dest.Count() + Source.Count() );
+	for( int i = 0; i != Source.Count(); ++i )
+		Dest.AddToTail( CopyPolyhedron( Source[i] ) );
+}
+
+static void ReleasePolyhedronList( CUtlVector<CPolyhedron *> &List )
+{
+	for( int i = List.Count(); --i >= 0; )
+		List[i]->Release();
+
+	List.RemoveAll();
+}
+
+static void QuantizePlacement( const Vector &ptCenter, const QAngle &qAngles, int *pQuantizedOut )
+{
+	pQuantizedOut[0] = RoundFloatToInt( ptCenter.x * PORTAL_CARVE_CACHE_ORIGIN_QUANTIZE );
+	pQuantizedOut[1] = RoundFloatToInt( ptCenter.y * PORTAL_CARVE_CACHE_ORIGIN_QUANTIZE );
+	pQuantizedOut[2] = RoundFloatToInt( ptCenter.z * PORTAL_CARVE_CACHE_ORIGIN_QUANTIZE );
+	pQuantizedOut[3] = RoundFloatToInt( qAngles.x * PORTAL_CARVE_CACHE_ANGLE_QUANTIZE );
+	pQuantizedOut[4] = RoundFloatToInt( qAngles.y * PORTAL_CARVE_CACHE_ANGLE_QUANTIZE );
+	pQuantizedOut[5] = RoundFloatToInt( qAngles.z * PORTAL_CARVE_CACHE_ANGLE_QUANTIZE );
+}
+
+CPortalCarvedPolyhedronCache::CPortalCarvedPolyhedronCache( void )
+: m_iUseCounter( 0 )
+{
+
+}
+
+CPortalCarvedPolyhedronCache::~CPortalCarvedPolyhedronCache( void )
+{
+	Clear();
+}
+
+void CPortalCarvedPolyhedronCache::LevelInitPreEntity( void )
+{
+	//the carves are only valid for the map geometry they were cut from
+	Clear();
+}
+
+void CPortalCarvedPolyhedronCache::LevelShutdownPostEntity( void )
+{
+	Clear();
+}
+
+void CPortalCarvedPolyhedronCache::Shutdown( void )
+{
+	Clear();
+}
+
+void CPortalCarvedPolyhedronCache::Clear( void )
+{
+	for( int i = m_Placements.Count(); --i >= 0; )
+		FreePlacement( m_Placements[i] );
+
+	m_Placements.RemoveAll();
+	m_iUseCounter = 0;
+}
+
+void CPortalCarvedPolyhedronCache::FreePlacement( CarvedPlacement_t *pPlacement )
+{
+	ReleasePolyhedronList( pPlacement->WorldBrushes );
+	ReleasePolyhedronList( pPlacement->WorldStaticProps );
+	ReleasePolyhedronList( pPlacement->WallTube );
+	ReleasePolyhedronList( pPlacement->WallBrushes );
+	delete pPlacement;
+}
+
+int CPortalCarvedPolyhedronCache::FindPlacement( const Vector &ptCenter, const QAngle &qAngles, const Vector &vWorldBounds, bool bCarvedWallBrushes ) const
+{
+	int iQuantized[6];
+	QuantizePlacement( ptCenter, qAngles, iQuantized );
+
+	for( int i = m_Placements.Count(); --i >= 0; )
+	{
+		const CarvedPlacement_t *pPlacement = m_Placements[i];
+		if( memcmp( pPlacement->iQuantizedPlacement, iQuantized, sizeof( iQuantized ) ) != 0 )
+			continue;
+
+		//same grid cell, but the carve has to come from the exact same spot to line up with the hole
+		if( (pPlacement->ptCenter == ptCenter) &&
+			(pPlacement->qAngles == qAngles) &&
+			(pPlacement->vWorldBounds == vWorldBounds) &&
+			(pPlacement->bCarvedWallBrushes == bCarvedWallBrushes) )
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+bool CPortalCarvedPolyhedronCache::RestoreCarvedPolyhedrons( const Vector &ptCenter, const QAngle &qAngles, const Vector &vWorldBounds, bool bCarvedWallBrushes, PS_SD_Static_t &StaticOut )
+{
+	if( !sv_portal_carved_polyhedron_cache.GetBool() )
+		return false;
+
+	int iPlacement = FindPlacement( ptCenter, qAngles, vWorldBounds, bCarvedWallBrushes );
+	if( iPlacement == -1 )
+		return false;
+
+	CarvedPlacement_t *pPlacement = m_Placements[iPlacement];
+	pPlacement->iLastUsed = ++m_iUseCounter;
+
+	Assert( StaticOut.World.Brushes.Polyhedrons.Count() == 0 );
+	Assert( StaticOut.World.StaticProps.Polyhedrons.Count() == 0 );
+	Assert( StaticOut.Wall.Local.Tube.Polyhedrons.Count() == 0 );
+	Assert( StaticOut.Wall.Local.Brushes.Polyhedrons.Count() == 0 );
+
+	CopyPolyhedronList( pPlacement->WorldBrushes, StaticOut.World.Brushes.Polyhedrons );
+	CopyPolyhedronList( pPlacement->WorldStaticProps, StaticOut.World.StaticProps.Polyhedrons );
+	CopyPolyhedronList( pPlacement->WallTube, StaticOut.Wall.Local.Tube.Polyhedrons );
+	CopyPolyhedronList( pPlacement->WallBrushes, StaticOut.Wall.Local.Brushes.Polyhedrons );
+
+	for( int i = 0; i != pPlacement->ClippedStaticProps.Count(); ++i )
+	{
+		const ClippedStaticProp_t &cachedProp = pPlacement->ClippedStaticProps[i];
+
+		int index = StaticOut.World.StaticProps.ClippedRepresentations.AddToTail();
+		PS_SD_Static_World_StaticProps_ClippedProp_t &NewEntry = StaticOut.World.StaticProps.ClippedRepresentations[index];
+
+		NewEntry.PolyhedronGroup.iStartIndex = cachedProp.iStartIndex;
+		NewEntry.PolyhedronGroup.iNumPolyhedrons = cachedProp.iNumPolyhedrons;
+		NewEntry.pCollide = NULL;
+		NewEntry.pPhysicsObject = NULL;
+		NewEntry.pSourceProp = cachedProp.pSourceProp;
+		NewEntry.iTraceContents = cachedProp.iTraceContents;
+		NewEntry.iTraceSurfaceProps = cachedProp.iTraceSurfaceProps;
+	}
+
+	return true;
+}
+
+void CPortalCarvedPolyhedronCache::StoreCarvedPolyhedrons( const Vector &ptCenter, const QAngle &qAngles, const Vector &vWorldBounds, bool bCarvedWallBrushes, const PS_SD_Static_t &Static )
+{
+	if( !sv_portal_carved_polyhedron_cache.GetBool() )
+		return;
+
+	int iMaxPlacements = sv_portal_carved_polyhedron_cache_size.GetInt();
+	if( iMaxPlacements <= 0 )
+		return;
+
+	if( FindPlacement( ptCenter, qAngles, vWorldBounds, bCarvedWallBrushes ) != -1 )
+		return;
+
+	//evict the least recently used placements to make room
+	while( m_Placements.Count() >= iMaxPlacements )
+	{
+		int iOldest = 0;
+		for( int i = 1; i < m_Placements.Count(); ++i )
+		{
+			if( m_Placements[i]->iLastUsed < m_Placements[iOldest]->iLastUsed )
+				iOldest = i;
+		}
+
+		FreePlacement( m_Placements[iOldest] );
+		m_Placements.FastRemove( iOldest );
+	}
+
+	CarvedPlacement_t *pPlacement = new CarvedPlacement_t;
+	QuantizePlacement( ptCenter, qAngles, pPlacement->iQuantizedPlacement );
+	pPlacement->ptCenter = ptCenter;
+	pPlacement->qAngles = qAngles;
+	pPlacement->vWorldBounds = vWorldBounds;
+	pPlacement->bCarvedWallBrushes = bCarvedWallBrushes;
+	pPlacement->iLastUsed = ++m_iUseCounter;
+
+	CopyPolyhedronList( Static.World.Brushes.Polyhedrons, pPlacement->WorldBrushes );
+	CopyPolyhedronList( Static.World.StaticProps.Polyhedrons, pPlacement->WorldStaticProps );
+	CopyPolyhedronList( Static.Wall.Local.Tube.Polyhedrons, pPlacement->WallTube );
+	CopyPolyhedronList( Static.Wall.Local.Brushes.Polyhedrons, pPlacement->WallBrushes );
+
+	pPlacement->ClippedStaticProps.EnsureCapacity( Static.World.StaticProps.ClippedRepresentations.Count() );
+	for( int i = 0; i != Static.World.StaticProps.ClippedRepresentations.Count(); ++i )
+	{
+		const PS_SD_Static_World_StaticProps_ClippedProp_t &clippedProp = Static.World.StaticProps.ClippedRepresentations[i];
+
+		ClippedStaticProp_t &cachedProp = pPlacement->ClippedStaticProps[pPlacement->ClippedStaticProps.AddToTail()];
+		cachedProp.iStartIndex = clippedProp.PolyhedronGroup.iStartIndex;
+		cachedProp.iNumPolyhedrons = clippedProp.PolyhedronGroup.iNumPolyhedrons;
+		cachedProp.pSourceProp = clippedProp.pSourceProp;
+		cachedProp.iTraceContents = clippedProp.iTraceContents;
+		cachedProp.iTraceSurfaceProps = clippedProp.iTraceSurfaceProps;
+	}
+
+	m_Placements.AddToTail( pPlacement );
+}
@@ -50,3 +50,59 @@ private:
 };
 
 extern CStaticCollisionPolyhedronCache g_StaticCollisionPolyhedronCache;
+
+
+
+struct PS_SD_Static_t;
+
+//Portal placements tend to repeat (floor tiles, puzzle spots, etc). This caches the carved world and wall polyhedrons
+//for recent placements so CPortalSimulator::CreatePolyhedrons() can skip the brush gathering and clipping work.
+class CPortalCarvedPolyhedronCache : public CAutoGameSystem
+{
+public:
+	CPortalCarvedPolyhedronCache( void );
+	~CPortalCarvedPolyhedronCache( void );
+
+	void LevelInitPreEntity( void );
+	void LevelShutdownPostEntity( void );
+	void Shutdown( void );
+
+	//fills the polyhedron lists of StaticOut with copies of the cached carve. Returns false on a cache miss
+	bool RestoreCarvedPolyhedrons( const Vector &ptCenter, const QAngle &qAngles, const Vector &vWorldBounds, bool bCarvedWallBrushes, PS_SD_Static_t &StaticOut );
+	void StoreCarvedPolyhedrons( const Vector &ptCenter, const QAngle &qAngles, const Vector &vWorldBounds, bool bCarvedWallBrushes, const PS_SD_Static_t &Static );
+
+private:
+	struct ClippedStaticProp_t
+	{
+		int iStartIndex;
+		int iNumPolyhedrons;
+		IHandleEntity *pSourceProp;
+		int iTraceContents;
+		short iTraceSurfaceProps;
+	};
+
+	struct CarvedPlacement_t
+	{
+		int iQuantizedPlacement[6]; //quick rejection, origin and angles snapped to a grid
+		Vector ptCenter; //exact placement, the carve is only reused when these match
+		QAngle qAngles;
+		Vector vWorldBounds;
+		bool bCarvedWallBrushes;
+		unsigned int iLastUsed;
+
+		CUtlVector<CPolyhedron *> WorldBrushes;
+		CUtlVector<CPolyhedron *> WorldStaticProps;
+		CUtlVector<ClippedStaticProp_t> ClippedStaticProps;
+		CUtlVector<CPolyhedron *> WallTube;
+		CUtlVector<CPolyhedron *> WallBrushes;
+	};
+
+	int FindPlacement( const Vector &ptCenter, const QAngle &qAngles, const Vector &vWorldBounds, bool bCarvedWallBrushes ) const;
+	void FreePlacement( CarvedPlacement_t *pPlacement );
+	void Clear( void );
+
+	CUtlVector<CarvedPlacement_t *> m_Placements;
+	unsigned int m_iUseCounter;
+};
+
+extern CPortalCarvedPolyhedronCache g_PortalCarvedPolyhedronCache;
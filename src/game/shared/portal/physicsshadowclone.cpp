@@ -21,12 +21,15 @@
 #endif
 
 #include "PortalSimulation.h"
+#include "portal_simulator_profiling.h"
 
 #define MAX_SHADOW_CLONE_COUNT 200
 
 static int g_iShadowCloneCount = 0;
 ConVar sv_debug_physicsshadowclones("sv_debug_physicsshadowclones", "0", FCVAR_REPLICATED );
 ConVar sv_use_shadow_clones( "sv_use_shadow_clones", "1", FCVAR_REPLICATED | FCVAR_CHEAT ); //should we create shadow clones?
+ConVar sv_shadowclone_pool_size( "sv_shadowclone_pool_size", "16", FCVAR_REPLICATED | FCVAR_CHEAT ); //how many freed clones to keep around for reuse
+ConVar sv_shadowclone_incremental_sync( "sv_shadowclone_incremental_sync", "1", FCVAR_REPLICATED | FCVAR_CHEAT ); //skip per-frame syncs of cloned objects that haven't changed
 
 static void DrawDebugOverlayForShadowClone( CPhysicsShadowClone *pClone );
 
@@ -37,6 +40,7 @@ LINK_ENTITY_TO_CLASS( physicsshadowclone, CPhysicsShadowClone );
 #endif
 
 static CUtlVector<CPhysicsShadowClone *> s_ActiveShadowClones;
+static CUtlVector<CPhysicsShadowClone *> s_IdleShadowClones; //freed clones kept alive with their physics objects, reused for entities with the same collision models
 CUtlVector<CPhysicsShadowClone *> const &CPhysicsShadowClone::g_ShadowCloneList = s_ActiveShadowClones;
 #ifdef GAME_DLL
 static bool s_IsShadowClone[MAX_EDICTS] = { false };
@@ -94,6 +98,7 @@ CPhysicsShadowClone::~CPhysicsShadowClone( void )
 	VPhysicsSetObject( NULL );
 	m_hClonedEntity = NULL;
 	s_ActiveShadowClones.FindAndRemove( this ); //also removed in UpdateOnRemove()
+	s_IdleShadowClones.FindAndRemove( this );
 #ifdef GAME_DLL
 	Assert( s_IsShadowClone[entindex()] == true );
 	s_IsShadowClone[entindex()] = false;
@@ -103,7 +108,7 @@ CPhysicsShadowClone::~CPhysicsShadowClone( void )
 #endif
 }
 
-void CPhysicsShadowClone::UpdateOnRemove( void )
+void CPhysicsShadowClone::UnlinkFromClonedEntity( void )
 {
 	CBaseEntity *pSource = m_hClonedEntity;
 	if( pSource )
@@ -130,6 +135,20 @@ void CPhysicsShadowClone::UpdateOnRemove( void )
 		}
 		s_SCLLManager.Free( pFind );
 	}
+}
+
+void CPhysicsShadowClone::UpdateOnRemove( void )
+{
+	if( s_IdleShadowClones.FindAndRemove( this ) )
+	{
+		//pooled clones still count against the clone limit until they're really gone
+		--g_iShadowCloneCount;
+	}
+
+	if( m_hClonedEntity.Get() )
+	{
+		UnlinkFromClonedEntity();
+	}
 #ifdef _DEBUG
 	else
 	{
@@ -170,6 +189,7 @@ void CPhysicsShadowClone::Spawn( void )
 void CPhysicsShadowClone::FullSync( bool bAllowAssumedSync )
 {
 	Assert( IsMarkedForDeletion() == false );
+	PORTAL_SIMULATOR_PROFILE_SCOPE( PSPP_CLONE_SYNC, "CPhysicsShadowClone::FullSync" );
 
 	CBaseEntity *pClonedEntity = m_hClonedEntity.Get();
 
@@ -594,6 +614,49 @@ static void FullSyncPhysicsObject( IPhysicsObject *pSource, IPhysicsObject *pDes
 	//pDest->RecheckContactPoints();
 }
 
+static void RecordSyncedState( PhysicsObjectCloneLink_t &link )
+{
+	link.pSource->GetPosition( &link.ptSyncedSourceOrigin, &link.qSyncedSourceAngles );
+	link.pSource->GetVelocity( &link.vSyncedSourceVelocity, &link.vSyncedSourceAngularVelocity );
+	link.pClone->GetPosition( &link.ptSyncedCloneOrigin, &link.qSyncedCloneAngles );
+	link.iSyncedSourceGameFlags = link.pSource->GetGameFlags();
+	link.bSyncedStateValid = true;
+}
+
+//returns true if syncing this link would do more than rewrite the values the clone already has
+static bool NeedsSync( const PhysicsObjectCloneLink_t &link )
+{
+	if( !link.bSyncedStateValid )
+		return true;
+
+	IPhysicsObject *pSource = link.pSource;
+	IPhysicsObject *pClone = link.pClone;
+
+	//shadow controllers and held objects chase a target that changes without the source moving, they always need an update
+	if( (pSource->GetShadowController() != NULL) || (pSource->GetGameFlags() != link.iSyncedSourceGameFlags) || (link.iSyncedSourceGameFlags & FVPHYSICS_PLAYER_HELD) )
+		return true;
+
+	if( (pSource->IsCollisionEnabled() != pClone->IsCollisionEnabled()) || (pSource->IsMotionEnabled() != pClone->IsMotionEnabled()) )
+		return true;
+
+	Vector ptOrigin;
+	QAngle qAngles;
+	pSource->GetPosition( &ptOrigin, &qAngles );
+	if( (ptOrigin != link.ptSyncedSourceOrigin) || (qAngles != link.qSyncedSourceAngles) )
+		return true; //sleeping objects can still get teleported, so the position is checked either way
+
+	pClone->GetPosition( &ptOrigin, &qAngles );
+	if( (ptOrigin != link.ptSyncedCloneOrigin) || (qAngles != link.qSyncedCloneAngles) )
+		return true;
+
+	if( pSource->IsAsleep() )
+		return !pClone->IsAsleep();
+
+	Vector vVelocity, vAngularVelocity;
+	pSource->GetVelocity( &vVelocity, &vAngularVelocity );
+	return ( (vVelocity != link.vSyncedSourceVelocity) || (vAngularVelocity != link.vSyncedSourceAngularVelocity) );
+}
+
 static void PartialSyncPhysicsObject( IPhysicsObject *pSource, IPhysicsObject *pDest, const VMatrix *pTransform )
 {
 	Vector ptOrigin, vVelocity, vAngularVelocity, vInertia;
@@ -669,9 +732,34 @@ void CPhysicsShadowClone::FullSyncClonedPhysicsObjects( bool bTeleport )
 
 		if( i == iObjectCount ) //no changes
 		{
+			if( bTeleport || !sv_shadowclone_incremental_sync.GetBool() )
+			{
+				for( i = 0; i != iObjectCount; ++i )
+				{
+					FullSyncPhysicsObject( m_CloneLinks[i].pSource, m_CloneLinks[i].pClone, pTransform, bTeleport );
+					RecordSyncedState( m_CloneLinks[i] );
+				}
+
+				return;
+			}
+
+			//gather the links that actually changed first so the sync pass only touches moving objects
+			int *pDirtyLinks = (int *)stackalloc( sizeof( int ) * iObjectCount );
+			int iDirtyCount = 0;
 			for( i = 0; i != iObjectCount; ++i )
-				FullSyncPhysicsObject( m_CloneLinks[i].pSource, m_CloneLinks[i].pClone, pTransform, bTeleport );
+			{
+				if( NeedsSync( m_CloneLinks[i] ) )
+					pDirtyLinks[iDirtyCount++] = i;
+			}
 
+			for( i = 0; i != iDirtyCount; ++i )
+			{
+				PhysicsObjectCloneLink_t &link = m_CloneLinks[pDirtyLinks[i]];
+				FullSyncPhysicsObject( link.pSource, link.pClone, pTransform, false );
+				RecordSyncedState( link );
+			}
+
+			stackfree( pDirtyLinks );
 			return;
 		}
 	}
@@ -734,6 +822,7 @@ void CPhysicsShadowClone::FullSyncClonedPhysicsObjects( bool bTeleport )
 		}
 
 		FullSyncPhysicsObject( cloneLink.pSource, cloneLink.pClone, pTransform, bTeleport );
+		RecordSyncedState( cloneLink );
 
 		//cloneLink.pClone->Wake();
 
@@ -777,6 +866,8 @@ void CPhysicsShadowClone::FullSyncClonedPhysicsObjects( bool bTeleport )
 
 void CPhysicsShadowClone::PartialSync( bool bPullChanges )
 {
+	PORTAL_SIMULATOR_PROFILE_SCOPE( PSPP_CLONE_SYNC, "CPhysicsShadowClone::PartialSync" );
+
 	VMatrix *pTransform;
 	
 	if( bPullChanges )
@@ -1005,22 +1096,62 @@ CPhysicsShadowClone *CPhysicsShadowClone::CreateShadowClone( IPhysicsEnvironment
 		return NULL;
 	}*/
 
-	// Too many shadow clones breaks the game (too many entities)
-	if( g_iShadowCloneCount >= MAX_SHADOW_CLONE_COUNT )
+	//look for a pooled clone that already has physics objects built from the same collision models
+	CPhysicsShadowClone *pClone = NULL;
 	{
-		AssertMsg( false, "Too many shadow clones, consider upping the limit or reducing the level's physics props" );
-		return NULL;
+		IPhysicsObject *pSourceObjects[1024];
+		int iSourceObjectCount = pClonedEntity->VPhysicsGetObjectList( pSourceObjects, 1024 );
+
+		for( int i = s_IdleShadowClones.Count(); --i >= 0; )
+		{
+			if( s_IdleShadowClones[i]->CanReuseForEntity( pInPhysicsEnvironment, pSourceObjects, iSourceObjectCount ) )
+			{
+				pClone = s_IdleShadowClones[i];
+				s_IdleShadowClones.Remove( i ); //keep the rest in least recently freed order for eviction
+
+				//point the existing links at the new source, the full sync on spawn takes care of everything else
+				for( int j = 0; j != iSourceObjectCount; ++j )
+				{
+					pClone->m_CloneLinks[j].pSource = pSourceObjects[j];
+					pClone->m_CloneLinks[j].bSyncedStateValid = false;
+				}
+				break;
+			}
+		}
 	}
-	++g_iShadowCloneCount;
+
+	if( pClone == NULL )
+	{
+		// Too many shadow clones breaks the game (too many entities)
+		if( (g_iShadowCloneCount >= MAX_SHADOW_CLONE_COUNT) && (s_IdleShadowClones.Count() != 0) )
+		{
+			//make room by getting rid of the clone that's been idle the longest
+			CPhysicsShadowClone *pEvict = s_IdleShadowClones[0];
+			s_IdleShadowClones.Remove( 0 );
+			pEvict->DestroyEntity();
+		}
+
+		if( g_iShadowCloneCount >= MAX_SHADOW_CLONE_COUNT )
+		{
+			AssertMsg( false, "Too many shadow clones, consider upping the limit or reducing the level's physics props" );
+			return NULL;
+		}
+		++g_iShadowCloneCount;
 
 #ifdef GAME_DLL
-	CPhysicsShadowClone *pClone = (CPhysicsShadowClone*)CreateEntityByName("physicsshadowclone");
+		pClone = (CPhysicsShadowClone*)CreateEntityByName("physicsshadowclone");
 #else
-	CPhysicsShadowClone *pClone = new CPhysicsShadowClone();
+		pClone = new CPhysicsShadowClone();
 #endif
 #ifdef GAME_DLL
-	s_IsShadowClone[pClone->entindex()] = true;
+		s_IsShadowClone[pClone->entindex()] = true;
 #endif
+	}
+	else
+	{
+		s_ActiveShadowClones.AddToTail( pClone );
+	}
+
 	pClone->m_pOwnerPhysEnvironment = pInPhysicsEnvironment;
 	pClone->m_hClonedEntity = hEntToClone;
 	DBG_CODE_NOSCOPE( pClone->m_szDebugMarker = szDebugMarker; );
@@ -1043,6 +1174,21 @@ CPhysicsShadowClone *CPhysicsShadowClone::CreateShadowClone( IPhysicsEnvironment
 			}
 		}
 	}
+	else
+	{
+		//pooled clones may still have a transform from their previous life
+		pClone->m_matrixShadowTransform.Identity();
+		pClone->m_matrixShadowTransform_Inverse.Identity();
+		pClone->m_bShadowTransformIsIdentity = true;
+	}
+
+	if( pClone->m_CloneLinks.Count() != 0 )
+	{
+		//reused from the pool, already spawned
+		pClone->FullSync( false );
+		pClone->m_bInAssumedSyncState = false;
+		return pClone;
+	}
 
 #ifdef GAME_DLL
 	DispatchSpawn( pClone );
@@ -1053,7 +1199,62 @@ CPhysicsShadowClone *CPhysicsShadowClone::CreateShadowClone( IPhysicsEnvironment
 	return pClone;
 }
 
+bool CPhysicsShadowClone::CanReuseForEntity( IPhysicsEnvironment *pPhysicsEnvironment, IPhysicsObject **pSourceObjects, int iSourceObjectCount ) const
+{
+	if( (m_pOwnerPhysEnvironment != pPhysicsEnvironment) || (m_CloneLinks.Count() != iSourceObjectCount) )
+		return false;
+
+	for( int i = 0; i != iSourceObjectCount; ++i )
+	{
+		if( (pSourceObjects[i] == NULL) || (pSourceObjects[i]->GetCollide() != m_CloneLinks[i].pClone->GetCollide()) )
+			return false;
+	}
+
+	return true;
+}
+
+bool CPhysicsShadowClone::ReturnToPool( void )
+{
+	if( (m_CloneLinks.Count() == 0) || (s_IdleShadowClones.Count() >= sv_shadowclone_pool_size.GetInt()) || IsMarkedForDeletion() )
+		return false;
+
+	UnlinkFromClonedEntity();
+	m_hClonedEntity = NULL;
+	s_ActiveShadowClones.FindAndRemove( this );
+
+	//keep the physics objects, but make sure nothing in the environment can touch them until we're reused
+	for( int i = m_CloneLinks.Count(); --i >= 0; )
+	{
+		IPhysicsObject *pClonePhysics = m_CloneLinks[i].pClone;
+		if( pClonePhysics->GetShadowController() != NULL )
+			pClonePhysics->RemoveShadowController();
+
+		pClonePhysics->EnableCollisions( false );
+		pClonePhysics->EnableMotion( false );
+		pClonePhysics->Sleep();
+
+		m_CloneLinks[i].pSource = NULL;
+		m_CloneLinks[i].bSyncedStateValid = false;
+	}
+
+	SetMoveType( MOVETYPE_NONE );
+	SetSolid( SOLID_NONE );
+	SetSolidFlags( 0 );
+	SetCollisionGroup( COLLISION_GROUP_NONE );
+
+	s_IdleShadowClones.AddToTail( this );
+	return true;
+}
+
 void CPhysicsShadowClone::Free( void )
+{
+	if( ReturnToPool() )
+		return;
+
+	DestroyEntity();
+}
+
+void CPhysicsShadowClone::DestroyEntity( void )
 {
 	VPhysicsDestroyObject();
 
@@ -1070,12 +1271,25 @@ void CPhysicsShadowClone::Free( void )
 
 void CPhysicsShadowClone::FullSyncAllClones( void )
 {
+	PORTAL_SIMULATOR_PROFILE_SCOPE( PSPP_CLONE_SYNC, "CPhysicsShadowClone::FullSyncAllClones" );
+
 	for( int i = s_ActiveShadowClones.Count(); --i >= 0; )
 	{
 		s_ActiveShadowClones[i]->FullSync( true );
 	}
 }
 
+void CPhysicsShadowClone::ReleaseIdleClones( void )
+{
+	while( s_IdleShadowClones.Count() != 0 )
+	{
+		int iLast = s_IdleShadowClones.Count() - 1;
+		CPhysicsShadowClone *pClone = s_IdleShadowClones[iLast];
+		s_IdleShadowClones.Remove( iLast );
+		pClone->DestroyEntity();
+	}
+}
+
 
 IPhysicsObject *CPhysicsShadowClone::TranslatePhysicsToClonedEnt( const IPhysicsObject *pPhysics )
 {
@@ -1136,7 +1350,7 @@ bool CTraceFilterTranslateClones::ShouldHitEntity( IHandleEntity *pEntity, int c
 	{
 		CBaseEntity *pClonedEntity = ((CPhysicsShadowClone *)pEnt)->GetClonedEntity();
 		CPortalSimulator *pSimulator = CPortalSimulator::GetSimulatorThatOwnsEntity( pClonedEntity );
-		if( pSimulator->GetInternalData().Simulation.Dynamic.EntFlags[pClonedEntity->entindex()] & PSEF_IS_IN_PORTAL_HOLE )
+		if( pSimulator->GetEntityFlags( pClonedEntity ) & PSEF_IS_IN_PORTAL_HOLE )
 			return m_pActualFilter->ShouldHitEntity( pClonedEntity, contentsMask );
 		else
 			return false;
@@ -27,6 +27,16 @@ struct PhysicsObjectCloneLink_t
 	IPhysicsObject *pSource;
 	IPhysicsShadowController *pShadowController;
 	IPhysicsObject *pClone;
+
+	//state as of the last full sync, lets incremental syncs skip objects that haven't changed since
+	Vector ptSyncedSourceOrigin;
+	QAngle qSyncedSourceAngles;
+	Vector vSyncedSourceVelocity;
+	Vector vSyncedSourceAngularVelocity;
+	Vector ptSyncedCloneOrigin; //the clone simulates on its own, so it can drift away from what we last gave it
+	QAngle qSyncedCloneAngles;
+	unsigned int iSyncedSourceGameFlags;
+	bool bSyncedStateValid;
 };
 
 struct CPhysicsShadowCloneLL
@@ -54,6 +64,11 @@ private:
 	void			FullSyncClonedPhysicsObjects( bool bTeleport );
 	void			SyncEntity( bool bPullChanges );
 
+	void			UnlinkFromClonedEntity( void ); //removes us from the source entity's list of clones
+	bool			ReturnToPool( void ); //parks this clone and its physics objects for reuse, returns false if it should be destroyed instead
+	bool			CanReuseForEntity( IPhysicsEnvironment *pPhysicsEnvironment, IPhysicsObject **pSourceObjects, int iSourceObjectCount ) const;
+	void			DestroyEntity( void );
+
 	IPhysicsEnvironment *m_pOwnerPhysEnvironment; //clones exist because of multi-environment situations
 
 
@@ -132,6 +147,7 @@ public:
 	static bool IsShadowClone( CBaseEntity *pEntity );
 	static CPhysicsShadowCloneLL *GetClonesOfEntity( const CBaseEntity *pEntity );
 	static void FullSyncAllClones( void );
+	static void ReleaseIdleClones( void ); //destroys every pooled clone, the pool can't outlive the physics environments it references
 
 	static CUtlVector<CPhysicsShadowClone *> const &g_ShadowCloneList;
 };
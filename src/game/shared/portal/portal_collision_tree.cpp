@@ -0,0 +1,206 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Bounding volume hierarchy over the carved polyhedrons a portal
+//			simulator builds its static collideables from. Lets traces find
+//			out which collideables they could possibly hit before paying for
+//			a physcollision trace against each one.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "cbase.h"
+#include "portal_collision_tree.h"
+#include "mathlib/polyhedron.h"
+#include "mathlib/vmatrix.h"
+#include "collisionutils.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define PORTAL_COLLISION_TREE_BOUNDS_PADDING 1.0f //collideables built from polyhedrons aren't guaranteed to stay exactly inside the polyhedron bounds
+#define PORTAL_COLLISION_TREE_MAX_LEAVES_PER_NODE 4
+#define PORTAL_COLLISION_TREE_MAX_DEPTH 64
+
+CPortalCollisionTree::CPortalCollisionTree( void )
+: m_iGroupCount( 0 ),
+  m_bBuilt( false )
+{
+}
+
+void CPortalCollisionTree::Clear( void )
+{
+	m_Leaves.RemoveAll();
+	m_Nodes.RemoveAll();
+	m_iGroupCount = 0;
+	m_bBuilt = false;
+}
+
+void CPortalCollisionTree::AddPolyhedrons( CPolyhedron * const *pPolyhedrons, int iPolyhedronCount, int iGroup )
+{
+	Assert( !m_bBuilt );
+
+	if( iGroup >= m_iGroupCount )
+		m_iGroupCount = iGroup + 1;
+
+	Vector vPadding( PORTAL_COLLISION_TREE_BOUNDS_PADDING, PORTAL_COLLISION_TREE_BOUNDS_PADDING, PORTAL_COLLISION_TREE_BOUNDS_PADDING );
+
+	for( int i = 0; i != iPolyhedronCount; ++i )
+	{
+		const CPolyhedron *pPolyhedron = pPolyhedrons[i];
+		if( (pPolyhedron == NULL) || (pPolyhedron->iVertexCount == 0) )
+			continue;
+
+		Leaf_t &leaf = m_Leaves[m_Leaves.AddToTail()];
+		leaf.iGroup = iGroup;
+		leaf.vMins = leaf.vMaxs = pPolyhedron->pVertices[0];
+		for( int j = 1; j < pPolyhedron->iVertexCount; ++j )
+		{
+			VectorMin( leaf.vMins, pPolyhedron->pVertices[j], leaf.vMins );
+			VectorMax( leaf.vMaxs, pPolyhedron->pVertices[j], leaf.vMaxs );
+		}
+
+		leaf.vMins -= vPadding;
+		leaf.vMaxs += vPadding;
+	}
+}
+
+void CPortalCollisionTree::Build( void )
+{
+	m_Nodes.RemoveAll();
+	m_bBuilt = true;
+
+	if( m_Leaves.Count() == 0 )
+		return;
+
+	m_Nodes.EnsureCapacity( (m_Leaves.Count() * 2) - 1 );
+	BuildRecursive( 0, m_Leaves.Count() );
+}
+
+int CPortalCollisionTree::BuildRecursive( int iFirstLeaf, int iLeafCount )
+{
+	Assert( iLeafCount > 0 );
+
+	int iNode = m_Nodes.AddToTail();
+	Vector vCentroidMins, vCentroidMaxs;
+	{
+		Node_t &node = m_Nodes[iNode];
+		node.iChildren[0] = node.iChildren[1] = -1;
+		node.iFirstLeaf = iFirstLeaf;
+		node.iLeafCount = iLeafCount;
+
+		node.vMins = m_Leaves[iFirstLeaf].vMins;
+		node.vMaxs = m_Leaves[iFirstLeaf].vMaxs;
+		vCentroidMins = vCentroidMaxs = m_Leaves[iFirstLeaf].vMins + m_Leaves[iFirstLeaf].vMaxs;
+		for( int i = iFirstLeaf + 1; i < iFirstLeaf + iLeafCount; ++i )
+		{
+			const Leaf_t &leaf = m_Leaves[i];
+			VectorMin( node.vMins, leaf.vMins, node.vMins );
+			VectorMax( node.vMaxs, leaf.vMaxs, node.vMaxs );
+
+			Vector vCentroid = leaf.vMins + leaf.vMaxs;
+			VectorMin( vCentroidMins, vCentroid, vCentroidMins );
+			VectorMax( vCentroidMaxs, vCentroid, vCentroidMaxs );
+		}
+
+		if( iLeafCount <= PORTAL_COLLISION_TREE_MAX_LEAVES_PER_NODE )
+			return iNode;
+	}
+
+	//split at the middle of the centroid bounds along their longest axis, falling back to an even split if everything lands on one side
+	Vector vSize = vCentroidMaxs - vCentroidMins;
+	int iAxis = (vSize.x > vSize.y) ? ((vSize.x > vSize.z) ? 0 : 2) : ((vSize.y > vSize.z) ? 1 : 2);
+	float fSplit = (vCentroidMins[iAxis] + vCentroidMaxs[iAxis]) * 0.5f;
+
+	int iLow = iFirstLeaf;
+	int iHigh = iFirstLeaf + iLeafCount - 1;
+	while( iLow <= iHigh )
+	{
+		if( (m_Leaves[iLow].vMins[iAxis] + m_Leaves[iLow].vMaxs[iAxis]) < fSplit )
+		{
+			++iLow;
+		}
+		else
+		{
+			Leaf_t temp = m_Leaves[iLow];
+			m_Leaves[iLow] = m_Leaves[iHigh];
+			m_Leaves[iHigh] = temp;
+			--iHigh;
+		}
+	}
+
+	int iLowCount = iLow - iFirstLeaf;
+	if( (iLowCount == 0) || (iLowCount == iLeafCount) )
+		iLowCount = iLeafCount / 2;
+
+	int iChild0 = BuildRecursive( iFirstLeaf, iLowCount );
+	int iChild1 = BuildRecursive( iFirstLeaf + iLowCount, iLeafCount - iLowCount );
+	m_Nodes[iNode].iChildren[0] = iChild0;
+	m_Nodes[iNode].iChildren[1] = iChild1;
+	m_Nodes[iNode].iLeafCount = 0;
+
+	return iNode;
+}
+
+void CPortalCollisionTree::EnumerateGroupsAlongRay( const Ray_t &ray, bool *pGroupHits ) const
+{
+	if( !m_bBuilt )
+	{
+		for( int i = 0; i != m_iGroupCount; ++i )
+			pGroupHits[i] = true;
+
+		return;
+	}
+
+	for( int i = 0; i != m_iGroupCount; ++i )
+		pGroupHits[i] = false;
+
+	if( m_Nodes.Count() == 0 )
+		return;
+
+	int iStack[PORTAL_COLLISION_TREE_MAX_DEPTH];
+	int iStackCount = 0;
+	iStack[iStackCount++] = 0;
+
+	while( iStackCount != 0 )
+	{
+		const Node_t &node = m_Nodes[iStack[--iStackCount]];
+		if( !IsBoxIntersectingRay( node.vMins, node.vMaxs, ray ) )
+			continue;
+
+		if( node.iChildren[0] == -1 )
+		{
+			for( int i = node.iFirstLeaf; i != node.iFirstLeaf + node.iLeafCount; ++i )
+			{
+				const Leaf_t &leaf = m_Leaves[i];
+				if( !pGroupHits[leaf.iGroup] && IsBoxIntersectingRay( leaf.vMins, leaf.vMaxs, ray ) )
+					pGroupHits[leaf.iGroup] = true;
+			}
+		}
+		else
+		{
+			Assert( iStackCount + 2 <= PORTAL_COLLISION_TREE_MAX_DEPTH );
+			iStack[iStackCount++] = node.iChildren[1];
+			iStack[iStackCount++] = node.iChildren[0];
+		}
+	}
+}
+
+void CPortalCollisionTree::EnumerateGroupsAlongTransformedRay( const Ray_t &ray, const VMatrix &matRayToTree, bool *pGroupHits ) const
+{
+	Ray_t transformedRay;
+	transformedRay.m_Start = matRayToTree * ray.m_Start;
+	transformedRay.m_Delta = matRayToTree.ApplyRotation( ray.m_Delta );
+	transformedRay.m_StartOffset = matRayToTree.ApplyRotation( ray.m_StartOffset );
+	transformedRay.m_IsRay = ray.m_IsRay;
+	transformedRay.m_IsSwept = ray.m_IsSwept;
+
+	//an axis aligned box rotated into another space needs bigger extents to stay conservative
+	for( int i = 0; i != 3; ++i )
+	{
+		transformedRay.m_Extents[i] = fabs( matRayToTree.m[i][0] ) * ray.m_Extents.x +
+									  fabs( matRayToTree.m[i][1] ) * ray.m_Extents.y +
+									  fabs( matRayToTree.m[i][2] ) * ray.m_Extents.z;
+	}
+
+	EnumerateGroupsAlongRay( transformedRay, pGroupHits );
+}
@@ -0,0 +1,78 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Bounding volume hierarchy over the carved polyhedrons a portal
+//			simulator builds its static collideables from. Lets traces find
+//			out which collideables they could possibly hit before paying for
+//			a physcollision trace against each one.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef PORTAL_COLLISION_TREE_H
+#define PORTAL_COLLISION_TREE_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "mathlib/vector.h"
+#include "tier1/utlvector.h"
+
+class CPolyhedron;
+class VMatrix;
+struct Ray_t;
+
+enum PortalCollisionTreeGroup_t
+{
+	PCTG_WORLD_BRUSHES = 0,
+	PCTG_WALL_BRUSHES,
+	PCTG_WALL_TUBE,
+	PCTG_STATIC_PROPS, //clipped static prop N is group PCTG_STATIC_PROPS + N
+
+	PCTG_FIXED_GROUP_COUNT = PCTG_STATIC_PROPS,
+};
+
+class CPortalCollisionTree
+{
+public:
+	CPortalCollisionTree( void );
+
+	void Clear( void );
+	void AddPolyhedrons( CPolyhedron * const *pPolyhedrons, int iPolyhedronCount, int iGroup );
+	void Build( void ); //call once every polyhedron has been added
+
+	inline bool IsBuilt( void ) const { return m_bBuilt; }
+	inline int GetGroupCount( void ) const { return m_iGroupCount; }
+
+	//fills pGroupHits (GetGroupCount() entries) with whether the ray touches the bounds of any polyhedron in each group. Every group counts as hit if the tree isn't built
+	void EnumerateGroupsAlongRay( const Ray_t &ray, bool *pGroupHits ) const;
+
+	//same as above, with the ray transformed by matRayToTree first. For testing rays against a linked simulator's geometry
+	void EnumerateGroupsAlongTransformedRay( const Ray_t &ray, const VMatrix &matRayToTree, bool *pGroupHits ) const;
+
+private:
+	struct Leaf_t
+	{
+		Vector vMins;
+		Vector vMaxs;
+		int iGroup;
+	};
+
+	struct Node_t
+	{
+		Vector vMins;
+		Vector vMaxs;
+		int iChildren[2]; //both -1 for leaves
+		int iFirstLeaf; //leaf nodes only
+		int iLeafCount;
+	};
+
+	int BuildRecursive( int iFirstLeaf, int iLeafCount );
+
+	CUtlVector<Leaf_t> m_Leaves;
+	CUtlVector<Node_t> m_Nodes;
+	int m_iGroupCount;
+	bool m_bBuilt;
+};
+
+#endif //#ifndef PORTAL_COLLISION_TREE_H
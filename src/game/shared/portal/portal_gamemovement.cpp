@@ -13,6 +13,7 @@
 #include "prop_portal_shared.h"
 #include "rumble_shared.h"
 #include "portal_gamemovement.h"
+#include "portal_simulator_profiling.h"
 
 #if defined( CLIENT_DLL )
 	#include "c_portal_player.h"
@@ -46,6 +47,10 @@ ConVar portal_player_interaction_quadtest_epsilon( "portal_player_interaction_qu
 
 
 ConVar sv_portal_new_player_trace( "sv_portal_new_player_trace", "0", FCVAR_REPLICATED | FCVAR_CHEAT );
+ConVar sv_portal_player_trace_hole_test( "sv_portal_player_trace_hole_test", "1", FCVAR_REPLICATED | FCVAR_CHEAT, "Player movement traces in a portal environment that can't reach the portal hole skip the portal trace." );
+ConVar sv_portal_player_trace_hole_margin( "sv_portal_player_trace_hole_margin", "8", FCVAR_REPLICATED | FCVAR_CHEAT, "Distance around the portal hole where player movement traces always use the portal trace." );
+
+#define PORTAL_PLAYER_TRACE_HOLE_DEPTH 200.0f //how far behind the portal plane the simulator replaces local world with remote world
 
 
 #if defined( CLIENT_DLL )
@@ -181,6 +186,8 @@ void CPortalGameMovement::ClientVerticalElevatorFixes( CBasePlayer *pPlayer, CMo
 //-----------------------------------------------------------------------------
 CPortalGameMovement::CPortalGameMovement()
 {
+	m_PortalTraceCache.pPortal = NULL;
+	m_bPortalTraceCacheActive = false;
 }
 
 //-----------------------------------------------------------------------------
@@ -206,6 +213,8 @@ void CPortalGameMovement::ProcessMovement( CBasePlayer *pPlayer, CMoveData *pMov
 	gpGlobals->frametime *= pPlayer->GetLaggedMovementValue();
 
 	ResetGetPointContentsCache();
+	ResetPortalTraceCache();
+	m_bPortalTraceCacheActive = true;
 
 	// Cropping movement speed scales mv->m_fForwardSpeed etc. globally
 	// Once we crop, we don't want to recursively crop again, so we set the crop
@@ -258,6 +267,10 @@ void CPortalGameMovement::ProcessMovement( CBasePlayer *pPlayer, CMoveData *pMov
 	pPlayer->UnforceButtons( IN_DUCK );
 	pPlayer->UnforceButtons( IN_JUMP );
 
+	//portals can move before the next command, traces from outside of movement shouldn't see this command's state
+	ResetPortalTraceCache();
+	m_bPortalTraceCacheActive = false;
+
 	//This is probably not needed, but just in case.
 	gpGlobals->frametime = flStoreFrametime;
 }
@@ -1029,6 +1042,8 @@ ConVar sv_portal_new_player_trace_vs_remote_ents( "sv_portal_new_player_trace_vs
 
 void TracePortalPlayerAABB( CPortal_Player *pPortalPlayer, CProp_Portal *pPortal, const Ray_t &ray_local, const Ray_t &ray_remote, const Vector &vRemoteShift, unsigned int fMask, int collisionGroup, CTrace_PlayerAABB_vs_Portals &pm, bool bSkipRemoteTubeCheck )
 {
+	PORTAL_SIMULATOR_PROFILE_HOT_SCOPE( PSPP_PORTAL_TRACE );
+
 #ifdef CLIENT_DLL
 	CTraceFilterSimple traceFilter( pPortalPlayer, collisionGroup );
 #else
@@ -1307,6 +1322,91 @@ void TracePortalPlayerAABB( CPortal_Player *pPortalPlayer, CProp_Portal *pPortal
 }
 
 
+void CPortalGameMovement::ResetPortalTraceCache( void )
+{
+	m_PortalTraceCache.pPortal = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Portal state the player traces need, looked up once per command.
+// Output : NULL if pPortal can't be traced through
+//-----------------------------------------------------------------------------
+const CPortalGameMovement::PortalTraceCache_t *CPortalGameMovement::GetPortalTraceCache( CProp_Portal *pPortal, const Vector &vExtents )
+{
+	if( !pPortal || !pPortal->IsActivedAndLinked() )
+		return NULL;
+
+	PortalTraceCache_t &cache = m_PortalTraceCache;
+	if( m_bPortalTraceCacheActive && (cache.pPortal == pPortal) && (cache.vExtents == vExtents) )
+		return &cache;
+
+	const PS_InternalData_t &portalSimulator = pPortal->m_PortalSimulator.GetInternalData();
+
+	CProp_Portal *pLinkedPortal = pPortal->m_hLinkedPortal;
+	const PS_InternalData_t &linkedPortalSimulator = pLinkedPortal->m_PortalSimulator.GetInternalData();
+
+	cache.pPortal = pPortal;
+	cache.vExtents = vExtents;
+	cache.vRemoteShift = CalculateExtentShift( vExtents, portalSimulator.Placement.PortalPlane.m_Normal, vExtents, linkedPortalSimulator.Placement.PortalPlane.m_Normal );
+
+	//the box runs from the margin in front of the portal plane to the far end of the remote world behind it
+	float fMargin = MAX( sv_portal_player_trace_hole_margin.GetFloat(), 0.0f );
+	float fFront = fMargin;
+	float fBack = PORTAL_PLAYER_TRACE_HOLE_DEPTH + fMargin;
+
+	cache.vHoleAxes[0] = portalSimulator.Placement.vForward;
+	cache.vHoleAxes[1] = portalSimulator.Placement.vRight;
+	cache.vHoleAxes[2] = portalSimulator.Placement.vUp;
+	cache.vHoleHalfExtents.Init( (fFront + fBack) * 0.5f, PORTAL_HALF_WIDTH + fMargin, PORTAL_HALF_HEIGHT + fMargin );
+	cache.vHoleCenter = portalSimulator.Placement.ptCenter + (portalSimulator.Placement.vForward * ((fFront - fBack) * 0.5f));
+
+	for( int i = 0; i != 3; ++i )
+	{
+		cache.vHoleWorldExtents[i] = (fabs( cache.vHoleAxes[0][i] ) * cache.vHoleHalfExtents.x) +
+									(fabs( cache.vHoleAxes[1][i] ) * cache.vHoleHalfExtents.y) +
+									(fabs( cache.vHoleAxes[2][i] ) * cache.vHoleHalfExtents.z);
+	}
+
+	return &cache;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Conservative test of the box swept from start to end against the
+//			portal hole. Only the box and hole face normals are tested as
+//			separating axes, so this can say yes when the two don't touch.
+//-----------------------------------------------------------------------------
+bool CPortalGameMovement::SweptPlayerBBoxMayTouchPortalHole( const PortalTraceCache_t &cache, const Vector &start, const Vector &end )
+{
+	if( !sv_portal_player_trace_hole_test.GetBool() )
+		return true;
+
+	Vector vSweptMins, vSweptMaxs;
+	VectorMin( start, end, vSweptMins );
+	VectorMax( start, end, vSweptMaxs );
+	vSweptMins += GetPlayerMins();
+	vSweptMaxs += GetPlayerMaxs();
+
+	Vector vSweptCenter = (vSweptMins + vSweptMaxs) * 0.5f;
+	Vector vSweptExtents = (vSweptMaxs - vSweptMins) * 0.5f;
+	Vector vOffset = vSweptCenter - cache.vHoleCenter;
+
+	for( int i = 0; i != 3; ++i )
+	{
+		if( fabs( vOffset[i] ) > (vSweptExtents[i] + cache.vHoleWorldExtents[i]) )
+			return false;
+	}
+
+	for( int i = 0; i != 3; ++i )
+	{
+		const Vector &vAxis = cache.vHoleAxes[i];
+		float fSweptRadius = (fabs( vAxis.x ) * vSweptExtents.x) + (fabs( vAxis.y ) * vSweptExtents.y) + (fabs( vAxis.z ) * vSweptExtents.z);
+		if( fabs( vOffset.Dot( vAxis ) ) > (fSweptRadius + cache.vHoleHalfExtents[i]) )
+			return false;
+	}
+
+	return true;
+}
+
 void CPortalGameMovement::TracePlayerBBox( const Vector& start, const Vector& end, unsigned int fMask, int collisionGroup, CTrace_PlayerAABB_vs_Portals& pm )
 {
 	VPROF( "CGameMovement::TracePlayerBBox" );
@@ -1328,19 +1428,16 @@ void CPortalGameMovement::TracePlayerBBox( const Vector& start, const Vector& en
 	Ray_t ray_local;
 	ray_local.Init( start, end, GetPlayerMins(), GetPlayerMaxs() );
 
-	if( pPortal && pPortal->IsActivedAndLinked() )
+	//Far from the hole the portal environment collides just like the real world. Skipping the portal trace there is most of what the LAGFIX above was after.
+	const PortalTraceCache_t *pPortalCache = GetPortalTraceCache( pPortal, ray_local.m_Extents );
+	if( pPortalCache && SweptPlayerBBoxMayTouchPortalHole( *pPortalCache, start, end ) )
 	{
-		const PS_InternalData_t &portalSimulator = pPortal->m_PortalSimulator.GetInternalData();
-
-		CProp_Portal *pLinkedPortal = pPortal->m_hLinkedPortal;
-		const PS_InternalData_t &linkedPortalSimulator = pLinkedPortal->m_PortalSimulator.GetInternalData();
-
 		Vector vTeleportExtents = ray_local.m_Extents; //if we would adjust our extents due to a portal teleport, that change should be reflected here
 
 		//Need to take AABB extent changes from possible ducking into account
 		//bool bForcedDuck = false;
 
-		Vector vRemoteShift = CalculateExtentShift( ray_local.m_Extents, portalSimulator.Placement.PortalPlane.m_Normal, vTeleportExtents, linkedPortalSimulator.Placement.PortalPlane.m_Normal );
+		const Vector &vRemoteShift = pPortalCache->vRemoteShift;
 
 		//this is roughly the ray we'd use if we had just teleported, the exception being the centered startoffset
 		Ray_t ray_remote = ray_local;
@@ -1371,7 +1468,8 @@ void CPortalGameMovement::TracePlayerBBox( const Vector& start, const Vector& en
 	Ray_t ray_local;
 	ray_local.Init( start, end, GetPlayerMins(), GetPlayerMaxs() );
 
-	if( pPortal && pPortal->IsActivedAndLinked() )
+	const PortalTraceCache_t *pPortalCache = GetPortalTraceCache( pPortal, ray_local.m_Extents );
+	if( pPortalCache && SweptPlayerBBoxMayTouchPortalHole( *pPortalCache, start, end ) )
 	{
 		const PS_InternalData_t &portalSimulator = pPortal->m_PortalSimulator.GetInternalData();
 
@@ -1470,7 +1568,7 @@ void CPortalGameMovement::HandlePortalling( void )
 #endif
 
 #if defined( CLIENT_DLL )	
-	pPortalPlayer->UnrollPredictedTeleportations( player->m_pCurrentCommand->command_number );
+	pPortalPlayer->BeginPredictedTeleportationReplay( player->m_pCurrentCommand->command_number );
 	pPortalPlayer->CheckPlayerAboutToTouchPortal();
 #endif
 
@@ -1748,6 +1846,16 @@ void CPortalGameMovement::HandlePortalling( void )
 			bool bForceDuckToFit = false;
 			bool bForceDuck = bForceDuckToFit;
 
+#if defined( CLIENT_DLL )
+			//re-predicting a teleportation we already applied leaves the interpolators and engine view angles as they are
+			int iReplayedTeleportation = pPortalPlayer->FindReplayedTeleportation( player->m_pCurrentCommand->command_number, pPortal, bForceDuck );
+			if( iReplayedTeleportation == -1 )
+			{
+				//whatever we predicted from here on didn't happen this way
+				pPortalPlayer->UnrollPredictedTeleportations( player->m_pCurrentCommand->command_number );
+			}
+#endif
+
 			//reduced version of forced duckjump
 			if( bForceDuck )
 			{
@@ -1832,6 +1940,11 @@ void CPortalGameMovement::HandlePortalling( void )
 				mv->SetAbsOrigin( vTransformedMoveCenter - vOriginToCenter );
 
 #if defined( CLIENT_DLL )
+				if( iReplayedTeleportation != -1 )
+				{
+					pPortalPlayer->m_PredictedPortalTeleportations[iReplayedTeleportation].bReplayPending = false;
+				}
+				else
 				{
 					C_Portal_Player::PredictedPortalTeleportation_t entry;
 					entry.flTime = gpGlobals->curtime;
@@ -1840,6 +1953,8 @@ void CPortalGameMovement::HandlePortalling( void )
 					entry.fDeleteServerTimeStamp = -1.0f;
 					entry.matUnroll = pPortal->m_hLinkedPortal->MatrixThisToLinked();
 					entry.bDuckForced = bForceDuck;
+					entry.bReplayPending = false;
+					entry.pExitPortal = pExitPortal;
 					pPortalPlayer->m_PredictedPortalTeleportations.AddToTail( entry );
 				}		
 #endif
@@ -1851,6 +1966,7 @@ void CPortalGameMovement::HandlePortalling( void )
 
 #if defined( CLIENT_DLL )
 			//engine view angles (for mouse input smoothness)
+			if( iReplayedTeleportation == -1 )
 			{
 				QAngle qEngineAngles;
 				engine->GetViewAngles( qEngineAngles );
@@ -1937,7 +2053,10 @@ void CPortalGameMovement::HandlePortalling( void )
 			pPortalPlayer->ApplyPortalTeleportation( pPortal, mv );
 			pPortal->PostTeleportTouchingEntity( player );
 #else
-			pPortalPlayer->ApplyPredictedPortalTeleportation( pPortal, mv, bForceDuck );		
+			if( iReplayedTeleportation != -1 )
+				pPortalPlayer->ReplayPredictedPortalTeleportation( pPortal, mv );
+			else
+				pPortalPlayer->ApplyPredictedPortalTeleportation( pPortal, mv, bForceDuck );
 #endif
 
 			//Fix us up if we got stuck
@@ -2023,7 +2142,11 @@ void CPortalGameMovement::HandlePortalling( void )
 		pPortalPlayer->m_hPortalEnvironment = pPlayerTouchingPortal;
 		if( pPlayerTouchingPortal )
 		{
+#if defined( CLIENT_DLL )
+			pPortalPlayer->FixPortalEnvironmentOwnership(); //may still be owned by the portal a journaled teleportation later in this replay exits into
+#else
 			pPlayerTouchingPortal->m_PortalSimulator.TakeOwnershipOfEntity( player );
+#endif
 		}
 		else
 		{
@@ -2054,6 +2177,10 @@ void CPortalGameMovement::HandlePortalling( void )
 		
 	}
 	
+#if defined( CLIENT_DLL )
+	pPortalPlayer->FinishPredictedTeleportationReplay( player->m_pCurrentCommand->command_number );
+#endif
+
 #if defined( TRACE_DEBUG_ENABLED )
 	CheckStuck();
 #endif
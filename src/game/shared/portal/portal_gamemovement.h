@@ -103,7 +103,26 @@ public:
 #endif
 
 private:
-
+	//portal state shared by every TracePlayerBBox() in a single ProcessMovement()
+	struct PortalTraceCache_t
+	{
+		CProp_Portal *pPortal; //NULL when nothing is cached
+		Vector vExtents; //player extents vRemoteShift was calculated with
+		Vector vRemoteShift;
+
+		//hole OBB the swept player box has to overlap before the portal trace can differ from a regular one
+		Vector vHoleCenter;
+		Vector vHoleAxes[3]; //forward, right, up
+		Vector vHoleHalfExtents; //along vHoleAxes
+		Vector vHoleWorldExtents; //half extents of the hole OBB's world AABB
+	};
+
+	void ResetPortalTraceCache( void );
+	const PortalTraceCache_t *GetPortalTraceCache( CProp_Portal *pPortal, const Vector &vExtents );
+	bool SweptPlayerBBoxMayTouchPortalHole( const PortalTraceCache_t &cache, const Vector &start, const Vector &end );
+
+	PortalTraceCache_t m_PortalTraceCache;
+	bool m_bPortalTraceCacheActive; //only valid while inside ProcessMovement()
 
 	CPortal_Player	*GetPortalPlayer();
 };
\ No newline at end of file
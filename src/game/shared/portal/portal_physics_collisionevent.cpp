@@ -92,7 +92,7 @@ int CPortal_CollisionEvent::ShouldCollide( IPhysicsObject *pObj0, IPhysicsObject
 				CBaseEntity *pSource = pClone->GetClonedEntity();
 
 				CPortalSimulator *pSourceSimulator = CPortalSimulator::GetSimulatorThatOwnsEntity( pClone )->GetLinkedPortalSimulator();
-				Assert( (pSimulators[i]->GetInternalData().Simulation.Dynamic.EntFlags[pClone->entindex()] & PSEF_IS_IN_PORTAL_HOLE) == (pSourceSimulator->GetInternalData().Simulation.Dynamic.EntFlags[pSource->entindex()] & PSEF_IS_IN_PORTAL_HOLE) );
+				Assert( (pSimulators[i]->GetEntityFlags( pClone ) & PSEF_IS_IN_PORTAL_HOLE) == (pSourceSimulator->GetEntityFlags( pSource ) & PSEF_IS_IN_PORTAL_HOLE) );
 			}
 		}
 #endif
@@ -113,7 +113,7 @@ int CPortal_CollisionEvent::ShouldCollide( IPhysicsObject *pObj0, IPhysicsObject
 								if(	pSimulators[i]->CreatedPhysicsObject( pPhysObjects[i], &objectSource ) && 
 									((objectSource == PSPOST_REMOTE_BRUSHES) || (objectSource == PSPOST_REMOTE_STATICPROPS)) )
 								{
-									if( (pSimulators[1-i]->GetInternalData().Simulation.Dynamic.EntFlags[pEntities[1-i]->entindex()] & PSEF_IS_IN_PORTAL_HOLE) == 0 )
+									if( (pSimulators[1-i]->GetEntityFlags( pEntities[1-i] ) & PSEF_IS_IN_PORTAL_HOLE) == 0 )
 										return 0; //require that the entity be in the portal hole before colliding with transformed geometry
 									//FIXME: The above requirement might fail horribly for transformed collision blocking the portal from the other side and fast moving objects
 								}	
@@ -124,8 +124,8 @@ int CPortal_CollisionEvent::ShouldCollide( IPhysicsObject *pObj0, IPhysicsObject
 				}
 				else if( bShadowClonesInvolved )
 				{
-					if( ((pSimulators[0]->GetInternalData().Simulation.Dynamic.EntFlags[pEntities[0]->entindex()] | 
-						pSimulators[1]->GetInternalData().Simulation.Dynamic.EntFlags[pEntities[1]->entindex()]) &
+					if( ((pSimulators[0]->GetEntityFlags( pEntities[0] ) | 
+						pSimulators[1]->GetEntityFlags( pEntities[1] )) &
 						PSEF_IS_IN_PORTAL_HOLE) == 0 )
 					{
 						return 0; //neither entity was actually in the portal hole
@@ -164,7 +164,7 @@ int CPortal_CollisionEvent::ShouldCollide( IPhysicsObject *pObj0, IPhysicsObject
 							}
 							else if( pSimulator_Entity )
 							{
-								if( (pSimulator_Entity->GetInternalData().Simulation.Dynamic.EntFlags[pEntities[i]->entindex()] & PSEF_CLONES_ENTITY_FROM_MAIN) == 0 )
+								if( (pSimulator_Entity->GetEntityFlags( pEntities[i] ) & PSEF_CLONES_ENTITY_FROM_MAIN) == 0 )
 								{
 									//entity is in a portal environment, static is not, static not cloned from main.
 									if( !pPhysObjects[i]->IsTrigger() ) //we should probably do this with triggers too. But it breaks tractor beams in devtest when the cube portals, too late in the ship cycle to chase the sweater thread without a good reason
@@ -186,7 +186,7 @@ int CPortal_CollisionEvent::ShouldCollide( IPhysicsObject *pObj0, IPhysicsObject
 					if( pSimulators[i] )
 					{
 						//entities in the physics environment only collide with statics created by the environment (handled above), entities in the same environment (also above), or entities that should be cloned from main to the same environment
-						if( (pSimulators[i]->GetInternalData().Simulation.Dynamic.EntFlags[pEntities[1-i]->entindex()] & PSEF_CLONES_ENTITY_FROM_MAIN) == 0 ) //not cloned from main
+						if( (pSimulators[i]->GetEntityFlags( pEntities[1-i] ) & PSEF_CLONES_ENTITY_FROM_MAIN) == 0 ) //not cloned from main
 							return 0;
 					}
 				}
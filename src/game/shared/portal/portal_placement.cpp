@@ -10,6 +10,7 @@
 #include "collisionutils.h"
 #include "decals.h"
 #include "debugoverlay_shared.h"
+#include "tier1/checksum_crc.h"
 
 #ifdef GAME_DLL
 #include "func_noportal_volume.h"
@@ -35,6 +36,8 @@
 
 #define MAXIMUM_BUMP_DISTANCE ( ( PORTAL_HALF_WIDTH * 2.0f ) * ( PORTAL_HALF_WIDTH * 2.0f ) + ( PORTAL_HALF_HEIGHT * 2.0f ) * ( PORTAL_HALF_HEIGHT * 2.0f ) ) / 2.0f
 
+#define PORTAL_PLACEMENT_CACHE_SIZE 8
+
 
 struct CPortalCornerFitData
 {
@@ -53,6 +56,7 @@ bool g_bBumpedByLinkedPortal;
 
 ConVar sv_portal_placement_debug ("sv_portal_placement_debug", "0", FCVAR_REPLICATED );
 ConVar sv_portal_placement_never_bump ("sv_portal_placement_never_bump", "0", FCVAR_REPLICATED | FCVAR_CHEAT );
+ConVar sv_portal_placement_cache_time ("sv_portal_placement_cache_time", "0.1", FCVAR_REPLICATED | FCVAR_CHEAT, "How long, in seconds rounded to ticks, preview placement results are reused for repeat queries at the exact same spot, 0 disables." );
 
 
 bool IsMaterialInList( const csurface_t &surface, char *g_ppszMaterials[] )
@@ -152,6 +156,128 @@ int AllEdictsAlongRay( CBaseEntity **pList, int listMax, const Ray_t &ray, int f
 	return rayEnum.GetCount();
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: While active, every line trace and bumper query made while fitting a 
+//			portal runs against leaves and entities gathered once for the whole
+//			area the portal could be bumped around in, instead of walking the
+//			world and the spatial partition again for each corner.
+//-----------------------------------------------------------------------------
+class CPortalPlacementTraceBatch
+{
+public:
+	CPortalPlacementTraceBatch( const Vector &vOrigin );
+	~CPortalPlacementTraceBatch( void );
+
+	static bool IsRayInBatch( const Ray_t &ray );
+
+	static CTraceListData *s_pTraceList;
+	static CUtlVector<CBaseEntity *> s_BumpingEntities;
+	static Vector s_vMins;
+	static Vector s_vMaxs;
+	static bool s_bActive;
+
+private:
+	bool m_bOwnsBatch; //nested placement checks just use the outer batch
+};
+
+CTraceListData *CPortalPlacementTraceBatch::s_pTraceList = NULL;
+CUtlVector<CBaseEntity *> CPortalPlacementTraceBatch::s_BumpingEntities;
+Vector CPortalPlacementTraceBatch::s_vMins;
+Vector CPortalPlacementTraceBatch::s_vMaxs;
+bool CPortalPlacementTraceBatch::s_bActive = false;
+
+static bool IsBumpingEntity( CBaseEntity *pEntity )
+{
+	return ( ( dynamic_cast<CFuncPortalBumper*>( pEntity ) != NULL ) ||
+			 ( dynamic_cast<CTriggerPortalCleanser*>( pEntity ) != NULL ) ||
+			 ( dynamic_cast<CFuncNoPortalVolume*>( pEntity ) != NULL ) );
+}
+
+CPortalPlacementTraceBatch::CPortalPlacementTraceBatch( const Vector &vOrigin )
+{
+	m_bOwnsBatch = !s_bActive;
+	if( !m_bOwnsBatch )
+		return;
+
+	//the portal can wander up to the maximum bump distance, and its corners are half a diagonal past that. Rays that still leave the box fall back to regular traces
+	float fExtent = FastSqrt( MAXIMUM_BUMP_DISTANCE ) + FastSqrt( PORTAL_HALF_WIDTH * PORTAL_HALF_WIDTH + PORTAL_HALF_HEIGHT * PORTAL_HALF_HEIGHT ) + 2.0f;
+	Vector vExtents( fExtent, fExtent, fExtent );
+	s_vMins = vOrigin - vExtents;
+	s_vMaxs = vOrigin + vExtents;
+
+	if( s_pTraceList == NULL )
+		s_pTraceList = new CTraceListData;
+
+	s_pTraceList->Reset();
+	enginetrace->SetupLeafAndEntityListBox( s_vMins, s_vMaxs, *s_pTraceList );
+
+	CBaseEntity *list[1024];
+	CFlaggedEntitiesEnum boxEnum( list, 1024, 0 );
+#if defined( GAME_DLL )
+	partition->EnumerateElementsInBox( PARTITION_ENGINE_NON_STATIC_EDICTS, s_vMins, s_vMaxs, false, &boxEnum );
+#else
+	partition->EnumerateElementsInBox( PARTITION_ALL_CLIENT_EDICTS, s_vMins, s_vMaxs, false, &boxEnum );
+#endif
+
+	s_BumpingEntities.RemoveAll();
+	for( int i = 0; i != boxEnum.GetCount(); ++i )
+	{
+		if( IsBumpingEntity( list[i] ) )
+			s_BumpingEntities.AddToTail( list[i] );
+	}
+
+	s_bActive = true;
+}
+
+CPortalPlacementTraceBatch::~CPortalPlacementTraceBatch( void )
+{
+	if( !m_bOwnsBatch )
+		return;
+
+	s_bActive = false;
+	s_pTraceList->Reset();
+	s_BumpingEntities.RemoveAll();
+}
+
+bool CPortalPlacementTraceBatch::IsRayInBatch( const Ray_t &ray )
+{
+	if( !s_bActive )
+		return false;
+
+	//the box is convex, so both ends being inside means the whole line is
+	Vector vEnd = ray.m_Start + ray.m_Delta;
+	return ray.m_IsRay && IsPointInBox( ray.m_Start, s_vMins, s_vMaxs ) && IsPointInBox( vEnd, s_vMins, s_vMaxs );
+}
+
+static void PortalPlacementTraceLine( const Vector &vStart, const Vector &vEnd, unsigned int fMask, ITraceFilter *pFilter, trace_t *pTrace )
+{
+	Ray_t ray;
+	ray.Init( vStart, vEnd );
+
+	if( CPortalPlacementTraceBatch::IsRayInBatch( ray ) )
+		enginetrace->TraceRayAgainstLeafAndEntityList( ray, *CPortalPlacementTraceBatch::s_pTraceList, fMask, pFilter, pTrace );
+	else
+		UTIL_TraceLine( vStart, vEnd, fMask, pFilter, pTrace );
+}
+
+static int BumpingEntitiesAlongRay( CBaseEntity **pList, int listMax, const Ray_t &ray )
+{
+	if( !CPortalPlacementTraceBatch::IsRayInBatch( ray ) )
+		return AllEdictsAlongRay( pList, listMax, ray, 0 );
+
+	int nCount = 0;
+	CUtlVector<CBaseEntity *> &bumpingEntities = CPortalPlacementTraceBatch::s_BumpingEntities;
+	for( int i = 0; (i != bumpingEntities.Count()) && (nCount != listMax); ++i )
+	{
+		Vector vMins, vMaxs;
+		bumpingEntities[i]->CollisionProp()->WorldSpaceAABB( &vMins, &vMaxs );
+		if( IsBoxIntersectingRay( vMins, vMaxs, ray ) )
+			pList[nCount++] = bumpingEntities[i];
+	}
+
+	return nCount;
+}
+
 bool TraceBumpingEntities( const Vector &vStart, const Vector &vEnd, trace_t &tr )
 {
 	UTIL_ClearTrace( tr );
@@ -165,7 +291,7 @@ bool TraceBumpingEntities( const Vector &vStart, const Vector &vEnd, trace_t &tr
 	Ray_t ray;
 	ray.Init( vStart, vEnd );
 
-	int nCount = AllEdictsAlongRay(list, 1024, ray, 0);
+	int nCount = BumpingEntitiesAlongRay( list, 1024, ray );
 
 	for ( int i = 0; i < nCount; i++ )
 	{
@@ -238,7 +364,7 @@ bool TracePortalCorner( const CProp_Portal *pIgnorePortal, const Vector &vOrigin
 
 	// Check for surface edge
 	trace_t trSurfaceEdge;
-	UTIL_TraceLine( vOrigin - vForward, vCorner - vForward, MASK_SHOT_PORTAL, pTraceFilterPortalShot, &trSurfaceEdge );
+	PortalPlacementTraceLine( vOrigin - vForward, vCorner - vForward, MASK_SHOT_PORTAL, pTraceFilterPortalShot, &trSurfaceEdge );
 
 	if ( trSurfaceEdge.startsolid )
 	{
@@ -246,7 +372,7 @@ bool TracePortalCorner( const CProp_Portal *pIgnorePortal, const Vector &vOrigin
 
 		while ( trSurfaceEdge.startsolid && trSurfaceEdge.fractionleftsolid > 0.0f && fTotalFraction < 1.0f )
 		{
-			UTIL_TraceLine( vOrigin + vOriginToCorner * ( fTotalFraction + 0.05f ) - vForward, vCorner + vOriginToCorner * ( fTotalFraction + 0.05f ) - vForward, MASK_SHOT_PORTAL, pTraceFilterPortalShot, &trSurfaceEdge );
+			PortalPlacementTraceLine( vOrigin + vOriginToCorner * ( fTotalFraction + 0.05f ) - vForward, vCorner + vOriginToCorner * ( fTotalFraction + 0.05f ) - vForward, MASK_SHOT_PORTAL, pTraceFilterPortalShot, &trSurfaceEdge );
 
 			if ( trSurfaceEdge.startsolid )
 			{
@@ -256,7 +382,7 @@ bool TracePortalCorner( const CProp_Portal *pIgnorePortal, const Vector &vOrigin
 
 		if ( fTotalFraction < 1.0f )
 		{
-			UTIL_TraceLine( vOrigin + vOriginToCorner * ( fTotalFraction + 0.05f ) - vForward, vOrigin - vForward, MASK_SHOT_PORTAL, pTraceFilterPortalShot, &trSurfaceEdge );
+			PortalPlacementTraceLine( vOrigin + vOriginToCorner * ( fTotalFraction + 0.05f ) - vForward, vOrigin - vForward, MASK_SHOT_PORTAL, pTraceFilterPortalShot, &trSurfaceEdge );
 
 			if ( trSurfaceEdge.startsolid )
 			{
@@ -280,7 +406,7 @@ bool TracePortalCorner( const CProp_Portal *pIgnorePortal, const Vector &vOrigin
 
 	// Check for enclosing wall
 	trace_t trEnclosingWall;
-	UTIL_TraceLine( vOrigin + vForward, vCorner + vForward, MASK_SOLID_BRUSHONLY|CONTENTS_MONSTER, pTraceFilterPortalShot, &trEnclosingWall );
+	PortalPlacementTraceLine( vOrigin + vForward, vCorner + vForward, MASK_SOLID_BRUSHONLY|CONTENTS_MONSTER, pTraceFilterPortalShot, &trEnclosingWall );
 
 	if ( trSurfaceEdge.fraction < trEnclosingWall.fraction )
 	{
@@ -1239,9 +1365,7 @@ bool IsPortalOnValidSurface( const Vector &vOrigin, const Vector &vForward, cons
 				ptCorner += vRight * ( PORTAL_HALF_WIDTH - PORTAL_BUMP_FORGIVENESS * 1.1f ); //right
 		}
 
-		Ray_t ray;
-		ray.Init( ptCorner + vForward, ptCorner - vForward );
-		enginetrace->TraceRay( ray, MASK_SOLID_BRUSHONLY, traceFilterPortalShot, &tr );
+		PortalPlacementTraceLine( ptCorner + vForward, ptCorner - vForward, MASK_SOLID_BRUSHONLY, traceFilterPortalShot, &tr );
 
 		if ( tr.startsolid )
 		{
@@ -1305,10 +1429,111 @@ bool IsPortalOnValidSurface( const Vector &vOrigin, const Vector &vForward, cons
 	return true;
 }
 
-float VerifyPortalPlacement( const CProp_Portal *pIgnorePortal, Vector &vOrigin, QAngle &qAngles, int iPlacedBy, bool bTest /*= false*/ )
+//-----------------------------------------------------------------------------
+// Purpose: The portal gun preview asks about the same spot over and over,
+//			remember the last few answers for a few ticks. Only test placements
+//			are cached, a real shot always does the full check.
+//-----------------------------------------------------------------------------
+struct PortalPlacementCacheEntry_t
 {
-	Vector vOriginalOrigin = vOrigin;
+	const CProp_Portal *pIgnorePortal;
+	EHANDLE hSurfaceEntity;
+	unsigned short iSurfaceProps;
+	int iPlacedBy;
+	Vector vInputOrigin;
+	QAngle qAngles;
+	CRC32_t iPortalStateCRC; //other portals moving around changes the result without the surface changing
+
+	Vector vOutputOrigin;
+	float fResult;
+	int iStoreTick;
+	int iExpireTick;
+};
+
+static PortalPlacementCacheEntry_t s_PortalPlacementCache[PORTAL_PLACEMENT_CACHE_SIZE];
+static int s_iNextPortalPlacementCacheEntry = 0;
+
+static float FitPortalOnPlacementSurface( const CProp_Portal *pIgnorePortal, Vector &vOrigin, const QAngle &qAngles, const Vector &vForward, const Vector &vRight, const Vector &vUp, int iPlacedBy, bool bTest, ITraceFilter *pTraceFilterPortalShot, const trace_t &tr );
 
+static CRC32_t ComputePortalStateCRC( void )
+{
+	CRC32_t crc;
+	CRC32_Init( &crc );
+
+	int iPortalCount = CProp_Portal_Shared::AllPortals.Count();
+	CProp_Portal **pPortals = CProp_Portal_Shared::AllPortals.Base();
+	for( int i = 0; i != iPortalCount; ++i )
+	{
+		CProp_Portal *pPortal = pPortals[i];
+		bool bActive = pPortal->IsActive();
+		CRC32_ProcessBuffer( &crc, &pPortal, sizeof( pPortal ) );
+		CRC32_ProcessBuffer( &crc, &bActive, sizeof( bActive ) );
+		if( bActive )
+		{
+			int iLinkageGroupID = pPortal->m_iLinkageGroupID;
+			CRC32_ProcessBuffer( &crc, &iLinkageGroupID, sizeof( iLinkageGroupID ) );
+			CRC32_ProcessBuffer( &crc, &pPortal->GetAbsOrigin(), sizeof( Vector ) );
+			CRC32_ProcessBuffer( &crc, &pPortal->GetAbsAngles(), sizeof( QAngle ) );
+		}
+	}
+
+	CRC32_Final( &crc );
+	return crc;
+}
+
+static void BuildPortalPlacementCacheKey( PortalPlacementCacheEntry_t &key, const CProp_Portal *pIgnorePortal, const Vector &vOrigin, const QAngle &qAngles, int iPlacedBy, const trace_t &trSurface )
+{
+	key.pIgnorePortal = pIgnorePortal;
+	key.hSurfaceEntity = trSurface.m_pEnt;
+	key.iSurfaceProps = trSurface.surface.surfaceProps;
+	key.iPlacedBy = iPlacedBy;
+	key.vInputOrigin = vOrigin;
+	key.qAngles = qAngles;
+	key.iPortalStateCRC = ComputePortalStateCRC();
+}
+
+static bool LookupPortalPlacementCache( const PortalPlacementCacheEntry_t &key, Vector &vOrigin, float &fResult )
+{
+	int iTick = gpGlobals->tickcount; //ticks, so the client and server agree on what has expired
+
+	for( int i = 0; i != PORTAL_PLACEMENT_CACHE_SIZE; ++i )
+	{
+		const PortalPlacementCacheEntry_t &entry = s_PortalPlacementCache[i];
+		if( (iTick < entry.iStoreTick) || //prediction went back to before this was stored
+			(iTick >= entry.iExpireTick) ||
+			(entry.pIgnorePortal != key.pIgnorePortal) ||
+			(entry.hSurfaceEntity != key.hSurfaceEntity) ||
+			(entry.iSurfaceProps != key.iSurfaceProps) ||
+			(entry.iPlacedBy != key.iPlacedBy) ||
+			(entry.vInputOrigin != key.vInputOrigin) ||
+			(entry.qAngles != key.qAngles) ||
+			(entry.iPortalStateCRC != key.iPortalStateCRC) )
+		{
+			continue;
+		}
+
+		vOrigin = entry.vOutputOrigin;
+		fResult = entry.fResult;
+		return true;
+	}
+
+	return false;
+}
+
+static void StorePortalPlacementCache( const PortalPlacementCacheEntry_t &key, const Vector &vOutputOrigin, float fResult, int iCacheTicks )
+{
+	PortalPlacementCacheEntry_t &entry = s_PortalPlacementCache[s_iNextPortalPlacementCacheEntry];
+	s_iNextPortalPlacementCacheEntry = ( s_iNextPortalPlacementCacheEntry + 1 ) % PORTAL_PLACEMENT_CACHE_SIZE;
+
+	entry = key;
+	entry.vOutputOrigin = vOutputOrigin;
+	entry.fResult = fResult;
+	entry.iStoreTick = gpGlobals->tickcount;
+	entry.iExpireTick = entry.iStoreTick + iCacheTicks;
+}
+
+float VerifyPortalPlacement( const CProp_Portal *pIgnorePortal, Vector &vOrigin, QAngle &qAngles, int iPlacedBy, bool bTest /*= false*/ )
+{
 	Vector vForward, vRight, vUp;
 	AngleVectors( qAngles, &vForward, &vRight, &vUp );
 
@@ -1368,6 +1593,40 @@ float VerifyPortalPlacement( const CProp_Portal *pIgnorePortal, Vector &vOrigin,
 		return PORTAL_ANALOG_SUCCESS_INVALID_SURFACE;
 	}
 
+	// only previews use the cache, the placement of a real shot is always checked in full
+	int iCacheTicks = TIME_TO_TICKS( sv_portal_placement_cache_time.GetFloat() );
+	bool bUseCache = bTest && ( iCacheTicks > 0 ) && !sv_portal_placement_debug.GetBool();
+
+	PortalPlacementCacheEntry_t cacheKey;
+	if ( bUseCache )
+	{
+		BuildPortalPlacementCacheKey( cacheKey, pIgnorePortal, vOrigin, qAngles, iPlacedBy, tr );
+
+		float fCachedResult;
+		if ( LookupPortalPlacementCache( cacheKey, vOrigin, fCachedResult ) )
+			return fCachedResult;
+	}
+
+	float fResult;
+	{
+		CPortalPlacementTraceBatch traceBatch( vOrigin );
+		fResult = FitPortalOnPlacementSurface( pIgnorePortal, vOrigin, qAngles, vForward, vRight, vUp, iPlacedBy, bTest, &traceFilterPortalShot, tr );
+	}
+
+	if ( bUseCache )
+		StorePortalPlacementCache( cacheKey, vOrigin, fResult, iCacheTicks );
+
+	return fResult;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Everything past the center trace in VerifyPortalPlacement(). Split
+//			out so the result can be cached.
+//-----------------------------------------------------------------------------
+static float FitPortalOnPlacementSurface( const CProp_Portal *pIgnorePortal, Vector &vOrigin, const QAngle &qAngles, const Vector &vForward, const Vector &vRight, const Vector &vUp, int iPlacedBy, bool bTest, ITraceFilter *pTraceFilterPortalShot, const trace_t &tr )
+{
+	Vector vOriginalOrigin = vOrigin;
+
 	// Check for invalid materials
 	if ( IsPassThroughMaterial( tr.surface ) )
 	{
@@ -1412,7 +1671,7 @@ float VerifyPortalPlacement( const CProp_Portal *pIgnorePortal, Vector &vOrigin,
 		Vector vRightEdge = vRight * ( PORTAL_HALF_WIDTH - PORTAL_BUMP_FORGIVENESS );
 		Vector vLeftEdge = -vRightEdge;
 
-		if ( !FitPortalOnSurface( pIgnorePortal, vOrigin, vForward, vRight, vTopEdge, vBottomEdge, vRightEdge, vLeftEdge, iPlacedBy, &traceFilterPortalShot ) )
+		if ( !FitPortalOnSurface( pIgnorePortal, vOrigin, vForward, vRight, vTopEdge, vBottomEdge, vRightEdge, vLeftEdge, iPlacedBy, pTraceFilterPortalShot ) )
 		{
 			if ( g_bBumpedByLinkedPortal )
 			{
@@ -1453,12 +1712,12 @@ float VerifyPortalPlacement( const CProp_Portal *pIgnorePortal, Vector &vOrigin,
 		{
 			Vector vSmallForward = vForward * 0.05f;
 			trace_t FloorTrace;
-			UTIL_TraceLine( vOrigin + vSmallForward, vOrigin + vSmallForward - (vUp * (PORTAL_HALF_HEIGHT + 1.5f)), MASK_SOLID_BRUSHONLY, &traceFilterPortalShot, &FloorTrace );
+			PortalPlacementTraceLine( vOrigin + vSmallForward, vOrigin + vSmallForward - (vUp * (PORTAL_HALF_HEIGHT + 1.5f)), MASK_SOLID_BRUSHONLY, pTraceFilterPortalShot, &FloorTrace );
 			if( FloorTrace.fraction < 1.0f )
 			{
 				//we hit floor in that 1 extra unit, now doublecheck to make sure we didn't hit something else
 				trace_t FloorTrace_Verify;
-				UTIL_TraceLine( vOrigin + vSmallForward, vOrigin + vSmallForward - (vUp * (PORTAL_HALF_HEIGHT - 0.1f)), MASK_SOLID_BRUSHONLY, &traceFilterPortalShot, &FloorTrace_Verify );
+				PortalPlacementTraceLine( vOrigin + vSmallForward, vOrigin + vSmallForward - (vUp * (PORTAL_HALF_HEIGHT - 0.1f)), MASK_SOLID_BRUSHONLY, pTraceFilterPortalShot, &FloorTrace_Verify );
 				if( FloorTrace_Verify.fraction == 1.0f )
 				{
 					//if we're in here, we're definitely in a floor matching configuration, bump down to match the floor better
@@ -1476,7 +1735,7 @@ float VerifyPortalPlacement( const CProp_Portal *pIgnorePortal, Vector &vOrigin,
 	}
 		
 	// Fail if it's on a flagged surface material
-	if ( !IsPortalOnValidSurface( vOrigin, vForward, vRight, vUp, &traceFilterPortalShot ) )
+	if ( !IsPortalOnValidSurface( vOrigin, vForward, vRight, vUp, pTraceFilterPortalShot ) )
 	{
 		if ( sv_portal_placement_debug.GetBool() )
 		{
@@ -0,0 +1,290 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Per-phase timing counters for portal simulators. Every phase keeps
+//			a rolling window of samples with a histogram over it, visible
+//			through VProf, a console command and a CSV dump.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "cbase.h"
+#include "portal_simulator_profiling.h"
+#include "tier0/threadtools.h"
+#include "filesystem.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define PORTAL_SIMULATOR_PROFILE_WINDOW 512 //samples kept per phase
+#define PORTAL_SIMULATOR_PROFILE_BUCKETS 10
+
+bool g_bPortalSimulatorProfileEnabled = false;
+
+static void PortalSimulatorProfileChanged( IConVar *var, const char *pOldValue, float flOldValue )
+{
+	g_bPortalSimulatorProfileEnabled = ((ConVar *)var)->GetBool();
+}
+
+static ConVar portal_simulator_profile( "portal_simulator_profile", "0", FCVAR_REPLICATED | FCVAR_CHEAT, "Record per-phase timings of portal simulator work. See portal_simulator_profile_print and portal_simulator_profile_dump_csv.", PortalSimulatorProfileChanged );
+
+static const char *s_szPhaseNames[PSPP_COUNT] =
+{
+	"polyhedron_carve",
+	"collision_creation",
+	"physics_creation",
+	"clone_sync",
+	"ownership_change",
+	"portal_trace",
+};
+
+//upper edge of each histogram bucket in milliseconds, the last bucket catches everything above
+static const float s_fBucketEdges[PORTAL_SIMULATOR_PROFILE_BUCKETS - 1] = { 0.05f, 0.1f, 0.25f, 0.5f, 1.0f, 2.0f, 4.0f, 8.0f, 16.0f };
+
+struct PortalSimulatorProfileSample_t
+{
+	float fMilliseconds;
+	int iTickCount;
+};
+
+struct PortalSimulatorPhaseProfile_t
+{
+	PortalSimulatorProfileSample_t Samples[PORTAL_SIMULATOR_PROFILE_WINDOW];
+	int iNextSample;
+	int iWindowCount;
+	int iBucketCounts[PORTAL_SIMULATOR_PROFILE_BUCKETS]; //over the samples in the window
+	int iTotalSamples;
+	double fTotalMilliseconds;
+	float fMaxMilliseconds;
+};
+
+static PortalSimulatorPhaseProfile_t s_PhaseProfiles[PSPP_COUNT];
+static CThreadFastMutex s_PhaseProfileMutex; //carves report from job threads
+static int s_iMainThreadPhaseDepth[PSPP_COUNT] = { 0 };
+
+static int GetHistogramBucket( float fMilliseconds )
+{
+	for( int i = 0; i != PORTAL_SIMULATOR_PROFILE_BUCKETS - 1; ++i )
+	{
+		if( fMilliseconds < s_fBucketEdges[i] )
+			return i;
+	}
+
+	return PORTAL_SIMULATOR_PROFILE_BUCKETS - 1;
+}
+
+const char *PortalSimulatorProfile_GetPhaseName( PortalSimulatorProfilePhase_t phase )
+{
+	Assert( (phase >= 0) && (phase < PSPP_COUNT) );
+	return s_szPhaseNames[phase];
+}
+
+bool PortalSimulatorProfile_IsEnabled( void )
+{
+	return portal_simulator_profile.GetBool();
+}
+
+void PortalSimulatorProfile_SetEnabled( bool bEnabled )
+{
+	portal_simulator_profile.SetValue( bEnabled );
+}
+
+void PortalSimulatorProfile_GetTotals( PortalSimulatorProfilePhase_t phase, int &iSamples, double &fTotalMilliseconds, float &fMaxMilliseconds )
+{
+	Assert( (phase >= 0) && (phase < PSPP_COUNT) );
+	AUTO_LOCK( s_PhaseProfileMutex );
+
+	const PortalSimulatorPhaseProfile_t &profile = s_PhaseProfiles[phase];
+	iSamples = profile.iTotalSamples;
+	fTotalMilliseconds = profile.fTotalMilliseconds;
+	fMaxMilliseconds = profile.fMaxMilliseconds;
+}
+
+void PortalSimulatorProfile_AddSample( PortalSimulatorProfilePhase_t phase, float fMilliseconds )
+{
+	Assert( (phase >= 0) && (phase < PSPP_COUNT) );
+	AUTO_LOCK( s_PhaseProfileMutex );
+
+	PortalSimulatorPhaseProfile_t &profile = s_PhaseProfiles[phase];
+	PortalSimulatorProfileSample_t &sample = profile.Samples[profile.iNextSample];
+
+	if( profile.iWindowCount == PORTAL_SIMULATOR_PROFILE_WINDOW )
+		--profile.iBucketCounts[GetHistogramBucket( sample.fMilliseconds )]; //rolling out of the window
+	else
+		++profile.iWindowCount;
+
+	sample.fMilliseconds = fMilliseconds;
+	sample.iTickCount = gpGlobals->tickcount;
+	++profile.iBucketCounts[GetHistogramBucket( fMilliseconds )];
+	profile.iNextSample = (profile.iNextSample + 1) % PORTAL_SIMULATOR_PROFILE_WINDOW;
+
+	++profile.iTotalSamples;
+	profile.fTotalMilliseconds += fMilliseconds;
+	if( fMilliseconds > profile.fMaxMilliseconds )
+		profile.fMaxMilliseconds = fMilliseconds;
+}
+
+void PortalSimulatorProfile_Reset( void )
+{
+	AUTO_LOCK( s_PhaseProfileMutex );
+	memset( s_PhaseProfiles, 0, sizeof( s_PhaseProfiles ) );
+}
+
+
+
+void CPortalSimulatorProfileScope::Begin( void )
+{
+	if( ThreadInMainThread() )
+	{
+		m_bCountsDepth = true;
+		if( s_iMainThreadPhaseDepth[m_Phase]++ != 0 )
+			return; //already inside this phase, the outer scope covers us
+	}
+
+	m_bRecording = true;
+	m_Timer.Start();
+}
+
+void CPortalSimulatorProfileScope::End( void )
+{
+	if( m_bCountsDepth )
+		--s_iMainThreadPhaseDepth[m_Phase];
+
+	if( m_bRecording )
+	{
+		m_Timer.End();
+		PortalSimulatorProfile_AddSample( m_Phase, m_Timer.GetDuration().GetMillisecondsF() );
+	}
+}
+
+
+
+static int SortProfileSamples( const float *pLeft, const float *pRight )
+{
+	if( *pLeft < *pRight )
+		return -1;
+
+	return (*pLeft > *pRight) ? 1 : 0;
+}
+
+static void PortalSimulatorProfile_Print( void )
+{
+	AUTO_LOCK( s_PhaseProfileMutex );
+
+	Msg( "Portal simulator profile (%s, last %d samples per phase)\n", portal_simulator_profile.GetBool() ? "recording" : "not recording", PORTAL_SIMULATOR_PROFILE_WINDOW );
+	for( int i = 0; i != PSPP_COUNT; ++i )
+	{
+		const PortalSimulatorPhaseProfile_t &profile = s_PhaseProfiles[i];
+		if( profile.iTotalSamples == 0 )
+		{
+			Msg( "  %-20s no samples\n", s_szPhaseNames[i] );
+			continue;
+		}
+
+		//percentiles come from a sorted copy of the window
+		CUtlVector<float> sorted;
+		sorted.EnsureCount( profile.iWindowCount );
+		for( int j = 0; j != profile.iWindowCount; ++j )
+			sorted[j] = profile.Samples[j].fMilliseconds;
+		sorted.Sort( SortProfileSamples );
+
+		Msg( "  %-20s total %d, avg %.3fms, max %.3fms | window median %.3fms, p95 %.3fms, p99 %.3fms\n",
+			s_szPhaseNames[i], profile.iTotalSamples, (float)(profile.fTotalMilliseconds / profile.iTotalSamples), profile.fMaxMilliseconds,
+			sorted[(sorted.Count() - 1) / 2], sorted[((sorted.Count() - 1) * 95) / 100], sorted[((sorted.Count() - 1) * 99) / 100] );
+
+		Msg( "  %-20s", "" );
+		for( int j = 0; j != PORTAL_SIMULATOR_PROFILE_BUCKETS; ++j )
+		{
+			if( j != PORTAL_SIMULATOR_PROFILE_BUCKETS - 1 )
+				Msg( " <%gms:%d", s_fBucketEdges[j], profile.iBucketCounts[j] );
+			else
+				Msg( " >=%gms:%d", s_fBucketEdges[j - 1], profile.iBucketCounts[j] );
+		}
+		Msg( "\n" );
+	}
+}
+
+static void PortalSimulatorProfile_DumpCSV( const char *pszFileName )
+{
+	//only ever write below the game's write path
+	if( V_IsAbsolutePath( pszFileName ) || V_strstr( pszFileName, ":" ) || V_strstr( pszFileName, ".." ) )
+	{
+		Warning( "Profile dumps must use a relative path without \"..\", not %s\n", pszFileName );
+		return;
+	}
+
+	FileHandle_t hFile = g_pFullFileSystem->Open( pszFileName, "wt", "DEFAULT_WRITE_PATH" );
+	if( hFile == FILESYSTEM_INVALID_HANDLE )
+	{
+		Warning( "Unable to open %s for writing\n", pszFileName );
+		return;
+	}
+
+#ifdef GAME_DLL
+	const char *pszMapName = STRING( gpGlobals->mapname );
+#else
+	const char *pszMapName = engine->GetLevelName();
+#endif
+
+	AUTO_LOCK( s_PhaseProfileMutex );
+
+	g_pFullFileSystem->FPrintf( hFile, "map,phase,tick,milliseconds\n" );
+	int iRowCount = 0;
+	for( int i = 0; i != PSPP_COUNT; ++i )
+	{
+		//oldest first
+		const PortalSimulatorPhaseProfile_t &profile = s_PhaseProfiles[i];
+		int iFirst = (profile.iWindowCount == PORTAL_SIMULATOR_PROFILE_WINDOW) ? profile.iNextSample : 0;
+		for( int j = 0; j != profile.iWindowCount; ++j )
+		{
+			const PortalSimulatorProfileSample_t &sample = profile.Samples[(iFirst + j) % PORTAL_SIMULATOR_PROFILE_WINDOW];
+			g_pFullFileSystem->FPrintf( hFile, "%s,%s,%d,%f\n", pszMapName, s_szPhaseNames[i], sample.iTickCount, sample.fMilliseconds );
+			++iRowCount;
+		}
+	}
+
+	g_pFullFileSystem->Close( hFile );
+	Msg( "Wrote %d portal simulator profile samples to %s\n", iRowCount, pszFileName );
+}
+
+#ifdef GAME_DLL
+CON_COMMAND( portal_simulator_profile_print, "Print server portal simulator timings per phase" )
+#else
+CON_COMMAND( cl_portal_simulator_profile_print, "Print client portal simulator timings per phase" )
+#endif
+{
+	PortalSimulatorProfile_Print();
+}
+
+#ifdef GAME_DLL
+CON_COMMAND( portal_simulator_profile_reset, "Throw away recorded server portal simulator timings" )
+#else
+CON_COMMAND( cl_portal_simulator_profile_reset, "Throw away recorded client portal simulator timings" )
+#endif
+{
+#ifdef GAME_DLL
+	if( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+#endif
+
+	PortalSimulatorProfile_Reset();
+}
+
+#ifdef GAME_DLL
+CON_COMMAND( portal_simulator_profile_dump_csv, "<filename> Write recorded server portal simulator timings as CSV" )
+#else
+CON_COMMAND( cl_portal_simulator_profile_dump_csv, "<filename> Write recorded client portal simulator timings as CSV" )
+#endif
+{
+#ifdef GAME_DLL
+	if( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+#endif
+
+	if( args.ArgC() < 2 )
+	{
+		Msg( "Usage: %s <filename>\n", args[0] );
+		return;
+	}
+
+	PortalSimulatorProfile_DumpCSV( args[1] );
+}
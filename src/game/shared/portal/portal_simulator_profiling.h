@@ -0,0 +1,82 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Per-phase timing counters for portal simulators. Every phase keeps
+//			a rolling window of samples with a histogram over it, visible
+//			through VProf, a console command and a CSV dump.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef PORTAL_SIMULATOR_PROFILING_H
+#define PORTAL_SIMULATOR_PROFILING_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/fasttimer.h"
+#include "tier0/vprof.h"
+
+#define VPROF_BUDGETGROUP_PORTAL_SIMULATION _T("Portal Simulation")
+
+enum PortalSimulatorProfilePhase_t
+{
+	PSPP_POLYHEDRON_CARVE = 0,
+	PSPP_COLLISION_CREATION,
+	PSPP_PHYSICS_CREATION,
+	PSPP_CLONE_SYNC,
+	PSPP_OWNERSHIP_CHANGE,
+	PSPP_PORTAL_TRACE,
+
+	PSPP_COUNT,
+};
+
+const char *PortalSimulatorProfile_GetPhaseName( PortalSimulatorProfilePhase_t phase );
+bool PortalSimulatorProfile_IsEnabled( void );
+void PortalSimulatorProfile_SetEnabled( bool bEnabled );
+void PortalSimulatorProfile_GetTotals( PortalSimulatorProfilePhase_t phase, int &iSamples, double &fTotalMilliseconds, float &fMaxMilliseconds );
+void PortalSimulatorProfile_AddSample( PortalSimulatorProfilePhase_t phase, float fMilliseconds );
+void PortalSimulatorProfile_Reset( void );
+
+extern bool g_bPortalSimulatorProfileEnabled; //mirrors portal_simulator_profile, scopes check this instead of the convar
+
+//-----------------------------------------------------------------------------
+// Purpose: Times a phase for as long as it's in scope. Phases call into each
+//			other recursively (CreateAllPhysics -> CreateLocalPhysics), only
+//			the outermost scope of a phase on the main thread adds a sample.
+//-----------------------------------------------------------------------------
+class CPortalSimulatorProfileScope
+{
+public:
+	CPortalSimulatorProfileScope( PortalSimulatorProfilePhase_t phase ) : m_Phase( phase ), m_bCountsDepth( false ), m_bRecording( false )
+	{
+		if( g_bPortalSimulatorProfileEnabled )
+			Begin();
+	}
+
+	~CPortalSimulatorProfileScope( void )
+	{
+		if( m_bCountsDepth || m_bRecording )
+			End();
+	}
+
+private:
+	void Begin( void );
+	void End( void );
+
+	PortalSimulatorProfilePhase_t m_Phase;
+	bool m_bCountsDepth;
+	bool m_bRecording;
+	CFastTimer m_Timer;
+};
+
+//VProf isn't safe off the main thread, jobs should create a CPortalSimulatorProfileScope by itself
+#define PORTAL_SIMULATOR_PROFILE_SCOPE( phase, name ) \
+	VPROF_BUDGET( name, VPROF_BUDGETGROUP_PORTAL_SIMULATION ); \
+	CPortalSimulatorProfileScope portalSimulatorProfileScope_##phase( phase )
+
+//for paths that run many times a tick like traces, leaves out VProf so it costs one test of a global when not recording
+#define PORTAL_SIMULATOR_PROFILE_HOT_SCOPE( phase ) \
+	CPortalSimulatorProfileScope portalSimulatorProfileScope_##phase( phase )
+
+#endif //#ifndef PORTAL_SIMULATOR_PROFILING_H
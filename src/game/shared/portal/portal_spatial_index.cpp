@@ -0,0 +1,280 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Bounding volume hierarchy over active portals so ray and box
+//			queries don't have to walk every portal in the map.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "cbase.h"
+#include "portal_spatial_index.h"
+#include "prop_portal_shared.h"
+#include "portal_util_shared.h"
+#include "collisionutils.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define PORTAL_SPATIAL_INDEX_BOUNDS_PADDING 1.0f //keep the portal quad safely inside its leaf bounds
+#define PORTAL_SPATIAL_INDEX_MAX_DEPTH 64
+
+CPortalSpatialIndex g_PortalSpatialIndex;
+
+CPortalSpatialIndex::CPortalSpatialIndex( void )
+: m_bTreeDirty( true ),
+  m_iRefitsSinceBuild( 0 )
+{
+}
+
+int CPortalSpatialIndex::FindEntry( const CProp_Portal *pPortal ) const
+{
+	for( int i = 0; i != m_Entries.Count(); ++i )
+	{
+		if( m_Entries[i].pPortal == pPortal )
+			return i;
+	}
+
+	return -1;
+}
+
+void CPortalSpatialIndex::AddPortal( CProp_Portal *pPortal )
+{
+	Assert( FindEntry( pPortal ) == -1 );
+
+	//portals are added from their constructor, so don't read any state from them yet. They're inactive until UpdatePortal() says otherwise
+	int iEntry = m_Entries.AddToTail();
+	PortalEntry_t &entry = m_Entries[iEntry];
+	entry.pPortal = pPortal;
+	entry.vMins.Init();
+	entry.vMaxs.Init();
+	entry.iLeafNode = -1;
+	entry.bActive = false;
+}
+
+void CPortalSpatialIndex::RemovePortal( CProp_Portal *pPortal )
+{
+	int iEntry = FindEntry( pPortal );
+	if( iEntry == -1 )
+		return;
+
+	if( m_Entries[iEntry].bActive )
+		m_bTreeDirty = true;
+
+	//leaves reference entries by index, so fast removal is only safe when the tree gets rebuilt anyways
+	m_Entries.FastRemove( iEntry );
+	if( !m_bTreeDirty && (iEntry != m_Entries.Count()) && m_Entries[iEntry].bActive )
+		m_Nodes[m_Entries[iEntry].iLeafNode].iEntry = iEntry;
+}
+
+void CPortalSpatialIndex::ComputeEntryBounds( PortalEntry_t &entry )
+{
+	UTIL_Portal_AABB( entry.pPortal, entry.vMins, entry.vMaxs );
+
+	Vector vPadding( PORTAL_SPATIAL_INDEX_BOUNDS_PADDING, PORTAL_SPATIAL_INDEX_BOUNDS_PADDING, PORTAL_SPATIAL_INDEX_BOUNDS_PADDING );
+	entry.vMins -= vPadding;
+	entry.vMaxs += vPadding;
+}
+
+void CPortalSpatialIndex::UpdatePortal( CProp_Portal *pPortal )
+{
+	int iEntry = FindEntry( pPortal );
+	if( iEntry == -1 )
+		return;
+
+	PortalEntry_t &entry = m_Entries[iEntry];
+	bool bActive = pPortal->IsActive();
+
+	if( bActive != entry.bActive )
+	{
+		//membership change, the tree has to be rebuilt
+		entry.bActive = bActive;
+		entry.iLeafNode = -1;
+		m_bTreeDirty = true;
+	}
+
+	if( !bActive )
+		return;
+
+	Vector vOldMins = entry.vMins;
+	Vector vOldMaxs = entry.vMaxs;
+	ComputeEntryBounds( entry );
+
+	//prediction restores call this every time, don't wear the tree down when nothing moved
+	if( (entry.vMins == vOldMins) && (entry.vMaxs == vOldMaxs) )
+		return;
+
+	if( !m_bTreeDirty && (entry.iLeafNode != -1) )
+	{
+		RefitLeaf( entry.iLeafNode );
+		++m_iRefitsSinceBuild;
+	}
+}
+
+void CPortalSpatialIndex::RefitLeaf( int iLeafNode )
+{
+	Node_t &leaf = m_Nodes[iLeafNode];
+	const PortalEntry_t &entry = m_Entries[leaf.iEntry];
+	leaf.vMins = entry.vMins;
+	leaf.vMaxs = entry.vMaxs;
+
+	//parents might have to grow or shrink, recompute them from their children all the way up
+	int iNode = leaf.iParent;
+	while( iNode != -1 )
+	{
+		Node_t &node = m_Nodes[iNode];
+		const Node_t &child0 = m_Nodes[node.iChildren[0]];
+		const Node_t &child1 = m_Nodes[node.iChildren[1]];
+		VectorMin( child0.vMins, child1.vMins, node.vMins );
+		VectorMax( child0.vMaxs, child1.vMaxs, node.vMaxs );
+		iNode = node.iParent;
+	}
+}
+
+void CPortalSpatialIndex::RebuildIfNeeded( void )
+{
+	//a refit tree stays correct, but bounds get loose as portals hop around the map
+	if( !m_bTreeDirty && (m_iRefitsSinceBuild <= m_Entries.Count()) )
+		return;
+
+	m_Nodes.RemoveAll();
+	m_bTreeDirty = false;
+	m_iRefitsSinceBuild = 0;
+
+	int iEntryCount = m_Entries.Count();
+	if( iEntryCount == 0 )
+		return;
+
+	int *pActiveEntries = (int *)stackalloc( sizeof( int ) * iEntryCount );
+	int iActiveCount = 0;
+	for( int i = 0; i != iEntryCount; ++i )
+	{
+		PortalEntry_t &entry = m_Entries[i];
+		entry.iLeafNode = -1;
+		if( entry.bActive )
+		{
+			ComputeEntryBounds( entry );
+			pActiveEntries[iActiveCount++] = i;
+		}
+	}
+
+	if( iActiveCount == 0 )
+		return;
+
+	m_Nodes.EnsureCapacity( (iActiveCount * 2) - 1 );
+	BuildRecursive( pActiveEntries, iActiveCount, -1 );
+}
+
+int CPortalSpatialIndex::BuildRecursive( int *pEntryIndices, int iCount, int iParent )
+{
+	Assert( iCount > 0 );
+
+	int iNode = m_Nodes.AddToTail();
+	{
+		Node_t &node = m_Nodes[iNode];
+		node.iParent = iParent;
+		node.iChildren[0] = node.iChildren[1] = -1;
+		node.iEntry = -1;
+		node.vMins = m_Entries[pEntryIndices[0]].vMins;
+		node.vMaxs = m_Entries[pEntryIndices[0]].vMaxs;
+		for( int i = 1; i < iCount; ++i )
+		{
+			const PortalEntry_t &entry = m_Entries[pEntryIndices[i]];
+			VectorMin( node.vMins, entry.vMins, node.vMins );
+			VectorMax( node.vMaxs, entry.vMaxs, node.vMaxs );
+		}
+
+		if( iCount == 1 )
+		{
+			node.iEntry = pEntryIndices[0];
+			m_Entries[node.iEntry].iLeafNode = iNode;
+			return iNode;
+		}
+	}
+
+	//split at the median centroid along the longest axis. Portal counts are small, an insertion sort is plenty
+	Vector vSize = m_Nodes[iNode].vMaxs - m_Nodes[iNode].vMins;
+	int iAxis = (vSize.x > vSize.y) ? ((vSize.x > vSize.z) ? 0 : 2) : ((vSize.y > vSize.z) ? 1 : 2);
+
+	for( int i = 1; i < iCount; ++i )
+	{
+		int iEntry = pEntryIndices[i];
+		float fCentroid = m_Entries[iEntry].vMins[iAxis] + m_Entries[iEntry].vMaxs[iAxis];
+		int j = i - 1;
+		while( (j >= 0) && ((m_Entries[pEntryIndices[j]].vMins[iAxis] + m_Entries[pEntryIndices[j]].vMaxs[iAxis]) > fCentroid) )
+		{
+			pEntryIndices[j + 1] = pEntryIndices[j];
+			--j;
+		}
+		pEntryIndices[j + 1] = iEntry;
+	}
+
+	int iHalf = iCount / 2;
+	int iChild0 = BuildRecursive( pEntryIndices, iHalf, iNode );
+	int iChild1 = BuildRecursive( pEntryIndices + iHalf, iCount - iHalf, iNode );
+	m_Nodes[iNode].iChildren[0] = iChild0;
+	m_Nodes[iNode].iChildren[1] = iChild1;
+
+	return iNode;
+}
+
+void CPortalSpatialIndex::EnumeratePortalsAlongRay( const Ray_t &ray, IPortalSpatialIndexEnumerator *pEnumerator )
+{
+	RebuildIfNeeded();
+
+	if( m_Nodes.Count() == 0 )
+		return;
+
+	int iStack[PORTAL_SPATIAL_INDEX_MAX_DEPTH];
+	int iStackCount = 0;
+	iStack[iStackCount++] = 0;
+
+	while( iStackCount != 0 )
+	{
+		const Node_t &node = m_Nodes[iStack[--iStackCount]];
+		if( !IsBoxIntersectingRay( node.vMins, node.vMaxs, ray ) )
+			continue;
+
+		if( node.iEntry != -1 )
+		{
+			if( !pEnumerator->EnumPortal( m_Entries[node.iEntry].pPortal ) )
+				return;
+		}
+		else
+		{
+			Assert( iStackCount + 2 <= PORTAL_SPATIAL_INDEX_MAX_DEPTH );
+			iStack[iStackCount++] = node.iChildren[1];
+			iStack[iStackCount++] = node.iChildren[0];
+		}
+	}
+}
+
+void CPortalSpatialIndex::EnumeratePortalsInBox( const Vector &vMins, const Vector &vMaxs, IPortalSpatialIndexEnumerator *pEnumerator )
+{
+	RebuildIfNeeded();
+
+	if( m_Nodes.Count() == 0 )
+		return;
+
+	int iStack[PORTAL_SPATIAL_INDEX_MAX_DEPTH];
+	int iStackCount = 0;
+	iStack[iStackCount++] = 0;
+
+	while( iStackCount != 0 )
+	{
+		const Node_t &node = m_Nodes[iStack[--iStackCount]];
+		if( !IsBoxIntersectingBox( node.vMins, node.vMaxs, vMins, vMaxs ) )
+			continue;
+
+		if( node.iEntry != -1 )
+		{
+			if( !pEnumerator->EnumPortal( m_Entries[node.iEntry].pPortal ) )
+				return;
+		}
+		else
+		{
+			Assert( iStackCount + 2 <= PORTAL_SPATIAL_INDEX_MAX_DEPTH );
+			iStack[iStackCount++] = node.iChildren[1];
+			iStack[iStackCount++] = node.iChildren[0];
+		}
+	}
+}
@@ -0,0 +1,83 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Bounding volume hierarchy over active portals so ray and box
+//			queries don't have to walk every portal in the map.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef PORTAL_SPATIAL_INDEX_H
+#define PORTAL_SPATIAL_INDEX_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "mathlib/vector.h"
+#include "tier1/utlvector.h"
+
+#ifdef CLIENT_DLL
+class C_Prop_Portal;
+typedef C_Prop_Portal CProp_Portal;
+#else
+class CProp_Portal;
+#endif
+
+struct Ray_t;
+
+//called for every portal whose bounds pass the query, return false to stop enumerating
+class IPortalSpatialIndexEnumerator
+{
+public:
+	virtual bool EnumPortal( CProp_Portal *pPortal ) = 0;
+};
+
+class CPortalSpatialIndex
+{
+public:
+	CPortalSpatialIndex( void );
+
+	void AddPortal( CProp_Portal *pPortal );
+	void RemovePortal( CProp_Portal *pPortal );
+	void UpdatePortal( CProp_Portal *pPortal ); //call whenever a portal moves or changes activation state
+
+	//enumerates active portals whose bounds the ray touches, in no particular order
+	void EnumeratePortalsAlongRay( const Ray_t &ray, IPortalSpatialIndexEnumerator *pEnumerator );
+
+	//enumerates active portals whose bounds overlap the box, in no particular order
+	void EnumeratePortalsInBox( const Vector &vMins, const Vector &vMaxs, IPortalSpatialIndexEnumerator *pEnumerator );
+
+private:
+	struct PortalEntry_t
+	{
+		CProp_Portal *pPortal;
+		Vector vMins;
+		Vector vMaxs;
+		int iLeafNode; //-1 when not in the tree (inactive)
+		bool bActive;
+	};
+
+	struct Node_t
+	{
+		Vector vMins;
+		Vector vMaxs;
+		int iParent;
+		int iChildren[2]; //both -1 for leaves
+		int iEntry; //leaf only
+	};
+
+	int FindEntry( const CProp_Portal *pPortal ) const;
+	void ComputeEntryBounds( PortalEntry_t &entry );
+	void RefitLeaf( int iLeafNode );
+	void RebuildIfNeeded( void );
+	int BuildRecursive( int *pEntryIndices, int iCount, int iParent );
+
+	CUtlVector<PortalEntry_t> m_Entries;
+	CUtlVector<Node_t> m_Nodes;
+	bool m_bTreeDirty;
+	int m_iRefitsSinceBuild; //refitting degrades the tree, rebuild once it's been done a lot
+};
+
+extern CPortalSpatialIndex g_PortalSpatialIndex;
+
+#endif //#ifndef PORTAL_SPATIAL_INDEX_H
@@ -19,11 +19,14 @@
 	#include "env_debughistory.h"
 	#include "portal_player.h"
 	#include "weapon_portalgun.h"
+	#include "ilagcompensationmanager.h"
 #else
 	#include "c_portal_player.h"
 	#include "c_weapon_portalgun.h"
 #endif
 #include "PortalSimulation.h"
+#include "portal_spatial_index.h"
+#include "portal_simulator_profiling.h"
 
 bool g_bAllowForcePortalTrace = false;
 bool g_bForcePortalTrace = false;
@@ -33,6 +36,7 @@ ConVar sv_portal_trace_vs_world ("sv_portal_trace_vs_world", "1", FCVAR_REPLICAT
 ConVar sv_portal_trace_vs_displacements ("sv_portal_trace_vs_displacements", "1", FCVAR_REPLICATED | FCVAR_CHEAT, "Use traces against portal environment displacement geometry" );
 ConVar sv_portal_trace_vs_holywall ("sv_portal_trace_vs_holywall", "1", FCVAR_REPLICATED | FCVAR_CHEAT, "Use traces against portal environment carved wall" );
 ConVar sv_portal_trace_vs_staticprops ("sv_portal_trace_vs_staticprops", "1", FCVAR_REPLICATED | FCVAR_CHEAT, "Use traces against portal environment static prop geometry" );
+ConVar sv_portal_trace_use_collision_tree ("sv_portal_trace_use_collision_tree", "1", FCVAR_REPLICATED | FCVAR_CHEAT, "Skip portal environment collideables whose polyhedron bounds a trace doesn't touch" );
 ConVar sv_use_find_closest_passable_space ("sv_use_find_closest_passable_space", "1", FCVAR_REPLICATED | FCVAR_CHEAT, "Enables heavy-handed player teleporting stuck fix code." );
 ConVar sv_use_transformed_collideables("sv_use_transformed_collideables", "1", FCVAR_REPLICATED | FCVAR_CHEAT, "Disables traces against remote portal moving entities using transforms to bring them into local space." );
 class CTransformedCollideable : public ICollideable //wraps an existing collideable, but transforms everything that pertains to world space by another transform
@@ -353,69 +357,120 @@ void UTIL_Portal_Trace_Filter( CTraceFilterSimpleClassnameList *traceFilterPorta
 
 }
 
-CProp_Portal* UTIL_Portal_FirstAlongRay( const Ray_t &ray, float &fMustBeCloserThan )
+class CPortalFirstAlongRayEnumerator : public IPortalSpatialIndexEnumerator
 {
-	CProp_Portal *pIntersectedPortal = NULL;
+public:
+	CPortalFirstAlongRayEnumerator( const Ray_t &ray, float fMustBeCloserThan, bool bRequireLinked )
+		: m_Ray( ray ), m_fMustBeCloserThan( fMustBeCloserThan ), m_bRequireLinked( bRequireLinked ), m_pIntersectedPortal( NULL ), m_iCandidateCount( 0 )
+	{
+	}
 
-	int iPortalCount = CProp_Portal_Shared::AllPortals.Count();
-	if( iPortalCount != 0 )
+	virtual bool EnumPortal( CProp_Portal *pPortal )
 	{
-		CProp_Portal **pPortals = CProp_Portal_Shared::AllPortals.Base();
+		if( m_bRequireLinked ? !pPortal->IsActivedAndLinked() : !pPortal->IsActive() )
+			return true;
 
-		for( int i = 0; i != iPortalCount; ++i )
+		//candidates get tested four at a time
+		m_pCandidates[m_iCandidateCount++] = pPortal;
+		if( m_iCandidateCount == 4 )
+			TestCandidates();
+
+		return true;
+	}
+
+	void TestCandidates( void )
+	{
+		if( m_iCandidateCount == 0 )
+			return;
+
+		FourPortals_t portals;
+		UTIL_Portal_LoadFourPortals( m_pCandidates, m_iCandidateCount, portals );
+		fltx4 fIntersections = UTIL_IntersectRayWithFourPortals( m_Ray, portals );
+
+		//the kernel already threw out portals facing away from the ray, the closest hit wins
+		for( int i = 0; i != m_iCandidateCount; ++i )
 		{
-			CProp_Portal *pTempPortal = pPortals[i];
-			if( pTempPortal->IsActivedAndLinked() )
+			float fIntersection = SubFloat( fIntersections, i );
+			if( fIntersection >= 0.0f && fIntersection < m_fMustBeCloserThan )
 			{
-				float fIntersection = UTIL_IntersectRayWithPortal( ray, pTempPortal );
-				if( fIntersection >= 0.0f && fIntersection < fMustBeCloserThan )
-				{
-					//within range, now check directionality
-					if( pTempPortal->m_plane_Origin.normal.Dot( ray.m_Delta ) < 0.0f )
-					{
-						//qualifies for consideration, now it just has to compete for closest
-						pIntersectedPortal = pTempPortal;
-						fMustBeCloserThan = fIntersection;
-					}
-				}
+				m_pIntersectedPortal = m_pCandidates[i];
+				m_fMustBeCloserThan = fIntersection;
 			}
 		}
+
+		m_iCandidateCount = 0;
 	}
 
-	return pIntersectedPortal;
+	const Ray_t &m_Ray;
+	float m_fMustBeCloserThan;
+	bool m_bRequireLinked;
+	CProp_Portal *m_pIntersectedPortal;
+	CProp_Portal *m_pCandidates[4];
+	int m_iCandidateCount;
+};
+
+CProp_Portal* UTIL_Portal_FirstAlongRay( const Ray_t &ray, float &fMustBeCloserThan )
+{
+	CPortalFirstAlongRayEnumerator enumerator( ray, fMustBeCloserThan, true );
+	g_PortalSpatialIndex.EnumeratePortalsAlongRay( ray, &enumerator );
+	enumerator.TestCandidates();
+
+	fMustBeCloserThan = enumerator.m_fMustBeCloserThan;
+	return enumerator.m_pIntersectedPortal;
 }
 
 // Only requires active portal, not linked
 CProp_Portal* UTIL_Portal_FirstAlongRayAll(const Ray_t &ray, float &fMustBeCloserThan)
 {
-    CProp_Portal *pIntersectedPortal = NULL;
-
-    int iPortalCount = CProp_Portal_Shared::AllPortals.Count();
-    if (iPortalCount != 0)
-    {
-        CProp_Portal **pPortals = CProp_Portal_Shared::AllPortals.Base();
-
-        for (int i = 0; i != iPortalCount; ++i)
-        {
-            CProp_Portal *pTempPortal = pPortals[i];
-            if (pTempPortal->IsActive())
-            {
-                float fIntersection = UTIL_IntersectRayWithPortal(ray, pTempPortal);
-                if (fIntersection >= 0.0f && fIntersection < fMustBeCloserThan)
-                {
-                    //within range, now check directionality
-                    if (pTempPortal->m_plane_Origin.normal.Dot(ray.m_Delta) < 0.0f)
-                    {
-                        //qualifies for consideration, now it just has to compete for closest
-                        pIntersectedPortal = pTempPortal;
-                        fMustBeCloserThan = fIntersection;
-                    }
-                }
-            }
-        }
-    }
-
-    return pIntersectedPortal;
+	CPortalFirstAlongRayEnumerator enumerator( ray, fMustBeCloserThan, false );
+	g_PortalSpatialIndex.EnumeratePortalsAlongRay( ray, &enumerator );
+	enumerator.TestCandidates();
+
+	fMustBeCloserThan = enumerator.m_fMustBeCloserThan;
+	return enumerator.m_pIntersectedPortal;
+}
+
+void UTIL_Portal_FirstAlongRays( const Ray_t *pRays, int iRayCount, CProp_Portal **pPortalsOut, float *pMustBeCloserThan )
+{
+	//swizzle every linked portal once and sweep all the rays over them, cheaper than a tree walk per ray for pellet sized batches
+	int iPortalCount = CProp_Portal_Shared::AllPortals.Count();
+	CProp_Portal **pLinkedPortals = (CProp_Portal **)stackalloc( sizeof( CProp_Portal * ) * (iPortalCount + 1) );
+	int iLinkedCount = 0;
+	for( int i = 0; i != iPortalCount; ++i )
+	{
+		CProp_Portal *pPortal = CProp_Portal_Shared::AllPortals[i];
+		if( pPortal->IsActivedAndLinked() )
+			pLinkedPortals[iLinkedCount++] = pPortal;
+	}
+
+	for( int iRay = 0; iRay != iRayCount; ++iRay )
+		pPortalsOut[iRay] = NULL;
+
+	if( iLinkedCount == 0 )
+		return;
+
+	CUtlVector< FourPortals_t, CUtlMemoryAligned< FourPortals_t, 16 > > PortalBlocks;
+	PortalBlocks.SetCount( (iLinkedCount + 3) / 4 );
+	for( int i = 0; i != PortalBlocks.Count(); ++i )
+		UTIL_Portal_LoadFourPortals( &pLinkedPortals[i * 4], MIN( 4, iLinkedCount - (i * 4) ), PortalBlocks[i] );
+
+	for( int iRay = 0; iRay != iRayCount; ++iRay )
+	{
+		for( int i = 0; i != PortalBlocks.Count(); ++i )
+		{
+			const FourPortals_t &portals = PortalBlocks[i];
+			fltx4 fIntersections = UTIL_IntersectRayWithFourPortals( pRays[iRay], portals );
+			for( int j = 0; j != 4; ++j )
+			{
+				float fIntersection = SubFloat( fIntersections, j );
+				if( fIntersection >= 0.0f && fIntersection < pMustBeCloserThan[iRay] )
+				{
+					pPortalsOut[iRay] = (CProp_Portal *)portals.pPortals[j];
+					pMustBeCloserThan[iRay] = fIntersection;
+				}
+			}
+		}
+	}
 }
 
 
@@ -777,8 +832,16 @@ CProp_Portal* UTIL_Portal_TraceRay( const Ray_t &ray, unsigned int fMask, const
 //			*pTrace - the trace struct to fill in with results
 //			bTraceHolyWall - if this trace is to test against the 'holy wall' geometry
 //-----------------------------------------------------------------------------
+//groups past the end of the hit list belong to a tree that hasn't been built, so they have to be traced
+static inline bool PortalCollisionGroupMayHit( const bool *pGroupHits, int iGroupCount, int iGroup )
+{
+	return (iGroup >= iGroupCount) || pGroupHits[iGroup];
+}
+
 void UTIL_Portal_TraceRay( const CProp_Portal *pPortal, const Ray_t &ray, unsigned int fMask, ITraceFilter *pTraceFilter, trace_t *pTrace, bool bTraceHolyWall )
 {
+	PORTAL_SIMULATOR_PROFILE_HOT_SCOPE( PSPP_PORTAL_TRACE );
+
 #ifdef CLIENT_DLL
 	Assert( (GameRules() == NULL) || GameRules()->IsMultiplayer() );
 #endif
@@ -809,6 +872,33 @@ void UTIL_Portal_TraceRay( const CProp_Portal *pPortal, const Ray_t &ray, unsign
 
 	bool bCopyBackBrushTraceData = false;
 
+	//find out which of the static collideables the ray could touch at all
+	int iLocalGroupCount = 0;
+	bool *pLocalGroupHits = NULL;
+	int iLinkedGroupCount = 0;
+	bool *pLinkedGroupHits = NULL;
+	if( sv_portal_trace_use_collision_tree.GetBool() )
+	{
+		const CPortalCollisionTree &localTree = portalSimulator.GetInternalData().Simulation.Static.CollisionTree;
+		iLocalGroupCount = localTree.GetGroupCount();
+		if( iLocalGroupCount != 0 )
+		{
+			pLocalGroupHits = (bool *)stackalloc( sizeof( bool ) * iLocalGroupCount );
+			localTree.EnumerateGroupsAlongRay( ray, pLocalGroupHits );
+		}
+
+		if( bTraceTransformedGeometry )
+		{
+			const CPortalCollisionTree &linkedTree = pLinkedPortalSimulator->GetInternalData().Simulation.Static.CollisionTree;
+			iLinkedGroupCount = linkedTree.GetGroupCount();
+			if( iLinkedGroupCount != 0 )
+			{
+				pLinkedGroupHits = (bool *)stackalloc( sizeof( bool ) * iLinkedGroupCount );
+				linkedTree.EnumerateGroupsAlongTransformedRay( ray, portalSimulator.GetInternalData().Placement.matThisToLinked, pLinkedGroupHits );
+			}
+		}
+	}
+
 	
 
 	// Traces vs world
@@ -816,7 +906,8 @@ void UTIL_Portal_TraceRay( const CProp_Portal *pPortal, const Ray_t &ray, unsign
 	{
 		//trace_t RealTrace;
 		//enginetrace->TraceRay( ray, fMask, pTraceFilter, &RealTrace );
-		if( portalSimulator.GetInternalData().Simulation.Static.World.Brushes.pCollideable && sv_portal_trace_vs_world.GetBool() )
+		if( portalSimulator.GetInternalData().Simulation.Static.World.Brushes.pCollideable && sv_portal_trace_vs_world.GetBool() &&
+			PortalCollisionGroupMayHit( pLocalGroupHits, iLocalGroupCount, PCTG_WORLD_BRUSHES ) )
 		{
 			physcollision->TraceBox( ray, portalSimulator.GetInternalData().Simulation.Static.World.Brushes.pCollideable, vec3_origin, vec3_angle, pTrace );
 			bCopyBackBrushTraceData = true;
@@ -824,7 +915,8 @@ void UTIL_Portal_TraceRay( const CProp_Portal *pPortal, const Ray_t &ray, unsign
 
 		if( bTraceHolyWall )
 		{
-			if( portalSimulator.GetInternalData().Simulation.Static.Wall.Local.Tube.pCollideable )
+			if( portalSimulator.GetInternalData().Simulation.Static.Wall.Local.Tube.pCollideable &&
+				PortalCollisionGroupMayHit( pLocalGroupHits, iLocalGroupCount, PCTG_WALL_TUBE ) )
 			{
 				physcollision->TraceBox( ray, portalSimulator.GetInternalData().Simulation.Static.Wall.Local.Tube.pCollideable, vec3_origin, vec3_angle, &TempTrace );
 
@@ -835,7 +927,8 @@ void UTIL_Portal_TraceRay( const CProp_Portal *pPortal, const Ray_t &ray, unsign
 				}
 			}
 
-			if( portalSimulator.GetInternalData().Simulation.Static.Wall.Local.Brushes.pCollideable )
+			if( portalSimulator.GetInternalData().Simulation.Static.Wall.Local.Brushes.pCollideable &&
+				PortalCollisionGroupMayHit( pLocalGroupHits, iLocalGroupCount, PCTG_WALL_BRUSHES ) )
 			{
 				physcollision->TraceBox( ray, portalSimulator.GetInternalData().Simulation.Static.Wall.Local.Brushes.pCollideable, vec3_origin, vec3_angle, &TempTrace );
 				if( (TempTrace.fraction < pTrace->fraction) )
@@ -846,7 +939,8 @@ void UTIL_Portal_TraceRay( const CProp_Portal *pPortal, const Ray_t &ray, unsign
 			}
 
 			//if( portalSimulator.GetInternalData().Simulation.Static.Wall.RemoteTransformedToLocal.Brushes.pCollideable && sv_portal_trace_vs_world.GetBool() )
-			if( bTraceTransformedGeometry && pLinkedPortalSimulator->GetInternalData().Simulation.Static.World.Brushes.pCollideable )
+			if( bTraceTransformedGeometry && pLinkedPortalSimulator->GetInternalData().Simulation.Static.World.Brushes.pCollideable &&
+				PortalCollisionGroupMayHit( pLinkedGroupHits, iLinkedGroupCount, PCTG_WORLD_BRUSHES ) )
 			{
 				physcollision->TraceBox( ray, pLinkedPortalSimulator->GetInternalData().Simulation.Static.World.Brushes.pCollideable, portalSimulator.GetInternalData().Placement.ptaap_LinkedToThis.ptOriginTransform, portalSimulator.GetInternalData().Placement.ptaap_LinkedToThis.qAngleTransform, &TempTrace );
 				if( (TempTrace.fraction < pTrace->fraction) )
@@ -913,10 +1007,12 @@ void UTIL_Portal_TraceRay( const CProp_Portal *pPortal, const Ray_t &ray, unsign
 					const PS_SD_Static_World_StaticProps_ClippedProp_t *pStop = pCurrentProp + iLocalStaticCount;
 					Vector vTransform = vec3_origin;
 					QAngle qTransform = vec3_angle;
+					int iGroup = PCTG_STATIC_PROPS;
 
 					do
 					{
-						if( (!bFilterStaticProps) || pTraceFilter->ShouldHitEntity( pCurrentProp->pSourceProp, fMask ) )
+						if( PortalCollisionGroupMayHit( pLocalGroupHits, iLocalGroupCount, iGroup ) &&
+							((!bFilterStaticProps) || pTraceFilter->ShouldHitEntity( pCurrentProp->pSourceProp, fMask )) )
 						{
 							physcollision->TraceBox( ray, pCurrentProp->pCollide, vTransform, qTransform, &TempTrace );
 							if( (TempTrace.fraction < pTrace->fraction) )
@@ -931,6 +1027,7 @@ void UTIL_Portal_TraceRay( const CProp_Portal *pPortal, const Ray_t &ray, unsign
 						}
 
 						++pCurrentProp;
+						++iGroup;
 					}
 					while( pCurrentProp != pStop );
 				}
@@ -948,10 +1045,12 @@ void UTIL_Portal_TraceRay( const CProp_Portal *pPortal, const Ray_t &ray, unsign
 						const PS_SD_Static_World_StaticProps_ClippedProp_t *pStop = pCurrentProp + iLocalStaticCount;
 						Vector vTransform = portalSimulator.GetInternalData().Placement.ptaap_LinkedToThis.ptOriginTransform;
 						QAngle qTransform = portalSimulator.GetInternalData().Placement.ptaap_LinkedToThis.qAngleTransform;
+						int iGroup = PCTG_STATIC_PROPS;
 
 						do
 						{
-							if( (!bFilterStaticProps) || pTraceFilter->ShouldHitEntity( pCurrentProp->pSourceProp, fMask ) )
+							if( PortalCollisionGroupMayHit( pLinkedGroupHits, iLinkedGroupCount, iGroup ) &&
+								((!bFilterStaticProps) || pTraceFilter->ShouldHitEntity( pCurrentProp->pSourceProp, fMask )) )
 							{
 								physcollision->TraceBox( ray, pCurrentProp->pCollide, vTransform, qTransform, &TempTrace );
 								if( (TempTrace.fraction < pTrace->fraction) )
@@ -966,6 +1065,7 @@ void UTIL_Portal_TraceRay( const CProp_Portal *pPortal, const Ray_t &ray, unsign
 							}
 
 							++pCurrentProp;
+							++iGroup;
 						}
 						while( pCurrentProp != pStop );
 					}
@@ -1071,6 +1171,14 @@ void UTIL_Portal_TraceEntity( CBaseEntity *pEntity, const Vector &vecAbsStart, c
 	*/
 
 	CPortalSimulator *pPortalSimulator = CPortalSimulator::GetSimulatorThatOwnsEntity( pEntity );
+#ifndef CLIENT_DLL
+	// lag compensation rewinds a player's portal environment handle but not simulator ownership
+	if( pEntity->IsPlayer() && lagcompensation->IsCurrentlyDoingLagCompensation() )
+	{
+		CProp_Portal *pPortal = ((CPortal_Player *)pEntity)->m_hPortalEnvironment.Get();
+		pPortalSimulator = (pPortal && pPortal->IsActivedAndLinked()) ? &pPortal->m_PortalSimulator : NULL;
+	}
+#endif
 
 	memset( pTrace, 0, sizeof(trace_t));
 	pTrace->fraction = 1.0f;
@@ -1644,6 +1752,93 @@ float UTIL_IntersectRayWithPortal( const Ray_t &ray, const CProp_Portal *pPortal
 	return IntersectRayWithTriangle( ray, pvTri2[ 0 ], pvTri2[ 1 ], pvTri2[ 2 ], false );
 }
 
+void UTIL_Portal_LoadFourPortals( const CProp_Portal * const *pPortals, int iPortalCount, FourPortals_t &portalsOut )
+{
+	Assert( iPortalCount <= 4 );
+
+	Vector vOrigins[4], vForwards[4], vRights[4], vUps[4];
+	fltx4 fValid = Four_Zeros;
+	for( int i = 0; i != 4; ++i )
+	{
+		const CProp_Portal *pPortal = (i < iPortalCount) ? pPortals[i] : NULL;
+		portalsOut.pPortals[i] = pPortal;
+
+		if( pPortal && pPortal->IsActive() )
+		{
+			vOrigins[i] = pPortal->m_ptOrigin;
+			AngleVectors( pPortal->m_qAbsAngle, &vForwards[i], &vRights[i], &vUps[i] ); //same basis UTIL_Portal_Triangles() builds the quad from
+			SubFloat( fValid, i ) = 1.0f;
+		}
+		else
+		{
+			//a zero forward vector fails the facing test all by itself
+			vOrigins[i].Init();
+			vForwards[i].Init();
+			vRights[i].Init();
+			vUps[i].Init();
+		}
+	}
+
+	portalsOut.vOrigin.LoadAndSwizzle( vOrigins[0], vOrigins[1], vOrigins[2], vOrigins[3] );
+	portalsOut.vForward.LoadAndSwizzle( vForwards[0], vForwards[1], vForwards[2], vForwards[3] );
+	portalsOut.vRight.LoadAndSwizzle( vRights[0], vRights[1], vRights[2], vRights[3] );
+	portalsOut.vUp.LoadAndSwizzle( vUps[0], vUps[1], vUps[2], vUps[3] );
+	portalsOut.fValidMask = CmpGtSIMD( fValid, Four_Zeros );
+}
+
+fltx4 UTIL_IntersectRayWithFourPortals( const Ray_t &ray, const FourPortals_t &portals )
+{
+	FourVectors vStart, vDelta;
+	vStart.DuplicateVector( ray.m_Start );
+	vDelta.DuplicateVector( ray.m_Delta );
+
+	// Discount rays not coming from the front of the portal, this also gets rid of rays parallel to the portal plane
+	fltx4 fDeltaDotForward = portals.vForward * vDelta;
+	fltx4 fHitMask = AndSIMD( portals.fValidMask, CmpLtSIMD( fDeltaDotForward, Four_Zeros ) );
+	if( IsAllZeros( fHitMask ) )
+		return Four_NegativeOnes;
+
+	// Intersect with the portal plane, keeping the divide away from zero in rejected lanes
+	FourVectors vStartToOrigin = portals.vOrigin;
+	vStartToOrigin -= vStart;
+	fltx4 fT = DivSIMD( portals.vForward * vStartToOrigin, MaskedAssign( fHitMask, fDeltaDotForward, Four_NegativeOnes ) );
+
+	// The plane hit has to land inside the portal quad, which is the pair of triangles from UTIL_Portal_Triangles()
+	FourVectors vOriginToHit = vDelta;
+	vOriginToHit *= fT;
+	vOriginToHit -= vStartToOrigin;
+	fHitMask = AndSIMD( fHitMask, CmpInBoundsSIMD( portals.vRight * vOriginToHit, ReplicateX4( PORTAL_HALF_WIDTH ) ) );
+	fHitMask = AndSIMD( fHitMask, CmpInBoundsSIMD( portals.vUp * vOriginToHit, ReplicateX4( PORTAL_HALF_HEIGHT ) ) );
+
+	// same slop IntersectRayWithTriangle() gives swept boxes
+	fltx4 fBoxT = ReplicateX4( ComputeBoxOffset( ray ) );
+	fHitMask = AndSIMD( fHitMask, CmpGeSIMD( fT, NegSIMD( fBoxT ) ) );
+	fHitMask = AndSIMD( fHitMask, CmpLeSIMD( fT, AddSIMD( Four_Ones, fBoxT ) ) );
+
+	fT = MinSIMD( MaxSIMD( fT, Four_Zeros ), Four_Ones );
+	return MaskedAssign( fHitMask, fT, Four_NegativeOnes );
+}
+
+void UTIL_IntersectRaysWithPortals( const Ray_t *pRays, int iRayCount, const CProp_Portal * const *pPortals, int iPortalCount, float *pFractionsOut )
+{
+	for( int iPortal = 0; iPortal < iPortalCount; iPortal += 4 )
+	{
+		int iBlockCount = MIN( 4, iPortalCount - iPortal );
+
+		FourPortals_t portals;
+		UTIL_Portal_LoadFourPortals( &pPortals[iPortal], iBlockCount, portals );
+
+		for( int iRay = 0; iRay != iRayCount; ++iRay )
+		{
+			fltx4 fIntersections = UTIL_IntersectRayWithFourPortals( pRays[iRay], portals );
+
+			float *pOut = &pFractionsOut[(iRay * iPortalCount) + iPortal];
+			for( int i = 0; i != iBlockCount; ++i )
+				pOut[i] = SubFloat( fIntersections, i );
+		}
+	}
+}
+
 bool UTIL_IntersectRayWithPortalOBB( const CProp_Portal *pPortal, const Ray_t &ray, trace_t *pTrace )
 {
 	return IntersectRayWithOBB( ray, pPortal->m_ptOrigin, pPortal->m_qAbsAngle, CProp_Portal_Shared::vLocalMins, CProp_Portal_Shared::vLocalMaxs, 0.0f, pTrace );
@@ -1691,54 +1886,56 @@ bool UTIL_IsBoxIntersectingPortal( const Vector &vecBoxCenter, const Vector &vec
 	return UTIL_IsBoxIntersectingPortal( vecBoxCenter, vecBoxExtents, pPortal->m_ptOrigin, pPortal->m_qAbsAngle, flTolerance );
 }
 
-CProp_Portal *UTIL_IntersectEntityExtentsWithPortal( const CBaseEntity *pEntity )
+//finds the first active and linked portal whose quad intersects the box
+class CPortalBoxIntersectionEnumerator : public IPortalSpatialIndexEnumerator
 {
-	int iPortalCount = CProp_Portal_Shared::AllPortals.Count();
-	if( iPortalCount == 0 )
-		return NULL;
-
-	Vector vMin, vMax;
-	pEntity->CollisionProp()->WorldSpaceAABB( &vMin, &vMax );
-	Vector ptCenter = ( vMin + vMax ) * 0.5f;
-	Vector vExtents = ( vMax - vMin ) * 0.5f;
+public:
+	CPortalBoxIntersectionEnumerator( const Vector &ptCenter, const Vector &vExtents )
+		: m_ptCenter( ptCenter ), m_vExtents( vExtents ), m_pIntersectedPortal( NULL )
+	{
+	}
 
-	CProp_Portal **pPortals = CProp_Portal_Shared::AllPortals.Base();
-	for( int i = 0; i != iPortalCount; ++i )
+	virtual bool EnumPortal( CProp_Portal *pPortal )
 	{
-		CProp_Portal *pTempPortal = pPortals[i];
-		if (pTempPortal->IsActive() &&
-			(pTempPortal->m_hLinkedPortal.Get() != NULL) &&
-			UTIL_IsBoxIntersectingPortal( ptCenter, vExtents, pTempPortal )	)
+		if( pPortal->IsActive() &&
+			(pPortal->m_hLinkedPortal.Get() != NULL) &&
+			UTIL_IsBoxIntersectingPortal( m_ptCenter, m_vExtents, pPortal ) )
 		{
-			return pPortals[i];
+			m_pIntersectedPortal = pPortal;
+			return false;
 		}
+
+		return true;
 	}
 
-	return NULL;
+	const Vector &m_ptCenter;
+	const Vector &m_vExtents;
+	CProp_Portal *m_pIntersectedPortal;
+};
+
+CProp_Portal *UTIL_IntersectEntityExtentsWithPortal( const CBaseEntity *pEntity )
+{
+	if( CProp_Portal_Shared::AllPortals.Count() == 0 )
+		return NULL;
+
+	Vector vMin, vMax;
+	pEntity->CollisionProp()->WorldSpaceAABB( &vMin, &vMax );
+
+	return UTIL_IntersectBoxExtentsWithPortal( vMin, vMax );
 }
 
 CProp_Portal *UTIL_IntersectBoxExtentsWithPortal( Vector vMin, Vector vMax )
 {
-	int iPortalCount = CProp_Portal_Shared::AllPortals.Count();
-	if( iPortalCount == 0 )
+	if( CProp_Portal_Shared::AllPortals.Count() == 0 )
 		return NULL;
 
 	Vector ptCenter = ( vMin + vMax ) * 0.5f;
 	Vector vExtents = ( vMax - vMin ) * 0.5f;
 
-	CProp_Portal **pPortals = CProp_Portal_Shared::AllPortals.Base();
-	for( int i = 0; i != iPortalCount; ++i )
-	{
-		CProp_Portal *pTempPortal = pPortals[i];
-		if (pTempPortal->IsActive() &&
-			(pTempPortal->m_hLinkedPortal.Get() != NULL) &&
-			UTIL_IsBoxIntersectingPortal( ptCenter, vExtents, pTempPortal )	)
-		{
-			return pPortals[i];
-		}
-	}
+	CPortalBoxIntersectionEnumerator enumerator( ptCenter, vExtents );
+	g_PortalSpatialIndex.EnumeratePortalsInBox( vMin, vMax, &enumerator );
 
-	return NULL;
+	return enumerator.m_pIntersectedPortal;
 }
 
 bool UTIL_EntityIsIntersectingFloorPortal(const CBaseEntity *pEntity)
@@ -11,6 +11,7 @@
 #endif
 
 #include "engine/IEngineTrace.h"
+#include "mathlib/ssemath.h"
 
 extern ConVar sv_portal_with_gamemovement;
 
@@ -104,6 +105,35 @@ float UTIL_Portal_ShortestDistanceSqr( const Vector &vPoint1, const Vector &vPoi
 //-----------------------------------------------------------------------------
 float UTIL_IntersectRayWithPortal( const Ray_t &ray, const CProp_Portal *pPortal );
 
+//-----------------------------------------------------------------------------
+//
+// UTIL_IntersectRayWithFourPortals
+//
+// SIMD version of UTIL_IntersectRayWithPortal() that tests one ray against
+// up to four portals loaded with UTIL_Portal_LoadFourPortals(). Each lane
+// holds t along the ray, or -1 when that portal wasn't hit.
+//
+//-----------------------------------------------------------------------------
+class ALIGN16 FourPortals_t
+{
+public:
+	FourVectors vOrigin;
+	FourVectors vForward;
+	FourVectors vRight;
+	FourVectors vUp;
+	fltx4 fValidMask; //~0 in lanes that hold an active portal
+	const CProp_Portal *pPortals[4];
+};
+
+void UTIL_Portal_LoadFourPortals( const CProp_Portal * const *pPortals, int iPortalCount, FourPortals_t &portalsOut );
+fltx4 UTIL_IntersectRayWithFourPortals( const Ray_t &ray, const FourPortals_t &portals );
+
+//fractions are written ray major, pFractionsOut[(iRay * iPortalCount) + iPortal], -1 for misses
+void UTIL_IntersectRaysWithPortals( const Ray_t *pRays, int iRayCount, const CProp_Portal * const *pPortals, int iPortalCount, float *pFractionsOut );
+
+//UTIL_Portal_FirstAlongRay() for many rays at once, pMustBeCloserThan is read and written per ray
+void UTIL_Portal_FirstAlongRays( const Ray_t *pRays, int iRayCount, CProp_Portal **pPortalsOut, float *pMustBeCloserThan );
+
 bool UTIL_IntersectRayWithPortalOBB( const CProp_Portal *pPortal, const Ray_t &ray, trace_t *pTrace );
 bool UTIL_IntersectRayWithPortalOBBAsAABB( const CProp_Portal *pPortal, const Ray_t &ray, trace_t *pTrace );
 
@@ -16,6 +16,7 @@
 #include "collisionutils.h"
 #include "weapon_physcannon.h"
 #include "portal_gamemovement.h"
+#include "portal_spatial_index.h"
 
 #ifdef CLIENT_DLL
 #include "c_func_portal_orientation.h"
@@ -33,6 +34,7 @@ extern CMoveData *g_pMoveData;
 extern IGameMovement *g_pGameMovement;
 
 ConVar sv_portal_unified_velocity( "sv_portal_unified_velocity", "1", FCVAR_REPLICATED, "An attempt at removing patchwork velocity tranformation in portals, moving to a unified approach." );
+ConVar sv_portal_placement_compact_network( "sv_portal_placement_compact_network", "1", FCVAR_REPLICATED | FCVAR_CHEAT, "Snap portals on axis aligned surfaces to a quantized placement and network it as a few small ints instead of full precision vectors." );
 extern ConVar sv_allow_customized_portal_colors;
 
 extern ConVar sv_portal_debug_touch;
@@ -62,6 +64,92 @@ void CProp_Portal_Shared::UpdatePortalTransformationMatrix( const matrix3x4_t &l
 	*pMatrix = matPortal2ToWorld * matRotation * matPortal1ToWorldInv;
 }
 
+#define PORTAL_PLACEMENT_AXIS_EPSILON 1e-6f //only snap normals that are axial to within float noise, anything tilted more keeps its full precision encoding
+
+static void GetPlacementAxisBasis( int iAxis, Vector &vNormal, Vector &vRollZero, Vector &vRollQuarter )
+{
+	int iComponent = iAxis >> 1;
+	vNormal.Init();
+	vNormal[iComponent] = (iAxis & 1) ? -1.0f : 1.0f;
+
+	//roll is measured from world up on walls, and from world x on floors and ceilings
+	vRollZero.Init();
+	vRollZero[(iComponent == 2) ? 0 : 2] = 1.0f;
+	CrossProduct( vNormal, vRollZero, vRollQuarter );
+}
+
+bool CProp_Portal_Shared::EncodePlacement( const Vector &vOrigin, const QAngle &qAngles, PortalPlacementEncoding_t &encoding )
+{
+	encoding.iAxis = PORTAL_PLACEMENT_AXIS_NONE;
+	if( !sv_portal_placement_compact_network.GetBool() )
+		return false;
+
+	Vector vForward, vUp;
+	AngleVectors( qAngles, &vForward, NULL, &vUp );
+
+	int iComponent = 0;
+	for( int i = 1; i != 3; ++i )
+	{
+		if( fabs( vForward[i] ) > fabs( vForward[iComponent] ) )
+			iComponent = i;
+	}
+
+	if( fabs( vForward[iComponent] ) < (1.0f - PORTAL_PLACEMENT_AXIS_EPSILON) )
+		return false;
+
+	const float fCoordScale = (float)(1 << PORTAL_PLACEMENT_COORD_FRACTION_BITS);
+	const float fMaxCoord = (float)((1 << (PORTAL_PLACEMENT_COORD_BITS - 1)) - 1);
+	for( int i = 0; i != 3; ++i )
+	{
+		float fCoord = vOrigin[(iComponent + i) % 3] * fCoordScale;
+		if( fabs( fCoord ) > fMaxCoord )
+			return false;
+
+		encoding.iCoords[i] = (int)floorf( fCoord + 0.5f );
+	}
+
+	int iAxis = (iComponent << 1) | ((vForward[iComponent] < 0.0f) ? 1 : 0);
+
+	Vector vNormal, vRollZero, vRollQuarter;
+	GetPlacementAxisBasis( iAxis, vNormal, vRollZero, vRollQuarter );
+
+	const int iRollSteps = 1 << PORTAL_PLACEMENT_ROLL_BITS;
+	float fRoll = atan2f( vUp.Dot( vRollQuarter ), vUp.Dot( vRollZero ) );
+	encoding.iRoll = ((int)floorf( fRoll * ((float)iRollSteps / (2.0f * M_PI_F)) + 0.5f )) & (iRollSteps - 1);
+	encoding.iAxis = iAxis;
+
+	return true;
+}
+
+void CProp_Portal_Shared::DecodePlacement( const PortalPlacementEncoding_t &encoding, Vector &vOrigin, QAngle &qAngles )
+{
+	Assert( (encoding.iAxis >= 0) && (encoding.iAxis < 6) );
+	int iComponent = encoding.iAxis >> 1;
+
+	const float fInvCoordScale = 1.0f / (float)(1 << PORTAL_PLACEMENT_COORD_FRACTION_BITS);
+	for( int i = 0; i != 3; ++i )
+		vOrigin[(iComponent + i) % 3] = (float)encoding.iCoords[i] * fInvCoordScale;
+
+	Vector vNormal, vRollZero, vRollQuarter;
+	GetPlacementAxisBasis( encoding.iAxis, vNormal, vRollZero, vRollQuarter );
+
+	const int iRollSteps = 1 << PORTAL_PLACEMENT_ROLL_BITS;
+	float fRoll = (float)encoding.iRoll * ((2.0f * M_PI_F) / (float)iRollSteps);
+	Vector vUp = (vRollZero * cosf( fRoll )) + (vRollQuarter * sinf( fRoll ));
+
+	VectorAngles( vNormal, vUp, qAngles );
+}
+
+bool CProp_Portal_Shared::QuantizePlacement( Vector &vOrigin, QAngle &qAngles )
+{
+	PortalPlacementEncoding_t encoding;
+	if( !EncodePlacement( vOrigin, qAngles, encoding ) )
+		return false;
+
+	DecodePlacement( encoding, vOrigin, qAngles );
+	return true;
+}
+
 static char *g_pszPortalNonTeleportable[] = 
 { 
 	"func_door", 
@@ -110,6 +198,11 @@ void CProp_Portal::SetActive( bool bActive )
 {
 	m_bOldActivatedState = m_bActivated;
 	m_bActivated = bActive;
+	g_PortalSpatialIndex.UpdatePortal( this );
+
+#ifdef CLIENT_DLL
+	m_bHasHandledNetworkChanges = false; //predicted activation changes have to go back through HandleNetworkChanges() if they're rolled back
+#endif
 
 #ifdef GAME_DLL
 	if ( !bActive )
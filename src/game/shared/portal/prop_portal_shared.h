@@ -13,6 +13,7 @@
 #endif
 
 #include "cbase.h"
+#include "coordsize.h"
 
 #ifdef CLIENT_DLL
 #include "c_prop_portal.h"
@@ -31,12 +32,32 @@
 // CProp_Portal enum for the portal corners (if a user wants a specific corner)
 enum PortalCorners_t { PORTAL_DOWN_RIGHT = 0, PORTAL_DOWN_LEFT, PORTAL_UP_RIGHT, PORTAL_UP_LEFT };
 
+//compact network form of a portal placement, see CProp_Portal_Shared::EncodePlacement()
+#define PORTAL_PLACEMENT_AXIS_BITS 3
+#define PORTAL_PLACEMENT_AXIS_NONE ((1 << PORTAL_PLACEMENT_AXIS_BITS) - 1) //not on an axis aligned surface, full precision origin and angles are networked instead
+#define PORTAL_PLACEMENT_COORD_FRACTION_BITS 5 //positions snap to 1/32 unit
+#define PORTAL_PLACEMENT_COORD_BITS (1 + COORD_INTEGER_BITS + PORTAL_PLACEMENT_COORD_FRACTION_BITS) //signed
+#define PORTAL_PLACEMENT_ROLL_BITS 12
+
+struct PortalPlacementEncoding_t
+{
+	int iAxis; //world axis the portal faces down, (component << 1) | negative
+	int iCoords[3]; //in 1/32 units, the surface plane's coordinate on iAxis followed by the two coordinates across it
+	int iRoll; //the portal's up vector as a fraction of a full turn around iAxis
+};
+
 class CProp_Portal_Shared  //defined as a class to make intellisense more intelligent
 {
 public:
 	static void UpdatePortalTransformationMatrix( const matrix3x4_t &localToWorld, const matrix3x4_t &remoteToWorld, VMatrix *pMatrix );
 
 	static bool IsEntityTeleportable( CBaseEntity *pEntity );
+
+	//Portals facing straight down a world axis can be described with a few quantized ints. Both sides only
+	//ever use the decoded placement, so they build the exact same transformation matrix from it.
+	static bool EncodePlacement( const Vector &vOrigin, const QAngle &qAngles, PortalPlacementEncoding_t &encoding ); //false when the placement needs full precision
+	static void DecodePlacement( const PortalPlacementEncoding_t &encoding, Vector &vOrigin, QAngle &qAngles );
+	static bool QuantizePlacement( Vector &vOrigin, QAngle &qAngles ); //snaps to exactly what the encoding reproduces
 	//static CProp_Portal *GetPortal1( bool bCreateIfNotFound = false );
 	//static CProp_Portal *GetPortal2( bool bCreateIfNotFound = false );
 
@@ -40,7 +40,7 @@ static void Collision_ClearTrace( const Vector &vecRayStart, const Vector &vecRa
 //-----------------------------------------------------------------------------
 // Compute the offset in t along the ray that we'll use for the collision
 //-----------------------------------------------------------------------------
-static float ComputeBoxOffset( const Ray_t& ray )
+float ComputeBoxOffset( const Ray_t& ray )
 {
 	if (ray.m_IsRay)
 		return 1e-3f;
@@ -45,6 +45,16 @@ float IntersectRayWithTriangle( const Ray_t& ray,
 		                        const Vector& v1, const Vector& v2, const Vector& v3, 
 								bool oneSided );
 
+//-----------------------------------------------------------------------------
+//
+// ComputeBoxOffset
+//
+// The slop in t that IntersectRayWithTriangle() allows a swept box along the
+// ray, the projection of the box extents onto the ray plus an epsilon.
+//
+//-----------------------------------------------------------------------------
+float ComputeBoxOffset( const Ray_t& ray );
+
 //-----------------------------------------------------------------------------
 //
 // ComputeIntersectionBarycentricCoordinates
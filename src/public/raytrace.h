@@ -192,6 +192,42 @@ protected:
 
 };
 
+#define BVH_MAX_DEPTH 64									// deeper nodes are forced to be leaves
+
+struct CacheOptimizedBVHNode
+{
+	// bounding volume hierarchy node, used instead of the kd-tree when RTE_FLAGS_BVH_ACCELERATION is
+	// set. 32 bytes, so two nodes share a cache line:
+	//
+	// A) the right child is always stored after the left child, so only one index is needed
+	// B) leaves reference a contiguous run of TriangleIndexList, since the bvh partitions the
+	//    triangles rather than splitting space, and no triangle is referenced twice
+	// C) the low 2 bits of m_nTrianglesAndAxis hold the axis the children were split along, which
+	//    is used to pick the near child first. The remaining bits are the leaf's triangle count,
+	//    which is 0 for interior nodes.
+
+	float m_flMins[3];
+	int32 m_nFirst;											// left child, or first entry in
+															// TriangleIndexList for leaves
+	float m_flMaxs[3];
+	int32 m_nTrianglesAndAxis;
+
+	inline bool IsLeaf(void) const
+	{
+		return ( m_nTrianglesAndAxis >> 2 ) != 0;
+	}
+
+	inline int SplitAxis(void) const
+	{
+		return m_nTrianglesAndAxis & 3;
+	}
+
+	inline int NumberOfTrianglesInLeaf(void) const
+	{
+		return m_nTrianglesAndAxis >> 2;
+	}
+};
+
 
 struct RayTracingSingleResult
 {
@@ -220,6 +256,7 @@ public:
 #define RTE_FLAGS_FAST_TREE_GENERATION 1
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS 2				// saves memory if not needed
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS 4
+#define RTE_FLAGS_BVH_ACCELERATION 8						// build a binned SAH bvh instead of a kd-tree
 
 enum RayTraceLightingMode_t {
 	DIRECT_LIGHTING,										// just dot product lighting
@@ -228,19 +265,17 @@ enum RayTraceLightingMode_t {
 };
 
 
+#define RAYSTREAM_MAX_PENDING 4096							// rays queued before a stream is traced
+
 class RayStream
 {
 	friend class RayTracingEnvironment;
 
-	RayTracingSingleResult *PendingStreamOutputs[8][4];
-	int n_in_stream[8];
-	FourRays PendingRays[8];
-
-public:
-	RayStream(void)
-	{
-		memset(n_in_stream,0,sizeof(n_in_stream));
-	}
+	// rays are queued until there are enough to sort into coherent packets, see TraceRayBatch
+	CUtlVector<Vector> PendingStarts;
+	CUtlVector<Vector> PendingEnds;
+	CUtlVector<RayTracingSingleResult *> PendingStreamOutputs;
+	CUtlVector<RayTracingSingleResult> PendingResults;
 };
 
 // When transparent triangles are in the list, the caller can provide a callback that will get called at each triangle
@@ -262,6 +297,7 @@ public:
 
 	FourVectors BackgroundColor;							//< color where no intersection
 	CUtlVector<CacheOptimizedKDNode> OptimizedKDTree;		//< the packed kdtree. root is 0
+	CUtlVector<CacheOptimizedBVHNode> OptimizedBVH;			//< the packed bvh, if RTE_FLAGS_BVH_ACCELERATION
 	CUtlBlockVector<CacheOptimizedTriangle> OptimizedTriangleList; //< the packed triangles
 	CUtlVector<int32> TriangleIndexList;					//< the list of triangle indices.
 	CUtlVector<LightDesc_t> LightList;						//< the list of lights
@@ -294,7 +330,8 @@ public:
 										const Vector &color);
 
 
-	// SetupAccelerationStructure to prepare for tracing
+	// SetupAccelerationStructure to prepare for tracing. Set RTE_FLAGS_BVH_ACCELERATION in Flags
+	// before calling this to build a bvh instead of a kd-tree. Both are traced through Trace4Rays.
 	void SetupAccelerationStructure(void);
 
 
@@ -310,6 +347,14 @@ public:
 					RayTracingResult *rslt_out,
 					int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
 
+	// bvh versions of the above, called by Trace4Rays when RTE_FLAGS_BVH_ACCELERATION is set. The
+	// 4 rays do not need to share direction signs.
+	void SetupBVHAccelerationStructure(void);
+
+	void TraceBVH4Rays(const FourRays &rays, fltx4 TMin, fltx4 TMax,
+					   RayTracingResult *rslt_out,
+					   int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
+
 	// compute virtual light sources to model inter-reflection
 	void ComputeVirtualLightSources(void);
 
@@ -329,29 +374,44 @@ public:
 
 					 
 	/// raytracing stream - lets you trace an array of rays by feeding them to this function.
-	/// results will not be returned until FinishStream is called. This function handles sorting
-	/// the rays by direction, tracing them 4 at a time, and de-interleaving the results.
+	/// results will not be returned until FinishStream is called. Rays are queued and traced in
+	/// batches with TraceRayBatch.
 
 	void AddToRayStream(RayStream &s,
 						Vector const &start,Vector const &end,RayTracingSingleResult *rslt_out);
 
-	inline void FlushStreamEntry(RayStream &s,int msk);
+	void FlushRayStream(RayStream &s);
 
 	/// call this when you are done. handles all cleanup. After this is called, all rslt ptrs
 	/// previously passed to AddToRaySteam will have been filled in.
 	void FinishRayStream(RayStream &s);
 
+	/// trace a large batch of line segments at once. The rays are sorted by direction octant and
+	/// then by origin cell, so that each group of 4 traced together starts in the same part of the
+	/// world and heads the same way and so visits mostly the same nodes. Works best with
+	/// thousands of rays, such as all of the shadow rays for a face.
+	void TraceRayBatch(int nrays, Vector const *starts, Vector const *ends,
+					   RayTracingSingleResult *rslts_out, int32 skip_id=-1);
+
 
 	int MakeLeafNode(int first_tri, int last_tri);
 
 
+	// tri_mins and tri_maxs are the triangles' extents along split_plane, 4 to an entry
 	float CalculateCostsOfSplit(
-		int split_plane,int32 const *tri_list,int ntris,
+		int split_plane,fltx4 const *tri_mins,fltx4 const *tri_maxs,int ntris,
+		float min_coord,float max_coord,
 		Vector MinBound,Vector MaxBound, float &split_value,
 		int &nleft, int &nright, int &nboth);
 		
 	void RefineNode(int node_number,int32 const *tri_list,int ntris,
 						 Vector MinBound,Vector MaxBound, int depth);
+
+	// builds into the given lists, so that subtrees can be built on other threads. Large
+	// subtrees are handed to other threads, and the result is the same as a serial build.
+	void RefineNode(CUtlVector<CacheOptimizedKDNode> &KDTree, CUtlVector<int32> &TriIndexList,
+					int node_number,int32 const *tri_list,int ntris,
+					Vector MinBound,Vector MaxBound, int depth);
 	
 	void CalculateTriangleListBounds(int32 const *tris,int ntris,
 									 Vector &minout, Vector &maxout);
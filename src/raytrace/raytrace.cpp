@@ -5,6 +5,7 @@
 #include <filesystem_tools.h>
 #include <cmdlib.h>
 #include <stdio.h>
+#include <tier0/threadtools.h>
 
 static bool SameSign(float a, float b)
 {
@@ -276,10 +277,119 @@ static float BoxSurfaceArea(Vector const &boxmin, Vector const &boxmax)
 	return 2.0*((boxdim[0]*boxdim[2])+(boxdim[0]*boxdim[1])+(boxdim[1]*boxdim[2]));
 }
 
+// intersect 4 rays with one triangle, updating the closest hits in rslt_out. Shared by the kd-tree
+// and bvh traversals.
+static FORCEINLINE void IntersectTriangleWithFourRays( const FourRays &rays,
+													   TriIntersectData_t const *tri, int32 tnum,
+													   RayTracingResult *rslt_out,
+													   ITransparentTriangleCallback *pCallback )
+{
+	n_intersection_calculations++;
+
+	// compute plane intersection
+	FourVectors N;
+	N.x = ReplicateX4( tri->m_flNx );
+	N.y = ReplicateX4( tri->m_flNy );
+	N.z = ReplicateX4( tri->m_flNz );
+
+	fltx4 DDotN = rays.direction * N;
+	// mask off zero or near zero (ray parallel to surface)
+	fltx4 did_hit = OrSIMD( CmpGtSIMD( DDotN,FourEpsilons ),
+							CmpLtSIMD( DDotN, FourNegativeEpsilons ) );
+
+	fltx4 numerator=SubSIMD( ReplicateX4( tri->m_flD ), rays.origin * N );
+
+	fltx4 isect_t=DivSIMD( numerator,DDotN );
+	// now, we have the distance to the plane. lets update our mask
+	did_hit = AndSIMD( did_hit, CmpGtSIMD( isect_t, FourZeros ) );
+	//did_hit=AndSIMD(did_hit,CmpLtSIMD(isect_t,TMax));
+	did_hit = AndSIMD( did_hit, CmpLtSIMD( isect_t, rslt_out->HitDistance ) );
+
+	if ( ! IsAnyNegative( did_hit ) )
+		return;
+
+	// now, check 3 edges
+	fltx4 hitc1 = AddSIMD( rays.origin[tri->m_nCoordSelect0],
+						MulSIMD( isect_t, rays.direction[ tri->m_nCoordSelect0] ) );
+	fltx4 hitc2 = AddSIMD( rays.origin[tri->m_nCoordSelect1],
+						   MulSIMD( isect_t, rays.direction[tri->m_nCoordSelect1] ) );
+	
+	// do barycentric coordinate check
+	fltx4 B0 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
+
+	B0 = AddSIMD(
+		B0,
+		MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
+	B0 = AddSIMD(
+		B0, ReplicateX4( tri->m_ProjectedEdgeEquations[2] ) );
+
+	did_hit = AndSIMD( did_hit, CmpGeSIMD( B0, FourZeros ) );
+
+	fltx4 B1 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
+	B1 = AddSIMD(
+		B1,
+		MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[4]), hitc2 ) );
+
+	B1 = AddSIMD(
+		B1, ReplicateX4( tri->m_ProjectedEdgeEquations[5] ) );
+	
+	did_hit = AndSIMD( did_hit, CmpGeSIMD( B1, FourZeros ) );
+
+	fltx4 B2 = AddSIMD( B1, B0 );
+	did_hit = AndSIMD( did_hit, CmpLeSIMD( B2, Four_Ones ) );
+
+	if ( ! IsAnyNegative( did_hit ) )
+		return;
+
+	// if the triangle is transparent
+	if ( tri->m_nFlags & FCACHETRI_TRANSPARENT )
+	{
+		if ( pCallback )
+		{
+			// assuming a triangle indexed as v0, v1, v2
+			// the projected edge equations are set up such that the vert opposite the first
+			// equation is v2, and the vert opposite the second equation is v0
+			// Therefore we pass them back in 1, 2, 0 order
+			// Also B2 is currently B1 + B0 and needs to be 1 - (B1+B0) in order to be a real
+			// barycentric coordinate.  Compute that now and pass it to the callback
+			fltx4 b2 = SubSIMD( Four_Ones, B2 );
+			if ( pCallback->VisitTriangle_ShouldContinue( *tri, rays, &did_hit, &B1, &b2, &B0, tnum ) )
+			{
+				did_hit = Four_Zeros;
+			}
+		}
+	}
+	// now, set the hit_id and closest_hit fields for any enabled rays
+	fltx4 replicated_n = ReplicateIX4(tnum);
+	StoreAlignedSIMD((float *) rslt_out->HitIds,
+				 OrSIMD(AndSIMD(replicated_n,did_hit),
+						   AndNotSIMD(did_hit,LoadAlignedSIMD(
+											 (float *) rslt_out->HitIds))));
+	rslt_out->HitDistance=OrSIMD(AndSIMD(isect_t,did_hit),
+					 AndNotSIMD(did_hit,rslt_out->HitDistance));
+
+	rslt_out->surface_normal.x=OrSIMD(
+		AndSIMD(N.x,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.x));
+	rslt_out->surface_normal.y=OrSIMD(
+		AndSIMD(N.y,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.y));
+	rslt_out->surface_normal.z=OrSIMD(
+		AndSIMD(N.z,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.z));
+}
+
 void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 TMax,
 									   RayTracingResult *rslt_out,
 									   int32 skip_id, ITransparentTriangleCallback *pCallback)
 {
+	if ( Flags & RTE_FLAGS_BVH_ACCELERATION )
+	{
+		// the bvh doesn't care about direction signs, so there's no need to split the rays up
+		TraceBVH4Rays(rays,TMin,TMax,rslt_out,skip_id,pCallback);
+		return;
+	}
+
 	int msk=rays.CalculateDirectionSignMask();
 	if (msk!=-1)
 		Trace4Rays(rays,TMin,TMax,msk,rslt_out,skip_id, pCallback);
@@ -348,6 +458,12 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 									   int DirectionSignMask, RayTracingResult *rslt_out,
 									   int32 skip_id, ITransparentTriangleCallback *pCallback)
 {
+	if ( Flags & RTE_FLAGS_BVH_ACCELERATION )
+	{
+		TraceBVH4Rays(rays,TMin,TMax,rslt_out,skip_id,pCallback);
+		return;
+	}
+
 	rays.Check();
 
 	memset(rslt_out->HitIds,0xff,sizeof(rslt_out->HitIds));
@@ -476,101 +592,8 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 				TriIntersectData_t const *tri = &( OptimizedTriangleList[tnum].m_Data.m_IntersectData );
 				if ( ( mailboxids[mbox_slot] != tnum ) && ( tri->m_nTriangleID != skip_id ) )
 				{
-					n_intersection_calculations++;
 					mailboxids[mbox_slot] = tnum;
-					// compute plane intersection
-
-
-					FourVectors N;
-					N.x = ReplicateX4( tri->m_flNx );
-					N.y = ReplicateX4( tri->m_flNy );
-					N.z = ReplicateX4( tri->m_flNz );
-
-					fltx4 DDotN = rays.direction * N;
-					// mask off zero or near zero (ray parallel to surface)
-					fltx4 did_hit = OrSIMD( CmpGtSIMD( DDotN,FourEpsilons ),
-											CmpLtSIMD( DDotN, FourNegativeEpsilons ) );
-
-					fltx4 numerator=SubSIMD( ReplicateX4( tri->m_flD ), rays.origin * N );
-
-					fltx4 isect_t=DivSIMD( numerator,DDotN );
-					// now, we have the distance to the plane. lets update our mask
-					did_hit = AndSIMD( did_hit, CmpGtSIMD( isect_t, FourZeros ) );
-					//did_hit=AndSIMD(did_hit,CmpLtSIMD(isect_t,TMax));
-					did_hit = AndSIMD( did_hit, CmpLtSIMD( isect_t, rslt_out->HitDistance ) );
-
-					if ( ! IsAnyNegative( did_hit ) )
-						continue;
-
-					// now, check 3 edges
-					fltx4 hitc1 = AddSIMD( rays.origin[tri->m_nCoordSelect0],
-										MulSIMD( isect_t, rays.direction[ tri->m_nCoordSelect0] ) );
-					fltx4 hitc2 = AddSIMD( rays.origin[tri->m_nCoordSelect1],
-										   MulSIMD( isect_t, rays.direction[tri->m_nCoordSelect1] ) );
-					
-					// do barycentric coordinate check
-					fltx4 B0 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
-
-					B0 = AddSIMD(
-						B0,
-						MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
-					B0 = AddSIMD(
-						B0, ReplicateX4( tri->m_ProjectedEdgeEquations[2] ) );
-
-					did_hit = AndSIMD( did_hit, CmpGeSIMD( B0, FourZeros ) );
-
-					fltx4 B1 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
-					B1 = AddSIMD(
-						B1,
-						MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[4]), hitc2 ) );
-
-					B1 = AddSIMD(
-						B1, ReplicateX4( tri->m_ProjectedEdgeEquations[5] ) );
-					
-					did_hit = AndSIMD( did_hit, CmpGeSIMD( B1, FourZeros ) );
-
-					fltx4 B2 = AddSIMD( B1, B0 );
-					did_hit = AndSIMD( did_hit, CmpLeSIMD( B2, Four_Ones ) );
-
-					if ( ! IsAnyNegative( did_hit ) )
-						continue;
-
-					// if the triangle is transparent
-					if ( tri->m_nFlags & FCACHETRI_TRANSPARENT )
-					{
-						if ( pCallback )
-						{
-							// assuming a triangle indexed as v0, v1, v2
-							// the projected edge equations are set up such that the vert opposite the first
-							// equation is v2, and the vert opposite the second equation is v0
-							// Therefore we pass them back in 1, 2, 0 order
-							// Also B2 is currently B1 + B0 and needs to be 1 - (B1+B0) in order to be a real
-							// barycentric coordinate.  Compute that now and pass it to the callback
-							fltx4 b2 = SubSIMD( Four_Ones, B2 );
-							if ( pCallback->VisitTriangle_ShouldContinue( *tri, rays, &did_hit, &B1, &b2, &B0, tnum ) )
-							{
-								did_hit = Four_Zeros;
-							}
-						}
-					}
-					// now, set the hit_id and closest_hit fields for any enabled rays
-					fltx4 replicated_n = ReplicateIX4(tnum);
-					StoreAlignedSIMD((float *) rslt_out->HitIds,
-								 OrSIMD(AndSIMD(replicated_n,did_hit),
-										   AndNotSIMD(did_hit,LoadAlignedSIMD(
-															 (float *) rslt_out->HitIds))));
-					rslt_out->HitDistance=OrSIMD(AndSIMD(isect_t,did_hit),
-									 AndNotSIMD(did_hit,rslt_out->HitDistance));
-
-					rslt_out->surface_normal.x=OrSIMD(
-						AndSIMD(N.x,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.x));
-					rslt_out->surface_normal.y=OrSIMD(
-						AndSIMD(N.y,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.y));
-					rslt_out->surface_normal.z=OrSIMD(
-						AndSIMD(N.z,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.z));
+					IntersectTriangleWithFourRays( rays, tri, tnum, rslt_out, pCallback );
 					
 				}
 			} while (--ntris);
@@ -595,6 +618,78 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 }
 
 
+void RayTracingEnvironment::TraceBVH4Rays(const FourRays &rays, fltx4 TMin, fltx4 TMax,
+										  RayTracingResult *rslt_out,
+										  int32 skip_id, ITransparentTriangleCallback *pCallback)
+{
+	memset(rslt_out->HitIds,0xff,sizeof(rslt_out->HitIds));
+
+	rslt_out->HitDistance=ReplicateX4(1.0e23);
+
+	rslt_out->surface_normal.DuplicateVector(Vector(0.,0.,0.));
+	if (! OptimizedBVH.Count() )
+		return;												// empty scene
+
+	FourVectors OneOverRayDir=rays.direction;
+	OneOverRayDir.MakeReciprocalSaturate();
+
+	// visit the child on the near side of the split first, judged by the first ray. Rays in the
+	// bundle with different signs are still traced correctly, they just get less early-out.
+	int near_idx[3];
+	for(int c=0;c<3;c++)
+		near_idx[c]=(SubFloat(rays.direction[c],0)<0) ? 1 : 0;
+
+	// nodes are tested when they are visited, so at most one entry per level gets pushed
+	int32 NodeStack[BVH_MAX_DEPTH+1];
+	int stack_len=0;
+	int32 node_idx=0;
+	while(1)
+	{
+		CacheOptimizedBVHNode const &node=OptimizedBVH[node_idx];
+
+		// clip the rays against the node's box. Nodes further away than the closest hit found so far
+		// are skipped.
+		fltx4 tnear=TMin;
+		fltx4 tfar=MinSIMD(TMax,rslt_out->HitDistance);
+		for(int c=0;c<3;c++)
+		{
+			fltx4 isect_min_t=
+				MulSIMD(SubSIMD(ReplicateX4(node.m_flMins[c]),rays.origin[c]),OneOverRayDir[c]);
+			fltx4 isect_max_t=
+				MulSIMD(SubSIMD(ReplicateX4(node.m_flMaxs[c]),rays.origin[c]),OneOverRayDir[c]);
+			tnear=MaxSIMD(tnear,MinSIMD(isect_min_t,isect_max_t));
+			tfar=MinSIMD(tfar,MaxSIMD(isect_min_t,isect_max_t));
+		}
+		if ( IsAnyNegative(CmpLeSIMD(tnear,tfar)) )
+		{
+			if (! node.IsLeaf() )
+			{
+				int near_child=node.m_nFirst+near_idx[node.SplitAxis()];
+				Assert(stack_len<=BVH_MAX_DEPTH);
+				NodeStack[stack_len++]=node.m_nFirst+(near_idx[node.SplitAxis()]^1);
+				node_idx=near_child;
+				continue;
+			}
+
+			// a leaf. the bvh never references a triangle twice, so there's no need for mailboxes
+			int32 const *tlist=&(TriangleIndexList[node.m_nFirst]);
+			for(int ntris=node.NumberOfTrianglesInLeaf();ntris;ntris--)
+			{
+				int tnum=*(tlist++);
+				TriIntersectData_t const *tri = &( OptimizedTriangleList[tnum].m_Data.m_IntersectData );
+				if ( tri->m_nTriangleID != skip_id )
+					IntersectTriangleWithFourRays( rays, tri, tnum, rslt_out, pCallback );
+			}
+		}
+
+		if (! stack_len )
+			return;
+		// pop stack!
+		node_idx=NodeStack[--stack_len];
+	}
+}
+
+
 int RayTracingEnvironment::MakeLeafNode(int first_tri, int last_tri)
 {
 	CacheOptimizedKDNode ret;
@@ -652,49 +747,38 @@ void RayTracingEnvironment::CalculateTriangleListBounds(int32 const *tris,int nt
 
 
 float RayTracingEnvironment::CalculateCostsOfSplit(
-	int split_plane,int32 const *tri_list,int ntris,
+	int split_plane,fltx4 const *tri_mins,fltx4 const *tri_maxs,int ntris,
+	float min_coord,float max_coord,
 	Vector MinBound,Vector MaxBound, float &split_value,
 	int &nleft, int &nright, int &nboth)
 {
-	// determine the costs of splitting on a given axis, and label triangles with respect to
-	// that axis by storing the value in coordselect0. It will also return the number of
-	// tris in the left, right, and nboth groups, in order to facilitate memory
-	nleft=nboth=nright=0;
-	
-	// now, label each triangle. Since we have not converted the triangles into
-	// intersection fromat yet, we can use the CoordSelect0 field of each as a temp.
+	// determine the costs of splitting on a given axis. It will also return the number of
+	// tris in the left, right, and nboth groups, in order to facilitate memory. tri_mins and
+	// tri_maxs hold the extent of each triangle along split_plane, 4 triangles per entry, with
+	// the unused slots at the end padded with FLT_MAX.
+	//
+	// A triangle is positive if it starts at or past the split, and otherwise negative if it ends
+	// at or before it. This is the same test as ClassifyAgainstAxisSplit, 4 triangles at a time.
+	fltx4 split=ReplicateX4(split_value);
+	fltx4 left_count=Four_Zeros;
+	fltx4 right_count=Four_Zeros;
+	int nblocks=(ntris+3)>>2;
+	for(int b=0;b<nblocks;b++)
+	{
+		fltx4 is_right=CmpGeSIMD(tri_mins[b],split);
+		fltx4 is_left=AndNotSIMD(is_right,CmpLeSIMD(tri_maxs[b],split));
+		right_count=AddSIMD(right_count,AndSIMD(is_right,Four_Ones));
+		left_count=AddSIMD(left_count,AndSIMD(is_left,Four_Ones));
+	}
 	nleft=0;
-	nright=0;
-	nboth=0;
-	float min_coord=1.0e23,max_coord=-1.0e23;
-
-	for(int t=0;t<ntris;t++)
+	nright=-((nblocks<<2)-ntris);							// padding always lands on the right
+	for(int i=0;i<4;i++)
 	{
-		CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[t]];
-		// determine max and min coordinate values for later optimization
-		for(int v=0;v<3;v++)
-		{
-			min_coord = min( min_coord, tri.Vertex(v)[split_plane] );
-			max_coord = max( max_coord, tri.Vertex(v)[split_plane] );
-		}
-		switch(tri.ClassifyAgainstAxisSplit(split_plane,split_value))
-		{
-			case PLANECHECK_NEGATIVE:
-				nleft++;
-				tri.m_Data.m_GeometryData.m_nTmpData0 = PLANECHECK_NEGATIVE;
-				break;
-
-			case PLANECHECK_POSITIVE:
-				nright++;
-				tri.m_Data.m_GeometryData.m_nTmpData0 = PLANECHECK_POSITIVE;
-				break;
-
-			case PLANECHECK_STRADDLING:
-				nboth++;
-				tri.m_Data.m_GeometryData.m_nTmpData0 = PLANECHECK_STRADDLING;
-				break;
-		}
+		nleft+=(int) SubFloat(left_count,i);
+		nright+=(int) SubFloat(right_count,i);
 	}
+	nboth=ntris-nleft-nright;
+
 	// now, if the split resulted in one half being empty, "grow" the empty half
 	if (nleft && (nboth==0) && (nright==0))
 		split_value=max_coord;
@@ -719,90 +803,176 @@ float RayTracingEnvironment::CalculateCostsOfSplit(
 
 #define NEVER_SPLIT 0
 
+// subtrees with at least this many triangles are handed to another thread, if one is free
+#define KDTREE_MIN_PARALLEL_TRIANGLES 4096
+#define KDTREE_MAX_BUILD_THREADS 32
+
+static long volatile s_nKDTreeBuildThreads=0;				// threads building subtrees right now
+static int s_nMaxKDTreeBuildThreads=0;
+
+static bool TryStartKDTreeBuildThread(void)
+{
+	for(;;)
+	{
+		long nThreads=s_nKDTreeBuildThreads;
+		if (nThreads>=s_nMaxKDTreeBuildThreads)
+			return false;
+		if (ThreadInterlockedAssignIf(&s_nKDTreeBuildThreads,nThreads+1,nThreads))
+			return true;
+	}
+}
+
+// a subtree being built on another thread. It is built into its own node and index lists, with
+// the subtree's root at node 0, and spliced into the parent's lists once done.
+struct KDSubtreeBuild_t
+{
+	RayTracingEnvironment *m_pEnv;
+	int32 const *m_pTriangleList;
+	int m_nTriangles;
+	Vector m_MinBound;
+	Vector m_MaxBound;
+	int m_nDepth;
+	CUtlVector<CacheOptimizedKDNode> m_Nodes;
+	CUtlVector<int32> m_TriangleIndices;
+};
+
+static unsigned BuildKDSubtreeThreadFn(void *pParam)
+{
+	KDSubtreeBuild_t *pBuild=(KDSubtreeBuild_t *) pParam;
+	CacheOptimizedKDNode root;
+	pBuild->m_Nodes.AddToTail(root);
+	pBuild->m_pEnv->RefineNode(pBuild->m_Nodes,pBuild->m_TriangleIndices,0,
+							   pBuild->m_pTriangleList,pBuild->m_nTriangles,
+							   pBuild->m_MinBound,pBuild->m_MaxBound,pBuild->m_nDepth);
+	ThreadInterlockedDecrement(&s_nKDTreeBuildThreads);
+	return 0;
+}
+
 void RayTracingEnvironment::RefineNode(int node_number,int32 const *tri_list,int ntris,
 									   Vector MinBound,Vector MaxBound, int depth)
+{
+	RefineNode(OptimizedKDTree,TriangleIndexList,node_number,tri_list,ntris,MinBound,MaxBound,depth);
+}
+
+void RayTracingEnvironment::RefineNode(CUtlVector<CacheOptimizedKDNode> &KDTree,
+									   CUtlVector<int32> &TriIndexList,
+									   int node_number,int32 const *tri_list,int ntris,
+									   Vector MinBound,Vector MaxBound, int depth)
 {
 	if (ntris<3)											// never split empty lists
 	{
 		// no point in continuing
-		OptimizedKDTree[node_number].Children=KDNODE_STATE_LEAF+(TriangleIndexList.Count()<<2);
-		OptimizedKDTree[node_number].SetNumberOfTrianglesInLeafNode(ntris);
+		KDTree[node_number].Children=KDNODE_STATE_LEAF+(TriIndexList.Count()<<2);
+		KDTree[node_number].SetNumberOfTrianglesInLeafNode(ntris);
 
 #ifdef DEBUG_RAYTRACE
-		OptimizedKDTree[node_number].vecMins = MinBound;
-		OptimizedKDTree[node_number].vecMaxs = MaxBound;
+		KDTree[node_number].vecMins = MinBound;
+		KDTree[node_number].vecMaxs = MaxBound;
 #endif
 
 		for(int t=0;t<ntris;t++)
-			TriangleIndexList.AddToTail(tri_list[t]);
+			TriIndexList.AddToTail(tri_list[t]);
 		return;
 	}
 
 	float best_cost=1.0e23;
 	int best_nleft=0,best_nright=0,best_nboth=0;
 	float best_splitvalue=0;
+	float best_classifyvalue=0;								// best_splitvalue before "growing"
 	int split_plane=0;
 
-	int tri_skip=1+(ntris/10);								// don't try all trinagles as split
-															// points when there are a lot of them
-	for(int axis=0;axis<3;axis++)
 	{
-		for(int ts=-1;ts<ntris;ts+=tri_skip)
+		// gather the extent of each triangle along each axis, so that the split candidates can be
+		// evaluated 4 triangles at a time
+		int nblocks=(ntris+3)>>2;
+		CUtlVector< fltx4, CUtlMemoryAligned< fltx4, 16 > > TriExtents;
+		TriExtents.SetCount(6*nblocks);
+		fltx4 *tri_mins[3],*tri_maxs[3];
+		float min_coord[3],max_coord[3];
+		for(int c=0;c<3;c++)
+		{
+			tri_mins[c]=TriExtents.Base()+2*c*nblocks;
+			tri_maxs[c]=tri_mins[c]+nblocks;
+			tri_mins[c][nblocks-1]=ReplicateX4(FLT_MAX);
+			tri_maxs[c][nblocks-1]=ReplicateX4(FLT_MAX);
+			min_coord[c]=1.0e23;
+			max_coord[c]=-1.0e23;
+		}
+		for(int t=0;t<ntris;t++)
 		{
-			for(int tv=0;tv<3;tv++)
+			CacheOptimizedTriangle const &tri=OptimizedTriangleList[tri_list[t]];
+			for(int c=0;c<3;c++)
 			{
-				int trial_nleft,trial_nright,trial_nboth;
-				float trial_splitvalue;
-				if (ts==-1)
-					trial_splitvalue=0.5*(MinBound[axis]+MaxBound[axis]);
-				else
+				float minc=tri.Vertex(0)[c];
+				float maxc=minc;
+				for(int v=1;v<3;v++)
 				{
-					// else, split at the triangle vertex if possible
-					CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[ts]];
-					trial_splitvalue = tri.Vertex(tv)[axis];
-					if ((trial_splitvalue>MaxBound[axis]) || (trial_splitvalue<MinBound[axis]))
-						continue;							// don't try this vertex - not inside
-					
+					minc=min(minc,tri.Vertex(v)[c]);
+					maxc=max(maxc,tri.Vertex(v)[c]);
 				}
-//				printf("ts=%d tv=%d tp=%f\n",ts,tv,trial_splitvalue);
-				float trial_cost=
-					CalculateCostsOfSplit(axis,tri_list,ntris,MinBound,MaxBound,trial_splitvalue,
-										  trial_nleft,trial_nright, trial_nboth);
-// 				printf("try %d cost=%f nl=%d nr=%d nb=%d sp=%f\n",axis,trial_cost,trial_nleft,trial_nright, trial_nboth,
-// 					   trial_splitvalue);
-				if (trial_cost<best_cost)
+				SubFloat(tri_mins[c][t>>2],t&3)=minc;
+				SubFloat(tri_maxs[c][t>>2],t&3)=maxc;
+				min_coord[c]=min(min_coord[c],minc);
+				max_coord[c]=max(max_coord[c],maxc);
+			}
+		}
+
+		int tri_skip=1+(ntris/10);							// don't try all trinagles as split
+															// points when there are a lot of them
+		for(int axis=0;axis<3;axis++)
+		{
+			for(int ts=-1;ts<ntris;ts+=tri_skip)
+			{
+				for(int tv=0;tv<3;tv++)
 				{
-					split_plane=axis;
-					best_cost=trial_cost;
-					best_nleft=trial_nleft;
-					best_nright=trial_nright;
-					best_nboth=trial_nboth;
-					best_splitvalue=trial_splitvalue;
-					// save away the axis classification of each triangle
-					for(int t=0 ; t < ntris; t++)
+					int trial_nleft,trial_nright,trial_nboth;
+					float trial_splitvalue;
+					if (ts==-1)
+						trial_splitvalue=0.5*(MinBound[axis]+MaxBound[axis]);
+					else
 					{
-						CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[t]];
-						tri.m_Data.m_GeometryData.m_nTmpData1 = tri.m_Data.m_GeometryData.m_nTmpData0;
+						// else, split at the triangle vertex if possible
+						CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[ts]];
+						trial_splitvalue = tri.Vertex(tv)[axis];
+						if ((trial_splitvalue>MaxBound[axis]) || (trial_splitvalue<MinBound[axis]))
+							continue;						// don't try this vertex - not inside
+
+					}
+					float trial_classifyvalue=trial_splitvalue;
+					float trial_cost=
+						CalculateCostsOfSplit(axis,tri_mins[axis],tri_maxs[axis],ntris,
+											  min_coord[axis],max_coord[axis],
+											  MinBound,MaxBound,trial_splitvalue,
+											  trial_nleft,trial_nright, trial_nboth);
+					if (trial_cost<best_cost)
+					{
+						split_plane=axis;
+						best_cost=trial_cost;
+						best_nleft=trial_nleft;
+						best_nright=trial_nright;
+						best_nboth=trial_nboth;
+						best_splitvalue=trial_splitvalue;
+						best_classifyvalue=trial_classifyvalue;
 					}
+					if (ts==-1)
+						break;
 				}
-				if (ts==-1)
-					break;
 			}
-		}
 
+		}
 	}
 	float cost_of_no_split=COST_OF_INTERSECTION*ntris;
 	if ( (cost_of_no_split<=best_cost) || NEVER_SPLIT || (depth>MAX_TREE_DEPTH))
 	{
 		// no benefit to splitting. just make this a leaf node
-		OptimizedKDTree[node_number].Children=KDNODE_STATE_LEAF+(TriangleIndexList.Count()<<2);
-		OptimizedKDTree[node_number].SetNumberOfTrianglesInLeafNode(ntris);
+		KDTree[node_number].Children=KDNODE_STATE_LEAF+(TriIndexList.Count()<<2);
+		KDTree[node_number].SetNumberOfTrianglesInLeafNode(ntris);
 #ifdef DEBUG_RAYTRACE
-		OptimizedKDTree[node_number].vecMins = MinBound;
-		OptimizedKDTree[node_number].vecMaxs = MaxBound;
+		KDTree[node_number].vecMins = MinBound;
+		KDTree[node_number].vecMaxs = MaxBound;
 #endif
 		for(int t=0;t<ntris;t++)
-			TriangleIndexList.AddToTail(tri_list[t]);
+			TriIndexList.AddToTail(tri_list[t]);
 	}
 	else
 	{
@@ -826,8 +996,10 @@ void RayTracingEnvironment::RefineNode(int node_number,int32 const *tri_list,int
 		int n_right_output=0;
 		for(int t=0;t<ntris;t++)
 		{
+			// classify against the split as it was counted, before any growing. Subtrees may be
+			// built on other threads, so this can't be stashed in the shared triangles.
 			CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[t]];
-			switch( tri.m_Data.m_GeometryData.m_nTmpData1 )
+			switch( tri.ClassifyAgainstAxisSplit(split_plane,best_classifyvalue) )
 			{
 				case PLANECHECK_NEGATIVE:
 //					printf("%d goes left\n",t);
@@ -847,26 +1019,65 @@ void RayTracingEnvironment::RefineNode(int node_number,int32 const *tri_list,int
 					
 			}
 		}
-		int left_child=OptimizedKDTree.Count();
+		int left_child=KDTree.Count();
 		int right_child=left_child+1;
 // 		printf("node %d split on axis %d at %f, nl=%d nr=%d nb=%d lc=%d rc=%d\n",node_number,
 // 			   split_plane,best_splitvalue,best_nleft,best_nright,best_nboth,
 // 			   left_child,right_child);
-		OptimizedKDTree[node_number].Children=split_plane+(left_child<<2);
-		OptimizedKDTree[node_number].SplittingPlaneValue=best_splitvalue;
+		KDTree[node_number].Children=split_plane+(left_child<<2);
+		KDTree[node_number].SplittingPlaneValue=best_splitvalue;
 #ifdef DEBUG_RAYTRACE
-		OptimizedKDTree[node_number].vecMins = MinBound;
-		OptimizedKDTree[node_number].vecMaxs = MaxBound;
+		KDTree[node_number].vecMins = MinBound;
+		KDTree[node_number].vecMaxs = MaxBound;
 #endif
 		CacheOptimizedKDNode newnode;
-		OptimizedKDTree.AddToTail(newnode);
-		OptimizedKDTree.AddToTail(newnode);
+		KDTree.AddToTail(newnode);
+		KDTree.AddToTail(newnode);
 		// now, recurse!
 		if ( (ntris<20) && ((best_nleft==0) || (best_nright==0)) )
 			depth+=100;
-		RefineNode(left_child,new_triangle_list,best_nleft+best_nboth,LeftMins,LeftMaxes,depth+1);
-		RefineNode(right_child,new_triangle_list+best_nleft,best_nright+best_nboth,
-				   RightMins,RightMaxes,depth+1);
+		if ( ( best_nright+best_nboth>=KDTREE_MIN_PARALLEL_TRIANGLES ) && TryStartKDTreeBuildThread() )
+		{
+			// build the right side on another thread while this one does the left, then splice
+			// it in after the left side. The result is identical to building them in order.
+			KDSubtreeBuild_t right_build;
+			right_build.m_pEnv=this;
+			right_build.m_pTriangleList=new_triangle_list+best_nleft;
+			right_build.m_nTriangles=best_nright+best_nboth;
+			right_build.m_MinBound=RightMins;
+			right_build.m_MaxBound=RightMaxes;
+			right_build.m_nDepth=depth+1;
+			ThreadHandle_t hThread=CreateSimpleThread(BuildKDSubtreeThreadFn,&right_build);
+
+			RefineNode(KDTree,TriIndexList,left_child,new_triangle_list,best_nleft+best_nboth,
+					   LeftMins,LeftMaxes,depth+1);
+
+			ThreadJoin(hThread);
+			ReleaseThreadHandle(hThread);
+
+			// the subtree's node k lands at node_base+k, except its root which is right_child
+			int node_base=KDTree.Count()-1;
+			int index_base=TriIndexList.Count();
+			KDTree.EnsureCapacity(node_base+right_build.m_Nodes.Count());
+			for(int n=0;n<right_build.m_Nodes.Count();n++)
+			{
+				CacheOptimizedKDNode node=right_build.m_Nodes[n];
+				node.Children+=(node.NodeType()==KDNODE_STATE_LEAF ? index_base : node_base)<<2;
+				if (n==0)
+					KDTree[right_child]=node;
+				else
+					KDTree.AddToTail(node);
+			}
+			TriIndexList.AddMultipleToTail(right_build.m_TriangleIndices.Count(),
+										   right_build.m_TriangleIndices.Base());
+		}
+		else
+		{
+			RefineNode(KDTree,TriIndexList,left_child,new_triangle_list,best_nleft+best_nboth,
+					   LeftMins,LeftMaxes,depth+1);
+			RefineNode(KDTree,TriIndexList,right_child,new_triangle_list+best_nleft,
+					   best_nright+best_nboth,RightMins,RightMaxes,depth+1);
+		}
 		delete[] new_triangle_list;
 	}	
 }
@@ -874,6 +1085,12 @@ void RayTracingEnvironment::RefineNode(int node_number,int32 const *tri_list,int
 
 void RayTracingEnvironment::SetupAccelerationStructure(void)
 {
+	if ( Flags & RTE_FLAGS_BVH_ACCELERATION )
+	{
+		SetupBVHAccelerationStructure();
+		return;
+	}
+
 	CacheOptimizedKDNode root;
 	OptimizedKDTree.AddToTail(root);
 	int32 *root_triangle_list=new int32[OptimizedTriangleList.Count()];
@@ -881,6 +1098,8 @@ void RayTracingEnvironment::SetupAccelerationStructure(void)
 		root_triangle_list[t]=t;
 	CalculateTriangleListBounds(root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,
 								m_MaxBound);
+	// subtrees are handed to other threads as they become free, the calling thread counts as one
+	s_nMaxKDTreeBuildThreads=clamp(GetCPUInformation()->m_nLogicalProcessors-1,0,KDTREE_MAX_BUILD_THREADS);
 	RefineNode(0,root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,m_MaxBound,0);
 	delete[] root_triangle_list;
 
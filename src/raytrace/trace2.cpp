@@ -303,74 +303,151 @@ static unsigned int GetSignMask(Vector const &v)
 }
 
 
-inline void RayTracingEnvironment::FlushStreamEntry(RayStream &s,int msk)
+#define RAYBATCH_CELL_BITS 9								// origin grid is 512^3 cells
+#define RAYBATCH_OCTANT_SHIFT (3*RAYBATCH_CELL_BITS)
+#define RAYBATCH_RADIX_BITS 10
+#define RAYBATCH_KEY_BITS (RAYBATCH_OCTANT_SHIFT+3)
+
+// spread the low 10 bits of v out so that there are 2 zero bits between each, for interleaving 3
+// coordinates into a morton order key
+static uint32 SpreadBitsBy3(uint32 v)
 {
-	assert(msk>=0);
-	assert(msk<8);
-	fltx4 tmax=s.PendingRays[msk].direction.length();
-	fltx4 scl=ReciprocalSaturateSIMD(tmax);
-	s.PendingRays[msk].direction*=scl;					// normalize
-	RayTracingResult tmpresult;
-	Trace4Rays(s.PendingRays[msk],Four_Zeros,tmax,msk,&tmpresult);
-	// now, write out results
-	for(int r=0;r<4;r++)
-	{
-		RayTracingSingleResult *out=s.PendingStreamOutputs[msk][r];
-		out->ray_length=SubFloat( tmax, r );
-		out->surface_normal.x=tmpresult.surface_normal.X(r);
-		out->surface_normal.y=tmpresult.surface_normal.Y(r);
-		out->surface_normal.z=tmpresult.surface_normal.Z(r);
-		out->HitID=tmpresult.HitIds[r];
-		out->HitDistance=SubFloat( tmpresult.HitDistance, r );
-	}
-	s.n_in_stream[msk]=0;
+	v=(v|(v<<16))&0x030000FF;
+	v=(v|(v<<8))&0x0300F00F;
+	v=(v|(v<<4))&0x030C30C3;
+	v=(v|(v<<2))&0x09249249;
+	return v;
 }
 
-void RayTracingEnvironment::AddToRayStream(RayStream &s,
-										   Vector const &start,Vector const &end,
-										   RayTracingSingleResult *rslt_out)
+// sort ray indices by key, lowest first. Returns whichever of the two buffers ends up holding the
+// sorted indices.
+static int32 *RadixSortRays(int nrays, uint32 *keys, int32 *indices, uint32 *tmp_keys, int32 *tmp_indices)
 {
-	Vector delta=end;
-	delta-=start;
-	int msk=GetSignMask(delta);
-	assert(msk>=0);
-	assert(msk<8);
-	int pos=s.n_in_stream[msk];
-	assert(pos<4);
-	s.PendingRays[msk].origin.X(pos)=start.x;
-	s.PendingRays[msk].origin.Y(pos)=start.y;
-	s.PendingRays[msk].origin.Z(pos)=start.z;
-	s.PendingRays[msk].direction.X(pos)=delta.x;
-	s.PendingRays[msk].direction.Y(pos)=delta.y;
-	s.PendingRays[msk].direction.Z(pos)=delta.z;
-	s.PendingStreamOutputs[msk][pos]=rslt_out;
-	if (pos==3)
+	for(int shift=0;shift<RAYBATCH_KEY_BITS;shift+=RAYBATCH_RADIX_BITS)
 	{
-		FlushStreamEntry(s,msk);
+		int offsets[1<<RAYBATCH_RADIX_BITS];
+		memset(offsets,0,sizeof(offsets));
+		for(int i=0;i<nrays;i++)
+			offsets[(keys[i]>>shift)&((1<<RAYBATCH_RADIX_BITS)-1)]++;
+		int total=0;
+		for(int d=0;d<(1<<RAYBATCH_RADIX_BITS);d++)
+		{
+			int cnt=offsets[d];
+			offsets[d]=total;
+			total+=cnt;
+		}
+		for(int i=0;i<nrays;i++)
+		{
+			int pos=offsets[(keys[i]>>shift)&((1<<RAYBATCH_RADIX_BITS)-1)]++;
+			tmp_keys[pos]=keys[i];
+			tmp_indices[pos]=indices[i];
+		}
+		V_swap(keys,tmp_keys);
+		V_swap(indices,tmp_indices);
 	}
-	else
-		s.n_in_stream[msk]++;
+	return indices;
 }
 
-void RayTracingEnvironment::FinishRayStream(RayStream &s)
+void RayTracingEnvironment::TraceRayBatch(int nrays, Vector const *starts, Vector const *ends,
+										  RayTracingSingleResult *rslts_out, int32 skip_id)
 {
-	for(int msk=0;msk<8;msk++)
+	if (! nrays)
+		return;
+
+	// key each ray by octant, then by the morton order of the cell its origin is in, so that
+	// neighboring rays in the sorted order start near each other
+	Vector cell_scale;
+	for(int c=0;c<3;c++)
 	{
-		int cnt=s.n_in_stream[msk];
-		if (cnt)
+		float extent=m_MaxBound[c]-m_MinBound[c];
+		cell_scale[c]=(extent>0) ? (1<<RAYBATCH_CELL_BITS)/extent : 0;
+	}
+	CUtlVector<uint32> keys;
+	CUtlVector<int32> indices;
+	keys.SetCount(2*nrays);
+	indices.SetCount(2*nrays);
+	for(int i=0;i<nrays;i++)
+	{
+		uint32 morton=0;
+		for(int c=0;c<3;c++)
 		{
-			// fill in unfilled entries with dups of first
-			for(int c=cnt;c<4;c++)
-			{
-				s.PendingRays[msk].origin.X(c) = s.PendingRays[msk].origin.X(0);
-				s.PendingRays[msk].origin.Y(c) = s.PendingRays[msk].origin.Y(0);
-				s.PendingRays[msk].origin.Z(c) = s.PendingRays[msk].origin.Z(0);
-				s.PendingRays[msk].direction.X(c) = s.PendingRays[msk].direction.X(0);
-				s.PendingRays[msk].direction.Y(c) = s.PendingRays[msk].direction.Y(0);
-				s.PendingRays[msk].direction.Z(c) = s.PendingRays[msk].direction.Z(0);
-				s.PendingStreamOutputs[msk][c]=s.PendingStreamOutputs[msk][0];
-			}
-			FlushStreamEntry(s,msk);
+			int cell=(int) ((starts[i][c]-m_MinBound[c])*cell_scale[c]);
+			cell=clamp(cell,0,(1<<RAYBATCH_CELL_BITS)-1);
+			morton|=SpreadBitsBy3(cell)<<c;
 		}
+		keys[i]=(GetSignMask(ends[i]-starts[i])<<RAYBATCH_OCTANT_SHIFT)|morton;
+		indices[i]=i;
 	}
+	int32 const *sorted=RadixSortRays(nrays,keys.Base(),indices.Base(),keys.Base()+nrays,
+									  indices.Base()+nrays);
+
+	// now, trace runs of 4 that share an octant. Short runs are padded out with copies of their
+	// first ray, whose results are dropped.
+	int i=0;
+	while(i<nrays)
+	{
+		int msk=GetSignMask(ends[sorted[i]]-starts[sorted[i]]);
+		int ray_idx[4];
+		int n=0;
+		while( (n<4) && (i<nrays) && (GetSignMask(ends[sorted[i]]-starts[sorted[i]])==msk) )
+			ray_idx[n++]=sorted[i++];
+
+		FourRays rays;
+		for(int r=0;r<4;r++)
+		{
+			int src=ray_idx[(r<n) ? r : 0];
+			Vector delta=ends[src]-starts[src];
+			rays.origin.X(r)=starts[src].x;
+			rays.origin.Y(r)=starts[src].y;
+			rays.origin.Z(r)=starts[src].z;
+			rays.direction.X(r)=delta.x;
+			rays.direction.Y(r)=delta.y;
+			rays.direction.Z(r)=delta.z;
+		}
+		fltx4 tmax=rays.direction.length();
+		fltx4 scl=ReciprocalSaturateSIMD(tmax);
+		rays.direction*=scl;								// normalize
+		RayTracingResult tmpresult;
+		Trace4Rays(rays,Four_Zeros,tmax,msk,&tmpresult,skip_id);
+		// now, write out results
+		for(int r=0;r<n;r++)
+		{
+			RayTracingSingleResult *out=rslts_out+ray_idx[r];
+			out->ray_length=SubFloat( tmax, r );
+			out->surface_normal.x=tmpresult.surface_normal.X(r);
+			out->surface_normal.y=tmpresult.surface_normal.Y(r);
+			out->surface_normal.z=tmpresult.surface_normal.Z(r);
+			out->HitID=tmpresult.HitIds[r];
+			out->HitDistance=SubFloat( tmpresult.HitDistance, r );
+		}
+	}
+}
+
+void RayTracingEnvironment::FlushRayStream(RayStream &s)
+{
+	int nrays=s.PendingStarts.Count();
+	s.PendingResults.SetCount(nrays);
+	TraceRayBatch(nrays,s.PendingStarts.Base(),s.PendingEnds.Base(),s.PendingResults.Base());
+	for(int i=0;i<nrays;i++)
+		*(s.PendingStreamOutputs[i])=s.PendingResults[i];
+	s.PendingStarts.RemoveAll();
+	s.PendingEnds.RemoveAll();
+	s.PendingStreamOutputs.RemoveAll();
+}
+
+void RayTracingEnvironment::AddToRayStream(RayStream &s,
+										   Vector const &start,Vector const &end,
+										   RayTracingSingleResult *rslt_out)
+{
+	s.PendingStarts.AddToTail(start);
+	s.PendingEnds.AddToTail(end);
+	s.PendingStreamOutputs.AddToTail(rslt_out);
+	if (s.PendingStarts.Count()>=RAYSTREAM_MAX_PENDING)
+		FlushRayStream(s);
+}
+
+void RayTracingEnvironment::FinishRayStream(RayStream &s)
+{
+	if (s.PendingStarts.Count())
+		FlushRayStream(s);
 }
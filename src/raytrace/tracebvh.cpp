@@ -0,0 +1,380 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id$
+
+// binned surface area heuristic bvh builder, used instead of the kd-tree when
+// RTE_FLAGS_BVH_ACCELERATION is set.
+//
+// A bvh partitions the triangles instead of splitting space, so each node owns a contiguous range
+// of TriangleIndexList and sibling subtrees never touch the same data. That makes the build easy to
+// run in parallel: the top of the tree is built on the calling thread until the nodes are small
+// enough, and the remaining subtrees are handed out to worker threads. Splits are chosen by binning
+// triangle centroids along each axis and evaluating the same cost model as the kd-tree at each bin
+// boundary, which is linear in the number of triangles instead of the kd-tree's quadratic search.
+
+#include "raytrace.h"
+#include <tier0/threadtools.h>
+#include <stdlib.h>
+
+#define BVH_NUM_BINS 16										// candidate split planes per axis
+#define BVH_MAX_LEAF_TRIANGLES 16							// larger nodes are always split
+#define BVH_MIN_SUBTREE_TRIANGLES 1024						// don't hand out smaller subtrees than this
+#define BVH_MAX_BUILD_THREADS 32
+
+#define BVH_COST_OF_TRAVERSAL 100							// approximate #operations for a box test
+#define BVH_COST_OF_INTERSECTION 167						// approximate #operations
+
+
+static float BoxSurfaceArea(Vector const &boxmin, Vector const &boxmax)
+{
+	Vector boxdim=boxmax-boxmin;
+	return 2.0*((boxdim[0]*boxdim[2])+(boxdim[0]*boxdim[1])+(boxdim[1]*boxdim[2]));
+}
+
+
+struct BVHBuildTriangle_t
+{
+	Vector m_Mins;
+	Vector m_Maxs;
+	Vector m_Center;										// center of the bounding box
+};
+
+struct BVHBuildBin_t
+{
+	Vector m_Mins;
+	Vector m_Maxs;
+	int m_nCount;
+};
+
+struct BVHBuildTask_t
+{
+	int32 m_nNode;
+	int32 m_nFirst;
+	int32 m_nCount;
+	int32 m_nDepth;
+};
+
+
+class CBVHBuilder
+{
+public:
+	CBVHBuilder( RayTracingEnvironment *pEnv );
+
+	void Build( void );
+
+private:
+	void BuildNode( int nNode, int nFirst, int nCount, int nDepth, bool bQueueSubtrees );
+	void MakeLeaf( int nNode, int nFirst, int nCount );
+	int AllocateNodePair( void );
+
+	// returns the number of triangles in the left child, or 0 if the node shouldn't be split by
+	// centroid
+	int FindSplit( CacheOptimizedBVHNode &node, int nFirst, int nCount,
+				   Vector const &centerMins, Vector const &centerMaxs, int &nAxisOut );
+
+	static unsigned BuildSubtreesThreadFn( void *pParam );
+	static int __cdecl CompareTasks( const void *pA, const void *pB );
+
+	RayTracingEnvironment *m_pEnv;
+	int32 *m_pTriangleIndices;
+	CUtlVector<BVHBuildTriangle_t> m_Triangles;
+	CUtlVector<BVHBuildTask_t> m_Tasks;
+	int m_nSubtreeTriangles;								// queue subtrees this small or smaller
+	long volatile m_nNodesUsed;
+	long volatile m_nNextTask;
+};
+
+
+CBVHBuilder::CBVHBuilder( RayTracingEnvironment *pEnv )
+{
+	m_pEnv = pEnv;
+	m_pTriangleIndices = NULL;
+	m_nSubtreeTriangles = 0;
+	m_nNodesUsed = 0;
+	m_nNextTask = 0;
+}
+
+
+int CBVHBuilder::AllocateNodePair( void )
+{
+	int nNode = ThreadInterlockedExchangeAdd( &m_nNodesUsed, 2 );
+	Assert( nNode + 1 < m_pEnv->OptimizedBVH.Count() );
+	return nNode;
+}
+
+
+void CBVHBuilder::MakeLeaf( int nNode, int nFirst, int nCount )
+{
+	CacheOptimizedBVHNode &node = m_pEnv->OptimizedBVH[nNode];
+	node.m_nFirst = nFirst;
+	node.m_nTrianglesAndAxis = nCount << 2;
+}
+
+
+int CBVHBuilder::FindSplit( CacheOptimizedBVHNode &node, int nFirst, int nCount,
+							Vector const &centerMins, Vector const &centerMaxs, int &nAxisOut )
+{
+	float flBestCost = 1.0e23;
+	int nBestAxis = -1;
+	int nBestBin = 0;
+	float flBestScale = 0;
+
+	for ( int nAxis = 0; nAxis < 3; nAxis++ )
+	{
+		float flExtent = centerMaxs[nAxis] - centerMins[nAxis];
+		if ( flExtent <= 0 )
+			continue;										// all centers on one plane
+
+		// slightly under BVH_NUM_BINS so the max center lands in the last bin
+		float flScale = ( BVH_NUM_BINS * ( 1.0f - 1.0e-5f ) ) / flExtent;
+
+		BVHBuildBin_t bins[BVH_NUM_BINS];
+		for ( int b = 0; b < BVH_NUM_BINS; b++ )
+		{
+			bins[b].m_Mins = Vector( 1.0e23, 1.0e23, 1.0e23 );
+			bins[b].m_Maxs = Vector( -1.0e23, -1.0e23, -1.0e23 );
+			bins[b].m_nCount = 0;
+		}
+		for ( int t = 0; t < nCount; t++ )
+		{
+			BVHBuildTriangle_t const &tri = m_Triangles[m_pTriangleIndices[nFirst + t]];
+			int nBin = clamp( (int)( ( tri.m_Center[nAxis] - centerMins[nAxis] ) * flScale ), 0, BVH_NUM_BINS - 1 );
+			bins[nBin].m_nCount++;
+			AddPointToBounds( tri.m_Mins, bins[nBin].m_Mins, bins[nBin].m_Maxs );
+			AddPointToBounds( tri.m_Maxs, bins[nBin].m_Mins, bins[nBin].m_Maxs );
+		}
+
+		// sweep from the right to get the area*count of everything right of each boundary, then
+		// sweep from the left evaluating each boundary
+		float flRightCost[BVH_NUM_BINS];
+		Vector rightMins( 1.0e23, 1.0e23, 1.0e23 );
+		Vector rightMaxs( -1.0e23, -1.0e23, -1.0e23 );
+		int nRight = 0;
+		for ( int b = BVH_NUM_BINS - 1; b > 0; b-- )
+		{
+			if ( bins[b].m_nCount )
+			{
+				nRight += bins[b].m_nCount;
+				AddPointToBounds( bins[b].m_Mins, rightMins, rightMaxs );
+				AddPointToBounds( bins[b].m_Maxs, rightMins, rightMaxs );
+			}
+			flRightCost[b] = nRight ? BoxSurfaceArea( rightMins, rightMaxs ) * nRight : 0;
+		}
+
+		Vector leftMins( 1.0e23, 1.0e23, 1.0e23 );
+		Vector leftMaxs( -1.0e23, -1.0e23, -1.0e23 );
+		int nLeft = 0;
+		for ( int b = 0; b < BVH_NUM_BINS - 1; b++ )
+		{
+			if ( bins[b].m_nCount )
+			{
+				nLeft += bins[b].m_nCount;
+				AddPointToBounds( bins[b].m_Mins, leftMins, leftMaxs );
+				AddPointToBounds( bins[b].m_Maxs, leftMins, leftMaxs );
+			}
+			if ( ( nLeft == 0 ) || ( nLeft == nCount ) )
+				continue;									// one side would be empty
+			float flCost = BoxSurfaceArea( leftMins, leftMaxs ) * nLeft + flRightCost[b + 1];
+			if ( flCost < flBestCost )
+			{
+				flBestCost = flCost;
+				nBestAxis = nAxis;
+				nBestBin = b;
+				flBestScale = flScale;
+			}
+		}
+	}
+
+	if ( nBestAxis == -1 )
+		return 0;
+
+	// same cost model as the kd-tree: is traversing one more node cheaper than testing every
+	// triangle in this one?
+	Vector nodeMins( node.m_flMins[0], node.m_flMins[1], node.m_flMins[2] );
+	Vector nodeMaxs( node.m_flMaxs[0], node.m_flMaxs[1], node.m_flMaxs[2] );
+	float flNodeArea = BoxSurfaceArea( nodeMins, nodeMaxs );
+	float flCostOfSplit = BVH_COST_OF_TRAVERSAL;
+	if ( flNodeArea > 0 )
+		flCostOfSplit += BVH_COST_OF_INTERSECTION * flBestCost / flNodeArea;
+	if ( ( flCostOfSplit >= BVH_COST_OF_INTERSECTION * nCount ) && ( nCount <= BVH_MAX_LEAF_TRIANGLES ) )
+		return 0;
+
+	// partition the index range in place, left bins first
+	int32 *pIndices = m_pTriangleIndices + nFirst;
+	int nLeft = 0;
+	int nRight = nCount;
+	while ( nLeft < nRight )
+	{
+		BVHBuildTriangle_t const &tri = m_Triangles[pIndices[nLeft]];
+		int nBin = clamp( (int)( ( tri.m_Center[nBestAxis] - centerMins[nBestAxis] ) * flBestScale ), 0, BVH_NUM_BINS - 1 );
+		if ( nBin <= nBestBin )
+			nLeft++;
+		else
+			V_swap( pIndices[nLeft], pIndices[--nRight] );
+	}
+	Assert( ( nLeft > 0 ) && ( nLeft < nCount ) );
+	nAxisOut = nBestAxis;
+	return nLeft;
+}
+
+
+void CBVHBuilder::BuildNode( int nNode, int nFirst, int nCount, int nDepth, bool bQueueSubtrees )
+{
+	if ( bQueueSubtrees && ( nCount <= m_nSubtreeTriangles ) )
+	{
+		BVHBuildTask_t task;
+		task.m_nNode = nNode;
+		task.m_nFirst = nFirst;
+		task.m_nCount = nCount;
+		task.m_nDepth = nDepth;
+		m_Tasks.AddToTail( task );
+		return;
+	}
+
+	// bound the triangles and their centers
+	Vector mins( 1.0e23, 1.0e23, 1.0e23 );
+	Vector maxs( -1.0e23, -1.0e23, -1.0e23 );
+	Vector centerMins( 1.0e23, 1.0e23, 1.0e23 );
+	Vector centerMaxs( -1.0e23, -1.0e23, -1.0e23 );
+	for ( int t = 0; t < nCount; t++ )
+	{
+		BVHBuildTriangle_t const &tri = m_Triangles[m_pTriangleIndices[nFirst + t]];
+		AddPointToBounds( tri.m_Mins, mins, maxs );
+		AddPointToBounds( tri.m_Maxs, mins, maxs );
+		AddPointToBounds( tri.m_Center, centerMins, centerMaxs );
+	}
+
+	CacheOptimizedBVHNode &node = m_pEnv->OptimizedBVH[nNode];
+	for ( int c = 0; c < 3; c++ )
+	{
+		node.m_flMins[c] = mins[c];
+		node.m_flMaxs[c] = maxs[c];
+	}
+
+	if ( ( nCount <= 2 ) || ( nDepth >= BVH_MAX_DEPTH ) )
+	{
+		MakeLeaf( nNode, nFirst, nCount );
+		return;
+	}
+
+	int nAxis = 0;
+	int nLeft = FindSplit( node, nFirst, nCount, centerMins, centerMaxs, nAxis );
+	if ( nLeft == 0 )
+	{
+		if ( nCount <= BVH_MAX_LEAF_TRIANGLES )
+		{
+			MakeLeaf( nNode, nFirst, nCount );
+			return;
+		}
+
+		// too many triangles sharing a center to split by position. Just cut the list in half
+		// along the longest axis, which at least keeps the leaves small.
+		Vector extent = maxs - mins;
+		nAxis = ( extent.x > extent.y ) ? ( ( extent.x > extent.z ) ? 0 : 2 ) : ( ( extent.y > extent.z ) ? 1 : 2 );
+		nLeft = nCount / 2;
+	}
+
+	int nChildren = AllocateNodePair();
+	node.m_nFirst = nChildren;
+	node.m_nTrianglesAndAxis = nAxis;
+
+	BuildNode( nChildren, nFirst, nLeft, nDepth + 1, bQueueSubtrees );
+	BuildNode( nChildren + 1, nFirst + nLeft, nCount - nLeft, nDepth + 1, bQueueSubtrees );
+}
+
+
+int __cdecl CBVHBuilder::CompareTasks( const void *pA, const void *pB )
+{
+	// biggest first, so that no thread is left with a huge subtree at the end
+	return ( (BVHBuildTask_t const *) pB )->m_nCount - ( (BVHBuildTask_t const *) pA )->m_nCount;
+}
+
+
+unsigned CBVHBuilder::BuildSubtreesThreadFn( void *pParam )
+{
+	CBVHBuilder *pBuilder = (CBVHBuilder *) pParam;
+	for (;;)
+	{
+		int nTask = ThreadInterlockedIncrement( &pBuilder->m_nNextTask ) - 1;
+		if ( nTask >= pBuilder->m_Tasks.Count() )
+			break;
+		BVHBuildTask_t const &task = pBuilder->m_Tasks[nTask];
+		pBuilder->BuildNode( task.m_nNode, task.m_nFirst, task.m_nCount, task.m_nDepth, false );
+	}
+	return 0;
+}
+
+
+void CBVHBuilder::Build( void )
+{
+	int ntris = m_pEnv->OptimizedTriangleList.Count();
+	m_pEnv->OptimizedBVH.Purge();
+	m_pEnv->TriangleIndexList.Purge();
+	if ( ! ntris )
+		return;
+
+	m_Triangles.SetCount( ntris );
+	m_pEnv->TriangleIndexList.SetCount( ntris );
+	m_pTriangleIndices = m_pEnv->TriangleIndexList.Base();
+	for ( int t = 0; t < ntris; t++ )
+	{
+		CacheOptimizedTriangle const &tri = m_pEnv->OptimizedTriangleList[t];
+		BVHBuildTriangle_t &bt = m_Triangles[t];
+		bt.m_Mins = tri.Vertex( 0 );
+		bt.m_Maxs = tri.Vertex( 0 );
+		AddPointToBounds( tri.Vertex( 1 ), bt.m_Mins, bt.m_Maxs );
+		AddPointToBounds( tri.Vertex( 2 ), bt.m_Mins, bt.m_Maxs );
+		bt.m_Center = 0.5 * ( bt.m_Mins + bt.m_Maxs );
+		m_pTriangleIndices[t] = t;
+	}
+
+	// every split leaves at least one triangle on each side, so there are at most ntris leaves
+	// and 2*ntris-1 nodes. Allocate them all up front so threads never grow the vector.
+	m_pEnv->OptimizedBVH.SetCount( 2 * ntris - 1 );
+	m_nNodesUsed = 1;
+
+	int nThreads = clamp( GetCPUInformation()->m_nLogicalProcessors, 1, BVH_MAX_BUILD_THREADS );
+	if ( nThreads > 1 )
+	{
+		// enough subtrees for each thread to get several, so the work evens out
+		m_nSubtreeTriangles = MAX( ntris / ( nThreads * 8 ), BVH_MIN_SUBTREE_TRIANGLES );
+	}
+	BuildNode( 0, 0, ntris, 0, nThreads > 1 );
+
+	if ( m_Tasks.Count() )
+	{
+		qsort( m_Tasks.Base(), m_Tasks.Count(), sizeof( BVHBuildTask_t ), CompareTasks );
+
+		ThreadHandle_t hThreads[BVH_MAX_BUILD_THREADS];
+		int nWorkers = MIN( nThreads, m_Tasks.Count() ) - 1;
+		for ( int i = 0; i < nWorkers; i++ )
+			hThreads[i] = CreateSimpleThread( BuildSubtreesThreadFn, this );
+
+		// this thread pitches in too
+		BuildSubtreesThreadFn( this );
+
+		for ( int i = 0; i < nWorkers; i++ )
+		{
+			ThreadJoin( hThreads[i] );
+			ReleaseThreadHandle( hThreads[i] );
+		}
+	}
+
+	m_pEnv->OptimizedBVH.RemoveMultipleFromTail( m_pEnv->OptimizedBVH.Count() - m_nNodesUsed );
+}
+
+
+void RayTracingEnvironment::SetupBVHAccelerationStructure(void)
+{
+	CBVHBuilder builder( this );
+	builder.Build();
+
+	if ( OptimizedBVH.Count() )
+	{
+		m_MinBound.Init( OptimizedBVH[0].m_flMins[0], OptimizedBVH[0].m_flMins[1], OptimizedBVH[0].m_flMins[2] );
+		m_MaxBound.Init( OptimizedBVH[0].m_flMaxs[0], OptimizedBVH[0].m_flMaxs[1], OptimizedBVH[0].m_flMaxs[2] );
+	}
+
+	// now, convert all triangles to "intersection format"
+	for(int i=0;i<OptimizedTriangleList.Count();i++)
+		OptimizedTriangleList[i].ChangeIntoIntersectionFormat();
+}
@@ -13,13 +13,23 @@
 
 #define	USED
 
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
 #include "cmdlib.h"
 #define NO_THREAD_NAMES
 #include "threads.h"
 #include "pacifier.h"
+#include "tier0/threadtools.h"
+
+#define	MAX_THREADS	MAX_TOOL_THREADS
 
-#define	MAX_THREADS	16
+// Work items are claimed in chunks of (remaining / WORK_CHUNK_DIVISOR), clamped to WORK_CHUNK_MAX, so a
+// thread's slice starts out handing over big chunks and shrinks to single items near the end.
+#define WORK_CHUNK_DIVISOR	8
+#define WORK_CHUNK_MAX		32
 
 
 class CRunThreadsData
@@ -33,15 +43,151 @@ public:
 CRunThreadsData g_RunThreadsData[MAX_THREADS];
 
 
-int		dispatch;
 int		workcount;
 qboolean		pacifier;
 
 qboolean	threaded;
 bool g_bLowPriorityThreads = false;
 
-HANDLE g_ThreadHandles[MAX_THREADS];
+ThreadHandle_t g_ThreadHandles[MAX_THREADS];
+
+
+/*
+===================================================================
+
+WORK STEALING
+
+Every thread owns a slice of the work, packed into one 64 bit word (first
+item in the low half, end in the high half) so the owner and thieves can
+both claim items from it with a single compare and swap, no lock involved.
+Owners take chunks off the front of their slice, threads that run dry steal
+the back half of the biggest slice left.
+
+Slices are columns of the work laid out row by row, so thread t walks items
+t, t+numthreads, t+2*numthreads... Every thread moves through the items in
+roughly their original order, which callers like vvis rely on (it sorts
+portals so the cheap ones finish first and speed up the rest).
+
+===================================================================
+*/
+
+struct ThreadWorkQueue_t
+{
+	volatile int64 m_nRange;	// Stealable slice, see PackWorkRange().
+	int m_iNext;				// Chunk this thread already claimed, only touched by the owner.
+	int m_iEnd;
+	byte m_Pad[64 - sizeof( int64 ) - 2 * sizeof( int )];	// Keep each queue on its own cache line.
+};
+
+static ThreadWorkQueue_t g_WorkQueues[MAX_TOOL_THREADS+1];
+static int g_nWorkQueues;
+static int g_nWorkRows;					// Rows in the item layout described above.
+static volatile int g_nWorkDispatched;	// Only feeds the pacifier.
+static volatile int g_nPacifierBusy;
+
+// 1 + the index of the RunThreadsOn thread running on this OS thread, 0 anywhere else.
+static CTHREADLOCALINT g_iWorkQueueThread;
+
+
+static inline int64 PackWorkRange( int iBegin, int iEnd )
+{
+	return (int64)( ( (uint64)(uint32)iEnd << 32 ) | (uint64)(uint32)iBegin );
+}
+
+static inline int WorkRangeBegin( int64 nRange )
+{
+	return (int)(uint32)( (uint64)nRange & 0xFFFFFFFF );
+}
 
+static inline int WorkRangeEnd( int64 nRange )
+{
+	return (int)(uint32)( (uint64)nRange >> 32 );
+}
+
+// Maps a position in the slices back to the work item it stands for, -1 for the padding at the end of the last row.
+static inline int WorkSlotToItem( int iSlot )
+{
+	int iItem = ( iSlot % g_nWorkRows ) * g_nWorkQueues + ( iSlot / g_nWorkRows );
+	return ( iItem < workcount ) ? iItem : -1;
+}
+
+
+static void InitWorkQueues( int nWorkItems, int nThreads )
+{
+	g_nWorkQueues = clamp( nThreads, 1, MAX_TOOL_THREADS );
+	g_nWorkRows = ( nWorkItems + g_nWorkQueues - 1 ) / g_nWorkQueues;
+	g_nWorkDispatched = 0;
+	g_nPacifierBusy = 0;
+
+	for ( int i=0; i < (MAX_TOOL_THREADS+1); i++ )
+	{
+		ThreadWorkQueue_t &queue = g_WorkQueues[i];
+		if ( i < g_nWorkQueues )
+			queue.m_nRange = PackWorkRange( i * g_nWorkRows, ( i + 1 ) * g_nWorkRows );
+		else
+			queue.m_nRange = PackWorkRange( 0, 0 );	// THREADINDEX_MAIN and unused threads only ever steal.
+
+		queue.m_iNext = queue.m_iEnd = 0;
+	}
+}
+
+
+static bool ClaimWorkChunk( ThreadWorkQueue_t &queue )
+{
+	while ( 1 )
+	{
+		int64 nRange = queue.m_nRange;
+		int iBegin = WorkRangeBegin( nRange );
+		int iEnd = WorkRangeEnd( nRange );
+		if ( iBegin >= iEnd )
+			return false;
+
+		int nChunk = clamp( ( iEnd - iBegin ) / WORK_CHUNK_DIVISOR, 1, WORK_CHUNK_MAX );
+		if ( ThreadInterlockedAssignIf64( &queue.m_nRange, PackWorkRange( iBegin + nChunk, iEnd ), nRange ) )
+		{
+			queue.m_iNext = iBegin;
+			queue.m_iEnd = iBegin + nChunk;
+			return true;
+		}
+	}
+}
+
+
+static bool StealWork( int iThief )
+{
+	while ( 1 )
+	{
+		// Go after whoever has the most left, that's where the stolen half is worth the most.
+		int iVictim = -1;
+		int64 nVictimRange = 0;
+		int nMostRemaining = 0;
+		for ( int i=1; i <= (MAX_TOOL_THREADS+1); i++ )
+		{
+			int iQueue = ( iThief + i ) % (MAX_TOOL_THREADS+1);
+			int64 nRange = g_WorkQueues[iQueue].m_nRange;
+			int nRemaining = WorkRangeEnd( nRange ) - WorkRangeBegin( nRange );
+			if ( nRemaining > nMostRemaining )
+			{
+				iVictim = iQueue;
+				nVictimRange = nRange;
+				nMostRemaining = nRemaining;
+			}
+		}
+
+		if ( iVictim == -1 )
+			return false;	// Anything left is already claimed by the thread running it.
+
+		int iBegin = WorkRangeBegin( nVictimRange );
+		int iEnd = WorkRangeEnd( nVictimRange );
+		int iSplit = iEnd - ( nMostRemaining + 1 ) / 2;
+		if ( ThreadInterlockedAssignIf64( &g_WorkQueues[iVictim].m_nRange, PackWorkRange( iBegin, iSplit ), nVictimRange ) )
+		{
+			// Our own slice is empty, nobody else will touch it until the stolen half shows up in it.
+			ThreadInterlockedExchange64( &g_WorkQueues[iThief].m_nRange, PackWorkRange( iSplit, iEnd ) );
+			return true;
+		}
+	}
+}
 
 
 /*
@@ -52,23 +198,32 @@ GetThreadWork
 */
 int	GetThreadWork (void)
 {
-	int	r;
+	int iThread = g_iWorkQueueThread - 1;
+	if ( iThread < 0 )
+		iThread = THREADINDEX_MAIN;
 
-	ThreadLock ();
-
-	if (dispatch == workcount)
+	ThreadWorkQueue_t &queue = g_WorkQueues[iThread];
+	while ( 1 )
 	{
-		ThreadUnlock ();
-		return -1;
-	}
-
-	UpdatePacifier( (float)dispatch / workcount );
-
-	r = dispatch;
-	dispatch++;
-	ThreadUnlock ();
+		while ( queue.m_iNext < queue.m_iEnd )
+		{
+			int iItem = WorkSlotToItem( queue.m_iNext++ );
+			if ( iItem == -1 )
+				continue;
+
+			int nDispatched = ThreadInterlockedIncrement( &g_nWorkDispatched );
+			if ( ThreadInterlockedAssignIf( &g_nPacifierBusy, 1, 0 ) )
+			{
+				UpdatePacifier( (float)nDispatched / workcount );
+				g_nPacifierBusy = 0;
+			}
+
+			return iItem;
+		}
 
-	return r;
+		if ( !ClaimWorkChunk( queue ) && !StealWork( iThread ) )
+			return -1;
+	}
 }
 
 
@@ -101,43 +256,36 @@ void RunThreadsOnIndividual (int workcnt, qboolean showpacifier, ThreadWorkerFn
 /*
 ===================================================================
 
-WIN32
+THREADS
 
 ===================================================================
 */
 
 int		numthreads = -1;
-CRITICAL_SECTION		crit;
+CThreadMutex		crit;
 static int enter;
 
 
-class CCritInit
-{
-public:
-	CCritInit()
-	{
-		InitializeCriticalSection (&crit);
-	}
-} g_CritInit;
-
-
 
 void SetLowPriority()
 {
+#ifdef _WIN32
 	SetPriorityClass( GetCurrentProcess(), IDLE_PRIORITY_CLASS );
+#else
+	setpriority( PRIO_PROCESS, 0, 19 );
+#endif
 }
 
 
 void ThreadSetDefault (void)
 {
-	SYSTEM_INFO info;
-
 	if (numthreads == -1)	// not set manually
 	{
-		GetSystemInfo (&info);
-		numthreads = info.dwNumberOfProcessors;
-		if (numthreads < 1 || numthreads > 32)
+		numthreads = GetCPUInformation()->m_nLogicalProcessors;
+		if (numthreads < 1)
 			numthreads = 1;
+		else if (numthreads > MAX_TOOL_THREADS)
+			numthreads = MAX_TOOL_THREADS;
 	}
 
 	Msg ("%i threads\n", numthreads);
@@ -148,7 +296,7 @@ void ThreadLock (void)
 {
 	if (!threaded)
 		return;
-	EnterCriticalSection (&crit);
+	crit.Lock();
 	if (enter)
 		Error ("Recursive ThreadLock\n");
 	enter = 1;
@@ -161,15 +309,17 @@ void ThreadUnlock (void)
 	if (!enter)
 		Error ("ThreadUnlock without lock\n");
 	enter = 0;
-	LeaveCriticalSection (&crit);
+	crit.Unlock();
 }
 
 
 // This runs in the thread and dispatches a RunThreadsFn call.
-DWORD WINAPI InternalRunThreadsFn( LPVOID pParameter )
+static unsigned InternalRunThreadsFn( void *pParameter )
 {
 	CRunThreadsData *pData = (CRunThreadsData*)pParameter;
+	g_iWorkQueueThread = pData->m_iThread + 1;
 	pData->m_Fn( pData->m_iThread, pData->m_pUserData );
+	g_iWorkQueueThread = 0;
 	return 0;
 }
 
@@ -188,33 +338,31 @@ void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePr
 		g_RunThreadsData[i].m_pUserData = pUserData;
 		g_RunThreadsData[i].m_Fn = fn;
 
-		DWORD dwDummy;
-		g_ThreadHandles[i] = CreateThread(
-		   NULL,	// LPSECURITY_ATTRIBUTES lpsa,
-		   0,		// DWORD cbStack,
-		   InternalRunThreadsFn,	// LPTHREAD_START_ROUTINE lpStartAddr,
-		   &g_RunThreadsData[i],	// LPVOID lpvThreadParm,
-		   0,			// DWORD fdwCreate,
-		   &dwDummy );
+		g_ThreadHandles[i] = CreateSimpleThread( InternalRunThreadsFn, &g_RunThreadsData[i] );
 
+#ifdef _WIN32
+		// POSIX threads stay at the process priority, SetLowPriority() lowers it for all of them.
 		if ( ePriority == k_eRunThreadsPriority_UseGlobalState )
 		{
 			if( g_bLowPriorityThreads )
-				SetThreadPriority( g_ThreadHandles[i], THREAD_PRIORITY_LOWEST );
+				ThreadSetPriority( g_ThreadHandles[i], THREAD_PRIORITY_LOWEST );
 		}
 		else if ( ePriority == k_eRunThreadsPriority_Idle )
 		{
-			SetThreadPriority( g_ThreadHandles[i], THREAD_PRIORITY_IDLE );
+			ThreadSetPriority( g_ThreadHandles[i], THREAD_PRIORITY_IDLE );
 		}
+#endif
 	}
 }
 
 
 void RunThreads_End()
 {
-	WaitForMultipleObjects( numthreads, g_ThreadHandles, TRUE, INFINITE );
 	for ( int i=0; i < numthreads; i++ )
-		CloseHandle( g_ThreadHandles[i] );
+	{
+		ThreadJoin( g_ThreadHandles[i] );
+		ReleaseThreadHandle( g_ThreadHandles[i] );
+	}
 
 	threaded = false;
 }
@@ -230,8 +378,8 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	int		start, end;
 
 	start = Plat_FloatTime();
-	dispatch = 0;
 	workcount = workcnt;
+	InitWorkQueues( workcnt, numthreads );
 	StartPacifier("");
 	pacifier = showpacifier;
 
@@ -18,7 +18,7 @@
 
 // Arrays that are indexed by thread should always be MAX_TOOL_THREADS+1
 // large so THREADINDEX_MAIN can be used from the main thread.
-#define MAX_TOOL_THREADS	16
+#define MAX_TOOL_THREADS	64
 #define THREADINDEX_MAIN	(MAX_TOOL_THREADS)
 
 
@@ -43,6 +43,9 @@ enum ERunThreadsPriority
 void SetLowPriority();
 
 void ThreadSetDefault (void);
+
+// Returns the next work item for the calling RunThreadsOn thread, or -1 once everything is handed out.
+// Items come out of per-thread slices without taking a lock, threads that run dry steal from the others.
 int	GetThreadWork (void);
 
 void RunThreadsOnIndividual ( int workcnt, qboolean showpacifier, ThreadWorkerFn fn );
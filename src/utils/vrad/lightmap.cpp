@@ -1976,10 +1976,18 @@ void GatherSampleStandardLightSSE( SSE_sampleLightOutput_t &out, directlight_t *
 		out.m_flFalloff = MulSIMD( mult, out.m_flFalloff );
 	}
 
-	// Raytrace for visibility function
-	fltx4 fractionVisible = Four_Ones;
-	TestLine( pos, src, &fractionVisible, static_prop_index_to_ignore);
-	dot = MulSIMD( fractionVisible, dot );
+	// Raytrace for visibility function, unless the caller is batching up the shadow rays
+	if ( nLFlags & GATHERLFLAGS_DEFER_VISIBILITY )
+	{
+		out.m_VisibilityEnd = src;
+		out.m_bVisibilityDeferred = true;
+	}
+	else
+	{
+		fltx4 fractionVisible = Four_Ones;
+		TestLine( pos, src, &fractionVisible, static_prop_index_to_ignore);
+		dot = MulSIMD( fractionVisible, dot );
+	}
 	out.m_flDot[0] = dot;
 
 	for ( int i = 1; i < normalCount; i++ )
@@ -2010,6 +2018,7 @@ void GatherSampleLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int
 		out.m_flDot[b] = Four_Zeros;
 	out.m_flFalloff = Four_Zeros;
 	out.m_flSunAmount = Four_Zeros;
+	out.m_bVisibilityDeferred = false;
 	Assert( normalCount <= (NUM_BUMP_VECTS+1) );
 
 	// skylights work fundamentally differently than normal lights
@@ -2486,41 +2495,64 @@ static void ComputeIlluminationPointAndNormalsSSE( lightinfo_t const& l, FourVec
 }
 
 //-----------------------------------------------------------------------------
-// Iterates over all lights and computes lighting at up to 4 sample points
+// A light's contribution to a group of up to 4 samples, waiting on its shadow
+// rays before it gets added to the lightmap
 //-----------------------------------------------------------------------------
-static void GatherSampleLightAt4Points( SSE_SampleInfo_t& info, int sampleIdx, int numSamples )
+struct DeferredSampleLight_t
+{
+	directlight_t	*m_pLight;
+	int				m_nSample;
+	int				m_nNumSamples;
+	int				m_nRay[4];				// shadow ray in the batch for each sample, or -1
+	float			m_flFxDot[NUM_BUMP_VECTS+1][4];
+	float			m_flSunAmount[4];
+	Vector			m_vecPoint;				// for the too many light styles warning
+};
+
+struct DeferredFaceLights_t
 {
-	SSE_sampleLightOutput_t out;
+	CShadowRayBatch						m_ShadowRays;
+	CUtlVector<DeferredSampleLight_t>	m_Lights;
+};
 
-	// Iterate over all direct lights and add them to the particular sample
-	for (directlight_t *dl = activelights; dl != NULL; dl = dl->next)
-	{	    
-		// is this lights cluster visible?
-		fltx4 dotMask = Four_Zeros;
+static DeferredFaceLights_t s_DeferredFaceLights[MAX_TOOL_THREADS+1];
+
+// Enough rays for TraceRayBatch to sort into coherent packets, without holding
+// a huge face's worth of contributions at once
+#define DEFERRED_SHADOW_RAY_LIMIT 8192
+
+//-----------------------------------------------------------------------------
+// Traces the queued shadow rays and adds the lights that got through, in the
+// order they were queued so light styles get allocated just like before
+//-----------------------------------------------------------------------------
+static void AddDeferredSampleLights( SSE_SampleInfo_t& info )
+{
+	DeferredFaceLights_t &deferred = s_DeferredFaceLights[info.m_iThread];
+	if ( deferred.m_ShadowRays.Count() )
+	{
+		deferred.m_ShadowRays.Trace();
+	}
+
+	for ( int l = 0; l < deferred.m_Lights.Count(); l++ )
+	{
+		DeferredSampleLight_t &light = deferred.m_Lights[l];
+		directlight_t *dl = light.m_pLight;
+
+		// Shadowing is all or nothing without texture shadows, so an occluded
+		// sample loses all of its bump contributions, as it did in GatherSampleLightSSE()
 		bool skipLight = true;
-		for( int s = 0; s < numSamples; s++ )
+		for ( int i = 0; i < light.m_nNumSamples; i++ )
 		{
-			if( PVSCheck( dl->pvs, info.m_Clusters[s] ) )
+			if ( ( light.m_nRay[i] != -1 ) && !deferred.m_ShadowRays.IsVisible( light.m_nRay[i] ) )
 			{
-				dotMask = SetComponentSIMD( dotMask, s, 1.0f );
-				skipLight = false;
+				for ( int n = 0; n < info.m_NormalCount; n++ )
+					light.m_flFxDot[n][i] = 0.0f;
 			}
-		}
-		if ( skipLight )
-			continue;
 
-		GatherSampleLightSSE( out, dl, info.m_FaceNum, info.m_Points, info.m_PointNormals, info.m_NormalCount, info.m_iThread );
-		
-		// Apply the PVS check filter and compute falloff x dot
-		fltx4 fxdot[NUM_BUMP_VECTS + 1];
-		skipLight = true;
-		for ( int b = 0; b < info.m_NormalCount; b++ )
-		{
-			fxdot[b] = MulSIMD( out.m_flDot[b], dotMask );
-			fxdot[b] = MulSIMD( fxdot[b], out.m_flFalloff );
-			if ( !IsAllZeros( fxdot[b] ) )
+			for ( int n = 0; n < info.m_NormalCount; n++ )
 			{
-				skipLight = false;
+				if ( light.m_flFxDot[n][i] != 0.0f )
+					skipLight = false;
 			}
 		}
 		if ( skipLight )
@@ -2534,7 +2566,7 @@ static void GatherSampleLightAt4Points( SSE_SampleInfo_t& info, int sampleIdx, i
 			if (info.m_WarnFace != info.m_FaceNum)
 			{
 				Warning ("\nWARNING: Too many light styles on a face at (%f, %f, %f)\n",
-					info.m_Points.x.m128_f32[0], info.m_Points.y.m128_f32[0], info.m_Points.z.m128_f32[0] );
+					light.m_vecPoint.x, light.m_vecPoint.y, light.m_vecPoint.z );
 				info.m_WarnFace = info.m_FaceNum;
 			}
 			continue;
@@ -2547,20 +2579,96 @@ static void GatherSampleLightAt4Points( SSE_SampleInfo_t& info, int sampleIdx, i
 		// Incremental lighting only cares about lightstyle zero
 		if( g_pIncremental && (dl->light.style == 0) )
 		{
-			for ( int i = 0; i < numSamples; i++ )
+			for ( int i = 0; i < light.m_nNumSamples; i++ )
 			{
-				g_pIncremental->AddLightToFace( dl->m_IncrementalID, info.m_FaceNum, sampleIdx + i, 
-					info.m_LightmapSize, SubFloat( fxdot[0], i ), info.m_iThread );
+				g_pIncremental->AddLightToFace( dl->m_IncrementalID, info.m_FaceNum, light.m_nSample + i, 
+					info.m_LightmapSize, light.m_flFxDot[0][i], info.m_iThread );
 			}
 		}
 
 		for( int n = 0; n < info.m_NormalCount; ++n )
 		{
-			for ( int i = 0; i < numSamples; i++ )
+			for ( int i = 0; i < light.m_nNumSamples; i++ )
+			{
+				pLightmaps[n][light.m_nSample + i].AddLight( light.m_flFxDot[n][i], dl->light.intensity, light.m_flSunAmount[i] );
+			}
+		}
+	}
+
+	deferred.m_ShadowRays.RemoveAll();
+	deferred.m_Lights.RemoveAll();
+}
+
+//-----------------------------------------------------------------------------
+// Iterates over all lights and computes lighting at up to 4 sample points.
+// The shadow rays for point, spot and surface lights are queued, and the
+// results are added by AddDeferredSampleLights().
+//-----------------------------------------------------------------------------
+static void GatherSampleLightAt4Points( SSE_SampleInfo_t& info, int sampleIdx, int numSamples )
+{
+	SSE_sampleLightOutput_t out;
+	DeferredFaceLights_t &deferred = s_DeferredFaceLights[info.m_iThread];
+
+	// texture shadows need the coverage callback, which only Trace4Rays has
+	int nLFlags = g_bTextureShadows ? 0 : GATHERLFLAGS_DEFER_VISIBILITY;
+
+	// Iterate over all direct lights and add them to the particular sample
+	for (directlight_t *dl = activelights; dl != NULL; dl = dl->next)
+	{	    
+		// is this lights cluster visible?
+		fltx4 dotMask = Four_Zeros;
+		bool skipLight = true;
+		for( int s = 0; s < numSamples; s++ )
+		{
+			if( PVSCheck( dl->pvs, info.m_Clusters[s] ) )
 			{
-				pLightmaps[n][sampleIdx + i].AddLight( SubFloat( fxdot[n], i ), dl->light.intensity, SubFloat( out.m_flSunAmount, i ) );
+				dotMask = SetComponentSIMD( dotMask, s, 1.0f );
+				skipLight = false;
 			}
 		}
+		if ( skipLight )
+			continue;
+
+		GatherSampleLightSSE( out, dl, info.m_FaceNum, info.m_Points, info.m_PointNormals, info.m_NormalCount, info.m_iThread, nLFlags );
+		
+		// Apply the PVS check filter and compute falloff x dot
+		fltx4 fxdot[NUM_BUMP_VECTS + 1];
+		fltx4 noLight = CmpEqSIMD( Four_Zeros, Four_Zeros );
+		for ( int b = 0; b < info.m_NormalCount; b++ )
+		{
+			fxdot[b] = MulSIMD( out.m_flDot[b], dotMask );
+			fxdot[b] = MulSIMD( fxdot[b], out.m_flFalloff );
+			noLight = AndSIMD( noLight, CmpEqSIMD( fxdot[b], Four_Zeros ) );
+		}
+		int nLitLanes = ~TestSignSIMD( noLight ) & 0xF;
+		if ( !nLitLanes )
+			continue;
+
+		DeferredSampleLight_t &light = deferred.m_Lights[ deferred.m_Lights.AddToTail() ];
+		light.m_pLight = dl;
+		light.m_nSample = sampleIdx;
+		light.m_nNumSamples = numSamples;
+		light.m_vecPoint = info.m_Points.Vec( 0 );
+		for ( int b = 0; b < info.m_NormalCount; b++ )
+			StoreUnalignedSIMD( light.m_flFxDot[b], fxdot[b] );
+		StoreUnalignedSIMD( light.m_flSunAmount, out.m_flSunAmount );
+
+		// only trace the samples that would get some light
+		if ( out.m_bVisibilityDeferred )
+		{
+			deferred.m_ShadowRays.AddRays( out, info.m_Points, nLitLanes, light.m_nRay );
+		}
+		else
+		{
+			for ( int i = 0; i < 4; i++ )
+				light.m_nRay[i] = -1;
+		}
+	}
+
+	if ( ( deferred.m_ShadowRays.Count() >= DEFERRED_SHADOW_RAY_LIMIT ) ||
+		 ( deferred.m_Lights.Count() >= DEFERRED_SHADOW_RAY_LIMIT ) )
+	{
+		AddDeferredSampleLights( info );
 	}
 }
 
@@ -3144,6 +3252,9 @@ void BuildFacelights (int iThread, int facenum)
 		// Iterate over all the lights and add their contribution to this group of spots
 		GatherSampleLightAt4Points( sampleInfo, nSample, numSamples );
 	}
+
+	// Trace the shadow rays that are still queued and add the lights that got through
+	AddDeferredSampleLights( sampleInfo );
 	
 	// Tell the incremental light manager that we're done with this face.
 	if( g_pIncremental )
@@ -294,8 +294,17 @@ void MPI_ReceiveVisLeafsResults( uint64 iWorkUnit, MessageBuffer *pBuf, int iWor
 		patch->numtransfers = numtransfers;
 		if (numtransfers) 
 		{
-			patch->transfers = new transfer_t[numtransfers];
-			pBuf->read(patch->transfers, numtransfers * sizeof(transfer_t));
+			if ( g_bCompressTransfers )
+			{
+				pBuf->read( &patch->packedtransfersize, sizeof(patch->packedtransfersize) );
+				patch->packedtransfers = AllocPackedTransferRow( patch->packedtransfersize );
+				pBuf->read( patch->packedtransfers, patch->packedtransfersize );
+			}
+			else
+			{
+				patch->transfers = new transfer_t[numtransfers];
+				pBuf->read(patch->transfers, numtransfers * sizeof(transfer_t));
+			}
 		}
 		
 		total_transfer += numtransfers;
@@ -330,7 +339,18 @@ void MPI_AddPatchData( int iThread, int patchnum, CPatch *patch )
 		++pData->m_nPatchesInCluster;
 		pData->m_pVisLeafsMB->write(&patchnum, sizeof(patchnum));
 		pData->m_pVisLeafsMB->write(&patch->numtransfers, sizeof(patch->numtransfers));
-		pData->m_pVisLeafsMB->write( patch->transfers, patch->numtransfers * sizeof(transfer_t) );
+		if ( g_bCompressTransfers )
+		{
+			if ( patch->numtransfers )
+			{
+				pData->m_pVisLeafsMB->write( &patch->packedtransfersize, sizeof(patch->packedtransfersize) );
+				pData->m_pVisLeafsMB->write( patch->packedtransfers, patch->packedtransfersize );
+			}
+		}
+		else
+		{
+			pData->m_pVisLeafsMB->write( patch->transfers, patch->numtransfers * sizeof(transfer_t) );
+		}
 	}
 }
 
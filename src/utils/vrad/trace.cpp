@@ -180,6 +180,43 @@ void TestLine( const FourVectors& start, const FourVectors& stop,
 }
 
 
+void CShadowRayBatch::AddRays( SSE_sampleLightOutput_t const &out, FourVectors const &pos, int nLaneMask, int pRayIndex[4] )
+{
+	Assert( out.m_bVisibilityDeferred );
+	for ( int i = 0; i < 4; i++ )
+	{
+		pRayIndex[i] = -1;
+		if ( ( nLaneMask >> i ) & 0x1 )
+		{
+			pRayIndex[i] = m_Starts.AddToTail( pos.Vec( i ) );
+			m_Ends.AddToTail( out.m_VisibilityEnd.Vec( i ) );
+		}
+	}
+}
+
+void CShadowRayBatch::Trace( int static_prop_index_to_ignore )
+{
+	Assert( !g_bTextureShadows );
+	m_Results.SetCount( m_Starts.Count() );
+	g_RtEnv.TraceRayBatch( m_Starts.Count(), m_Starts.Base(), m_Ends.Base(), m_Results.Base(),
+		TRACE_ID_STATICPROP | static_prop_index_to_ignore );
+}
+
+// same test as TestLine()
+bool CShadowRayBatch::IsVisible( int nRay ) const
+{
+	RayTracingSingleResult const &result = m_Results[nRay];
+	return ( result.HitID == -1 ) || ( result.HitDistance >= result.ray_length );
+}
+
+void CShadowRayBatch::RemoveAll()
+{
+	m_Starts.RemoveAll();
+	m_Ends.RemoveAll();
+	m_Results.RemoveAll();
+}
+
+
 
 /*
 ================
@@ -19,6 +19,7 @@
 #include "tools_minidump.h"
 #include "loadcmdline.h"
 #include "byteswap.h"
+#include "vstdlib/random.h"
 
 #define ALLOWDEBUGOPTIONS (0 || _DEBUG)
 
@@ -39,6 +40,7 @@ CUtlVector<int>			faceParents;		// contains only root patches, use next parent t
 CUtlVector<int>			clusterChildren;
 CUtlVector<Vector>		emitlight;
 CUtlVector<bumplights_t>	addlight;
+CUtlVector<Vector>		shootlight;		// emitlight * reflectivity, for the packed transfer gather
 
 int num_sky_cameras;
 sky_camera_t sky_cameras[MAX_MAP_AREAS];
@@ -57,10 +59,12 @@ float		g_MaxDispPatchRadius = 1500.0f;			// Maximum radius allowed for displacem
 qboolean	g_bDumpPatches;
 bool	    bDumpNormals = false;
 bool		g_bDumpRtEnv = false;
+bool		g_bBenchmarkRtEnv = false;
 bool		bRed2Black = true;
 bool		g_bFastAmbient = false;
 bool        g_bNoSkyRecurse = false;
 bool		g_bDumpPropLightmaps = false;
+bool		g_bCompressTransfers = false;
 
 
 int			junk;
@@ -1218,11 +1222,6 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 			max_transfer = patch->numtransfers;
 		}
 
-
-		patch->transfers = ( transfer_t* )calloc (1, patch->numtransfers * sizeof(transfer_t));
-		if (!patch->transfers)
-			Error ("Memory allocation failure");
-
 		// get total transfer energy
 		t2 = all_transfers;
 
@@ -1238,12 +1237,28 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 		else	
 			total = 1.0f/M_PI;
 
-		t = patch->transfers;
-		t2 = all_transfers;
-		for (j=0 ; j<patch->numtransfers ; j++, t++, t2++)
+		if ( g_bCompressTransfers )
 		{
-			t->transfer = t2->transfer*total;
-			t->patch = t2->patch;
+			t2 = all_transfers;
+			for (j=0 ; j<patch->numtransfers ; j++, t2++)
+			{
+				t2->transfer *= total;
+			}
+			patch->packedtransfers = PackTransfers( all_transfers, patch->numtransfers, &patch->packedtransfersize );
+		}
+		else
+		{
+			patch->transfers = ( transfer_t* )calloc (1, patch->numtransfers * sizeof(transfer_t));
+			if (!patch->transfers)
+				Error ("Memory allocation failure");
+
+			t = patch->transfers;
+			t2 = all_transfers;
+			for (j=0 ; j<patch->numtransfers ; j++, t++, t2++)
+			{
+				t->transfer = t2->transfer*total;
+				t->patch = t2->patch;
+			}
 		}
 		if (patch->numtransfers > max_transfer)
 		{
@@ -1261,6 +1276,219 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 	ThreadUnlock ();
 }
 
+
+//-----------------------------------------------------------------------------
+// Packed transfer lists (-compresstransfers)
+//
+// A patch's transfers are packed into one row:
+//
+//		float	scale					dequantizes the transfers
+//		uint16	transfer[numtransfers]	transfer / scale as a small float, see below
+//		byte	index[]					patch indices, sorted, each stored as the
+//										delta from the previous one in 7 bit groups
+//										(high bit set = more groups follow)
+//
+// Each transfer keeps 5 bits of exponent and 11 bits of mantissa, which are
+// the low bits of the exponent and the high bits of the mantissa of an IEEE
+// float.  The scale puts the row's largest transfer at exponent 30, so every
+// transfer is kept to about 1 part in 8000 down to 2^-29 of the largest,
+// instead of the small ones rounding away next to one big neighbor.  Zero
+// is 0.
+//
+// That is 2 bytes per transfer plus 1 or 2 for the index, about 3.2 on
+// average, against 8 for a transfer_t.  Rows are allocated straight out of
+// large blocks as MakeScales packs them, so there is only ever one copy.
+//-----------------------------------------------------------------------------
+#define PACKED_TRANSFER_EXPONENT_BITS		5
+#define PACKED_TRANSFER_MANTISSA_SHIFT		( 23 - ( 16 - PACKED_TRANSFER_EXPONENT_BITS ) )
+#define PACKED_TRANSFER_MAX_EXPONENT		( ( 1 << PACKED_TRANSFER_EXPONENT_BITS ) - 2 )	// rounding can carry up one more
+#define PACKED_TRANSFER_BLOCK_SIZE			( 16 * 1024 * 1024 )
+
+static CUtlVector<byte *> g_PackedTransferBlocks;
+static byte *g_pPackedTransferPos = NULL;
+static byte *g_pPackedTransferEnd = NULL;
+static int g_nPackedTransferBytes = 0;
+
+//-----------------------------------------------------------------------------
+// Purpose: Gets space for a packed transfer row.  Rows are never freed.
+//-----------------------------------------------------------------------------
+byte *AllocPackedTransferRow( int nBytes )
+{
+	// keep each row 4 byte aligned for its scale
+	nBytes = AlignValue( nBytes, 4 );
+
+	ThreadLock();
+
+	byte *pRow;
+	if ( nBytes > PACKED_TRANSFER_BLOCK_SIZE / 4 )
+	{
+		// big rows get a block of their own rather than wasting the rest of the current one
+		pRow = (byte *)malloc( nBytes );
+		if ( !pRow )
+			Error( "Memory allocation failure" );
+		g_PackedTransferBlocks.AddToTail( pRow );
+	}
+	else
+	{
+		if ( g_pPackedTransferPos + nBytes > g_pPackedTransferEnd )
+		{
+			g_pPackedTransferPos = (byte *)malloc( PACKED_TRANSFER_BLOCK_SIZE );
+			if ( !g_pPackedTransferPos )
+				Error( "Memory allocation failure" );
+			g_pPackedTransferEnd = g_pPackedTransferPos + PACKED_TRANSFER_BLOCK_SIZE;
+			g_PackedTransferBlocks.AddToTail( g_pPackedTransferPos );
+		}
+		pRow = g_pPackedTransferPos;
+		g_pPackedTransferPos += nBytes;
+	}
+	g_nPackedTransferBytes += nBytes;
+
+	ThreadUnlock();
+
+	return pRow;
+}
+
+static int CompareTransfersByPatch( const void *pA, const void *pB )
+{
+	return ((transfer_t const *)pA)->patch - ((transfer_t const *)pB)->patch;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Packs a list of transfers into a new row.  The transfers are sorted
+//			in place.
+//-----------------------------------------------------------------------------
+byte *PackTransfers( transfer_t *transfers, int numtransfers, int *pPackedSize )
+{
+	qsort( transfers, numtransfers, sizeof( transfer_t ), CompareTransfersByPatch );
+
+	float flMaxTransfer = 0.0f;
+	int nIndexBytes = 0;
+	int nPrevPatch = 0;
+	for ( int i = 0; i < numtransfers; i++ )
+	{
+		flMaxTransfer = max( flMaxTransfer, transfers[i].transfer );
+
+		unsigned int nDelta = transfers[i].patch - nPrevPatch;
+		nPrevPatch = transfers[i].patch;
+		do
+		{
+			nIndexBytes++;
+			nDelta >>= 7;
+		} while ( nDelta );
+	}
+
+	*pPackedSize = sizeof( float ) + numtransfers * sizeof( uint16 ) + nIndexBytes;
+	byte *pPacked = AllocPackedTransferRow( *pPackedSize );
+
+	// put the largest transfer at exponent PACKED_TRANSFER_MAX_EXPONENT. Both
+	// the scale and its inverse are powers of 2, so scaling is exact.
+	float flScale = 0.0f;
+	float flInvScale = 0.0f;
+	if ( flMaxTransfer > 0.0f )
+	{
+		int nExponent;
+		frexp( flMaxTransfer, &nExponent );
+		int nShift = nExponent - ( PACKED_TRANSFER_MAX_EXPONENT + 1 - 127 );
+		flScale = ldexp( 1.0f, nShift );
+		flInvScale = ldexp( 1.0f, -nShift );
+	}
+	memcpy( pPacked, &flScale, sizeof( float ) );
+
+	uint16 *pQuantized = (uint16 *)( pPacked + sizeof( float ) );
+	for ( int i = 0; i < numtransfers; i++ )
+	{
+		float flScaled = transfers[i].transfer * flInvScale;
+		unsigned int nBits;
+		memcpy( &nBits, &flScaled, sizeof( nBits ) );
+		if ( ( nBits >> 23 ) == 0 )
+		{
+			// below exponent 1, round to 0 or the smallest value we can store
+			nBits = ( flScaled >= ldexp( 1.0f, -127 ) ) ? ( 1 << 23 ) : 0;
+		}
+
+		// round to nearest on the mantissa, a carry moves up to the next exponent
+		pQuantized[i] = (uint16)( ( nBits + ( 1 << ( PACKED_TRANSFER_MANTISSA_SHIFT - 1 ) ) ) >> PACKED_TRANSFER_MANTISSA_SHIFT );
+	}
+
+	byte *pIndex = (byte *)( pQuantized + numtransfers );
+	nPrevPatch = 0;
+	for ( int i = 0; i < numtransfers; i++ )
+	{
+		unsigned int nDelta = transfers[i].patch - nPrevPatch;
+		nPrevPatch = transfers[i].patch;
+		while ( nDelta >= 0x80 )
+		{
+			*pIndex++ = (byte)( nDelta | 0x80 );
+			nDelta >>= 7;
+		}
+		*pIndex++ = (byte)nDelta;
+	}
+
+	Assert( pIndex - pPacked == *pPackedSize );
+	return pPacked;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Decodes a patch's packed transfers four at a time.  The unused lanes
+//			of the last group repeat the last patch with a zero transfer.
+//-----------------------------------------------------------------------------
+class CPackedTransferReader
+{
+public:
+	CPackedTransferReader( CPatch const *patch )
+	{
+		float flScale;
+		memcpy( &flScale, patch->packedtransfers, sizeof( float ) );
+		m_Scale = ReplicateX4( flScale );
+		m_pQuantized = (uint16 const *)( patch->packedtransfers + sizeof( float ) );
+		m_pIndex = (byte const *)( m_pQuantized + patch->numtransfers );
+		m_nRemaining = patch->numtransfers;
+		m_nPatch = 0;
+	}
+
+	bool NextFour( int nPatch[4], fltx4 &transfer )
+	{
+		if ( m_nRemaining <= 0 )
+			return false;
+
+		// the packed bits go back to where they came from in a float
+		ALIGN16 uint32 nBits[4] ALIGN16_POST;
+		for ( int i = 0; i < 4; i++ )
+		{
+			if ( i < m_nRemaining )
+			{
+				unsigned int nDelta = 0;
+				int nShift = 0;
+				byte b;
+				do
+				{
+					b = *m_pIndex++;
+					nDelta |= ( b & 0x7f ) << nShift;
+					nShift += 7;
+				} while ( b & 0x80 );
+				m_nPatch += nDelta;
+				nBits[i] = (uint32)( *m_pQuantized++ ) << PACKED_TRANSFER_MANTISSA_SHIFT;
+			}
+			else
+			{
+				nBits[i] = 0;
+			}
+			nPatch[i] = m_nPatch;
+		}
+		m_nRemaining -= 4;
+		transfer = MulSIMD( LoadAlignedSIMD( nBits ), m_Scale );
+		return true;
+	}
+
+private:
+	fltx4 m_Scale;
+	uint16 const *m_pQuantized;
+	byte const *m_pIndex;
+	int m_nRemaining;
+	int m_nPatch;
+};
+
+
 /*
 =============
 WriteWorld
@@ -1334,6 +1562,102 @@ void WriteRTEnv (char *name)
 	g_pFileSystem->Close( out );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Builds the kd-tree and bvh ray tracing backends from the map's triangles,
+//			traces the same rays through both and reports build and trace times.
+//			Must be called before g_RtEnv's acceleration structure is built.
+//-----------------------------------------------------------------------------
+void BenchmarkRTEnv( void )
+{
+	const int nTriangles = g_RtEnv.OptimizedTriangleList.Count();
+	const int nRayPackets = 256 * 1024;
+	if ( !nTriangles )
+		return;
+
+	// surface to surface rays, like the visibility and shadow rays vrad traces
+	CUniformRandomStream random;
+	random.SetSeed( 1 );
+	CUtlVector< FourRays, CUtlMemoryAligned< FourRays, 16 > > rays;
+	CUtlVector< fltx4, CUtlMemoryAligned< fltx4, 16 > > rayLengths;
+	rays.SetCount( nRayPackets );
+	rayLengths.SetCount( nRayPackets );
+	for ( int i = 0; i < nRayPackets; i++ )
+	{
+		for ( int j = 0; j < 4; j++ )
+		{
+			const CacheOptimizedTriangle &from = g_RtEnv.OptimizedTriangleList[random.RandomInt( 0, nTriangles - 1 )];
+			const CacheOptimizedTriangle &to = g_RtEnv.OptimizedTriangleList[random.RandomInt( 0, nTriangles - 1 )];
+			Vector start = ( from.Vertex( 0 ) + from.Vertex( 1 ) + from.Vertex( 2 ) ) / 3.0f;
+			Vector end = ( to.Vertex( 0 ) + to.Vertex( 1 ) + to.Vertex( 2 ) ) / 3.0f;
+			Vector dir = end - start;
+			float flLength = VectorNormalize( dir );
+			if ( flLength < 1.0f )
+			{
+				dir.Init( 0, 0, 1 );
+				flLength = 1.0f;
+			}
+			rays[i].origin.X( j ) = start.x;
+			rays[i].origin.Y( j ) = start.y;
+			rays[i].origin.Z( j ) = start.z;
+			rays[i].direction.X( j ) = dir.x;
+			rays[i].direction.Y( j ) = dir.y;
+			rays[i].direction.Z( j ) = dir.z;
+			SubFloat( rayLengths[i], j ) = flLength - 1.0f;
+		}
+	}
+
+	const char *pBackendNames[2] = { "kd-tree", "bvh" };
+	CUtlVector< RayTracingResult, CUtlMemoryAligned< RayTracingResult, 16 > > results[2];
+	for ( int nBackend = 0; nBackend < 2; nBackend++ )
+	{
+		RayTracingEnvironment env;
+		env.Flags = RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS | RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS;
+		if ( nBackend == 1 )
+			env.Flags |= RTE_FLAGS_BVH_ACCELERATION;
+		for ( int t = 0; t < nTriangles; t++ )
+		{
+			const CacheOptimizedTriangle &tri = g_RtEnv.OptimizedTriangleList[t];
+			env.AddTriangle( tri.m_Data.m_GeometryData.m_nTriangleID, tri.Vertex( 0 ), tri.Vertex( 1 ), tri.Vertex( 2 ),
+				vec3_origin, tri.m_Data.m_GeometryData.m_nFlags, 0 );
+		}
+
+		double flBuildStart = Plat_FloatTime();
+		env.SetupAccelerationStructure();
+		double flBuildTime = Plat_FloatTime() - flBuildStart;
+
+		results[nBackend].SetCount( nRayPackets );
+		double flTraceStart = Plat_FloatTime();
+		for ( int i = 0; i < nRayPackets; i++ )
+		{
+			env.Trace4Rays( rays[i], ReplicateX4( 1.0f ), rayLengths[i], &results[nBackend][i] );
+		}
+		double flTraceTime = Plat_FloatTime() - flTraceStart;
+
+		Msg( "%-8s: %d triangles, build %.2f seconds, %d rays in %.2f seconds (%.2f Mrays/s)\n",
+			pBackendNames[nBackend], nTriangles, flBuildTime, nRayPackets * 4, flTraceTime,
+			flTraceTime > 0 ? nRayPackets * 4 / ( flTraceTime * 1.0e6 ) : 0.0 );
+	}
+
+	// the backends may return hits past the end of a ray, only compare the ones inside it. Where
+	// triangles overlap the two can legitimately disagree about which one was hit first, so also
+	// compare distances.
+	int nMismatches = 0;
+	for ( int i = 0; i < nRayPackets; i++ )
+	{
+		for ( int j = 0; j < 4; j++ )
+		{
+			bool bHit0 = results[0][i].HitIds[j] != -1 && SubFloat( results[0][i].HitDistance, j ) < SubFloat( rayLengths[i], j );
+			bool bHit1 = results[1][i].HitIds[j] != -1 && SubFloat( results[1][i].HitDistance, j ) < SubFloat( rayLengths[i], j );
+			if ( bHit0 != bHit1 ||
+				 ( bHit0 && fabs( SubFloat( results[0][i].HitDistance, j ) - SubFloat( results[1][i].HitDistance, j ) ) > 0.01f ) )
+			{
+				nMismatches++;
+			}
+		}
+	}
+	Msg( "%d of %d rays differ between the backends\n", nMismatches, nRayPackets * 4 );
+}
+
 void WriteWinding (FileHandle_t out, winding_t *w, Vector& color )
 {
 	int			i;
@@ -1532,6 +1856,72 @@ void PreGetBumpNormalsForDisp( texinfo_t *pTexinfo, Vector &vecU, Vector &vecV,
 	vecV = vecTexV;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: GatherLight for packed transfers, four transfers per iteration.
+//-----------------------------------------------------------------------------
+static void GatherPackedLight( CPatch const *patch, Vector &sum )
+{
+	int nPatch[4];
+	fltx4 transfer;
+	FourVectors sum4;
+	sum4.DuplicateVector( vec3_origin );
+
+	CPackedTransferReader reader( patch );
+	while ( reader.NextFour( nPatch, transfer ) )
+	{
+		FourVectors v( shootlight[nPatch[0]], shootlight[nPatch[1]], shootlight[nPatch[2]], shootlight[nPatch[3]] );
+		v *= transfer;
+		sum4 += v;
+	}
+
+	sum = sum4.Vec( 0 ) + sum4.Vec( 1 ) + sum4.Vec( 2 ) + sum4.Vec( 3 );
+}
+
+static void GatherPackedBumpLight( CPatch const *patch, Vector const *normals, Vector *bumpSum )
+{
+	int i;
+	int nPatch[4];
+	fltx4 transfer;
+
+	FourVectors origin4, flatNormal4, normals4[NUM_BUMP_VECTS+1], bumpSum4[NUM_BUMP_VECTS+1];
+	origin4.DuplicateVector( patch->origin );
+	flatNormal4.DuplicateVector( patch->normal );
+	for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
+	{
+		normals4[i].DuplicateVector( normals[i] );
+		bumpSum4[i].DuplicateVector( vec3_origin );
+	}
+
+	CPackedTransferReader reader( patch );
+	while ( reader.NextFour( nPatch, transfer ) )
+	{
+		// get vector to other patch
+		FourVectors delta( g_Patches[nPatch[0]].origin, g_Patches[nPatch[1]].origin,
+			g_Patches[nPatch[2]].origin, g_Patches[nPatch[3]].origin );
+		delta -= origin4;
+		delta.VectorNormalize();
+
+		// remove normal already factored into transfer steradian
+		fltx4 scale = ReciprocalSIMD( delta * flatNormal4 );
+
+		FourVectors v( shootlight[nPatch[0]], shootlight[nPatch[1]], shootlight[nPatch[2]], shootlight[nPatch[3]] );
+		v *= MulSIMD( transfer, scale );
+
+		// bump directions facing away from the other patch get nothing
+		for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
+		{
+			FourVectors bumpTransfer = v;
+			bumpTransfer *= MaxSIMD( delta * normals4[i], Four_Zeros );
+			bumpSum4[i] += bumpTransfer;
+		}
+	}
+
+	for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
+	{
+		bumpSum[i] = bumpSum4[i].Vec( 0 ) + bumpSum4[i].Vec( 1 ) + bumpSum4[i].Vec( 2 ) + bumpSum4[i].Vec( 3 );
+	}
+}
+
 void GatherLight (int threadnum, void *pUserData)
 {
 	int			i, j, k;
@@ -1588,6 +1978,12 @@ void GatherLight (int threadnum, void *pUserData)
 				VectorFill( bumpSum[i], 0 );
 			}
 
+			if ( patch->packedtransfers )
+			{
+				GatherPackedBumpLight( patch, normals, bumpSum );
+				num = 0;
+			}
+
 			float dot;
 			for (k=0 ; k<num ; k++, trans++)
 			{
@@ -1626,6 +2022,11 @@ void GatherLight (int threadnum, void *pUserData)
 		else
 		{
 			VectorFill( sum, 0 );
+			if ( patch->packedtransfers )
+			{
+				GatherPackedLight( patch, sum );
+				num = 0;
+			}
 			for (k=0 ; k<num ; k++, trans++)
 			{
 				for(i=0; i<3; i++)
@@ -1706,6 +2107,15 @@ void BounceLight (void)
 		// transfer light from to the leaf patches from other patches via transfers
 		// this moves shooter->emitlight to receiver->addlight
 		unsigned int uiPatchCount = g_Patches.Size();
+		if ( g_bCompressTransfers )
+		{
+			// the packed gather reads emitlight * reflectivity from one array
+			shootlight.SetCount( uiPatchCount );
+			for ( unsigned int j = 0; j < uiPatchCount; j++ )
+			{
+				shootlight[j] = emitlight[j] * g_Patches[j].reflectivity;
+			}
+		}
 		RunThreadsOn (uiPatchCount, true, GatherLight);
 		// move newly received light (addlight) to light to be sent out (emitlight)
 		// start at children and pull light up to parents
@@ -1932,8 +2342,17 @@ void MakeAllScales (void)
 
 	Msg("transfers %d, max %d\n", total_transfer, max_transfer );
 
-	qprintf ("transfer lists: %5.1f megs\n"
-		, (float)total_transfer * sizeof(transfer_t) / (1024*1024));
+	if ( g_bCompressTransfers )
+	{
+		qprintf ("transfer lists: %5.1f megs packed (%5.1f megs unpacked)\n"
+			, (float)g_nPackedTransferBytes / (1024*1024)
+			, (float)total_transfer * sizeof(transfer_t) / (1024*1024));
+	}
+	else
+	{
+		qprintf ("transfer lists: %5.1f megs\n"
+			, (float)total_transfer * sizeof(transfer_t) / (1024*1024));
+	}
 }
 
 
@@ -2268,6 +2687,12 @@ void VRAD_LoadBSP( char const *pFilename )
 	if ( g_bDumpRtEnv )
 		WriteRTEnv("trace.txt");
 
+	if ( g_bBenchmarkRtEnv )
+	{
+		BenchmarkRTEnv();
+		exit(0);
+	}
+
 	// Build acceleration structure
 	printf ( "Setting up ray-trace acceleration structure... ");
 	float start = Plat_FloatTime();
@@ -2416,6 +2841,18 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			g_bDumpRtEnv = true;
 		}
+		else if ( !Q_stricmp( argv[i], "-rtbvh" ) )
+		{
+			g_RtEnv.Flags |= RTE_FLAGS_BVH_ACCELERATION;
+		}
+		else if ( !Q_stricmp( argv[i], "-rtbench" ) )
+		{
+			g_bBenchmarkRtEnv = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-compresstransfers" ) )
+		{
+			g_bCompressTransfers = true;
+		}
 		else if ( !Q_stricmp( argv[i], "-LargeDispSampleRadius" ) )
 		{
 			g_bLargeDispSampleRadius = true;
@@ -2816,6 +3253,11 @@ void PrintUsage( int argc, char **argv )
 		"  -dump           : Write debugging .txt files.\n"
 		"  -dumpnormals    : Write normals to debug files.\n"
 		"  -dumptrace      : Write ray-tracing environment to debug files.\n"
+		"  -rtbvh          : Trace rays through a bvh instead of a kd-tree. Builds\n"
+		"                    much faster on large maps.\n"
+		"  -rtbench        : Time the kd-tree and bvh ray tracers on this map, then exit.\n"
+		"  -compresstransfers : Store the radiosity transfer lists packed to about half\n"
+		"                    the memory. Bounced light changes very slightly.\n"
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
 		"  -lights <file>  : Load a lights file in addition to lights.rad and the\n"
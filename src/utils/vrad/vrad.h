@@ -238,6 +238,8 @@ struct CPatch
 
 	int			numtransfers;
 	transfer_t	*transfers;
+	byte		*packedtransfers;		// -compresstransfers: transfers packed by PackTransfers
+	int			packedtransfersize;		// in bytes
 
 	short		indices[3];				// displacement use these for subdivision
 };
@@ -282,6 +284,7 @@ extern qboolean		do_fast;
 extern bool			g_bInterrupt;		// Was used with background lighting in WC. Tells VRAD to stop lighting.
 extern IIncremental *g_pIncremental;	// null if not doing incremental lighting
 extern bool			g_bDumpPropLightmaps;
+extern bool			g_bCompressTransfers;	// store transfers with PackTransfers instead of as transfer_t
 
 extern float g_flSkySampleScale;								// extra sampling factor for indirect light
 
@@ -400,6 +403,8 @@ void GetPhongNormal( int facenum, Vector const& spot, Vector& phongnormal );
 int LightForString( char *pLight, Vector& intensity );
 void MakeTransfer( int ndxPatch1, int ndxPatch2, transfer_t *all_transfers );
 void MakeScales( int ndxPatch, transfer_t *all_transfers );
+byte *PackTransfers( transfer_t *transfers, int numtransfers, int *pPackedSize );
+byte *AllocPackedTransferRow( int nBytes );
 
 // Run startup code like initialize mathlib.
 void VRAD_Init();
@@ -448,10 +453,13 @@ struct SSE_sampleLightOutput_t
 	fltx4 m_flDot[NUM_BUMP_VECTS+1];
 	fltx4 m_flFalloff;
 	fltx4 m_flSunAmount;
+	FourVectors m_VisibilityEnd;							// where the shadow rays go, if m_bVisibilityDeferred
+	bool m_bVisibilityDeferred;								// m_flDot[] doesn't include shadowing yet
 };
 
 #define GATHERLFLAGS_FORCE_FAST 1
 #define GATHERLFLAGS_IGNORE_NORMALS 2
+#define GATHERLFLAGS_DEFER_VISIBILITY 4						// point/spot/surface lights leave the shadow test to a CShadowRayBatch
 
 // SSE Gather light stuff
 void GatherSampleLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int facenum, 
@@ -475,6 +483,32 @@ void GatherSampleLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int
 //						  int static_prop_to_skip=-1,
 //						  float flEpsilon = 0.0 );
 
+//-----------------------------------------------------------------------------
+// Shadow rays for samples lit with GATHERLFLAGS_DEFER_VISIBILITY. They're
+// queued up so that a whole face or prop can go through g_RtEnv.TraceRayBatch
+// in one call, instead of being traced 4 at a time as each sample is lit.
+// Texture shadows need the per-packet coverage callback, so don't defer
+// when g_bTextureShadows is set.
+//-----------------------------------------------------------------------------
+class CShadowRayBatch
+{
+public:
+	// Queues a shadow ray for each lane of a deferred output that has a nonzero
+	// bit in nLaneMask. pRayIndex gets the ray for each lane, or -1.
+	void AddRays( SSE_sampleLightOutput_t const &out, FourVectors const &pos, int nLaneMask, int pRayIndex[4] );
+
+	void Trace( int static_prop_index_to_ignore = -1 );
+	bool IsVisible( int nRay ) const;
+
+	int Count() const { return m_Starts.Count(); }
+	void RemoveAll();
+
+private:
+	CUtlVector<Vector> m_Starts;
+	CUtlVector<Vector> m_Ends;
+	CUtlVector<RayTracingSingleResult> m_Results;
+};
+
 //-----------------------------------------------------------------------------
 // VRad Displacements
 //-----------------------------------------------------------------------------
@@ -1144,16 +1144,41 @@ bool PositionInSolid( Vector &position )
 	return false;
 }
 
+//-----------------------------------------------------------------------------
+// Direct light at a static prop vertex that's waiting on its shadow ray
+//-----------------------------------------------------------------------------
+struct DeferredVertexLight_t
+{
+	int		m_nColorVertex;
+	int		m_nRay;
+	Vector	m_Color;
+};
+
+struct DeferredPropLighting_t
+{
+	CShadowRayBatch						m_ShadowRays;
+	CUtlVector<DeferredVertexLight_t>	m_Lights;
+};
+
 //-----------------------------------------------------------------------------
 // Trace from a vertex to each direct light source, accumulating its contribution.
+// If pDeferred is passed, point, spot and surface lights are queued on it for
+// vertex nColorVertex instead of being traced and added to outColor here.
 //-----------------------------------------------------------------------------
 void ComputeDirectLightingAtPoint( Vector &position, Vector &normal, Vector &outColor, int iThread,
-								   int static_prop_id_to_skip=-1, int nLFlags = 0)
+								   int static_prop_id_to_skip=-1, int nLFlags = 0,
+								   DeferredPropLighting_t *pDeferred = NULL, int nColorVertex = -1 )
 {
 	SSE_sampleLightOutput_t	sampleOutput;
 
 	outColor.Init();
 
+	if ( pDeferred )
+	{
+		Assert( !g_bTextureShadows );
+		nLFlags |= GATHERLFLAGS_DEFER_VISIBILITY;
+	}
+
 	// Iterate over all direct lights and accumulate their contribution
 	int cluster = ClusterFromPoint( position );
 	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
@@ -1201,10 +1226,50 @@ void ComputeDirectLightingAtPoint( Vector &position, Vector &normal, Vector &out
 		GatherSampleLightSSE( sampleOutput, dl, -1, adjusted_pos4, &normal4, 1, iThread, nLFlags | GATHERLFLAGS_FORCE_FAST,
 		                      static_prop_id_to_skip, flEpsilon );
 		
-		VectorMA( outColor, sampleOutput.m_flFalloff.m128_f32[0] * sampleOutput.m_flDot[0].m128_f32[0], dl->light.intensity, outColor );
+		float flScale = sampleOutput.m_flFalloff.m128_f32[0] * sampleOutput.m_flDot[0].m128_f32[0];
+		if ( sampleOutput.m_bVisibilityDeferred )
+		{
+			// no light, no need for a shadow ray
+			if ( flScale == 0.0f )
+				continue;
+
+			int nRays[4];
+			DeferredVertexLight_t &light = pDeferred->m_Lights[ pDeferred->m_Lights.AddToTail() ];
+			pDeferred->m_ShadowRays.AddRays( sampleOutput, adjusted_pos4, 0x1, nRays );
+			light.m_nColorVertex = nColorVertex;
+			light.m_nRay = nRays[0];
+			VectorScale( dl->light.intensity, flScale, light.m_Color );
+			continue;
+		}
+
+		VectorMA( outColor, flScale, dl->light.intensity, outColor );
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Traces the shadow rays queued by ComputeDirectLightingAtPoint() and adds the
+// lights that got through to their vertexes
+//-----------------------------------------------------------------------------
+static void AddDeferredVertexLights( DeferredPropLighting_t &deferred, int static_prop_id_to_skip, CUtlVector<colorVertex_t> &colorVerts )
+{
+	if ( deferred.m_ShadowRays.Count() )
+	{
+		deferred.m_ShadowRays.Trace( static_prop_id_to_skip );
+	}
+
+	for ( int i = 0; i < deferred.m_Lights.Count(); i++ )
+	{
+		DeferredVertexLight_t &light = deferred.m_Lights[i];
+		if ( deferred.m_ShadowRays.IsVisible( light.m_nRay ) )
+		{
+			colorVerts[light.m_nColorVertex].m_Color += light.m_Color;
+		}
+	}
+
+	deferred.m_ShadowRays.RemoveAll();
+	deferred.m_Lights.RemoveAll();
+}
+
 //-----------------------------------------------------------------------------
 // Takes the results from a ComputeLighting call and applies it to the static prop in question.
 //-----------------------------------------------------------------------------
@@ -1329,6 +1394,11 @@ void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int pr
 	const int skip_prop = (g_bDisablePropSelfShadowing || (prop.m_Flags & STATIC_PROP_NO_SELF_SHADOWING)) ? prop_index : -1;
 	const int nFlags = ( prop.m_Flags & STATIC_PROP_IGNORE_NORMALS ) ? GATHERLFLAGS_IGNORE_NORMALS : 0;
 
+	// the shadow rays for each model's vertexes get traced together, unless texture
+	// shadows need them traced 4 at a time or the normals are being shown instead
+	DeferredPropLighting_t deferredLighting;
+	DeferredPropLighting_t *pDeferredLighting = ( g_bTextureShadows || g_bShowStaticPropNormals ) ? NULL : &deferredLighting;
+
 	VMPI_SetCurrentStage( "ComputeLighting" );
 
 	matrix3x4_t	matPos, matNormal;
@@ -1400,7 +1470,7 @@ void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int pr
 						Vector directColor(0,0,0);
 						ComputeDirectLightingAtPoint( direct_pos,
 														sampleNormal, directColor, iThread,
-														skip_prop, nFlags );
+														skip_prop, nFlags, pDeferredLighting, numVertexes );
 						Vector indirectColor(0,0,0);
 
 						if (g_bShowStaticPropNormals)
@@ -1426,6 +1496,11 @@ void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int pr
 					numVertexes++;
 				}
 			}
+
+			if ( pDeferredLighting )
+			{
+				AddDeferredVertexLights( *pDeferredLighting, skip_prop, colorVerts );
+			}
 			
 			// color in the bad vertexes
 			// when entire model has no lighting origin and no valid neighbors